@@ -10,6 +10,9 @@
 #include "kvtree_io.h"
 #include "kvtree_helpers.h"
 #include "kvtree_util.h"
+#include "kvtree_index.h"
+#include "kvtree_arena.h"
+#include "kvtree_intern.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -22,16 +25,113 @@
 #include <dirent.h>
 #include <limits.h>
 #include <regex.h>
-
-
-/* need at least version 8.5 of queue.h from Berkeley */
-#include "queue.h"
+#include <unistd.h>
+#include <pthread.h>
 
 #include <stdint.h>
 
 #define KVTREE_FILE_MAGIC          (0x951fc3f5)
 #define KVTREE_FILE_TYPE_HASH      (1)
 #define KVTREE_FILE_VERSION_HASH_1 (1)
+#define KVTREE_FILE_VERSION_HASH_2 (2) /* adds packed typed leaves */
+
+/* in version 2, a packed hash whose count has this bit set is a typed
+ * leaf, the low byte holds its type and is followed by its value */
+#define KVTREE_PACK_TYPED     (0x80000000)
+#define KVTREE_PACK_TYPED_HEX (0x100) /* uint64 formatted in hex */
+
+/* bits of hash->flags holding the type of a typed leaf */
+#define KVTREE_FLAG_TYPE_SHIFT (4)
+#define KVTREE_FLAG_TYPE_MASK  (0xf << KVTREE_FLAG_TYPE_SHIFT)
+#define KVTREE_FLAG_TYPE_HEX   (0x100) /* uint64 formatted in hex */
+#define KVTREE_FLAG_TYPE_ALL   (KVTREE_FLAG_TYPE_MASK | KVTREE_FLAG_TYPE_HEX)
+
+/* extract type of a hash from its flags */
+#define KVTREE_HASH_TYPE(h) (((h)->flags & KVTREE_FLAG_TYPE_MASK) >> KVTREE_FLAG_TYPE_SHIFT)
+
+/* define the storage of a blob, allocated along with its data */
+struct kvtree_bytes_struct {
+  uint64_t size;        /* number of bytes in data */
+  unsigned char data[]; /* the bytes themselves */
+};
+
+/* set in flags of a hash whose children are in kids.array, otherwise
+ * its only child, if any, is kids.one */
+#define KVTREE_FLAG_CHILD_ARRAY (0x200)
+
+/* bits of hash->flags recording the order kept by kvtree_set_order */
+#define KVTREE_FLAG_ORDER_STR  (0x400)
+#define KVTREE_FLAG_ORDER_INT  (0x800)
+#define KVTREE_FLAG_ORDER_DESC (0x1000)
+#define KVTREE_FLAG_ORDER_ALL  (KVTREE_FLAG_ORDER_STR | KVTREE_FLAG_ORDER_INT | KVTREE_FLAG_ORDER_DESC)
+
+/* set in flags of a hash made by kvtree_new_sharded, which holds no
+ * children itself, they are in the shards that val.shards points to */
+#define KVTREE_FLAG_SHARDED (0x2000)
+
+/* set in flags of the hash holding the children of one shard, whose
+ * val.shards points back to the shards it belongs to */
+#define KVTREE_FLAG_SHARD (0x4000)
+
+/* most owners of a hash shared with kvtree_share beyond the first */
+#define KVTREE_SHARES_MAX (INT_MAX)
+
+/* number of extra owners of a hash, a shared hash may not be changed,
+ * so its share count is the only part of it that changes, and it is
+ * kept apart from its flags and changed atomically, since threads
+ * reading different versions published by a kvtree_publisher may
+ * share or delete the same hash at once, while reading its flags */
+#define KVTREE_HASH_SHARES(h) __atomic_load_n(&(h)->shares, __ATOMIC_ACQUIRE)
+
+/* nonzero if h belongs to a tree made by kvtree_freeze */
+#define KVTREE_HASH_FROZEN(h) ((h)->arena != NULL && (h)->arena->image != NULL)
+
+/* define one shard of a sharded hash, padded so that threads using
+ * neighbouring shards do not write to the same cache line */
+union kvtree_shard {
+  struct {
+    pthread_rwlock_t lock; /* guards the children in hash */
+    kvtree* hash;          /* children whose keys hash to this shard */
+  } s;
+  char pad[128];
+};
+
+/* define the shards of a hash made by kvtree_new_sharded, a key goes
+ * to the shard picked by the high bits of its hash value, since the
+ * index of each shard uses the low bits */
+struct kvtree_shards_struct {
+  int count; /* number of shards, a power of two */
+  int shift; /* bits of a hash value below those that pick the shard */
+  union kvtree_shard shards[];
+};
+
+/* smallest child array we allocate, once a hash gets a second child */
+#define KVTREE_CHILDREN_MIN (4)
+
+/* define the children of a hash in the order asked of
+ * kvtree_sorted_view, kept until the children change */
+struct kvtree_view_struct {
+  int flags; /* KVTREE_FLAG_ORDER bits of the order, 0 once stale */
+  int cap;   /* number of slots allocated */
+  kvtree_elem* elems[];
+};
+
+/* define the array holding the children of a hash, oldest first */
+struct kvtree_children_struct {
+  int used; /* number of slots in use, including removed elements */
+  int cap;  /* number of slots allocated */
+  struct kvtree_view_struct* view; /* sorted view, NULL until asked for */
+  kvtree_elem* elems[]; /* children, NULL in slots of removed elements */
+};
+
+/* iterates over the children of hash from the last slot to the first,
+ * which is from the newest to the oldest unless hash is ordered,
+ * skipping the slots of removed elements, slot is a kvtree_elem**
+ * cursor, the body must not add children to hash */
+#define KVTREE_FOREACH(elem, slot, hash) \
+  for ((slot) = kvtree_children_slots(hash) + kvtree_children_used(hash); \
+       (slot)-- != kvtree_children_slots(hash); ) \
+    if (((elem) = *(slot)) != NULL)
 
 #define KVTREE_FILE_HASH_HEADER_SIZE (20)
 #define KVTREE_FILE_FLAGS_CRC32 (0x1) /* indicates that crc32 is stored at end of file */
@@ -39,372 +139,1940 @@
 /* ================================================= */
 /** @name Allocate and delete hash objects */
 ///@{
-/** allocates a new hash element */
-static kvtree_elem* kvtree_elem_new()
+/** allocates a new element to be stored in parent, with the given key
+ * of length keylen and hash, elements come from the arena of parent if
+ * it has one, key_interned is set if key itself came from the pool */
+static kvtree_elem* kvtree_elem_new(const kvtree* parent, const char* key, size_t keylen, int key_interned, kvtree* hash)
 {
-  kvtree_elem* elem = (kvtree_elem*) KVTREE_MALLOC(sizeof(kvtree_elem));
-  elem->key  = NULL;
-  elem->hash = NULL;
+  /* unless we share a pooled key, the key is stored right behind the
+   * element, so that both take a single allocation */
+  int intern = 0;
+  if (key != NULL && parent->arena == NULL) {
+    /* arena keys are not interned, since the pool would need the
+     * arena to drop its references one at a time */
+    intern = key_interned || kvtree_intern_enabled();
+  }
+  size_t size = sizeof(kvtree_elem);
+  if (key != NULL && ! intern) {
+    size += keylen + 1;
+  }
+
+  kvtree_elem* elem = (kvtree_elem*) kvtree_arena_malloc(parent->arena, size);
+  elem->hash   = hash;
+  elem->flags  = 0;
+  elem->keylen = (unsigned int) keylen;
+  elem->ikey   = 0;
+  elem->parent = NULL;
+  elem->pos    = 0;
+
+  /* remember the value of integer keys, like rank ids, so that we can
+   * look them up and convert them without going through strings */
+  if (key != NULL && kvtree_key_parse_int(key, &elem->ikey)) {
+    elem->flags |= KVTREE_ELEM_FLAG_INTKEY;
+  }
+
+  if (key == NULL) {
+    /* bad idea to allow key to be set to NULL */
+    elem->key    = NULL;
+    elem->keylen = 0;
+    kvtree_err("Setting hash element key to NULL @ %s:%d",
+      __FILE__, __LINE__
+    );
+  } else if (key_interned && intern) {
+    /* share the pooled key */
+    elem->key = kvtree_intern_ref((char*) key);
+    elem->flags |= KVTREE_ELEM_FLAG_INTERNED;
+  } else if (intern) {
+    elem->key = kvtree_intern_get(key);
+    elem->flags |= KVTREE_ELEM_FLAG_INTERNED;
+  } else {
+    elem->key = (char*) (elem + 1);
+    memcpy(elem->key, key, keylen + 1);
+  }
   return elem;
 }
 
-/** frees a hash element */
-static int kvtree_elem_delete(kvtree_elem* elem)
+/** frees a hash element that was allocated for the given hash */
+static int kvtree_elem_delete(const kvtree* hash, kvtree_elem* elem)
 {
   if (elem != NULL) {
-    /* free the key which was strdup'ed */
-    kvtree_free(&(elem->key));
+    /* drop our reference to a pooled key, other keys are stored in
+     * the element itself */
+    if (elem->flags & KVTREE_ELEM_FLAG_INTERNED) {
+      kvtree_intern_put(&(elem->key));
+    }
 
     /* free the hash */
     kvtree_delete(&elem->hash);
     elem->hash = NULL;
 
     /* finally, free the element structure itself */
-    kvtree_free(&elem);
+    kvtree_arena_free(hash->arena, &elem);
   }
   return KVTREE_SUCCESS;
 }
 
-/** allocates a new hash */
-kvtree* kvtree_new()
+/** initialize fields of a newly allocated hash */
+static void kvtree_init(kvtree* hash, struct kvtree_arena_struct* arena, int flags)
 {
-  kvtree* hash = (kvtree*) KVTREE_MALLOC(sizeof(kvtree));
-  LIST_INIT(hash);
-  return hash;
+  hash->kids.one = NULL;
+  hash->count = 0;
+  hash->flags = flags;
+  hash->shares = 0;
+  hash->index = NULL;
+  hash->arena = arena;
+  hash->val.u = 0;
 }
 
-/** frees a hash */
-int kvtree_delete(kvtree** ptr_hash)
+/** returns the number of child slots of hash in use */
+static inline int kvtree_children_used(const kvtree* hash)
 {
-  if (ptr_hash != NULL) {
-    kvtree* hash = *ptr_hash;
-    if (hash != NULL) {
-      while (!LIST_EMPTY(hash)) {
-        kvtree_elem* elem = LIST_FIRST(hash);
-        LIST_REMOVE(elem, pointers);
-        kvtree_elem_delete(elem);
-      }
-      kvtree_free(ptr_hash);
-    }
+  if (hash->flags & KVTREE_FLAG_CHILD_ARRAY) {
+    return hash->kids.array->used;
   }
-  return KVTREE_SUCCESS;
+  return (hash->kids.one != NULL);
 }
-///@}
 
-/* ================================================= */
-/** @name size, get, set, unset, and merge functions */
-///@{
-/** given an element, set its key and hash fields */
-static kvtree_elem* kvtree_elem_init(kvtree_elem* elem, const char* key, kvtree* hash)
+/** returns the child slots of hash */
+static inline kvtree_elem** kvtree_children_slots(const kvtree* hash)
 {
-  if (elem != NULL) {
-    if (key != NULL) {
-      elem->key = strdup(key);
-    } else {
-      /* bad idea to allow key to be set to NULL */
-      elem->key = NULL;
-      kvtree_err("Setting hash element key to NULL @ %s:%d",
-        __FILE__, __LINE__
-      );
-    }
-    elem->hash = hash;
+  if (hash->flags & KVTREE_FLAG_CHILD_ARRAY) {
+    return hash->kids.array->elems;
   }
-  return elem;
+  return (kvtree_elem**) &hash->kids.one;
 }
 
-/**
- * Return size of hash (number of keys)
- *
- * For example, if your tree was:
- *
- * NAME
- *   axl_cp
- * TYPE
- *   2
- * STATE_FILE
- *   state_file
- * STATE
- *   4
- * STATUS
- *   4
- * FILE
- *   hello.txt
- *     STATUS
- *       3
- *     SIZE
- *       6
- *     GID
- *       57592
- *     UID
- *       57592
- *     MODE
- *       33268
- *     DEST
- *       hello2.txt._AXL
- *
- * This would return 6 since there's six top level elements:
- *     "NAME", "TYPE", "STATE_FILE", "STATE", "STATUS", "FILE".
- */
-int kvtree_size(const kvtree* hash)
+/** marks the sorted view of the children in array stale, to be
+ * called whenever children are added, removed, or moved */
+static inline void kvtree_children_changed(struct kvtree_children_struct* array)
 {
-  int count = 0;
-  if (hash != NULL) {
-    kvtree_elem* elem;
-    LIST_FOREACH(elem, hash, pointers) {
-      count++;
-    }
+  if (array->view != NULL) {
+    array->view->flags = 0;
   }
-  return count;
 }
 
-/** given a hash and a key, return the hash associated with key,
- * returns NULL if not found */
-kvtree* kvtree_get(const kvtree* hash, const char* key)
+/** moves the children of hash into a new array of cap slots, closing
+ * the gaps left by removed elements, cap must be at least count */
+static void kvtree_children_resize(kvtree* hash, int cap)
 {
-  kvtree_elem* elem = kvtree_elem_get(hash, key);
-  if (elem != NULL) {
-    return elem->hash;
+  struct kvtree_children_struct* array = (struct kvtree_children_struct*) kvtree_arena_malloc(hash->arena,
+    sizeof(struct kvtree_children_struct) + (size_t) cap * sizeof(kvtree_elem*)
+  );
+  array->cap  = cap;
+  array->view = NULL;
+
+  int i;
+  int n = 0;
+  int used = kvtree_children_used(hash);
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  for (i = 0; i < used; i++) {
+    kvtree_elem* elem = slots[i];
+    if (elem != NULL) {
+      elem->pos = n;
+      array->elems[n] = elem;
+      n++;
+    }
   }
-  return NULL;
+  array->used = n;
+
+  /* the new array keeps the memory of any view */
+  if (hash->flags & KVTREE_FLAG_CHILD_ARRAY) {
+    array->view = hash->kids.array->view;
+    kvtree_children_changed(array);
+    kvtree_arena_free(hash->arena, &hash->kids.array);
+  }
+  hash->kids.array = array;
+  hash->flags |= KVTREE_FLAG_CHILD_ARRAY;
 }
 
-/** given a hash, a key, and a hash value, set (or reset) the key's
- * hash and return the pointer to the new hash */
-kvtree* kvtree_set(kvtree* hash, const char* key, kvtree* hash_value)
+/** closes the gaps left by removed elements in the child array */
+static void kvtree_children_compact(struct kvtree_children_struct* array)
 {
-  /* check that we have a valid hash to insert into and a valid key
-   * name */
-  if (hash == NULL || key == NULL) {
-    return NULL;
+  int i;
+  int n = 0;
+  for (i = 0; i < array->used; i++) {
+    kvtree_elem* elem = array->elems[i];
+    if (elem != NULL) {
+      elem->pos = n;
+      array->elems[n] = elem;
+      n++;
+    }
   }
+  array->used = n;
+  kvtree_children_changed(array);
+}
 
-  /* if there is a match in the hash, pull out that element */
-  kvtree_elem* elem = kvtree_elem_extract(hash, key);
-  if (elem == NULL) {
-    /* nothing found, so create a new element and set it */
-    elem = kvtree_elem_new();
-    kvtree_elem_init(elem, key, hash_value);
-  } else {
-    /* this key already exists, delete its current hash and reset it */
-    if (elem->hash != NULL) {
-      kvtree_delete(&elem->hash);
+/** adds elem as the newest child of hash, the caller updates count */
+static void kvtree_children_append(kvtree* hash, kvtree_elem* elem)
+{
+  elem->parent = hash;
+
+  /* most hashes hold a single key, which needs no array */
+  if (! (hash->flags & KVTREE_FLAG_CHILD_ARRAY)) {
+    if (hash->kids.one == NULL) {
+      elem->pos = 0;
+      hash->kids.one = elem;
+      return;
     }
-    elem->hash = hash_value;
+    kvtree_children_resize(hash, KVTREE_CHILDREN_MIN);
   }
 
-  /* insert the element into the hash */
-  LIST_INSERT_HEAD(hash, elem, pointers);
-
-  /* return the pointer to the hash of the element */
-  return elem->hash;
+  struct kvtree_children_struct* array = hash->kids.array;
+  if (array->used == array->cap) {
+    if (hash->count <= array->used / 2) {
+      /* at least half the slots belong to removed elements, so reuse
+       * them rather than growing */
+      kvtree_children_compact(array);
+    } else {
+      kvtree_children_resize(hash, array->cap * 2);
+      array = hash->kids.array;
+    }
+  }
+  elem->pos = array->used;
+  array->elems[array->used] = elem;
+  array->used++;
+  kvtree_children_changed(array);
 }
 
-/** given a hash and a key, extract and return hash for specified key,
- * returns NULL if not found */
-kvtree* kvtree_extract(kvtree* hash, const char* key)
+/** removes elem from the children of hash, leaving its slot empty
+ * until the array is compacted, the caller updates count */
+static void kvtree_children_remove(kvtree* hash, kvtree_elem* elem)
 {
-  if (hash == NULL) {
-    return NULL;
+  elem->parent = NULL;
+  if (! (hash->flags & KVTREE_FLAG_CHILD_ARRAY)) {
+    hash->kids.one = NULL;
+    return;
   }
 
-  kvtree_elem* elem = kvtree_elem_extract(hash, key);
-  if (elem != NULL) {
-    kvtree* elem_hash = elem->hash;
-    elem->hash = NULL;
-    kvtree_elem_delete(elem);
-    return elem_hash;
+  /* an ordered hash is searched by slot, so it can not have gaps */
+  struct kvtree_children_struct* array = hash->kids.array;
+  kvtree_children_changed(array);
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    int i;
+    for (i = elem->pos + 1; i < array->used; i++) {
+      array->elems[i - 1] = array->elems[i];
+      array->elems[i - 1]->pos = i - 1;
+    }
+    array->used--;
+    return;
+  }
+
+  /* drop empty slots at the end, so that removing the newest
+   * element, or all of them, leaves no gaps behind */
+  array->elems[elem->pos] = NULL;
+  while (array->used > 0 && array->elems[array->used - 1] == NULL) {
+    array->used--;
   }
-  return NULL;
 }
 
-/** given a hash and a key, extract and delete any matching element */
-int kvtree_unset(kvtree* hash, const char* key)
+/** inserts elem at slot pos of an ordered hash, moving the children
+ * from pos on up by one slot, the caller updates count */
+static void kvtree_children_insert(kvtree* hash, kvtree_elem* elem, int pos)
 {
-  if (hash == NULL) {
-    return KVTREE_SUCCESS;
+  elem->parent = hash;
+  if (! (hash->flags & KVTREE_FLAG_CHILD_ARRAY)) {
+    if (hash->kids.one == NULL) {
+      elem->pos = 0;
+      hash->kids.one = elem;
+      return;
+    }
+    kvtree_children_resize(hash, KVTREE_CHILDREN_MIN);
   }
 
-  kvtree_elem* elem = kvtree_elem_extract(hash, key);
-  if (elem != NULL) {
-    kvtree_elem_delete(elem);
+  struct kvtree_children_struct* array = hash->kids.array;
+  if (array->used == array->cap) {
+    kvtree_children_resize(hash, array->cap * 2);
+    array = hash->kids.array;
   }
-  return KVTREE_SUCCESS;
+  int i;
+  for (i = array->used; i > pos; i--) {
+    array->elems[i] = array->elems[i - 1];
+    array->elems[i]->pos = i;
+  }
+  elem->pos = pos;
+  array->elems[pos] = elem;
+  array->used++;
+  kvtree_children_changed(array);
 }
 
-/** unset all values in the hash, but don't delete it */
-int kvtree_unset_all(kvtree* hash)
+/** reverses the order of the child slots of hash from slot first to
+ * the last slot in use */
+static void kvtree_children_reverse_range(kvtree* hash, int first)
 {
-  kvtree_elem* elem = kvtree_elem_first(hash);
-  while (elem != NULL) {
-    /* remember this element */
-    kvtree_elem* tmp = elem;
-
-    /* get the next element */
-    elem = kvtree_elem_next(elem);
-
-    /* extract and delete the current element by address */
-    kvtree_elem_extract_by_addr(hash, tmp);
-    kvtree_elem_delete(tmp);
+  if (! (hash->flags & KVTREE_FLAG_CHILD_ARRAY)) {
+    return;
+  }
+  struct kvtree_children_struct* array = hash->kids.array;
+  kvtree_children_changed(array);
+  int i = first;
+  int j = array->used - 1;
+  while (i < j) {
+    kvtree_elem* tmp = array->elems[i];
+    array->elems[i] = array->elems[j];
+    array->elems[j] = tmp;
+    i++;
+    j--;
+  }
+  for (i = first; i < array->used; i++) {
+    if (array->elems[i] != NULL) {
+      array->elems[i]->pos = i;
+    }
   }
-  return KVTREE_SUCCESS;
 }
 
-/** merges (copies) elements from hash2 into hash1 */
-int kvtree_merge(kvtree* hash1, const kvtree* hash2)
+/** reverses the order of the child slots of hash */
+static void kvtree_children_reverse(kvtree* hash)
 {
-  /* need hash1 to be valid to insert anything into it */
-  if (hash1 == NULL) {
-    return KVTREE_FAILURE;
-  }
+  kvtree_children_reverse_range(hash, 0);
+}
 
-  /* if hash2 is NULL, there is nothing to insert, so we're done */
-  if (hash2 == NULL) {
-    return KVTREE_SUCCESS;
-  }
+/* hint that p will be read soon */
+#if defined(__GNUC__)
+#define KVTREE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define KVTREE_PREFETCH(p)
+#endif
 
-  int rc = KVTREE_SUCCESS;
+/* number of pointers worth of frames a stack holds before it allocates */
+#define KVTREE_STACK_LOCAL (64)
+
+/* define a stack of fixed size frames for walking a tree without
+ * recursion, frames start out in the structure itself, so walks of
+ * shallow trees do not allocate */
+struct kvtree_stack {
+  char* frames;      /* frames, in local or allocated with malloc */
+  size_t frame_size; /* number of bytes in a frame */
+  int depth;         /* number of frames on the stack */
+  int cap;           /* number of frames that fit in frames */
+  void* local[KVTREE_STACK_LOCAL];
+};
 
-  /* iterate over the elements in hash2 */
-  kvtree_elem* elem;
-  for (elem = kvtree_elem_first(hash2);
-       elem != NULL;
-       elem = kvtree_elem_next(elem))
-  {
-    /* get the key for this element */
-    char* key = kvtree_elem_key(elem);
+/** initializes an empty stack of frames of frame_size bytes */
+static void kvtree_stack_init(struct kvtree_stack* stack, size_t frame_size)
+{
+  stack->frames     = (char*) stack->local;
+  stack->frame_size = frame_size;
+  stack->depth      = 0;
+  stack->cap        = (int) (sizeof(stack->local) / frame_size);
+}
 
-    /* get hash for the matching element in hash1, if it has one */
-    kvtree* key_hash1 = kvtree_get(hash1, key);
-    if (key_hash1 == NULL) {
-      /* hash1 had no element with this key, so create one */
-      key_hash1 = kvtree_set(hash1, key, kvtree_new());
-    }
+/** returns the frame on top of the stack */
+static inline void* kvtree_stack_top(const struct kvtree_stack* stack)
+{
+  return stack->frames + (size_t) (stack->depth - 1) * stack->frame_size;
+}
 
-    /* merge the hash for this key from hash2 with the hash for this
-     * key from hash1 */
-    kvtree* key_hash2 = kvtree_elem_hash(elem);
-    if (kvtree_merge(key_hash1, key_hash2) != KVTREE_SUCCESS) {
-      rc = KVTREE_FAILURE;
+/** returns a new frame on top of the stack, which may move the frames
+ * below it, so callers must not hold pointers to them */
+static void* kvtree_stack_push(struct kvtree_stack* stack)
+{
+  if (stack->depth == stack->cap) {
+    int cap = stack->cap * 2;
+    char* frames = (char*) KVTREE_MALLOC((size_t) cap * stack->frame_size);
+    memcpy(frames, stack->frames, (size_t) stack->depth * stack->frame_size);
+    if (stack->frames != (char*) stack->local) {
+      kvtree_free(&stack->frames);
     }
+    stack->frames = frames;
+    stack->cap    = cap;
   }
+  stack->depth++;
+  return kvtree_stack_top(stack);
+}
 
-  return rc;
+/** drops the frame on top of the stack */
+static inline void kvtree_stack_pop(struct kvtree_stack* stack)
+{
+  stack->depth--;
 }
 
-/** traverse the given hash using a printf-like format string setting
- * an arbitrary list of keys to set (or reset) the hash associated
- * with the last-most key */
-kvtree* kvtree_setf(kvtree* hash, kvtree* hash_value, const char* format, ...)
+/** frees memory allocated by the stack */
+static void kvtree_stack_free(struct kvtree_stack* stack)
 {
-  /* check that we have a hash */
-  if (hash == NULL) {
-    return NULL;
+  if (stack->frames != (char*) stack->local) {
+    kvtree_free(&stack->frames);
   }
+  stack->frames = (char*) stack->local;
+  stack->depth  = 0;
+}
 
-  kvtree* h = hash;
-  char *rest = NULL;
+/** returns the slot of the first child of hash to visit and sets step
+ * to the direction of the visit, which is the order of
+ * kvtree_elem_next if elem_order is set, otherwise the order of
+ * KVTREE_FOREACH */
+static inline int kvtree_slot_first(const kvtree* hash, int elem_order, int* step)
+{
+  if (elem_order && (hash->flags & KVTREE_FLAG_ORDER_ALL)) {
+    *step = 1;
+    return 0;
+  }
+  *step = -1;
+  return kvtree_children_used(hash) - 1;
+}
 
-  /* make a copy of the format specifier, since strtok will clobber
-   * it */
-  char* format_copy = strdup(format);
-  if (format_copy == NULL) {
-    kvtree_abort(-1, "Failed to duplicate format string @ %s:%d",
-      __FILE__, __LINE__
-    );
+/** returns the child in slot of the used slots given, or the next one
+ * in the direction step, moving slot past it, returns NULL once none
+ * are left */
+static inline kvtree_elem* kvtree_slot_next(kvtree_elem* const* slots, int used, int* slot, int step)
+{
+  while (*slot >= 0 && *slot < used) {
+    kvtree_elem* elem = slots[*slot];
+    *slot += step;
+    if (elem != NULL) {
+      /* we are likely to read the next sibling and our children soon */
+      if (*slot >= 0 && *slot < used) {
+        KVTREE_PREFETCH(slots[*slot]);
+      }
+      KVTREE_PREFETCH(elem->hash);
+      return elem;
+    }
   }
+  return NULL;
+}
 
-  /* we break up tokens by spaces */
-  char* search = " ";
-  char* token = NULL;
+/* events reported by kvtree_walk_next */
+#define KVTREE_WALK_PRE  (1) /* before the children of the element */
+#define KVTREE_WALK_POST (2) /* after the children of the element */
+
+/* elem_order of a walk that visits the children of each hash in
+ * ascending string order, see kvtree_slot_first for the others */
+#define KVTREE_WALK_ORDER_STR (2)
+
+/* define a frame of a walk, one for each hash being visited */
+struct kvtree_walk_frame {
+  const kvtree* hash;        /* hash whose children are being visited */
+  kvtree_elem* elem;         /* element holding hash, NULL for the top */
+  kvtree_elem* const* slots; /* children of hash, or a view of them */
+  int used;                  /* number of slots */
+  int slot;                  /* slot of the next child to visit */
+  int step;                  /* direction in which slots are visited */
+};
 
-  /* count how many keys we have */
-  token = strtok_r(format_copy, search, &rest);
-  int count = 0;
-  while (token != NULL) {
-    token = strtok_r(NULL, search, &rest);
-    count++;
-  }
+/* define the state of a depth-first walk over a tree */
+struct kvtree_walk {
+  struct kvtree_stack stack;
+  int elem_order;       /* see kvtree_slot_first and KVTREE_WALK_ORDER_STR */
+  int events;           /* events to report, KVTREE_WALK_POST is
+                         * skipped unless it is set */
+  kvtree_elem* pending; /* element last reported before its children */
+  int prune;            /* skip the children of pending */
+};
 
-  /* free our copy of the format specifier */
-  kvtree_free(&format_copy);
+/** pushes a frame to visit the children of hash held by elem */
+static void kvtree_walk_push(struct kvtree_walk* walk, const kvtree* hash, kvtree_elem* elem)
+{
+  struct kvtree_walk_frame* frame = (struct kvtree_walk_frame*) kvtree_stack_push(&walk->stack);
+  frame->hash = hash;
+  frame->elem = elem;
+  if (walk->elem_order == KVTREE_WALK_ORDER_STR) {
+    frame->slots = kvtree_sorted_view(hash, KVTREE_ORDER_STR, KVTREE_SORT_ASCENDING, &frame->used);
+    frame->slot  = 0;
+    frame->step  = 1;
+    return;
+  }
+  frame->slots = kvtree_children_slots(hash);
+  frame->used  = kvtree_children_used(hash);
+  frame->slot  = kvtree_slot_first(hash, walk->elem_order, &frame->step);
+}
 
-  /* make a copy of the format specifier, since strtok will clobber
-   * it */
-  format_copy = strdup(format);
-  if (format_copy == NULL) {
-    kvtree_abort(-1, "Failed to duplicate format string @ %s:%d",
-      __FILE__, __LINE__
-    );
+/** starts a walk over the tree below hash, see kvtree_slot_first and
+ * KVTREE_WALK_ORDER_STR for elem_order, events is KVTREE_WALK_PRE with KVTREE_WALK_POST or'd in
+ * if the caller wants to see elements after their children */
+static void kvtree_walk_init(struct kvtree_walk* walk, const kvtree* hash, int elem_order, int events)
+{
+  kvtree_stack_init(&walk->stack, sizeof(struct kvtree_walk_frame));
+  walk->elem_order = elem_order;
+  walk->events     = events;
+  walk->pending    = NULL;
+  walk->prune      = 0;
+  if (hash != NULL) {
+    kvtree_walk_push(walk, hash, NULL);
   }
+}
 
-  /* for each format specifier, convert the next key argument to a
-   * string and look up the hash for that key */
-  va_list args;
-  va_start(args, format);
-  token = strtok_r(format_copy, search, &rest);
-  int i = 0;
-  while (i < count && token != NULL && h != NULL) {
-    /* interpret the format and convert the current key argument to
-     * a string */
-    char key[KVTREE_MAX_LINE];
-    int size = 0;
-    if (strcmp(token, "%s") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, char*));
-    } else if (strcmp(token, "%d")  == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, int));
-    } else if (strcmp(token, "%lld") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, long long));
-    } else if (strcmp(token, "%lu") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned long));
-    } else if (strcmp(token, "%#x") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned int));
-    } else if (strcmp(token, "%#lx") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned long));
-    } else if (strcmp(token, "%llu") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned long long));
-    } else if (strcmp(token, "%f") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, double));
-    } else if (strcmp(token, "%p") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, void*));
-    } else {
-      kvtree_abort(-1, "Unsupported hash key format '%s' @ %s:%d",
-        token, __FILE__, __LINE__
-      );
+/** returns the next element of the walk, setting event to
+ * KVTREE_WALK_PRE before visiting its children, and to
+ * KVTREE_WALK_POST after, returns NULL once the walk is done */
+static kvtree_elem* kvtree_walk_next(struct kvtree_walk* walk, int* event)
+{
+  /* go down into the children of the element we just reported */
+  kvtree_elem* elem = walk->pending;
+  if (elem != NULL) {
+    walk->pending = NULL;
+    if (! walk->prune && elem->hash != NULL && elem->hash->count > 0) {
+      kvtree_walk_push(walk, elem->hash, elem);
+    } else if (walk->events & KVTREE_WALK_POST) {
+      *event = KVTREE_WALK_POST;
+      return elem;
     }
+  }
 
-    /* check that we were able to fit the string into our buffer */
-    if (size >= sizeof(key)) {
-      kvtree_abort(-1, "Key buffer too small, have %lu need %d bytes @ %s:%d",
-        sizeof(key), size, __FILE__, __LINE__
-      );
+  while (walk->stack.depth > 0) {
+    struct kvtree_walk_frame* frame = (struct kvtree_walk_frame*) kvtree_stack_top(&walk->stack);
+    elem = kvtree_slot_next(frame->slots, frame->used, &frame->slot, frame->step);
+    if (elem != NULL) {
+      walk->pending = elem;
+      walk->prune   = 0;
+      *event = KVTREE_WALK_PRE;
+      return elem;
     }
 
-    if (i < count-1) {
-      /* check whether we have an entry for this key in the current
-       * hash */
-      kvtree* tmp = kvtree_get(h, key);
-
-      /* didn't find an entry for this key, so create one */
-      if (tmp == NULL) {
-        tmp = kvtree_set(h, key, kvtree_new());
-      }
-
-      /* now we have a hash for this key, continue with the next key */
-      h = tmp;
-    } else {
-      /* we are at the last key, so set its hash using the value
-       * provided by the caller */
-      h = kvtree_set(h, key, hash_value);
+    /* no children left, so we are done with the element holding them */
+    elem = frame->elem;
+    kvtree_stack_pop(&walk->stack);
+    if (elem != NULL && (walk->events & KVTREE_WALK_POST)) {
+      *event = KVTREE_WALK_POST;
+      return elem;
     }
-
-    /* get the next format string */
-    token = strtok_r(NULL, search, &rest);
-    i++;
   }
-  va_end(args);
-
-  /* free our copy of the format specifier */
-  kvtree_free(&format_copy);
+  return NULL;
+}
+
+/** skips the children of the element kvtree_walk_next just returned
+ * with KVTREE_WALK_PRE, it is still reported with KVTREE_WALK_POST */
+static inline void kvtree_walk_prune(struct kvtree_walk* walk)
+{
+  walk->prune = 1;
+}
+
+/** frees memory allocated by the walk */
+static void kvtree_walk_free(struct kvtree_walk* walk)
+{
+  kvtree_stack_free(&walk->stack);
+}
+
+/** returns the value of the key of elem used by KVTREE_ORDER_INT,
+ * which is the same as kvtree_elem_key_int */
+static int kvtree_elem_order_int(const kvtree_elem* elem)
+{
+  if (elem->flags & KVTREE_ELEM_FLAG_INTKEY) {
+    return (int) elem->ikey;
+  }
+  return (elem->key != NULL) ? atoi(elem->key) : 0;
+}
+
+/** compares a key, given as a string and as its integer value, to the
+ * key of elem in the order kept by hash, returns less than, equal to,
+ * or greater than zero if key comes before, with, or after elem */
+static int kvtree_order_cmp(const kvtree* hash, const char* key, int ival, const kvtree_elem* elem)
+{
+  int cmp;
+  if (hash->flags & KVTREE_FLAG_ORDER_INT) {
+    int e = kvtree_elem_order_int(elem);
+    cmp = (ival > e) - (ival < e);
+  } else {
+    cmp = strcmp(key, (elem->key != NULL) ? elem->key : "");
+  }
+  return (hash->flags & KVTREE_FLAG_ORDER_DESC) ? -cmp : cmp;
+}
+
+/** returns the first slot of an ordered hash whose key does not come
+ * before the given key, which is where a new element with that key
+ * goes, ahead of any older elements that compare equal */
+static int kvtree_order_lower(const kvtree* hash, const char* key, int ival)
+{
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int lo = 0;
+  int hi = kvtree_children_used(hash);
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (kvtree_order_cmp(hash, key, ival, slots[mid]) > 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/** returns the first slot of an ordered hash whose key comes after the
+ * given key */
+static int kvtree_order_upper(const kvtree* hash, const char* key, int ival)
+{
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int lo = 0;
+  int hi = kvtree_children_used(hash);
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (kvtree_order_cmp(hash, key, ival, slots[mid]) >= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/** finds an element of an ordered hash by binary search, with the key
+ * given as a string, or if key is NULL, as the integer ival, which
+ * only matches elements whose key is its canonical decimal form */
+static kvtree_elem* kvtree_order_find(const kvtree* hash, const char* key, int64_t ival)
+{
+  /* a string order compares strings, so format an integer key */
+  char buf[KVTREE_INT_KEY_MAX];
+  if (key == NULL && (hash->flags & KVTREE_FLAG_ORDER_STR)) {
+    kvtree_key_format_int(buf, ival);
+    key = buf;
+  }
+
+  /* keys with the same integer value need not be equal strings, so
+   * check each element that compares equal */
+  int order_ival = (key != NULL) ? atoi(key) : (int) ival;
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int used = kvtree_children_used(hash);
+  int i;
+  for (i = kvtree_order_lower(hash, key, order_ival); i < used; i++) {
+    kvtree_elem* elem = slots[i];
+    if (kvtree_order_cmp(hash, key, order_ival, elem) != 0) {
+      break;
+    }
+    if (key != NULL) {
+      if (elem->key != NULL && strcmp(elem->key, key) == 0) {
+        return elem;
+      }
+    } else if ((elem->flags & KVTREE_ELEM_FLAG_INTKEY) && elem->ikey == ival) {
+      return elem;
+    }
+  }
+  return NULL;
+}
+
+/** allocates a blob holding a copy of size bytes from buf, from the
+ * arena if one is given */
+static struct kvtree_bytes_struct* kvtree_bytes_new(struct kvtree_arena_struct* arena, const void* buf, size_t size)
+{
+  struct kvtree_bytes_struct* bytes = (struct kvtree_bytes_struct*) kvtree_arena_malloc(arena,
+    sizeof(struct kvtree_bytes_struct) + size
+  );
+  bytes->size = (uint64_t) size;
+  if (size > 0) {
+    memcpy(bytes->data, buf, size);
+  }
+  return bytes;
+}
+
+/** turns a typed leaf back into a plain hash, freeing its blob if it
+ * holds one */
+static void kvtree_clear_type(kvtree* hash)
+{
+  /* val of an untyped hash is zero, unless it points to shards */
+  if (! (hash->flags & KVTREE_FLAG_TYPE_ALL)) {
+    return;
+  }
+  if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+    kvtree_arena_free(hash->arena, &hash->val.bytes);
+  }
+  hash->flags &= ~KVTREE_FLAG_TYPE_ALL;
+  hash->val.u = 0;
+}
+
+/** allocates a new hash */
+kvtree* kvtree_new()
+{
+  kvtree* hash = (kvtree*) KVTREE_MALLOC(sizeof(kvtree));
+  kvtree_init(hash, NULL, 0);
+  return hash;
+}
+
+/** allocates a new hash that owns an arena, the hash itself is the
+ * first object allocated from that arena */
+kvtree* kvtree_new_arena()
+{
+  struct kvtree_arena_struct* arena = kvtree_arena_new();
+  kvtree* hash = (kvtree*) kvtree_arena_alloc(arena, sizeof(kvtree));
+  kvtree_init(hash, arena, KVTREE_FLAG_ARENA_NODE | KVTREE_FLAG_ARENA_OWNER);
+  return hash;
+}
+
+/** allocates a new hash to be inserted as a child of the given hash,
+ * children of an arena hash are allocated from the same arena */
+static kvtree* kvtree_new_child(const kvtree* parent)
+{
+  if (parent->arena == NULL) {
+    return kvtree_new();
+  }
+  kvtree* hash = (kvtree*) kvtree_arena_alloc(parent->arena, sizeof(kvtree));
+  kvtree_init(hash, parent->arena, KVTREE_FLAG_ARENA_NODE);
+  return hash;
+}
+
+/** allocates a new hash whose children are spread over shards */
+kvtree* kvtree_new_sharded(int shards)
+{
+  if (shards <= 0) {
+    shards = KVTREE_SHARDS;
+  }
+
+  /* round up to a power of two, which the high bits of a hash value
+   * pick from, leaving at least the low half of them to the index */
+  int bits = 0;
+  while ((1 << bits) < shards && bits < 16) {
+    bits++;
+  }
+  int count = 1 << bits;
+
+  struct kvtree_shards_struct* sharded = (struct kvtree_shards_struct*) KVTREE_MALLOC(
+    sizeof(struct kvtree_shards_struct) + (size_t) count * sizeof(union kvtree_shard)
+  );
+  sharded->count = count;
+  sharded->shift = 32 - bits;
+  int i;
+  for (i = 0; i < count; i++) {
+    union kvtree_shard* shard = &sharded->shards[i];
+    pthread_rwlock_init(&shard->s.lock, NULL);
+    shard->s.hash = kvtree_new();
+    shard->s.hash->flags |= KVTREE_FLAG_SHARD;
+    shard->s.hash->val.shards = sharded;
+  }
+
+  kvtree* hash = kvtree_new();
+  hash->flags |= KVTREE_FLAG_SHARDED;
+  hash->val.shards = sharded;
+  return hash;
+}
+
+/** returns the shard of a sharded hash that holds the key whose hash
+ * value is given */
+static inline union kvtree_shard* kvtree_shard_pick(const kvtree* hash, uint32_t key_hash)
+{
+  struct kvtree_shards_struct* sharded = hash->val.shards;
+  return &sharded->shards[(uint64_t) key_hash >> sharded->shift];
+}
+
+/** returns the first child of the first shard from shard i on that
+ * has any children, or NULL if none has */
+static kvtree_elem* kvtree_shards_first(const struct kvtree_shards_struct* sharded, int i)
+{
+  for (; i < sharded->count; i++) {
+    kvtree_elem* elem = kvtree_elem_first(sharded->shards[i].s.hash);
+    if (elem != NULL) {
+      return elem;
+    }
+  }
+  return NULL;
+}
+
+/** frees the shards of a sharded hash along with their children */
+static void kvtree_shards_delete(kvtree* hash)
+{
+  struct kvtree_shards_struct* sharded = hash->val.shards;
+  int i;
+  for (i = 0; i < sharded->count; i++) {
+    pthread_rwlock_destroy(&sharded->shards[i].s.lock);
+    kvtree_delete(&sharded->shards[i].s.hash);
+  }
+  kvtree_free(&sharded);
+  hash->flags &= ~KVTREE_FLAG_SHARDED;
+  hash->val.u = 0;
+}
+
+/** returns 1 unless hash was made by kvtree_new_sharded, in which case
+ * it reports that hash must be flattened first and returns 0 */
+static int kvtree_flat(const kvtree* hash)
+{
+  if (hash != NULL && (hash->flags & KVTREE_FLAG_SHARDED)) {
+    kvtree_err("Can not use a sharded hash as a whole, see kvtree_flatten @ %s:%d",
+      __FILE__, __LINE__
+    );
+    return 0;
+  }
+  return 1;
+}
+
+/** returns 1 if kvtree_delete frees the tree below hash one hash at a
+ * time, rather than leaving it to an arena or to other owners */
+static int kvtree_delete_owns(const kvtree* hash)
+{
+  return (hash != NULL && ! (hash->flags & KVTREE_FLAG_ARENA_NODE) && KVTREE_HASH_SHARES(hash) == 0);
+}
+
+/** frees a heap hash whose children were freed already */
+static void kvtree_delete_node(kvtree* hash)
+{
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    kvtree_shards_delete(hash);
+  }
+  kvtree_index_delete(&hash->index);
+  if (hash->flags & KVTREE_FLAG_CHILD_ARRAY) {
+    kvtree_free(&hash->kids.array->view);
+    kvtree_free(&hash->kids.array);
+  }
+  kvtree_clear_type(hash);
+  kvtree_free(&hash);
+}
+
+/** frees a hash */
+int kvtree_delete(kvtree** ptr_hash)
+{
+  if (ptr_hash != NULL) {
+    kvtree* hash = *ptr_hash;
+    if (hash != NULL) {
+      /* a shared hash is freed by its last owner, once there are no
+       * other owners none can be added, as only an owner may share it */
+      int shares = KVTREE_HASH_SHARES(hash);
+      while (shares > 0) {
+        if (__atomic_compare_exchange_n(&hash->shares, &shares, shares - 1,
+            1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+          *ptr_hash = NULL;
+          return KVTREE_SUCCESS;
+        }
+      }
+
+      if (hash->flags & KVTREE_FLAG_ARENA_NODE) {
+        /* the hash and everything allocated for it lives in the arena,
+         * we only need to visit the children if some hash from outside
+         * the arena was attached somewhere in the tree */
+        struct kvtree_arena_struct* arena = hash->arena;
+        if (arena->foreign > 0) {
+          struct kvtree_walk walk;
+          kvtree_walk_init(&walk, hash, 0, KVTREE_WALK_PRE);
+          int event;
+          kvtree_elem* elem;
+          while ((elem = kvtree_walk_next(&walk, &event)) != NULL) {
+            kvtree* child = elem->hash;
+            if (child == NULL ||
+                (child->arena == arena && ! (child->flags & KVTREE_FLAG_ARENA_OWNER)))
+            {
+              continue;
+            }
+            kvtree_walk_prune(&walk);
+            kvtree_delete(&elem->hash);
+          }
+          kvtree_walk_free(&walk);
+        }
+
+        /* release all memory at once if this hash owns the arena */
+        if (hash->flags & KVTREE_FLAG_ARENA_OWNER) {
+          kvtree_arena_delete(&arena);
+        }
+        *ptr_hash = NULL;
+        return KVTREE_SUCCESS;
+      }
+
+      /* tear down the tree bottom up, freeing each hash we own once
+       * its children are gone, and leaving hashes that are shared or
+       * from an arena to kvtree_delete, there is no need to maintain
+       * the index or the array of a hash while we do */
+      struct kvtree_walk walk;
+      kvtree_walk_init(&walk, hash, 0, KVTREE_WALK_PRE | KVTREE_WALK_POST);
+      int event;
+      kvtree_elem* elem;
+      while ((elem = kvtree_walk_next(&walk, &event)) != NULL) {
+        int owned = kvtree_delete_owns(elem->hash);
+        if (event == KVTREE_WALK_PRE) {
+          if (! owned) {
+            kvtree_walk_prune(&walk);
+          }
+          continue;
+        }
+        if (owned) {
+          kvtree_delete_node(elem->hash);
+          elem->hash = NULL;
+        }
+        kvtree_elem_delete(hash, elem);
+      }
+      kvtree_walk_free(&walk);
+      kvtree_delete_node(hash);
+      *ptr_hash = NULL;
+    }
+  }
+  return KVTREE_SUCCESS;
+}
+///@}
+
+/* ================================================= */
+/** @name size, get, set, unset, and merge functions */
+///@{
+/** insert element as the newest child of the hash, or in its place if
+ * the hash is ordered, update the element count, and add it to the
+ * index, building the index if the hash just grew large enough to need
+ * one, ordered hashes use binary search instead of an index */
+static void kvtree_elem_link(kvtree* hash, kvtree_elem* elem)
+{
+  /* a typed leaf has at most one subkey, so it is no longer one */
+  kvtree_clear_type(hash);
+
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    const char* key = (elem->key != NULL) ? elem->key : "";
+    int pos = kvtree_order_lower(hash, key, kvtree_elem_order_int(elem));
+    kvtree_children_insert(hash, elem, pos);
+    hash->count++;
+    return;
+  }
+
+  kvtree_children_append(hash, elem);
+  hash->count++;
+  if (hash->index != NULL) {
+    kvtree_index_insert(hash->index, elem);
+  } else if (hash->count >= KVTREE_INDEX_THRESHOLD) {
+    hash->index = kvtree_index_build(hash);
+  }
+}
+
+/** remove element from the hash, update the element count, and remove
+ * it from the index if the hash has one */
+static void kvtree_elem_unlink(kvtree* hash, kvtree_elem* elem)
+{
+  kvtree_clear_type(hash);
+
+  if (hash->index != NULL) {
+    kvtree_index_remove(hash->index, hash, elem);
+  }
+  kvtree_children_remove(hash, elem);
+  hash->count--;
+}
+
+/** returns 1 if hash may be changed, otherwise reports that it is
+ * shared or frozen and returns 0 */
+static int kvtree_writable(const kvtree* hash)
+{
+  if (hash != NULL && KVTREE_HASH_SHARES(hash) > 0) {
+    kvtree_err("Can not change a shared hash, see kvtree_unshare @ %s:%d",
+      __FILE__, __LINE__
+    );
+    return 0;
+  }
+  if (hash != NULL && KVTREE_HASH_FROZEN(hash)) {
+    kvtree_err("Can not change a frozen hash @ %s:%d",
+      __FILE__, __LINE__
+    );
+    return 0;
+  }
+  return 1;
+}
+
+/** returns hash shared with kvtree_share to be set as a child of
+ * parent, noting a hash from outside the arena of parent */
+static kvtree* kvtree_share_child(const kvtree* parent, const kvtree* hash)
+{
+  kvtree* shared = kvtree_share(hash);
+  if (parent->arena != NULL && shared->arena != parent->arena) {
+    parent->arena->foreign++;
+  }
+  return shared;
+}
+
+/** returns the hash of elem, first replacing a shared hash with a
+ * copy of its own that shares the children instead, so that it can be
+ * changed */
+static kvtree* kvtree_elem_hash_writable(kvtree_elem* elem)
+{
+  kvtree* hash = elem->hash;
+  if (hash != NULL && KVTREE_HASH_SHARES(hash) > 0) {
+    elem->hash = kvtree_snapshot(hash);
+    kvtree_delete(&hash);
+  }
+  return elem->hash;
+}
+
+/**
+ * Return size of hash (number of keys)
+ *
+ * For example, if your tree was:
+ *
+ * NAME
+ *   axl_cp
+ * TYPE
+ *   2
+ * STATE_FILE
+ *   state_file
+ * STATE
+ *   4
+ * STATUS
+ *   4
+ * FILE
+ *   hello.txt
+ *     STATUS
+ *       3
+ *     SIZE
+ *       6
+ *     GID
+ *       57592
+ *     UID
+ *       57592
+ *     MODE
+ *       33268
+ *     DEST
+ *       hello2.txt._AXL
+ *
+ * This would return 6 since there's six top level elements:
+ *     "NAME", "TYPE", "STATE_FILE", "STATE", "STATUS", "FILE".
+ */
+int kvtree_size(const kvtree* hash)
+{
+  if (hash == NULL) {
+    return 0;
+  }
+
+  /* a sharded hash holds the sum of its shards */
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    const struct kvtree_shards_struct* sharded = hash->val.shards;
+    int count = 0;
+    int i;
+    for (i = 0; i < sharded->count; i++) {
+      union kvtree_shard* shard = (union kvtree_shard*) &sharded->shards[i];
+      pthread_rwlock_rdlock(&shard->s.lock);
+      count += shard->s.hash->count;
+      pthread_rwlock_unlock(&shard->s.lock);
+    }
+    return count;
+  }
+  return hash->count;
+}
+
+/** return 1 if hash has no keys (or is NULL), 0 otherwise */
+int kvtree_is_empty(const kvtree* hash)
+{
+  if (hash != NULL && (hash->flags & KVTREE_FLAG_SHARDED)) {
+    return (kvtree_size(hash) == 0);
+  }
+  return (hash == NULL || hash->count == 0);
+}
+
+/** return 1 if hash has exactly one key, 0 otherwise */
+int kvtree_has_one(const kvtree* hash)
+{
+  if (hash != NULL && (hash->flags & KVTREE_FLAG_SHARDED)) {
+    return (kvtree_size(hash) == 1);
+  }
+  return (hash != NULL && hash->count == 1);
+}
+
+/** makes room for hash to hold n keys without growing its child
+ * array again, for callers about to add many keys at once */
+int kvtree_reserve(kvtree* hash, int n)
+{
+  if (hash == NULL || ! kvtree_writable(hash)) {
+    return KVTREE_FAILURE;
+  }
+  if (n <= 1) {
+    return KVTREE_SUCCESS;
+  }
+  if (! (hash->flags & KVTREE_FLAG_CHILD_ARRAY) || n > hash->kids.array->cap) {
+    kvtree_children_resize(hash, n);
+  }
+  return KVTREE_SUCCESS;
+}
+
+/** given a hash and a key, return the hash associated with key,
+ * returns NULL if not found */
+kvtree* kvtree_get(const kvtree* hash, const char* key)
+{
+  kvtree_elem* elem = kvtree_elem_get(hash, key);
+  if (elem != NULL) {
+    return elem->hash;
+  }
+  return NULL;
+}
+
+/** given a hash, a key, and a hash value, set (or reset) the key's
+ * hash and return the pointer to the new hash */
+kvtree* kvtree_set(kvtree* hash, const char* key, kvtree* hash_value)
+{
+  /* check that we have a valid hash to insert into and a valid key
+   * name */
+  if (hash == NULL || key == NULL || ! kvtree_writable(hash)) {
+    return NULL;
+  }
+
+  /* a sharded hash sets the key in its shard, holding the lock of
+   * that shard while it does */
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    union kvtree_shard* shard = kvtree_shard_pick(hash, kvtree_key_hash(key));
+    pthread_rwlock_wrlock(&shard->s.lock);
+    kvtree* set = kvtree_set(shard->s.hash, key, hash_value);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return set;
+  }
+
+  /* an arena hash must walk its tree on delete once it holds a hash
+   * that was not allocated from its arena */
+  if (hash->arena != NULL && hash_value != NULL &&
+      hash_value->arena != hash->arena)
+  {
+    hash->arena->foreign++;
+  }
+
+  /* an ordered hash resets an existing key where it stands, rather
+   * than moving it out and back into the same slot */
+  kvtree_elem* elem;
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    elem = kvtree_order_find(hash, key, 0);
+    if (elem != NULL) {
+      kvtree_clear_type(hash);
+      if (elem->hash != NULL) {
+        kvtree_delete(&elem->hash);
+      }
+      elem->hash = hash_value;
+      return elem->hash;
+    }
+  }
+
+  /* if there is a match in the hash, pull out that element */
+  elem = kvtree_elem_extract(hash, key);
+  if (elem == NULL) {
+    /* nothing found, so create a new element and set it */
+    elem = kvtree_elem_new(hash, key, strlen(key), 0, hash_value);
+  } else {
+    /* this key already exists, delete its current hash and reset it */
+    if (elem->hash != NULL) {
+      kvtree_delete(&elem->hash);
+    }
+    elem->hash = hash_value;
+  }
+
+  /* insert the element into the hash */
+  kvtree_elem_link(hash, elem);
+
+  /* return the pointer to the hash of the element */
+  return elem->hash;
+}
+
+/** given a hash and a key, extract and return hash for specified key,
+ * returns NULL if not found */
+kvtree* kvtree_extract(kvtree* hash, const char* key)
+{
+  if (hash == NULL) {
+    return NULL;
+  }
+
+  kvtree_elem* elem = kvtree_elem_extract(hash, key);
+  if (elem != NULL) {
+    kvtree* elem_hash = elem->hash;
+    elem->hash = NULL;
+    kvtree_elem_delete(hash, elem);
+    return elem_hash;
+  }
+  return NULL;
+}
+
+/** given a hash and a key, extract and delete any matching element */
+int kvtree_unset(kvtree* hash, const char* key)
+{
+  if (hash == NULL) {
+    return KVTREE_SUCCESS;
+  }
+  if (! kvtree_writable(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  kvtree_elem* elem = kvtree_elem_extract(hash, key);
+  if (elem != NULL) {
+    kvtree_elem_delete(hash, elem);
+  }
+  return KVTREE_SUCCESS;
+}
+
+/** unset all values in the hash, but don't delete it */
+int kvtree_unset_all(kvtree* hash)
+{
+  if (! kvtree_writable(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  kvtree_elem* elem = kvtree_elem_first(hash);
+  while (elem != NULL) {
+    /* remember this element */
+    kvtree_elem* tmp = elem;
+
+    /* get the next element */
+    elem = kvtree_elem_next(elem);
+
+    /* extract and delete the current element by address */
+    kvtree_elem_extract_by_addr(hash, tmp);
+    kvtree_elem_delete(hash, tmp);
+  }
+  return KVTREE_SUCCESS;
+}
+
+/** given a hash and an element from any hash, return the element in
+ * hash with the same key, using the pooled hash value and a pointer
+ * compare when the key of other came from the pool */
+static kvtree_elem* kvtree_elem_get_match(const kvtree* hash, const kvtree_elem* other)
+{
+  if (other->key == NULL) {
+    return NULL;
+  }
+
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    return kvtree_order_find(hash, other->key, 0);
+  }
+
+  int interned = other->flags & KVTREE_ELEM_FLAG_INTERNED;
+  if (hash->index != NULL) {
+    return kvtree_index_lookup_hash(hash->index, other->key,
+      kvtree_elem_key_hash(other), interned
+    );
+  }
+
+  kvtree_elem* elem;
+  kvtree_elem** slot;
+  KVTREE_FOREACH(elem, slot, hash) {
+    if (elem->key != NULL &&
+        KVTREE_KEY_EQUAL(elem->key, elem->flags & KVTREE_ELEM_FLAG_INTERNED, other->key, interned))
+    {
+      return elem;
+    }
+  }
+  return NULL;
+}
+
+/** given a hash and an integer, return the element whose key is the
+ * canonical decimal form of that integer, returns NULL if not found */
+static kvtree_elem* kvtree_elem_get_int(const kvtree* hash, int64_t key)
+{
+  if (hash == NULL) {
+    return NULL;
+  }
+
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    union kvtree_shard* shard = kvtree_shard_pick(hash, kvtree_int_hash(key));
+    pthread_rwlock_rdlock(&shard->s.lock);
+    kvtree_elem* elem = kvtree_elem_get_int(shard->s.hash, key);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return elem;
+  }
+
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    return kvtree_order_find(hash, NULL, key);
+  }
+  if (hash->index != NULL) {
+    return kvtree_index_lookup_int(hash->index, key);
+  }
+
+  kvtree_elem* elem;
+  kvtree_elem** slot;
+  KVTREE_FOREACH(elem, slot, hash) {
+    if ((elem->flags & KVTREE_ELEM_FLAG_INTKEY) && elem->ikey == key) {
+      return elem;
+    }
+  }
+  return NULL;
+}
+
+/** returns the hash for a key in hash ready to be changed, the key is
+ * the integer ikey if key is NULL, returns NULL if the key is not set
+ * or if hash itself is shared */
+static kvtree* kvtree_child_writable(kvtree* hash, const char* key, int64_t ikey)
+{
+  if (hash == NULL || ! kvtree_writable(hash)) {
+    return NULL;
+  }
+  kvtree_elem* elem = (key != NULL) ? kvtree_elem_get(hash, key) : kvtree_elem_get_int(hash, ikey);
+  if (elem == NULL) {
+    return NULL;
+  }
+  return kvtree_elem_hash_writable(elem);
+}
+
+/* define a frame of kvtree_merge, one for each pair of hashes merged */
+struct kvtree_merge_frame {
+  kvtree* hash1;       /* hash the elements are merged into */
+  const kvtree* hash2; /* hash the elements come from */
+  int slot;            /* slot of the next element of hash2 */
+  int step;            /* direction in which slots are visited */
+  int copy_type;       /* whether hash1 was empty to begin with */
+};
+
+/** pushes a frame to merge hash2 into hash1, getting hash1 ready */
+static void kvtree_merge_push(struct kvtree_stack* stack, kvtree* hash1, const kvtree* hash2)
+{
+  struct kvtree_merge_frame* frame = (struct kvtree_merge_frame*) kvtree_stack_push(stack);
+  frame->hash1 = hash1;
+  frame->hash2 = hash2;
+  frame->slot  = kvtree_slot_first(hash2, 1, &frame->step);
+
+  /* if hash1 starts out empty, it ends up a copy of hash2, including
+   * any order hash2 keeps, since the elements of hash2 then arrive in
+   * that order, each goes in the last slot */
+  frame->copy_type = kvtree_is_empty(hash1);
+  if (frame->copy_type && ! (hash1->flags & KVTREE_FLAG_ORDER_ALL)) {
+    kvtree_index_delete(&hash1->index);
+    hash1->flags |= (hash2->flags & KVTREE_FLAG_ORDER_ALL);
+  }
+}
+
+/** finishes merging the hashes of frame once all elements are in */
+static void kvtree_merge_tail(const struct kvtree_merge_frame* frame)
+{
+  /* carry over the value of a typed leaf, a blob gets its own copy */
+  kvtree* hash1 = frame->hash1;
+  const kvtree* hash2 = frame->hash2;
+  if (frame->copy_type && (hash2->flags & KVTREE_FLAG_TYPE_ALL)) {
+    kvtree_clear_type(hash1);
+    hash1->flags |= (hash2->flags & KVTREE_FLAG_TYPE_ALL);
+    if (KVTREE_HASH_TYPE(hash2) == KVTREE_TYPE_BYTES) {
+      const struct kvtree_bytes_struct* bytes = hash2->val.bytes;
+      hash1->val.bytes = kvtree_bytes_new(hash1->arena, bytes->data, (size_t) bytes->size);
+    } else {
+      hash1->val = hash2->val;
+    }
+  }
+}
+
+/** merges (copies) elements from hash2 into hash1 */
+int kvtree_merge(kvtree* hash1, const kvtree* hash2)
+{
+  /* need hash1 to be valid to insert anything into it */
+  if (hash1 == NULL || ! kvtree_writable(hash1) || ! kvtree_flat(hash1)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* if hash2 is NULL, there is nothing to insert, so we're done */
+  if (hash2 == NULL) {
+    return KVTREE_SUCCESS;
+  }
+  if (! kvtree_flat(hash2)) {
+    return KVTREE_FAILURE;
+  }
+
+  int rc = KVTREE_SUCCESS;
+
+  /* walk hash2, keeping a frame for each pair of hashes whose elements
+   * we are merging */
+  struct kvtree_stack stack;
+  kvtree_stack_init(&stack, sizeof(struct kvtree_merge_frame));
+  kvtree_merge_push(&stack, hash1, hash2);
+  while (stack.depth > 0) {
+    struct kvtree_merge_frame* frame = (struct kvtree_merge_frame*) kvtree_stack_top(&stack);
+    kvtree_elem* elem = kvtree_slot_next(
+      kvtree_children_slots(frame->hash2), kvtree_children_used(frame->hash2), &frame->slot, frame->step
+    );
+    if (elem == NULL) {
+      kvtree_merge_tail(frame);
+      kvtree_stack_pop(&stack);
+      continue;
+    }
+    kvtree* parent = frame->hash1;
+
+    /* get the key for this element */
+    char* key = kvtree_elem_key(elem);
+    if (key == NULL) {
+      rc = KVTREE_FAILURE;
+      continue;
+    }
+
+    /* get hash for the matching element in hash1, if it has one, a
+     * copy of its own if it was shared, since we are about to change it */
+    kvtree_elem* match = kvtree_elem_get_match(parent, elem);
+    kvtree* key_hash1 = (match != NULL) ? kvtree_elem_hash_writable(match) : NULL;
+    if (match == NULL) {
+      /* hash1 had no element with this key, so create one, which can
+       * share the key of elem if that came from the pool, and which
+       * can share the hash of elem too if that is already shared */
+      int shared = (elem->hash != NULL && KVTREE_HASH_SHARES(elem->hash) > 0);
+      key_hash1 = shared ? kvtree_share_child(parent, elem->hash) : kvtree_new_child(parent);
+      kvtree_elem* new_elem = kvtree_elem_new(parent, key, elem->keylen,
+        elem->flags & KVTREE_ELEM_FLAG_INTERNED, key_hash1
+      );
+      kvtree_elem_link(parent, new_elem);
+      if (shared) {
+        continue;
+      }
+    } else if (key_hash1 == NULL) {
+      /* hash1 has the key but no hash for it */
+      key_hash1 = kvtree_set(parent, key, kvtree_new_child(parent));
+    }
+
+    /* merge the hash for this key from hash2 with the hash for this
+     * key from hash1 */
+    kvtree* key_hash2 = kvtree_elem_hash(elem);
+    if (key_hash1 == NULL || ! kvtree_writable(key_hash1) ||
+        ! kvtree_flat(key_hash1) || ! kvtree_flat(key_hash2))
+    {
+      rc = KVTREE_FAILURE;
+    } else if (key_hash2 != NULL) {
+      kvtree_merge_push(&stack, key_hash1, key_hash2);
+    }
+  }
+  kvtree_stack_free(&stack);
+
+  return rc;
+}
+
+/** moves the typed value of hash2, if any, into hash1 */
+static void kvtree_move_type(kvtree* hash1, kvtree* hash2)
+{
+  if (hash2->flags & KVTREE_FLAG_TYPE_ALL) {
+    kvtree_clear_type(hash1);
+    hash1->flags |= (hash2->flags & KVTREE_FLAG_TYPE_ALL);
+    hash1->val = hash2->val;
+    hash2->flags &= ~KVTREE_FLAG_TYPE_ALL;
+    hash2->val.u = 0;
+  }
+}
+
+/** merges elements from hash2 into hash1, moving them rather than
+ * copying them, leaves hash2 empty */
+int kvtree_merge_move(kvtree* hash1, kvtree* hash2)
+{
+  /* need hash1 to be valid to insert anything into it */
+  if (hash1 == NULL || ! kvtree_writable(hash1) || ! kvtree_flat(hash1)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* if hash2 is NULL, there is nothing to insert, so we're done */
+  if (hash2 == NULL || hash2 == hash1) {
+    return KVTREE_SUCCESS;
+  }
+  if (! kvtree_flat(hash2)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* other owners still read a shared hash2, so its children can
+   * only be shared and not taken, nor can those of a frozen hash2 */
+  if (KVTREE_HASH_SHARES(hash2) > 0 || KVTREE_HASH_FROZEN(hash2)) {
+    return kvtree_merge(hash1, hash2);
+  }
+
+  /* elements are freed by the hash that holds them, so they can only
+   * move between two heap hashes or two hashes of the same arena,
+   * and not out of the hash that frees the arena, otherwise copy */
+  if (hash1->arena != hash2->arena || (hash2->flags & KVTREE_FLAG_ARENA_OWNER)) {
+    int rc = kvtree_merge(hash1, hash2);
+    kvtree_unset_all(hash2);
+    kvtree_clear_type(hash2);
+    return rc;
+  }
+
+  int rc = KVTREE_SUCCESS;
+
+  /* if hash1 starts out empty, and keeps no order other than that of
+   * hash2, it takes over the children of hash2 as they are */
+  int copy_type = kvtree_is_empty(hash1);
+  int order1 = hash1->flags & KVTREE_FLAG_ORDER_ALL;
+  int order2 = hash2->flags & KVTREE_FLAG_ORDER_ALL;
+  if (copy_type && hash2->count > 0 && (order1 == 0 || order1 == order2)) {
+    kvtree_clear_type(hash1);
+    kvtree_index_delete(&hash1->index);
+
+    /* swap the child arrays, so that hash2 keeps the empty one */
+    int array1 = hash1->flags & KVTREE_FLAG_CHILD_ARRAY;
+    int array2 = hash2->flags & KVTREE_FLAG_CHILD_ARRAY;
+    hash1->flags = (hash1->flags & ~(KVTREE_FLAG_CHILD_ARRAY | KVTREE_FLAG_ORDER_ALL)) | array2 | order2;
+    hash2->flags = (hash2->flags & ~KVTREE_FLAG_CHILD_ARRAY) | array1;
+    kvtree_elem* one = hash1->kids.one;
+    struct kvtree_children_struct* array = hash1->kids.array;
+    if (array2) {
+      hash1->kids.array = hash2->kids.array;
+    } else {
+      hash1->kids.one = hash2->kids.one;
+    }
+    if (array1) {
+      hash2->kids.array = array;
+    } else {
+      hash2->kids.one = one;
+    }
+    hash1->count = hash2->count;
+    hash2->count = 0;
+    hash1->index = hash2->index;
+    hash2->index = NULL;
+    if (array1) {
+      kvtree_children_changed(hash2->kids.array);
+    }
+
+    kvtree_elem* elem;
+    kvtree_elem** slot;
+    KVTREE_FOREACH(elem, slot, hash1) {
+      elem->parent = hash1;
+    }
+
+    /* along with the value of a typed leaf */
+    kvtree_move_type(hash1, hash2);
+    return KVTREE_SUCCESS;
+  }
+
+  /* an empty hash1 takes on the order of hash2, as in kvtree_merge */
+  if (copy_type && order1 == 0) {
+    kvtree_index_delete(&hash1->index);
+    hash1->flags |= order2;
+  }
+
+  /* move each element of hash2 whose key hash1 lacks, and merge the
+   * hashes of those it has */
+  kvtree_elem* elem = kvtree_elem_first(hash2);
+  while (elem != NULL) {
+    kvtree_elem* next = kvtree_elem_next(elem);
+    if (elem->key == NULL) {
+      rc = KVTREE_FAILURE;
+    } else {
+      kvtree_elem* match = kvtree_elem_get_match(hash1, elem);
+      if (match == NULL) {
+        kvtree_elem_unlink(hash2, elem);
+        kvtree_elem_link(hash1, elem);
+      } else if (match->hash == NULL) {
+        /* hash1 has the key but no hash for it, so take that of elem */
+        match->hash = (elem->hash != NULL) ? elem->hash : kvtree_new_child(hash1);
+        elem->hash = NULL;
+      } else if (kvtree_merge_move(kvtree_elem_hash_writable(match), elem->hash) != KVTREE_SUCCESS) {
+        rc = KVTREE_FAILURE;
+      }
+    }
+    elem = next;
+  }
+
+  /* drop the elements whose hashes were merged */
+  kvtree_unset_all(hash2);
+
+  /* carry over the value of a typed leaf */
+  if (copy_type) {
+    kvtree_move_type(hash1, hash2);
+  }
+  kvtree_clear_type(hash2);
+
+  return rc;
+}
+
+/** returns 1 if a copy can share hash rather than copy it, which it
+ * does for a hash that is shared already, or for any hash if all is
+ * positive, or never if all is negative, so long as hash is not from
+ * an arena, other than the top of a frozen tree, nor sharded, and has
+ * room for another owner */
+static int kvtree_clone_shares(const kvtree* hash, int all)
+{
+  if (all < 0 || KVTREE_HASH_SHARES(hash) == KVTREE_SHARES_MAX ||
+      (hash->flags & KVTREE_FLAG_SHARDED))
+  {
+    return 0;
+  }
+  if ((hash->flags & KVTREE_FLAG_ARENA_NODE) &&
+      ! ((hash->flags & KVTREE_FLAG_ARENA_OWNER) && KVTREE_HASH_FROZEN(hash)))
+  {
+    return 0;
+  }
+  return (all || KVTREE_HASH_SHARES(hash) > 0);
+}
+
+/** returns the number of arena bytes kvtree_clone_into allocates to
+ * copy the children and value of hash, not counting children that
+ * kvtree_clone_shares lets it share */
+static size_t kvtree_clone_size(const kvtree* hash, int share)
+{
+  size_t size = 0;
+  if (hash->count > 1) {
+    size += kvtree_arena_rounded(sizeof(struct kvtree_children_struct) +
+      (size_t) hash->count * sizeof(kvtree_elem*)
+    );
+  }
+  if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+    size += kvtree_arena_rounded(sizeof(struct kvtree_bytes_struct) + (size_t) hash->val.bytes->size);
+  }
+
+  kvtree_elem* elem;
+  kvtree_elem** slot;
+  KVTREE_FOREACH(elem, slot, hash) {
+    size += kvtree_arena_rounded(sizeof(kvtree_elem) + elem->keylen + 1);
+    if (elem->hash != NULL && ! kvtree_clone_shares(elem->hash, share)) {
+      size += kvtree_arena_rounded(sizeof(kvtree)) + kvtree_clone_size(elem->hash, share);
+    }
+  }
+  return size;
+}
+
+/** copies the children and value of hash into the empty hash clone,
+ * keeping the children in the same slots, so in the same order,
+ * children that kvtree_clone_shares allows are shared, not copied */
+static void kvtree_clone_into(kvtree* clone, const kvtree* hash, int share)
+{
+  if (hash->count > 1) {
+    kvtree_children_resize(clone, hash->count);
+  }
+
+  /* children are appended oldest first, so we walk the slots up */
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int used = kvtree_children_used(hash);
+  int i;
+  for (i = 0; i < used; i++) {
+    const kvtree_elem* elem = slots[i];
+    if (elem == NULL) {
+      continue;
+    }
+    kvtree* child = NULL;
+    if (elem->hash != NULL && kvtree_clone_shares(elem->hash, share)) {
+      child = kvtree_share_child(clone, elem->hash);
+    } else if (elem->hash != NULL) {
+      child = kvtree_new_child(clone);
+      kvtree_clone_into(child, elem->hash, 0);
+    }
+    kvtree_elem* copy = kvtree_elem_new(clone, elem->key, elem->keylen,
+      elem->flags & KVTREE_ELEM_FLAG_INTERNED, child
+    );
+    kvtree_children_append(clone, copy);
+    clone->count++;
+  }
+
+  /* the children are already in any order hash keeps, otherwise index
+   * them once they are all in */
+  clone->flags |= (hash->flags & KVTREE_FLAG_ORDER_ALL);
+  if (! (clone->flags & KVTREE_FLAG_ORDER_ALL) && clone->count >= KVTREE_INDEX_THRESHOLD) {
+    clone->index = kvtree_index_build(clone);
+  }
+
+  /* copy the value of a typed leaf, a blob gets its own copy */
+  if (hash->flags & KVTREE_FLAG_TYPE_ALL) {
+    clone->flags |= (hash->flags & KVTREE_FLAG_TYPE_ALL);
+    if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+      const struct kvtree_bytes_struct* bytes = hash->val.bytes;
+      clone->val.bytes = kvtree_bytes_new(clone->arena, bytes->data, (size_t) bytes->size);
+    } else {
+      clone->val = hash->val;
+    }
+  }
+}
+
+/** returns a new hash holding a copy of hash */
+kvtree* kvtree_clone(const kvtree* hash)
+{
+  if (! kvtree_flat(hash)) {
+    return NULL;
+  }
+  kvtree* clone = kvtree_new();
+  if (hash != NULL) {
+    kvtree_clone_into(clone, hash, 0);
+  }
+  return clone;
+}
+
+/** returns a new hash holding a copy of hash, allocated from an arena
+ * that it owns */
+kvtree* kvtree_clone_arena(const kvtree* hash)
+{
+  if (! kvtree_flat(hash)) {
+    return NULL;
+  }
+
+  /* size the first slab to hold the whole copy, save for any index */
+  struct kvtree_arena_struct* arena = kvtree_arena_new();
+  size_t size = kvtree_arena_rounded(sizeof(kvtree));
+  if (hash != NULL) {
+    size += kvtree_clone_size(hash, 0);
+  }
+  kvtree_arena_reserve(arena, size);
+
+  kvtree* clone = (kvtree*) kvtree_arena_alloc(arena, sizeof(kvtree));
+  kvtree_init(clone, arena, KVTREE_FLAG_ARENA_NODE | KVTREE_FLAG_ARENA_OWNER);
+  if (hash != NULL) {
+    kvtree_clone_into(clone, hash, 0);
+  }
+  return clone;
+}
+
+/** returns hash itself with one more owner, which must be freed with
+ * kvtree_delete like any other hash, a hash from an arena is copied
+ * with kvtree_clone instead */
+kvtree* kvtree_share(const kvtree* hash)
+{
+  if (hash == NULL || ! kvtree_clone_shares(hash, 1)) {
+    return kvtree_clone(hash);
+  }
+  kvtree* shared = (kvtree*) hash;
+  __atomic_fetch_add(&shared->shares, 1, __ATOMIC_RELAXED);
+  return shared;
+}
+
+/** returns a new hash with the same keys as hash, whose children are
+ * shared with hash rather than copied */
+kvtree* kvtree_snapshot(const kvtree* hash)
+{
+  if (! kvtree_flat(hash)) {
+    return NULL;
+  }
+  kvtree* snapshot = kvtree_new();
+  if (hash != NULL) {
+    kvtree_clone_into(snapshot, hash, 1);
+  }
+  return snapshot;
+}
+
+/** returns the hash for key in hash ready to be changed, replacing it
+ * with a snapshot first if it is shared, returns NULL if key is not
+ * set or if hash itself is shared */
+kvtree* kvtree_unshare(kvtree* hash, const char* key)
+{
+  if (key == NULL) {
+    return NULL;
+  }
+  return kvtree_child_writable(hash, key, 0);
+}
+
+/* kinds of components in a path format, a literal key or the
+ * conversion applied to the next argument */
+#define KVTREE_PATH_BAD    (-1) /* unsupported conversion */
+#define KVTREE_PATH_KEY    (0)  /* literal key */
+#define KVTREE_PATH_STR    (1)  /* %s */
+#define KVTREE_PATH_INT    (2)  /* %d */
+#define KVTREE_PATH_LLONG  (3)  /* %lld */
+#define KVTREE_PATH_ULONG  (4)  /* %lu */
+#define KVTREE_PATH_ULLONG (5)  /* %llu */
+#define KVTREE_PATH_XINT   (6)  /* %#x */
+#define KVTREE_PATH_XLONG  (7)  /* %#lx */
+#define KVTREE_PATH_DOUBLE (8)  /* %f */
+#define KVTREE_PATH_PTR    (9)  /* %p */
+
+/** define a component of a path */
+struct kvtree_path_token {
+  int type;        /* one of the KVTREE_PATH values */
+  const char* key; /* literal key, for KVTREE_PATH_KEY */
+};
+
+/** define a compiled path, literal keys are stored after the tokens */
+struct kvtree_path_struct {
+  int count; /* number of tokens */
+  struct kvtree_path_token tokens[];
+};
+
+/** define the conversions we support in a format */
+static const struct {
+  const char* spec;
+  int type;
+} kvtree_path_specs[] = {
+  { "%s",   KVTREE_PATH_STR    },
+  { "%d",   KVTREE_PATH_INT    },
+  { "%lld", KVTREE_PATH_LLONG  },
+  { "%lu",  KVTREE_PATH_ULONG  },
+  { "%#x",  KVTREE_PATH_XINT   },
+  { "%#lx", KVTREE_PATH_XLONG  },
+  { "%llu", KVTREE_PATH_ULLONG },
+  { "%f",   KVTREE_PATH_DOUBLE },
+  { "%p",   KVTREE_PATH_PTR    },
+};
+
+/** parses the next space-separated token of format starting at p,
+ * sets its type and length, returns pointer to the start of the token
+ * or NULL if there are no more tokens */
+static const char* kvtree_path_next(const char* p, int* type, size_t* len)
+{
+  while (*p == ' ') {
+    p++;
+  }
+  if (*p == '\0') {
+    return NULL;
+  }
+
+  size_t n = 0;
+  while (p[n] != ' ' && p[n] != '\0') {
+    n++;
+  }
+  *len = n;
+
+  *type = KVTREE_PATH_KEY;
+  if (p[0] == '%') {
+    *type = KVTREE_PATH_BAD;
+    size_t i;
+    for (i = 0; i < sizeof(kvtree_path_specs) / sizeof(kvtree_path_specs[0]); i++) {
+      const char* spec = kvtree_path_specs[i].spec;
+      if (strncmp(p, spec, n) == 0 && spec[n] == '\0') {
+        *type = kvtree_path_specs[i].type;
+        break;
+      }
+    }
+  }
+  return p;
+}
+
+/** converts the next argument for the given token into a key, integer
+ * conversions that yield a canonical integer key set ikey, set key to
+ * NULL, and return 1 so the caller can look them up without a string,
+ * otherwise sets key, formatting it into buf if needed, and returns 0 */
+static int kvtree_path_arg(const struct kvtree_path_token* tok, va_list* args,
+  char* buf, size_t bufsize, const char** key, int64_t* ikey)
+{
+  int size = 0;
+  switch (tok->type) {
+  case KVTREE_PATH_KEY:
+    *key = tok->key;
+    return 0;
+  case KVTREE_PATH_STR:
+    *key = va_arg(*args, char*);
+    if (*key == NULL) {
+      /* a NULL key is not an integer key, use the string printf gives */
+      *key = "(null)";
+    }
+    return 0;
+  case KVTREE_PATH_INT:
+    *ikey = (int64_t) va_arg(*args, int);
+    *key = NULL;
+    return 1;
+  case KVTREE_PATH_LLONG:
+    *ikey = (int64_t) va_arg(*args, long long);
+    *key = NULL;
+    return 1;
+  case KVTREE_PATH_ULONG:
+  case KVTREE_PATH_ULLONG:
+  {
+    unsigned long long u = (tok->type == KVTREE_PATH_ULONG) ?
+      (unsigned long long) va_arg(*args, unsigned long) : va_arg(*args, unsigned long long);
+    if (u <= (unsigned long long) INT64_MAX) {
+      *ikey = (int64_t) u;
+      *key = NULL;
+      return 1;
+    }
+    size = snprintf(buf, bufsize, "%llu", u);
+    break;
+  }
+  case KVTREE_PATH_XINT:
+    size = snprintf(buf, bufsize, "%#x", va_arg(*args, unsigned int));
+    break;
+  case KVTREE_PATH_XLONG:
+    size = snprintf(buf, bufsize, "%#lx", va_arg(*args, unsigned long));
+    break;
+  case KVTREE_PATH_DOUBLE:
+    size = snprintf(buf, bufsize, "%f", va_arg(*args, double));
+    break;
+  case KVTREE_PATH_PTR:
+    size = snprintf(buf, bufsize, "%p", va_arg(*args, void*));
+    break;
+  }
+
+  /* check that we were able to fit the string into our buffer */
+  if (size >= bufsize) {
+    kvtree_abort(-1, "Key buffer too small, have %lu need %d bytes @ %s:%d",
+      bufsize, size, __FILE__, __LINE__
+    );
+  }
+  *key = buf;
+  return 0;
+}
+
+/** returns the hash for a key in hash, the key is the integer ikey if
+ * key is NULL */
+static kvtree* kvtree_child_get(const kvtree* hash, const char* key, int64_t ikey)
+{
+  if (key == NULL) {
+    kvtree_elem* elem = kvtree_elem_get_int(hash, ikey);
+    return (elem != NULL) ? elem->hash : NULL;
+  }
+  return kvtree_get(hash, key);
+}
+
+/** returns the hash for a key in hash, adding the key if it is
+ * missing, if last is set, the key is set to hash_value instead, the
+ * key is the integer ikey if key is NULL */
+static kvtree* kvtree_child_set(kvtree* hash, const char* key, int64_t ikey, int last, kvtree* hash_value)
+{
+  if (! kvtree_writable(hash)) {
+    return NULL;
+  }
+
+  if (! last) {
+    kvtree* tmp = kvtree_child_writable(hash, key, ikey);
+    if (tmp != NULL) {
+      return tmp;
+    }
+  }
+
+  /* only format an integer if we need to create or reset the key */
+  char buf[KVTREE_INT_KEY_MAX];
+  if (key == NULL) {
+    kvtree_key_format_int(buf, ikey);
+    key = buf;
+  }
+
+  if (last) {
+    /* we are at the last key, so set its hash using the value
+     * provided by the caller */
+    return kvtree_set(hash, key, hash_value);
+  }
+
+  /* didn't find an entry for this key, so create one */
+  return kvtree_set(hash, key, kvtree_new_child(hash));
+}
+
+/** looks up the key given by the next path component in hash */
+static kvtree* kvtree_path_get_step(const kvtree* hash, const struct kvtree_path_token* tok, va_list* args)
+{
+  char buf[KVTREE_MAX_LINE];
+  const char* key;
+  int64_t ikey = 0;
+  kvtree_path_arg(tok, args, buf, sizeof(buf), &key, &ikey);
+  return kvtree_child_get(hash, key, ikey);
+}
+
+/** looks up the key given by the next path component in hash, adding
+ * it if it is missing, the last component is set to hash_value */
+static kvtree* kvtree_path_set_step(kvtree* hash, const struct kvtree_path_token* tok, va_list* args,
+  int last, kvtree* hash_value)
+{
+  char buf[KVTREE_MAX_LINE];
+  const char* key;
+  int64_t ikey = 0;
+  kvtree_path_arg(tok, args, buf, sizeof(buf), &key, &ikey);
+  return kvtree_child_set(hash, key, ikey, last, hash_value);
+}
+
+/** reads the next token of format into tok, copying a literal key into
+ * buf, aborts on an unsupported conversion, returns pointer just past
+ * the token or NULL if there are no more tokens */
+static const char* kvtree_path_parse(const char* format, struct kvtree_path_token* tok, char* buf, size_t bufsize)
+{
+  size_t len;
+  const char* p = kvtree_path_next(format, &tok->type, &len);
+  if (p == NULL) {
+    return NULL;
+  }
+
+  if (tok->type == KVTREE_PATH_BAD) {
+    kvtree_abort(-1, "Unsupported hash key format '%.*s' @ %s:%d",
+      (int) len, p, __FILE__, __LINE__
+    );
+  }
+
+  if (tok->type == KVTREE_PATH_KEY) {
+    if (len >= bufsize) {
+      kvtree_abort(-1, "Key buffer too small, have %lu need %lu bytes @ %s:%d",
+        bufsize, (unsigned long) len + 1, __FILE__, __LINE__
+      );
+      return NULL;
+    }
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    tok->key = buf;
+  }
+  return p + len;
+}
+
+/** traverse the given hash using a printf-like format string setting
+ * an arbitrary list of keys to set (or reset) the hash associated
+ * with the last-most key, each token of the format is either one of
+ * the conversions listed in kvtree_path_specs or a literal key */
+kvtree* kvtree_setf(kvtree* hash, kvtree* hash_value, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  kvtree* h = kvtree_vsetf(hash, hash_value, format, args);
+  va_end(args);
+  return h;
+}
+
+/** same as kvtree_setf, but with the keys given as a va_list */
+kvtree* kvtree_vsetf(kvtree* hash, kvtree* hash_value, const char* format, va_list args)
+{
+  /* check that we have a hash */
+  if (hash == NULL) {
+    return NULL;
+  }
+
+  kvtree* h = hash;
+
+  /* for each token, convert the next key argument and look up the
+   * hash for that key, we walk the format in place rather than copy
+   * and tokenize it, we step through a copy of args since a va_list
+   * parameter may not be passed on by address */
+  va_list ap;
+  va_copy(ap, args);
+  char buf[KVTREE_MAX_LINE];
+  struct kvtree_path_token tok;
+  const char* p = kvtree_path_parse(format, &tok, buf, sizeof(buf));
+  while (p != NULL && h != NULL) {
+    /* the last key gets the value provided by the caller */
+    int type;
+    size_t len;
+    int last = (kvtree_path_next(p, &type, &len) == NULL);
+    h = kvtree_path_set_step(h, &tok, &ap, last, hash_value);
+    p = kvtree_path_parse(p, &tok, buf, sizeof(buf));
+  }
+  va_end(ap);
 
   /* return the hash we found */
   return h;
@@ -412,6 +2080,16 @@ kvtree* kvtree_setf(kvtree* hash, kvtree* hash_value, const char* format, ...)
 
 /** return hash associated with list of keys */
 kvtree* kvtree_getf(const kvtree* hash, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  kvtree* h = kvtree_vgetf(hash, format, args);
+  va_end(args);
+  return h;
+}
+
+/** same as kvtree_getf, but with the keys given as a va_list */
+kvtree* kvtree_vgetf(const kvtree* hash, const char* format, va_list args)
 {
   /* check that we have a hash */
   if (hash == NULL) {
@@ -419,96 +2097,317 @@ kvtree* kvtree_getf(const kvtree* hash, const char* format, ...)
   }
 
   const kvtree* h = hash;
-  char* rest = NULL;
 
-  /* make a copy of the format specifier, since strtok clobbers it */
-  char* format_copy = strdup(format);
-  if (format_copy == NULL) {
-    kvtree_abort(-1, "Failed to duplicate format string @ %s:%d",
-      __FILE__, __LINE__
-    );
+  /* for each token, convert the next key argument and look up the
+   * hash for that key */
+  va_list ap;
+  va_copy(ap, args);
+  char buf[KVTREE_MAX_LINE];
+  struct kvtree_path_token tok;
+  const char* p = kvtree_path_parse(format, &tok, buf, sizeof(buf));
+  while (p != NULL && h != NULL) {
+    h = kvtree_path_get_step(h, &tok, &ap);
+    p = kvtree_path_parse(p, &tok, buf, sizeof(buf));
+  }
+  va_end(ap);
+
+  /* return the hash we found */
+  return (kvtree*) h;
+}
+
+/** formats the first key named by format and args into buf of
+ * bufsize bytes, sets last to 1 if no keys follow it, returns buf or
+ * NULL if format has no keys */
+const char* kvtree_path_first_key(const char* format, va_list args, char* buf, size_t bufsize, int* last)
+{
+  char keybuf[KVTREE_MAX_LINE];
+  struct kvtree_path_token tok;
+  const char* p = kvtree_path_parse(format, &tok, keybuf, sizeof(keybuf));
+  if (p == NULL) {
+    return NULL;
+  }
+
+  int type;
+  size_t len;
+  *last = (kvtree_path_next(p, &type, &len) == NULL);
+
+  va_list ap;
+  va_copy(ap, args);
+  const char* key;
+  int64_t ikey = 0;
+  kvtree_path_arg(&tok, &ap, buf, bufsize, &key, &ikey);
+  va_end(ap);
+
+  /* copy a literal or %s key, an integer key still needs formatting */
+  if (key == NULL) {
+    kvtree_key_format_int(buf, ikey);
+  } else if (key != buf) {
+    snprintf(buf, bufsize, "%s", key);
   }
+  return buf;
+}
 
-  /* we break up tokens by spaces */
-  char* search = " ";
-  char* token = NULL;
+/** compiles a format string like those taken by kvtree_getf into a
+ * path that can be evaluated many times */
+kvtree_path* kvtree_path_new(const char* format)
+{
+  if (format == NULL) {
+    return NULL;
+  }
 
-  /* count how many keys we have */
-  token = strtok_r(format_copy, search, &rest);
+  /* count tokens and the space we need for literal keys */
   int count = 0;
-  while (token != NULL) {
-    token = strtok_r(NULL, search, &rest);
+  size_t keys_size = 0;
+  int type;
+  size_t len;
+  const char* p = kvtree_path_next(format, &type, &len);
+  while (p != NULL) {
+    if (type == KVTREE_PATH_BAD) {
+      kvtree_err("Unsupported hash key format '%.*s' @ %s:%d",
+        (int) len, p, __FILE__, __LINE__
+      );
+      return NULL;
+    }
+    if (type == KVTREE_PATH_KEY) {
+      keys_size += len + 1;
+    }
     count++;
+    p = kvtree_path_next(p + len, &type, &len);
   }
 
-  /* free our copy of the format specifier */
-  kvtree_free(&format_copy);
+  /* allocate the path and its keys at once */
+  size_t size = sizeof(kvtree_path) + count * sizeof(struct kvtree_path_token);
+  kvtree_path* path = (kvtree_path*) KVTREE_MALLOC(size + keys_size);
+  path->count = count;
 
-  /* make a copy of the format specifier, since strtok clobbers it */
-  format_copy = strdup(format);
-  if (format_copy == NULL) {
-    kvtree_abort(-1, "Failed to duplicate format string @ %s:%d",
-      __FILE__, __LINE__
-    );
+  char* keys = (char*) path + size;
+  int i = 0;
+  p = kvtree_path_next(format, &type, &len);
+  while (p != NULL) {
+    path->tokens[i].type = type;
+    path->tokens[i].key  = NULL;
+    if (type == KVTREE_PATH_KEY) {
+      memcpy(keys, p, len);
+      keys[len] = '\0';
+      path->tokens[i].key = keys;
+      keys += len + 1;
+    }
+    i++;
+    p = kvtree_path_next(p + len, &type, &len);
+  }
+
+  return path;
+}
+
+/** frees a path, sets caller's pointer to NULL */
+void kvtree_path_delete(kvtree_path** ptr_path)
+{
+  kvtree_free(ptr_path);
+}
+
+/** same as kvtree_getf, but with a compiled path */
+kvtree* kvtree_getp(const kvtree* hash, const kvtree_path* path, ...)
+{
+  if (path == NULL) {
+    return NULL;
+  }
+
+  const kvtree* h = hash;
+
+  va_list args;
+  va_start(args, path);
+  int i;
+  for (i = 0; i < path->count && h != NULL; i++) {
+    h = kvtree_path_get_step(h, &path->tokens[i], &args);
+  }
+  va_end(args);
+
+  return (kvtree*) h;
+}
+
+/** same as kvtree_setf, but with a compiled path */
+kvtree* kvtree_setp(kvtree* hash, kvtree* hash_value, const kvtree_path* path, ...)
+{
+  if (path == NULL) {
+    return NULL;
   }
 
-  /* for each format specifier, convert the next key argument to a
-   * string and look up the hash for that key */
+  kvtree* h = hash;
+
   va_list args;
-  va_start(args, format);
-  token = strtok_r(format_copy, search, &rest);
-  int i = 0;
-  while (i < count && token != NULL && h != NULL) {
-    /* interpret the format and convert the current key argument to
-     * a string */
-    char key[KVTREE_MAX_LINE];
-    int size = 0;
-    if (strcmp(token, "%s") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, char*));
-    } else if (strcmp(token, "%d")  == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, int));
-    } else if (strcmp(token, "%lld") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, long long));
-    } else if (strcmp(token, "%lu") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned long));
-    } else if (strcmp(token, "%#x") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned int));
-    } else if (strcmp(token, "%#lx") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned long));
-    } else if (strcmp(token, "%llu") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, unsigned long long));
-    } else if (strcmp(token, "%f") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, double));
-    } else if (strcmp(token, "%p") == 0) {
-      size = snprintf(key, sizeof(key), token, va_arg(args, void*));
+  va_start(args, path);
+  int i;
+  for (i = 0; i < path->count && h != NULL; i++) {
+    int last = (i == path->count - 1);
+    h = kvtree_path_set_step(h, &path->tokens[i], &args, last, hash_value);
+  }
+  va_end(args);
+
+  return h;
+}
+
+/** walks keys given either as an array of strings or of key
+ * descriptors, returns the hash of the last key */
+static kvtree* kvtree_path_walk_get(const kvtree* hash, const char* const strs[], const kvtree_key keys[], int n)
+{
+  const kvtree* h = hash;
+  int i;
+  for (i = 0; i < n && h != NULL; i++) {
+    if (strs != NULL) {
+      h = kvtree_get(h, strs[i]);
     } else {
-      kvtree_abort(-1, "Unsupported hash key format '%s' @ %s:%d",
-        token, __FILE__, __LINE__
-      );
+      h = kvtree_child_get(h, keys[i].str, keys[i].ival);
     }
+  }
+  return (kvtree*) h;
+}
 
-    /* check that we were able to fit the string into our buffer */
-    if (size >= sizeof(key)) {
-      kvtree_abort(-1, "Key buffer too small, have %lu need %d bytes @ %s:%d",
-        sizeof(key), size, __FILE__, __LINE__
-      );
+/** walks keys given either as an array of strings or of key
+ * descriptors, adding any that are missing, and sets the last key to
+ * hash_value */
+static kvtree* kvtree_path_walk_set(kvtree* hash, kvtree* hash_value, const char* const strs[], const kvtree_key keys[], int n)
+{
+  if (n < 1) {
+    return NULL;
+  }
+
+  kvtree* h = hash;
+  int i;
+  for (i = 0; i < n && h != NULL; i++) {
+    int last = (i == n - 1);
+    if (strs != NULL) {
+      if (strs[i] == NULL) {
+        return NULL;
+      }
+      h = kvtree_child_set(h, strs[i], 0, last, hash_value);
+    } else {
+      h = kvtree_child_set(h, keys[i].str, keys[i].ival, last, hash_value);
+    }
+  }
+  return h;
+}
+
+/** walks keys given either as an array of strings or of key
+ * descriptors and deletes the last key */
+static int kvtree_path_walk_unset(kvtree* hash, const char* const strs[], const kvtree_key keys[], int n)
+{
+  if (hash == NULL || n < 1 || ! kvtree_writable(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* find the hash holding the last key, nothing to do if it's not set,
+   * taking copies of any shared hashes along the way */
+  kvtree* h = hash;
+  int i;
+  for (i = 0; i < n - 1 && h != NULL; i++) {
+    if (strs != NULL) {
+      h = kvtree_child_writable(h, strs[i], 0);
+    } else {
+      h = kvtree_child_writable(h, keys[i].str, keys[i].ival);
     }
+  }
+  if (h == NULL) {
+    return KVTREE_SUCCESS;
+  }
+
+  if (strs != NULL) {
+    return kvtree_unset(h, strs[n - 1]);
+  }
+  if (keys[n - 1].str != NULL) {
+    return kvtree_unset(h, keys[n - 1].str);
+  }
+  kvtree_elem* elem = kvtree_elem_extract_int(h, keys[n - 1].ival);
+  if (elem != NULL) {
+    kvtree_elem_delete(h, elem);
+  }
+  return KVTREE_SUCCESS;
+}
+
+/** return hash associated with the path of n keys */
+kvtree* kvtree_get_path(const kvtree* hash, const char* const keys[], int n)
+{
+  return kvtree_path_walk_get(hash, keys, NULL, n);
+}
+
+/** set the hash associated with the path of n keys */
+kvtree* kvtree_set_path(kvtree* hash, kvtree* hash_value, const char* const keys[], int n)
+{
+  return kvtree_path_walk_set(hash, hash_value, keys, NULL, n);
+}
+
+/** delete the hash associated with the path of n keys */
+int kvtree_unset_path(kvtree* hash, const char* const keys[], int n)
+{
+  return kvtree_path_walk_unset(hash, keys, NULL, n);
+}
+
+/** return hash associated with the path of n key descriptors */
+kvtree* kvtree_get_keys(const kvtree* hash, const kvtree_key keys[], int n)
+{
+  return kvtree_path_walk_get(hash, NULL, keys, n);
+}
+
+/** set the hash associated with the path of n key descriptors */
+kvtree* kvtree_set_keys(kvtree* hash, kvtree* hash_value, const kvtree_key keys[], int n)
+{
+  return kvtree_path_walk_set(hash, hash_value, NULL, keys, n);
+}
+
+/** delete the hash associated with the path of n key descriptors */
+int kvtree_unset_keys(kvtree* hash, const kvtree_key keys[], int n)
+{
+  return kvtree_path_walk_unset(hash, NULL, keys, n);
+}
+
+/** returns the bits of hash->flags for the given order and direction,
+ * -1 if order is not valid */
+static int kvtree_order_flags(int order, int direction)
+{
+  int flags;
+  if (order == KVTREE_ORDER_NONE) {
+    return 0;
+  } else if (order == KVTREE_ORDER_STR) {
+    flags = KVTREE_FLAG_ORDER_STR;
+  } else if (order == KVTREE_ORDER_INT) {
+    flags = KVTREE_FLAG_ORDER_INT;
+  } else {
+    return -1;
+  }
+  if (direction == KVTREE_SORT_DESCENDING) {
+    flags |= KVTREE_FLAG_ORDER_DESC;
+  }
+  return flags;
+}
+
+/** returns 1 if hash already keeps the given order and direction,
+ * otherwise makes hash keep no order and returns 0, or returns -1 if
+ * hash keeps another order that it may not drop */
+static int kvtree_order_take(kvtree* hash, int order, int direction)
+{
+  if (hash == NULL || ! (hash->flags & KVTREE_FLAG_ORDER_ALL)) {
+    return 0;
+  }
+  if ((hash->flags & KVTREE_FLAG_ORDER_ALL) == kvtree_order_flags(order, direction)) {
+    return 1;
+  }
+  if (kvtree_set_order(hash, KVTREE_ORDER_NONE, 0) != KVTREE_SUCCESS) {
+    return -1;
+  }
+  return 0;
+}
 
-    /* get hash for this key */
-    h = kvtree_get(h, key);
+/* sort integer keys with a radix sort once there are this many */
+#define KVTREE_SORT_RADIX_THRESHOLD (256)
 
-    /* get the next format string */
-    token = strtok_r(NULL, search, &rest);
-    i++;
-  }
-  va_end(args);
+/* sort string keys with several threads once there are this many */
+#define KVTREE_SORT_PARALLEL_THRESHOLD (65536)
 
-  /* free our copy of the format specifier */
-  kvtree_free(&format_copy);
+/* most threads kvtree_sort will use */
+#define KVTREE_SORT_THREADS_MAX (16)
 
-  /* return the hash we found */
-  return (kvtree*) h;
-}
+/* number of elements ahead of the one in hand that kvtree_sort
+ * fetches, an earlier sort leaves them spread all over memory */
+#define KVTREE_SORT_PREFETCH (8)
 
 /** define a structure to hold the key and elem address */
 struct sort_elem_str {
@@ -516,9 +2415,13 @@ struct sort_elem_str {
   kvtree_elem* addr;
 };
 
-/** define a structure to hold the key and elem address */
+/** define a structure to hold the key and elem address, index is the
+ * position of the element in the order of iteration, which breaks
+ * ties between keys like "7" and "07" so that every way we sort gives
+ * the same order, string keys are never equal */
 struct sort_elem_int {
   int key;
+  int index;
   kvtree_elem* addr;
 };
 
@@ -551,7 +2454,10 @@ static int kvtree_cmp_fn_int_asc(const void* a, const void* b)
   struct sort_elem_int* elem_b = (struct sort_elem_int*) b;
   int int_a = elem_a->key;
   int int_b = elem_b->key;
-  return (int) (int_a - int_b);
+  if (int_a == int_b) {
+    return (elem_a->index > elem_b->index) - (elem_a->index < elem_b->index);
+  }
+  return (int_a > int_b) - (int_a < int_b);
 }
 
 /** sort integers in descending order */
@@ -561,29 +2467,218 @@ static int kvtree_cmp_fn_int_desc(const void* a, const void* b)
   struct sort_elem_int* elem_b = (struct sort_elem_int*) b;
   int int_a = elem_a->key;
   int int_b = elem_b->key;
-  return (int) (int_b - int_a);
+  if (int_a == int_b) {
+    return (elem_a->index > elem_b->index) - (elem_a->index < elem_b->index);
+  }
+  return (int_b > int_a) - (int_b < int_a);
 }
 
-/** sort the hash assuming the keys are ints */
-int kvtree_sort(kvtree* hash, int direction)
+/** sorts list by key in the given direction with an LSD radix sort,
+ * one byte at a time, since each pass is stable and list is in order
+ * of index, this gives the same order as kvtree_cmp_fn_int_asc and
+ * kvtree_cmp_fn_int_desc */
+static void kvtree_sort_radix_int(struct sort_elem_int* list, int count, int direction)
 {
-  /* get the size of the hash */
-  int count = kvtree_size(hash);
+  /* flip the sign bit so negative keys come first when the keys are
+   * taken as unsigned, and flip the rest as well to sort descending */
+  uint32_t flip = 0x80000000u;
+  if (direction == KVTREE_SORT_DESCENDING) {
+    flip = 0x7fffffffu;
+  }
+
+  /* count the keys with each value of each byte in one pass */
+  size_t counts[4][256];
+  memset(counts, 0, sizeof(counts));
+  int i, pass;
+  for (i = 0; i < count; i++) {
+    uint32_t key = (uint32_t) list[i].key ^ flip;
+    counts[0][key & 0xff]++;
+    counts[1][(key >> 8) & 0xff]++;
+    counts[2][(key >> 16) & 0xff]++;
+    counts[3][key >> 24]++;
+  }
+
+  struct sort_elem_int* tmp = (struct sort_elem_int*) KVTREE_MALLOC(count * sizeof(struct sort_elem_int));
+  struct sort_elem_int* src = list;
+  struct sort_elem_int* dst = tmp;
+  for (pass = 0; pass < 4; pass++) {
+    /* skip a byte that is the same in every key, like the high bytes
+     * of rank ids */
+    int shift = 8 * pass;
+    uint32_t first = (((uint32_t) src[0].key ^ flip) >> shift) & 0xff;
+    if (counts[pass][first] == (size_t) count) {
+      continue;
+    }
+
+    /* turn counts into offsets, then scatter */
+    size_t offsets[256];
+    size_t offset = 0;
+    int b;
+    for (b = 0; b < 256; b++) {
+      offsets[b] = offset;
+      offset += counts[pass][b];
+    }
+    for (i = 0; i < count; i++) {
+      uint32_t key = (uint32_t) src[i].key ^ flip;
+      dst[offsets[(key >> shift) & 0xff]++] = src[i];
+    }
+
+    struct sort_elem_int* swap = src;
+    src = dst;
+    dst = swap;
+  }
+
+  if (src != list) {
+    memcpy(list, src, count * sizeof(struct sort_elem_int));
+  }
+  kvtree_free(&tmp);
+}
+
+/** returns the number of threads kvtree_sort may use, which is the
+ * number of online processors unless KVTREE_SORT_THREADS is set */
+static int kvtree_sort_threads(void)
+{
+  long threads = 1;
+  const char* value = getenv("KVTREE_SORT_THREADS");
+  if (value != NULL) {
+    threads = atol(value);
+  } else {
+#ifdef _SC_NPROCESSORS_ONLN
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  }
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > KVTREE_SORT_THREADS_MAX) {
+    threads = KVTREE_SORT_THREADS_MAX;
+  }
+  return (int) threads;
+}
+
+/* define a piece of a parallel merge sort */
+struct kvtree_sort_task {
+  struct sort_elem_str* list; /* elements to sort */
+  struct sort_elem_str* tmp;  /* scratch space as long as list */
+  int count;                  /* number of elements */
+  int threads;                /* number of threads to sort with */
+  int (*fn)(const void* a, const void* b);
+};
+
+/** sorts the elements of a task, handing half of them to another
+ * thread and merging the halves, while it has more than one thread */
+static void* kvtree_sort_task_run(void* arg)
+{
+  struct kvtree_sort_task* task = (struct kvtree_sort_task*) arg;
+  if (task->threads < 2) {
+    qsort(task->list, task->count, sizeof(struct sort_elem_str), task->fn);
+    return NULL;
+  }
+
+  int half = task->count / 2;
+  struct kvtree_sort_task left = {
+    task->list, task->tmp, half, task->threads / 2, task->fn
+  };
+  struct kvtree_sort_task right = {
+    task->list + half, task->tmp + half, task->count - half, task->threads - task->threads / 2, task->fn
+  };
+
+  /* sort the left half here if we can not start a thread for it */
+  pthread_t thread;
+  int started = (pthread_create(&thread, NULL, kvtree_sort_task_run, &left) == 0);
+  if (! started) {
+    kvtree_sort_task_run(&left);
+  }
+  kvtree_sort_task_run(&right);
+  if (started) {
+    pthread_join(thread, NULL);
+  }
+
+  /* merge the halves into tmp, then copy back */
+  int i = 0;
+  int j = half;
+  int k = 0;
+  while (i < half && j < task->count) {
+    if (task->fn(&task->list[j], &task->list[i]) < 0) {
+      task->tmp[k++] = task->list[j++];
+    } else {
+      task->tmp[k++] = task->list[i++];
+    }
+  }
+  memcpy(task->tmp + k, task->list + i, (half - i) * sizeof(struct sort_elem_str));
+  k += half - i;
+  memcpy(task->tmp + k, task->list + j, (task->count - j) * sizeof(struct sort_elem_str));
+  memcpy(task->list, task->tmp, task->count * sizeof(struct sort_elem_str));
+  return NULL;
+}
+
+/** sorts list with fn, using several threads for a long list, since
+ * no two keys are equal the order is the same either way */
+static void kvtree_sort_str_list(struct sort_elem_str* list, int count, int (*fn)(const void* a, const void* b))
+{
+  int threads = 1;
+  if (count >= KVTREE_SORT_PARALLEL_THRESHOLD) {
+    threads = kvtree_sort_threads();
+  }
+  if (threads < 2) {
+    qsort(list, count, sizeof(struct sort_elem_str), fn);
+    return;
+  }
+
+  struct sort_elem_str* tmp = (struct sort_elem_str*) KVTREE_MALLOC(count * sizeof(struct sort_elem_str));
+  struct kvtree_sort_task task = { list, tmp, count, threads, fn };
+  kvtree_sort_task_run(&task);
+  kvtree_free(&tmp);
+}
+
+/** rewrite the child array of a hash so that iteration, which runs
+ * from the newest slot down, visits elements in the order of list,
+ * whose entries are stride bytes apart, this only reorders the
+ * children, so the element count and index stay valid */
+static void kvtree_sort_apply(kvtree* hash, kvtree_elem* const* list, size_t stride, int count)
+{
+  struct kvtree_children_struct* array = hash->kids.array;
+  const char* next = (const char*) list;
+  int i;
+  for (i = 0; i < count; i++) {
+    if (i + KVTREE_SORT_PREFETCH < count) {
+      KVTREE_PREFETCH(*(kvtree_elem* const*) (next + KVTREE_SORT_PREFETCH * stride));
+    }
+    kvtree_elem* elem = *(kvtree_elem* const*) next;
+    elem->pos = count - 1 - i;
+    array->elems[elem->pos] = elem;
+    next += stride;
+  }
+  array->used = count;
+  kvtree_children_changed(array);
+}
 
+/** returns a list of the count children of hash, which has at least
+ * two, sorted by key as strings in the given direction, the caller
+ * frees the list */
+static struct sort_elem_str* kvtree_sort_list_str(const kvtree* hash, int direction, int count)
+{
   /* allocate space for each element */
   struct sort_elem_str* list = (struct sort_elem_str*) KVTREE_MALLOC(count * sizeof(struct sort_elem_str));
 
-  /* walk the hash and fill in the keys */
-  kvtree_elem* elem = NULL;
+  /* walk the hash in the order of iteration and fill in the keys */
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int used = kvtree_children_used(hash);
+  int step;
+  int slot = kvtree_slot_first(hash, 1, &step);
   int index = 0;
-  for (elem = kvtree_elem_first(hash);
-       elem != NULL;
-       elem = kvtree_elem_next(elem))
-  {
-    char* key = kvtree_elem_key(elem);
-    list[index].key = key;
-    list[index].addr = elem;
-    index++;
+  for (; slot >= 0 && slot < used; slot += step) {
+    int ahead = slot + KVTREE_SORT_PREFETCH * step;
+    if (ahead >= 0 && ahead < used) {
+      KVTREE_PREFETCH(slots[ahead]);
+    }
+    kvtree_elem* elem = slots[slot];
+    if (elem != NULL) {
+      char* key = kvtree_elem_key(elem);
+      list[index].key = key;
+      list[index].addr = elem;
+      index++;
+    }
   }
 
   /* sort the elements by key */
@@ -592,17 +2687,80 @@ int kvtree_sort(kvtree* hash, int direction)
   if (direction == KVTREE_SORT_DESCENDING) {
     fn = &kvtree_cmp_fn_str_desc;
   }
-  qsort(list, count, sizeof(struct sort_elem_str), fn);
+  kvtree_sort_str_list(list, count, fn);
+
+  return list;
+}
+
+/** returns a list of the count children of hash, which has at least
+ * two, sorted by key as ints in the given direction, the caller frees
+ * the list */
+static struct sort_elem_int* kvtree_sort_list_int(const kvtree* hash, int direction, int count)
+{
+  /* allocate space for each element */
+  struct sort_elem_int* list = (struct sort_elem_int*) KVTREE_MALLOC(count * sizeof(struct sort_elem_int));
+
+  /* walk the hash in the order of iteration and fill in the keys */
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int used = kvtree_children_used(hash);
+  int step;
+  int slot = kvtree_slot_first(hash, 1, &step);
+  int index = 0;
+  for (; slot >= 0 && slot < used; slot += step) {
+    int ahead = slot + KVTREE_SORT_PREFETCH * step;
+    if (ahead >= 0 && ahead < used) {
+      KVTREE_PREFETCH(slots[ahead]);
+    }
+    kvtree_elem* elem = slots[slot];
+    if (elem != NULL) {
+      int key = kvtree_elem_key_int(elem);
+      list[index].key = key;
+      list[index].index = index;
+      list[index].addr = elem;
+      index++;
+    }
+  }
+
+  /* sort the elements by key, a radix sort is much faster on the
+   * long lists of rank ids we see in kvtree_write_to_gather */
+  if (count >= KVTREE_SORT_RADIX_THRESHOLD) {
+    kvtree_sort_radix_int(list, count, direction);
+  } else {
+    int (*fn)(const void* a, const void* b) = NULL;
+    fn = &kvtree_cmp_fn_int_asc;
+    if (direction == KVTREE_SORT_DESCENDING) {
+      fn = &kvtree_cmp_fn_int_desc;
+    }
+    qsort(list, count, sizeof(struct sort_elem_int), fn);
+  }
+
+  return list;
+}
+
+/** sort the hash assuming the keys are strings */
+int kvtree_sort(kvtree* hash, int direction)
+{
+  if (! kvtree_writable(hash) || ! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* nothing to do if hash already keeps this order, otherwise it no
+   * longer keeps any */
+  int taken = kvtree_order_take(hash, KVTREE_ORDER_STR, direction);
+  if (taken != 0) {
+    return (taken > 0) ? KVTREE_SUCCESS : KVTREE_FAILURE;
+  }
 
-  /* walk the sorted list backwards, extracting the element by address,
-   * and inserting at the head */
-  while (index > 0) {
-    index--;
-    elem = list[index].addr;
-    LIST_REMOVE(elem, pointers);
-    LIST_INSERT_HEAD(hash, elem, pointers);
+  /* get the size of the hash, one child is always in order */
+  int count = kvtree_size(hash);
+  if (count < 2) {
+    return KVTREE_SUCCESS;
   }
 
+  /* sort the elements and put the children in that order */
+  struct sort_elem_str* list = kvtree_sort_list_str(hash, direction, count);
+  kvtree_sort_apply(hash, &list[0].addr, sizeof(struct sort_elem_str), count);
+
   /* free the list */
   kvtree_free(&list);
 
@@ -612,84 +2770,436 @@ int kvtree_sort(kvtree* hash, int direction)
 /** sort the hash assuming the keys are ints */
 int kvtree_sort_int(kvtree* hash, int direction)
 {
-  /* get the size of the hash */
+  if (! kvtree_writable(hash) || ! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* nothing to do if hash already keeps this order, otherwise it no
+   * longer keeps any */
+  int taken = kvtree_order_take(hash, KVTREE_ORDER_INT, direction);
+  if (taken != 0) {
+    return (taken > 0) ? KVTREE_SUCCESS : KVTREE_FAILURE;
+  }
+
+  /* get the size of the hash, one child is always in order */
   int count = kvtree_size(hash);
+  if (count < 2) {
+    return KVTREE_SUCCESS;
+  }
 
-  /* allocate space for each element */
-  struct sort_elem_int* list = (struct sort_elem_int*) KVTREE_MALLOC(count * sizeof(struct sort_elem_int));
+  /* sort the elements and put the children in that order */
+  struct sort_elem_int* list = kvtree_sort_list_int(hash, direction, count);
+  kvtree_sort_apply(hash, &list[0].addr, sizeof(struct sort_elem_int), count);
 
-  /* walk the hash and fill in the keys */
-  kvtree_elem* elem = NULL;
-  int index = 0;
-  for (elem = kvtree_elem_first(hash);
-       elem != NULL;
-       elem = kvtree_elem_next(elem))
-  {
-    int key = kvtree_elem_key_int(elem);
-    list[index].key = key;
-    list[index].addr = elem;
-    index++;
+  /* free the list */
+  kvtree_free(&list);
+
+  return KVTREE_SUCCESS;
+}
+
+/** returns the children of hash in the given order and direction,
+ * setting count to their number, the list is kept with hash until
+ * its children change */
+kvtree_elem* const* kvtree_sorted_view(const kvtree* hash, int order, int direction, int* count)
+{
+  *count = 0;
+  int flags = kvtree_order_flags(order, direction);
+  if (flags <= 0) {
+    kvtree_err("Unknown order %d @ %s:%d",
+      order, __FILE__, __LINE__
+    );
+    return NULL;
+  }
+  if (kvtree_is_empty(hash) || ! kvtree_flat(hash)) {
+    return NULL;
+  }
+
+  /* the slots of a single child, or of a hash that keeps this order,
+   * are already a sorted list */
+  *count = hash->count;
+  if (! (hash->flags & KVTREE_FLAG_CHILD_ARRAY)) {
+    return (kvtree_elem* const*) &hash->kids.one;
+  }
+  struct kvtree_children_struct* array = hash->kids.array;
+  if ((hash->flags & KVTREE_FLAG_ORDER_ALL) == flags) {
+    return array->elems;
+  }
+
+  /* otherwise sort the children, unless we did already */
+  struct kvtree_view_struct* view = array->view;
+  if (view != NULL && view->flags == flags) {
+    return view->elems;
+  }
+  if (view == NULL || view->cap < hash->count) {
+    kvtree_arena_free(hash->arena, &array->view);
+    view = (struct kvtree_view_struct*) kvtree_arena_malloc(hash->arena,
+      sizeof(struct kvtree_view_struct) + (size_t) hash->count * sizeof(kvtree_elem*)
+    );
+    view->cap = hash->count;
+    array->view = view;
+  }
+
+  int i;
+  if (order == KVTREE_ORDER_STR) {
+    struct sort_elem_str* list = kvtree_sort_list_str(hash, direction, hash->count);
+    for (i = 0; i < hash->count; i++) {
+      view->elems[i] = list[i].addr;
+    }
+    kvtree_free(&list);
+  } else {
+    struct sort_elem_int* list = kvtree_sort_list_int(hash, direction, hash->count);
+    for (i = 0; i < hash->count; i++) {
+      view->elems[i] = list[i].addr;
+    }
+    kvtree_free(&list);
+  }
+  view->flags = flags;
+  return view->elems;
+}
+
+/** keeps the keys of hash in the given order and direction */
+int kvtree_set_order(kvtree* hash, int order, int direction)
+{
+  if (hash == NULL || ! kvtree_writable(hash) || ! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  int flags = kvtree_order_flags(order, direction);
+  if (flags < 0) {
+    kvtree_err("Unknown order %d @ %s:%d",
+      order, __FILE__, __LINE__
+    );
+    return KVTREE_FAILURE;
+  }
+  if ((hash->flags & KVTREE_FLAG_ORDER_ALL) == flags) {
+    return KVTREE_SUCCESS;
+  }
+
+  /* an ordered hash is visited from its first slot, while other
+   * hashes are visited from their last, so flip the slots to go back
+   * to insertion order without changing the order of iteration */
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    kvtree_children_reverse(hash);
+    hash->flags &= ~KVTREE_FLAG_ORDER_ALL;
+  }
+  if (flags == 0) {
+    if (hash->count >= KVTREE_INDEX_THRESHOLD) {
+      hash->index = kvtree_index_build(hash);
+    }
+    return KVTREE_SUCCESS;
+  }
+
+  /* close any gaps, sort, and flip the slots, then drop the index
+   * since lookups use binary search from now on */
+  if (hash->flags & KVTREE_FLAG_CHILD_ARRAY) {
+    kvtree_children_compact(hash->kids.array);
+  }
+  if (hash->count > 1) {
+    if (order == KVTREE_ORDER_STR) {
+      kvtree_sort(hash, direction);
+    } else {
+      kvtree_sort_int(hash, direction);
+    }
+  }
+  kvtree_children_reverse(hash);
+  kvtree_index_delete(&hash->index);
+  hash->flags |= flags;
+
+  return KVTREE_SUCCESS;
+}
+
+/** returns the order kept by hash */
+int kvtree_get_order(const kvtree* hash)
+{
+  if (hash == NULL) {
+    return KVTREE_ORDER_NONE;
+  }
+  if (hash->flags & KVTREE_FLAG_ORDER_STR) {
+    return KVTREE_ORDER_STR;
+  }
+  if (hash->flags & KVTREE_FLAG_ORDER_INT) {
+    return KVTREE_ORDER_INT;
+  }
+  return KVTREE_ORDER_NONE;
+}
+
+/** given a hash, return a list of all keys converted to ints */
+/* caller must free list when done with it */
+int kvtree_list_int(const kvtree* hash, int* n, int** v)
+{
+  /* assume there aren't any keys */
+  *n = 0;
+  *v = NULL;
+
+  /* nothing to do if there are no keys */
+  if (kvtree_is_empty(hash)) {
+    return KVTREE_SUCCESS;
+  }
+  if (! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* now allocate array of ints to save keys */
+  int count = hash->count;
+  int* list = (int*) KVTREE_MALLOC(count * sizeof(int));
+
+  /* record key values in array, a hash that keeps this order already
+   * has them in order, otherwise sort them in a list of our own rather
+   * than in the view cached with hash, so that readers of a hash that
+   * no one changes do not write to it */
+  int i = 0;
+  int flags = kvtree_order_flags(KVTREE_ORDER_INT, KVTREE_SORT_ASCENDING);
+  if ((hash->flags & KVTREE_FLAG_ORDER_ALL) == flags) {
+    kvtree_elem* elem;
+    for (elem = kvtree_elem_first(hash); elem != NULL; elem = kvtree_elem_next(elem)) {
+      list[i++] = kvtree_elem_key_int(elem);
+    }
+  } else {
+    struct sort_elem_int* sorted = kvtree_sort_list_int(hash, KVTREE_SORT_ASCENDING, count);
+    for (i = 0; i < count; i++) {
+      list[i] = sorted[i].key;
+    }
+    kvtree_free(&sorted);
+  }
+
+  *n = count;
+  *v = list;
+
+  return KVTREE_SUCCESS;
+}
+
+/** bounds of a kvtree_range_int query */
+struct kvtree_range {
+  int lo;
+  int hi;
+};
+
+/** returns 1 if the key of elem is an integer within the range */
+static int kvtree_range_keep(const kvtree_elem* elem, const struct kvtree_range* range)
+{
+  return (elem->flags & KVTREE_ELEM_FLAG_INTKEY) &&
+         elem->ikey >= range->lo && elem->ikey <= range->hi;
+}
+
+/** returns 1 if the key of elem starts with the prefix */
+static int kvtree_prefix_keep(const kvtree_elem* elem, const char* prefix, size_t len)
+{
+  return elem->key != NULL && strncmp(elem->key, prefix, len) == 0;
+}
+
+/** calls fn on each child of hash whose key is an integer from lo to hi */
+int kvtree_range_int(const kvtree* hash, int lo, int hi, kvtree_elem_fn fn, void* arg)
+{
+  if (fn == NULL) {
+    return KVTREE_FAILURE;
+  }
+  if (kvtree_is_empty(hash) || lo > hi) {
+    return KVTREE_SUCCESS;
+  }
+  if (! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
+
+  /* in integer order the range is a run of slots, found by binary
+   * search, walk it backwards if the hash is in descending order */
+  struct kvtree_range range = { lo, hi };
+  if (hash->flags & KVTREE_FLAG_ORDER_INT) {
+    int first, last, step;
+    if (hash->flags & KVTREE_FLAG_ORDER_DESC) {
+      first = kvtree_order_upper(hash, "", lo) - 1;
+      last  = kvtree_order_lower(hash, "", hi) - 1;
+      step  = -1;
+    } else {
+      first = kvtree_order_lower(hash, "", lo);
+      last  = kvtree_order_upper(hash, "", hi);
+      step  = 1;
+    }
+    kvtree_elem** slots = kvtree_children_slots(hash);
+    int i;
+    for (i = first; (last - i) * step > 0; i += step) {
+      if (kvtree_range_keep(slots[i], &range)) {
+        int rc = fn(slots[i], arg);
+        if (rc != KVTREE_SUCCESS) {
+          return rc;
+        }
+      }
+    }
+    return KVTREE_SUCCESS;
+  }
+
+  /* with an index, a window narrower than the hash is cheaper to look
+   * up one integer at a time, which also yields the keys in order */
+  int64_t width = (int64_t) hi - (int64_t) lo + 1;
+  if (hash->index != NULL && width < hash->count) {
+    int64_t key;
+    for (key = lo; key <= hi; key++) {
+      kvtree_elem* elem = kvtree_index_lookup_int(hash->index, key);
+      if (elem != NULL) {
+        int rc = fn(elem, arg);
+        if (rc != KVTREE_SUCCESS) {
+          return rc;
+        }
+      }
+    }
+    return KVTREE_SUCCESS;
+  }
+
+  /* otherwise collect the matches and sort them, leaving hash as is */
+  struct sort_elem_int* list = (struct sort_elem_int*) KVTREE_MALLOC(hash->count * sizeof(struct sort_elem_int));
+  int count = 0;
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(hash); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (kvtree_range_keep(elem, &range)) {
+      list[count].key   = (int) elem->ikey;
+      list[count].index = count;
+      list[count].addr  = elem;
+      count++;
+    }
+  }
+  qsort(list, count, sizeof(struct sort_elem_int), &kvtree_cmp_fn_int_asc);
+
+  int rc = KVTREE_SUCCESS;
+  int i;
+  for (i = 0; i < count && rc == KVTREE_SUCCESS; i++) {
+    rc = fn(list[i].addr, arg);
+  }
+
+  kvtree_free(&list);
+  return rc;
+}
+
+/** calls fn on each child of hash whose key starts with prefix */
+int kvtree_prefix(const kvtree* hash, const char* prefix, kvtree_elem_fn fn, void* arg)
+{
+  if (prefix == NULL || fn == NULL) {
+    return KVTREE_FAILURE;
+  }
+  if (kvtree_is_empty(hash)) {
+    return KVTREE_SUCCESS;
+  }
+  if (! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
+  size_t len = strlen(prefix);
+
+  /* in string order the keys with the prefix are a run of slots that
+   * starts at the prefix itself, or in descending order ends there */
+  if (hash->flags & KVTREE_FLAG_ORDER_STR) {
+    kvtree_elem** slots = kvtree_children_slots(hash);
+    int used = kvtree_children_used(hash);
+    int i, step;
+    if (hash->flags & KVTREE_FLAG_ORDER_DESC) {
+      i    = kvtree_order_upper(hash, prefix, 0) - 1;
+      step = -1;
+    } else {
+      i    = kvtree_order_lower(hash, prefix, 0);
+      step = 1;
+    }
+    for (; i >= 0 && i < used && kvtree_prefix_keep(slots[i], prefix, len); i += step) {
+      int rc = fn(slots[i], arg);
+      if (rc != KVTREE_SUCCESS) {
+        return rc;
+      }
+    }
+    return KVTREE_SUCCESS;
   }
 
-  /* sort the elements by key */
-  int (*fn)(const void* a, const void* b) = NULL;
-  fn = &kvtree_cmp_fn_int_asc;
-  if (direction == KVTREE_SORT_DESCENDING) {
-    fn = &kvtree_cmp_fn_int_desc;
+  /* otherwise collect the matches and sort them, leaving hash as is */
+  struct sort_elem_str* list = (struct sort_elem_str*) KVTREE_MALLOC(hash->count * sizeof(struct sort_elem_str));
+  int count = 0;
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(hash); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (kvtree_prefix_keep(elem, prefix, len)) {
+      list[count].key  = elem->key;
+      list[count].addr = elem;
+      count++;
+    }
   }
-  qsort(list, count, sizeof(struct sort_elem_int), fn);
+  qsort(list, count, sizeof(struct sort_elem_str), &kvtree_cmp_fn_str_asc);
 
-  /* walk the sorted list backwards, extracting the element by address,
-   * and inserting at the head */
-  while (index > 0) {
-    index--;
-    elem = list[index].addr;
-    LIST_REMOVE(elem, pointers);
-    LIST_INSERT_HEAD(hash, elem, pointers);
+  int rc = KVTREE_SUCCESS;
+  int i;
+  for (i = 0; i < count && rc == KVTREE_SUCCESS; i++) {
+    rc = fn(list[i].addr, arg);
   }
 
-  /* free the list */
   kvtree_free(&list);
-
-  return KVTREE_SUCCESS;
+  return rc;
 }
 
-/** given a hash, return a list of all keys converted to ints */
-/* caller must free list when done with it */
-int kvtree_list_int(const kvtree* hash, int* n, int** v)
-{
-  /* assume there aren't any keys */
-  *n = 0;
-  *v = NULL;
+/* define the state kvtree_walk hands to its callbacks */
+struct kvtree_visit_struct {
+  struct kvtree_walk walk;
+  kvtree_elem* elem; /* element being visited */
+  int depth;         /* depth of elem, 0 for children of the top */
+};
 
-  /* count the number of keys */
-  int count = kvtree_size(hash);
-  if (count == 0) {
-    return KVTREE_SUCCESS;
+/** visits every element in the tree below hash depth first, calling
+ * pre before the children of an element and post after them, stops
+ * with an error at a sharded hash, whose children it can not visit */
+int kvtree_walk(const kvtree* hash, kvtree_visit_fn pre, kvtree_visit_fn post, void* arg)
+{
+  if (! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
   }
 
-  /* now allocate array of ints to save keys */
-  int* list = (int*) KVTREE_MALLOC(count * sizeof(int));
+  /* only stop after the children of each element if someone cares */
+  int events = KVTREE_WALK_PRE;
+  if (post != NULL) {
+    events |= KVTREE_WALK_POST;
+  }
 
-  /* record key values in array */
-  count = 0;
+  kvtree_visit visit;
+  kvtree_walk_init(&visit.walk, hash, 1, events);
+  int rc = KVTREE_SUCCESS;
+  int event;
   kvtree_elem* elem;
-  for (elem = kvtree_elem_first(hash);
-       elem != NULL;
-       elem = kvtree_elem_next(elem))
-  {
-    int key = kvtree_elem_key_int(elem);
-    list[count] = key;
-    count++;
+  while (rc == KVTREE_SUCCESS && (elem = kvtree_walk_next(&visit.walk, &event)) != NULL) {
+    visit.elem  = elem;
+    visit.depth = visit.walk.stack.depth - 1;
+    if (event == KVTREE_WALK_PRE) {
+      if (! kvtree_flat(elem->hash)) {
+        rc = KVTREE_FAILURE;
+      } else if (pre != NULL) {
+        rc = pre(elem, &visit, arg);
+      }
+    } else {
+      rc = post(elem, &visit, arg);
+    }
   }
+  kvtree_walk_free(&visit.walk);
+  return rc;
+}
 
-  /* sort the keys */
-  qsort(list, count, sizeof(int), &kvtree_cmp_fn_int_asc);
+/** returns the depth of the element being visited */
+int kvtree_visit_depth(const kvtree_visit* visit)
+{
+  return visit->depth;
+}
 
-  *n = count;
-  *v = list;
+/** returns the element at the given depth on the path to the element
+ * being visited */
+kvtree_elem* kvtree_visit_elem(const kvtree_visit* visit, int depth)
+{
+  if (depth < 0 || depth > visit->depth) {
+    return NULL;
+  }
+  if (depth == visit->depth) {
+    return visit->elem;
+  }
 
-  return KVTREE_SUCCESS;
+  /* the frame below the one holding the element at depth visits
+   * the children of its hash */
+  const struct kvtree_stack* stack = &visit->walk.stack;
+  const struct kvtree_walk_frame* frame = (const struct kvtree_walk_frame*)
+    (stack->frames + (size_t) (depth + 1) * stack->frame_size);
+  return frame->elem;
+}
+
+/** skips the children of the element being visited */
+void kvtree_visit_prune(kvtree_visit* visit)
+{
+  kvtree_walk_prune(&visit->walk);
 }
 ///@}
 
@@ -700,18 +3210,18 @@ int kvtree_list_int(const kvtree* hash, int* n, int** v)
 /** shortcut to create a key and subkey in a hash with one call */
 kvtree* kvtree_set_kv(kvtree* hash, const char* key, const char* val)
 {
-  if (hash == NULL) {
+  if (hash == NULL || ! kvtree_writable(hash)) {
     return NULL;
   }
 
-  kvtree* k = kvtree_get(hash, key);
+  kvtree* k = kvtree_child_writable(hash, key, 0);
   if (k == NULL) {
-    k = kvtree_set(hash, key, kvtree_new());
+    k = kvtree_set(hash, key, kvtree_new_child(hash));
   }
 
-  kvtree* v = kvtree_get(k, val);
+  kvtree* v = kvtree_child_writable(k, val, 0);
   if (v == NULL) {
-    v = kvtree_set(k, val, kvtree_new());
+    v = kvtree_set(k, val, kvtree_new_child(k));
   }
 
   return v;
@@ -720,12 +3230,24 @@ kvtree* kvtree_set_kv(kvtree* hash, const char* key, const char* val)
 /** same as kvtree_set_kv, but with the subkey specified as an int */
 kvtree* kvtree_set_kv_int(kvtree* hash, const char* key, int val)
 {
-  /* TODO: this feels kludgy, but I guess as long as the ASCII string
-   * is longer than a max int (or minimum int with leading minus sign)
-   * which is 11 chars, we're ok ("-2147483648" to "2147483647") */
-  char tmp[100];
-  sprintf(tmp, "%d", val);
-  return kvtree_set_kv(hash, key, tmp);
+  if (hash == NULL || ! kvtree_writable(hash)) {
+    return NULL;
+  }
+
+  kvtree* k = kvtree_child_writable(hash, key, 0);
+  if (k == NULL) {
+    k = kvtree_set(hash, key, kvtree_new_child(hash));
+  }
+
+  /* only format the subkey as a string if we need to create it */
+  kvtree* v = kvtree_child_writable(k, NULL, val);
+  if (v != NULL) {
+    return v;
+  }
+
+  char tmp[KVTREE_INT_KEY_MAX];
+  kvtree_key_format_int(tmp, val);
+  return kvtree_set(k, tmp, kvtree_new_child(k));
 }
 
 /** shortcut to get hash assocated with the subkey of a key in a hash
@@ -752,12 +3274,11 @@ kvtree* kvtree_get_kv(const kvtree* hash, const char* key, const char* val)
 /** same as kvtree_get_kv, but with the subkey specified as an int */
 kvtree* kvtree_get_kv_int(const kvtree* hash, const char* key, int val)
 {
-  /* TODO: this feels kludgy, but I guess as long as the ASCII string
-   * is longer than a max int (or minimum int with leading minus sign)
-   * which is 11 chars, we're ok ("-2147483648" to "2147483647") */
-  char tmp[100];
-  sprintf(tmp, "%d", val);
-  return kvtree_get_kv(hash, key, tmp);
+  kvtree_elem* elem = kvtree_elem_get_int(kvtree_get(hash, key), val);
+  if (elem == NULL) {
+    return NULL;
+  }
+  return elem->hash;
 }
 
 /** unset subkey under key, and if that removes the only element for
@@ -768,9 +3289,9 @@ int kvtree_unset_kv(kvtree* hash, const char* key, const char* val)
     return KVTREE_SUCCESS;
   }
 
-  kvtree* v = kvtree_get(hash, key);
+  kvtree* v = kvtree_child_writable(hash, key, 0);
   int rc = kvtree_unset(v, val);
-  if (kvtree_size(v) == 0) {
+  if (kvtree_is_empty(v)) {
     rc = kvtree_unset(hash, key);
   }
 
@@ -780,12 +3301,22 @@ int kvtree_unset_kv(kvtree* hash, const char* key, const char* val)
 /** same as kvtree_unset_kv, but with the subkey specified as an int */
 int kvtree_unset_kv_int(kvtree* hash, const char* key, int val)
 {
-  /* TODO: this feels kludgy, but I guess as long as the ASCII string
-   * is longer than a max int (or minimum int with leading minus sign)
-   * which is 11 chars, we're ok ("-2147483648" to "2147483647") */
-  char tmp[100];
-  sprintf(tmp, "%d", val);
-  return kvtree_unset_kv(hash, key, tmp);
+  if (hash == NULL) {
+    return KVTREE_SUCCESS;
+  }
+
+  kvtree* v = kvtree_child_writable(hash, key, 0);
+  kvtree_elem* elem = kvtree_elem_extract_int(v, val);
+  if (elem != NULL) {
+    kvtree_elem_delete(v, elem);
+  }
+
+  int rc = KVTREE_SUCCESS;
+  if (kvtree_is_empty(v)) {
+    rc = kvtree_unset(hash, key);
+  }
+
+  return rc;
 }
 
 /*
@@ -800,18 +3331,66 @@ kvtree_elem* kvtree_elem_first(const kvtree* hash)
   if (hash == NULL) {
     return NULL;
   }
-  kvtree_elem* elem = LIST_FIRST(hash);
-  return elem;
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    return kvtree_shards_first(hash->val.shards, 0);
+  }
+  /* an ordered hash is visited from its first slot, and has no gaps */
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  int used = kvtree_children_used(hash);
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    return (used > 0) ? slots[0] : NULL;
+  }
+  int i;
+  for (i = used - 1; i >= 0; i--) {
+    if (slots[i] != NULL) {
+      return slots[i];
+    }
+  }
+  return NULL;
 }
 
-/** given a hash element, returns the next element */
-kvtree_elem* kvtree_elem_next(const kvtree_elem* elem)
+/** returns the child of the same hash after elem, without going on
+ * to the next shard of a sharded hash */
+kvtree_elem* kvtree_elem_next_sibling(const kvtree_elem* elem)
 {
   if (elem == NULL) {
     return NULL;
   }
-  kvtree_elem* next = LIST_NEXT(elem, pointers);
-  return next;
+  /* an element that was removed from its hash has no next element */
+  const kvtree* hash = elem->parent;
+  if (hash == NULL) {
+    return NULL;
+  }
+  kvtree_elem** slots = kvtree_children_slots(hash);
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    int next = elem->pos + 1;
+    return (next < kvtree_children_used(hash)) ? slots[next] : NULL;
+  }
+  int i;
+  for (i = elem->pos - 1; i >= 0; i--) {
+    if (slots[i] != NULL) {
+      return slots[i];
+    }
+  }
+  return NULL;
+}
+
+/** given a hash element, returns the next element */
+kvtree_elem* kvtree_elem_next(const kvtree_elem* elem)
+{
+  kvtree_elem* next = kvtree_elem_next_sibling(elem);
+  if (next != NULL || elem == NULL) {
+    return next;
+  }
+
+  /* the last child of a shard is followed by those of the next shard */
+  const kvtree* hash = elem->parent;
+  if (hash != NULL && (hash->flags & KVTREE_FLAG_SHARD)) {
+    const struct kvtree_shards_struct* sharded = hash->val.shards;
+    int shard = (int) ((uint64_t) kvtree_elem_key_hash(elem) >> sharded->shift);
+    return kvtree_shards_first(sharded, shard + 1);
+  }
+  return NULL;
 }
 
 /** returns a pointer to the key of the specified element */
@@ -831,6 +3410,9 @@ int kvtree_elem_key_int(const kvtree_elem* elem)
   if (elem == NULL) {
     return 0;
   }
+  if (elem->flags & KVTREE_ELEM_FLAG_INTKEY) {
+    return (int) elem->ikey;
+  }
   int i = atoi(elem->key);
   return i;
 }
@@ -853,9 +3435,28 @@ kvtree_elem* kvtree_elem_get(const kvtree* hash, const char* key)
     return NULL;
   }
 
+  /* look in the shard of the key, holding its lock while we do */
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    union kvtree_shard* shard = kvtree_shard_pick(hash, kvtree_key_hash(key));
+    pthread_rwlock_rdlock(&shard->s.lock);
+    kvtree_elem* elem = kvtree_elem_get(shard->s.hash, key);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return elem;
+  }
+
+  /* use binary search or the index if we can */
+  if (hash->flags & KVTREE_FLAG_ORDER_ALL) {
+    return kvtree_order_find(hash, key, 0);
+  }
+  if (hash->index != NULL) {
+    return kvtree_index_lookup(hash->index, key);
+  }
+
+  /* otherwise the hash is small, so just search the children */
   kvtree_elem* elem;
-  LIST_FOREACH(elem, hash, pointers) {
-    if (elem->key != NULL && strcmp(elem->key, key) == 0) {
+  kvtree_elem** slot;
+  KVTREE_FOREACH(elem, slot, hash) {
+    if (elem->key != NULL && (elem->key == key || strcmp(elem->key, key) == 0)) {
       return elem;
     }
   }
@@ -883,9 +3484,19 @@ char* kvtree_elem_get_first_val(const kvtree* hash, const char* key)
  * from the hash, and return it */
 kvtree_elem* kvtree_elem_extract(kvtree* hash, const char* key)
 {
+  if (! kvtree_writable(hash)) {
+    return NULL;
+  }
+  if (hash != NULL && key != NULL && (hash->flags & KVTREE_FLAG_SHARDED)) {
+    union kvtree_shard* shard = kvtree_shard_pick(hash, kvtree_key_hash(key));
+    pthread_rwlock_wrlock(&shard->s.lock);
+    kvtree_elem* elem = kvtree_elem_extract(shard->s.hash, key);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return elem;
+  }
   kvtree_elem* elem = kvtree_elem_get(hash, key);
   if (elem != NULL) {
-    LIST_REMOVE(elem, pointers);
+    kvtree_elem_unlink(hash, elem);
   }
   return elem;
 }
@@ -894,12 +3505,19 @@ kvtree_elem* kvtree_elem_extract(kvtree* hash, const char* key)
  * remove it from the hash, and return it */
 kvtree_elem* kvtree_elem_extract_int(kvtree* hash, int key)
 {
-  char tmp[100];
-  sprintf(tmp, "%d", key);
-
-  kvtree_elem* elem = kvtree_elem_get(hash, tmp);
+  if (! kvtree_writable(hash)) {
+    return NULL;
+  }
+  if (hash != NULL && (hash->flags & KVTREE_FLAG_SHARDED)) {
+    union kvtree_shard* shard = kvtree_shard_pick(hash, kvtree_int_hash(key));
+    pthread_rwlock_wrlock(&shard->s.lock);
+    kvtree_elem* elem = kvtree_elem_extract_int(shard->s.hash, key);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return elem;
+  }
+  kvtree_elem* elem = kvtree_elem_get_int(hash, key);
   if (elem != NULL) {
-    LIST_REMOVE(elem, pointers);
+    kvtree_elem_unlink(hash, elem);
   }
   return elem;
 }
@@ -909,7 +3527,19 @@ kvtree_elem* kvtree_elem_extract_int(kvtree* hash, int key)
 kvtree_elem* kvtree_elem_extract_by_addr(kvtree* hash, kvtree_elem* elem)
 {
   /* TODO: check that elem is really in hash */
-  LIST_REMOVE(elem, pointers);
+  if (! kvtree_writable(hash)) {
+    return NULL;
+  }
+
+  /* the element of a sharded hash is held by one of its shards */
+  if (hash != NULL && (hash->flags & KVTREE_FLAG_SHARDED)) {
+    union kvtree_shard* shard = kvtree_shard_pick(hash, kvtree_elem_key_hash(elem));
+    pthread_rwlock_wrlock(&shard->s.lock);
+    kvtree_elem_unlink(shard->s.hash, elem);
+    pthread_rwlock_unlock(&shard->s.lock);
+    return elem;
+  }
+  kvtree_elem_unlink(hash, elem);
   return elem;
 }
 
@@ -929,155 +3559,723 @@ char* kvtree_get_val(const kvtree* hash, const char* key)
   if (key_hash != NULL) {
     /* check that the size of this hash belonging to the key is
      * exactly 1 */
-    int size = kvtree_size(key_hash);
-    if (size == 1) {
+    if (kvtree_has_one(key_hash)) {
       /* get the key of the first element in this hash */
       kvtree_elem* first = kvtree_elem_first(key_hash);
       value = kvtree_elem_key(first);
     } else {
       /* this is an error */
       kvtree_err("Hash for key %s expected to have exactly one element, but it has %d @ %s:%d",
-        key, size, __FILE__, __LINE__
+        key, kvtree_size(key_hash), __FILE__, __LINE__
       );
     }
   }
 
-  return value;
+  return value;
+}
+///@}
+
+/* ================================================= */
+/** @name Typed scalar values */
+///@{
+
+/** formats a typed value as a string, returns number of chars
+ * written (not counting the terminating NUL) */
+static int kvtree_format_value(char* buf, size_t size, int type, int hex, union kvtree_value val)
+{
+  int n = 0;
+  switch (type) {
+  case KVTREE_TYPE_INT64:
+    n = snprintf(buf, size, "%lld", (long long) val.i);
+    break;
+  case KVTREE_TYPE_UINT64:
+    if (hex) {
+      n = snprintf(buf, size, "%#llx", (unsigned long long) val.u);
+    } else {
+      n = snprintf(buf, size, "%llu", (unsigned long long) val.u);
+    }
+    break;
+  case KVTREE_TYPE_DOUBLE:
+    n = snprintf(buf, size, "%f", val.d);
+    break;
+  }
+  return n;
+}
+
+/** builds a typed leaf to be set as a child of parent, holding the
+ * given value and a single subkey with its string form, for strings
+ * str is the value itself */
+static kvtree* kvtree_new_typed(const kvtree* parent, int type, int hex, union kvtree_value val, const char* str)
+{
+  char buf[KVTREE_MAX_LINE];
+  if (type != KVTREE_TYPE_STRING) {
+    kvtree_format_value(buf, sizeof(buf), type, hex, val);
+    str = buf;
+  }
+
+  kvtree* leaf = kvtree_new_child(parent);
+  kvtree_set(leaf, str, kvtree_new_child(leaf));
+
+  /* set the type after linking the subkey, which clears it */
+  leaf->flags |= (type << KVTREE_FLAG_TYPE_SHIFT);
+  if (hex) {
+    leaf->flags |= KVTREE_FLAG_TYPE_HEX;
+  }
+  leaf->val = val;
+  return leaf;
+}
+
+/** set key to a typed leaf, replacing any current value */
+static kvtree* kvtree_set_typed(kvtree* hash, const char* key, int type, int hex, union kvtree_value val, const char* str)
+{
+  if (hash == NULL || key == NULL || ! kvtree_writable(hash)) {
+    return NULL;
+  }
+  kvtree* leaf = kvtree_new_typed(hash, type, hex, val, str);
+  return kvtree_set(hash, key, leaf);
+}
+
+/** set key to a typed signed integer value, returns hash for key */
+kvtree* kvtree_set_int64(kvtree* hash, const char* key, int64_t val)
+{
+  union kvtree_value v;
+  v.i = val;
+  return kvtree_set_typed(hash, key, KVTREE_TYPE_INT64, 0, v, NULL);
+}
+
+/** set key to a typed unsigned integer value, returns hash for key */
+kvtree* kvtree_set_uint64(kvtree* hash, const char* key, uint64_t val)
+{
+  union kvtree_value v;
+  v.u = val;
+  return kvtree_set_typed(hash, key, KVTREE_TYPE_UINT64, 0, v, NULL);
+}
+
+/** same as kvtree_set_uint64, but formats the value in hex */
+kvtree* kvtree_set_uint64_hex(kvtree* hash, const char* key, uint64_t val)
+{
+  union kvtree_value v;
+  v.u = val;
+  return kvtree_set_typed(hash, key, KVTREE_TYPE_UINT64, 1, v, NULL);
+}
+
+/** set key to a typed floating point value, returns hash for key */
+kvtree* kvtree_set_double(kvtree* hash, const char* key, double val)
+{
+  union kvtree_value v;
+  v.d = val;
+  return kvtree_set_typed(hash, key, KVTREE_TYPE_DOUBLE, 0, v, NULL);
+}
+
+/** set key to a typed string value, returns hash for key */
+kvtree* kvtree_set_str(kvtree* hash, const char* key, const char* val)
+{
+  if (val == NULL) {
+    return NULL;
+  }
+  union kvtree_value v;
+  v.u = 0;
+  return kvtree_set_typed(hash, key, KVTREE_TYPE_STRING, 0, v, val);
+}
+
+/** set key to a copy of size bytes starting at buf */
+kvtree* kvtree_set_bytes(kvtree* hash, const char* key, const void* buf, size_t size)
+{
+  if (hash == NULL || key == NULL || (buf == NULL && size > 0) || ! kvtree_writable(hash)) {
+    return NULL;
+  }
+  kvtree* leaf = kvtree_new_child(hash);
+  leaf->flags |= (KVTREE_TYPE_BYTES << KVTREE_FLAG_TYPE_SHIFT);
+  leaf->val.bytes = kvtree_bytes_new(leaf->arena, buf, size);
+  return kvtree_set(hash, key, leaf);
+}
+
+/** return the type of the value stored under key */
+int kvtree_get_type(const kvtree* hash, const char* key)
+{
+  kvtree* leaf = kvtree_get(hash, key);
+  if (leaf == NULL) {
+    return KVTREE_TYPE_NONE;
+  }
+  return KVTREE_HASH_TYPE(leaf);
+}
+
+/** get value of key as a signed integer */
+int kvtree_get_int64(const kvtree* hash, const char* key, int64_t* val)
+{
+  kvtree* leaf = kvtree_get(hash, key);
+  if (leaf == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  switch (KVTREE_HASH_TYPE(leaf)) {
+  case KVTREE_TYPE_INT64:
+    *val = leaf->val.i;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_UINT64:
+    *val = (int64_t) leaf->val.u;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_DOUBLE:
+    *val = (int64_t) leaf->val.d;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_BYTES:
+    return KVTREE_FAILURE;
+  }
+
+  /* not typed, so parse the string */
+  char* val_str = kvtree_get_val(hash, key);
+  if (val_str == NULL) {
+    return KVTREE_FAILURE;
+  }
+  *val = (int64_t) strtoll(val_str, NULL, 0);
+  return KVTREE_SUCCESS;
+}
+
+/** get value of key as an unsigned integer */
+int kvtree_get_uint64(const kvtree* hash, const char* key, uint64_t* val)
+{
+  kvtree* leaf = kvtree_get(hash, key);
+  if (leaf == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  switch (KVTREE_HASH_TYPE(leaf)) {
+  case KVTREE_TYPE_INT64:
+    *val = (uint64_t) leaf->val.i;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_UINT64:
+    *val = leaf->val.u;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_DOUBLE:
+    *val = (uint64_t) leaf->val.d;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_BYTES:
+    return KVTREE_FAILURE;
+  }
+
+  /* not typed, so parse the string */
+  char* val_str = kvtree_get_val(hash, key);
+  if (val_str == NULL) {
+    return KVTREE_FAILURE;
+  }
+  *val = (uint64_t) strtoull(val_str, NULL, 0);
+  return KVTREE_SUCCESS;
+}
+
+/** get value of key as floating point */
+int kvtree_get_double(const kvtree* hash, const char* key, double* val)
+{
+  kvtree* leaf = kvtree_get(hash, key);
+  if (leaf == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  switch (KVTREE_HASH_TYPE(leaf)) {
+  case KVTREE_TYPE_INT64:
+    *val = (double) leaf->val.i;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_UINT64:
+    *val = (double) leaf->val.u;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_DOUBLE:
+    *val = leaf->val.d;
+    return KVTREE_SUCCESS;
+  case KVTREE_TYPE_BYTES:
+    return KVTREE_FAILURE;
+  }
+
+  /* not typed, so parse the string */
+  char* val_str = kvtree_get_val(hash, key);
+  if (val_str == NULL) {
+    return KVTREE_FAILURE;
+  }
+  return kvtree_atod(val_str, val);
+}
+
+/** get blob stored under key without copying it */
+int kvtree_get_bytes(const kvtree* hash, const char* key, const void** buf, size_t* size)
+{
+  kvtree* leaf = kvtree_get(hash, key);
+  if (leaf == NULL || KVTREE_HASH_TYPE(leaf) != KVTREE_TYPE_BYTES) {
+    return KVTREE_FAILURE;
+  }
+  *buf  = leaf->val.bytes->data;
+  *size = (size_t) leaf->val.bytes->size;
+  return KVTREE_SUCCESS;
+}
+///@}
+
+/* ================================================= */
+/** @name Pack and unpack hash and elements into a char buffer */
+///@{
+
+/** returns 1 if hash can be packed in the compact typed encoding,
+ * which requires that nobody hung anything below its single subkey */
+static int kvtree_pack_is_typed(const kvtree* hash)
+{
+  if (hash == NULL || ! (hash->flags & KVTREE_FLAG_TYPE_MASK)) {
+    return 0;
+  }
+  if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+    return 1;
+  }
+  return kvtree_has_one(hash) && kvtree_is_empty(kvtree_elem_first(hash)->hash);
+}
+
+/** returns the packed form of hash if it is the top of a tree made
+ * by kvtree_freeze and sets size to its length, otherwise returns NULL */
+const char* kvtree_packed(const kvtree* hash, size_t* size)
+{
+  if (hash == NULL || ! (hash->flags & KVTREE_FLAG_ARENA_OWNER) || ! KVTREE_HASH_FROZEN(hash)) {
+    return NULL;
+  }
+  *size = hash->arena->image_size;
+  return hash->arena->image;
+}
+
+/** computes the number of bytes kvtree_pack writes for hash ahead of
+ * its children, sets typed to 1 if hash uses the typed encoding, and
+ * sets leaf to 1 if its children are not packed after it, returns 0
+ * if hash is sharded */
+static size_t kvtree_pack_size_head(const kvtree* hash, int* typed, int* leaf)
+{
+  size_t size = 0;
+  *leaf = 1;
+  if (hash == NULL) {
+    return sizeof(uint32_t);
+  }
+
+  /* a frozen tree was packed when it was made */
+  if (kvtree_packed(hash, &size) != NULL) {
+    *typed |= hash->arena->image_typed;
+    return size;
+  }
+
+  /* the elements of a sharded hash are not in its count */
+  if (! kvtree_flat(hash)) {
+    return 0;
+  }
+
+  /* add the size required to store the COUNT */
+  size += sizeof(uint32_t);
+
+  /* a typed leaf stores its value instead of its subkey */
+  if (kvtree_pack_is_typed(hash)) {
+    *typed = 1;
+    if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_STRING) {
+      size += kvtree_elem_first(hash)->keylen + 1;
+    } else if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+      size += sizeof(uint64_t) + (size_t) hash->val.bytes->size;
+    } else {
+      size += sizeof(uint64_t);
+    }
+    return size;
+  }
+
+  *leaf = 0;
+  return size;
 }
-///@}
 
-/* ================================================= */
-/** @name Pack and unpack hash and elements into a char buffer */
-///@{
+/** computes the number of bytes needed to pack the given hash, sets
+ * typed to 1 if any hash in the tree uses the typed encoding, returns
+ * 0 if the tree holds a sharded hash */
+static size_t kvtree_pack_size_typed(const kvtree* hash, int* typed)
+{
+  int leaf;
+  size_t size = kvtree_pack_size_head(hash, typed, &leaf);
+  if (leaf) {
+    return size;
+  }
+
+  /* add the size of each element, its key followed by its hash */
+  struct kvtree_walk walk;
+  kvtree_walk_init(&walk, hash, 0, KVTREE_WALK_PRE);
+  int event;
+  kvtree_elem* elem;
+  while ((elem = kvtree_walk_next(&walk, &event)) != NULL) {
+    size_t head = kvtree_pack_size_head(elem->hash, typed, &leaf);
+    if (head == 0) {
+      size = 0;
+      break;
+    }
+    size += (elem->key != NULL) ? elem->keylen + 1 : 1;
+    size += head;
+    if (leaf) {
+      kvtree_walk_prune(&walk);
+    }
+  }
+  kvtree_walk_free(&walk);
+  return size;
+}
+
+/** computes the number of bytes needed to pack the given hash, returns
+ * 0 if the tree holds a sharded hash */
+size_t kvtree_pack_size(const kvtree* hash)
+{
+  int typed = 0;
+  return kvtree_pack_size_typed(hash, &typed);
+}
 
-/** computes the number of bytes needed to pack the given hash element */
-static size_t kvtree_elem_pack_size(const kvtree_elem* elem)
+/** packs hash into specified buf ahead of its children and returns the
+ * number of bytes written, sets leaf to 1 if its children are not
+ * packed after it, returns 0 if hash is sharded */
+static size_t kvtree_pack_head(char* buf, const kvtree* hash, int* leaf)
 {
   size_t size = 0;
-  if (elem != NULL) {
-    if (elem->key != NULL) {
-      size += strlen(elem->key) + 1;
+  *leaf = 1;
+  if (hash == NULL) {
+    /* no hash -- just pack the count of 0 */
+    uint32_t count_network = kvtree_hton32((uint32_t) 0);
+    memcpy(buf + size, &count_network, sizeof(uint32_t));
+    size += sizeof(uint32_t);
+    return size;
+  }
+
+  /* a frozen tree was packed when it was made */
+  const char* image = kvtree_packed(hash, &size);
+  if (image != NULL) {
+    memcpy(buf, image, size);
+    return size;
+  }
+
+  /* the elements of a sharded hash are not in its count */
+  if (! kvtree_flat(hash)) {
+    return 0;
+  }
+
+  /* a typed leaf stores a marker with its type in place of the count,
+   * followed by its value */
+  if (kvtree_pack_is_typed(hash)) {
+    int type = KVTREE_HASH_TYPE(hash);
+    uint32_t marker = KVTREE_PACK_TYPED | (uint32_t) type;
+    if (hash->flags & KVTREE_FLAG_TYPE_HEX) {
+      marker |= KVTREE_PACK_TYPED_HEX;
+    }
+    uint32_t marker_network = kvtree_hton32(marker);
+    memcpy(buf + size, &marker_network, sizeof(uint32_t));
+    size += sizeof(uint32_t);
+
+    if (type == KVTREE_TYPE_STRING) {
+      const kvtree_elem* first = kvtree_elem_first(hash);
+      memcpy(buf + size, first->key, first->keylen + 1);
+      size += first->keylen + 1;
+    } else if (type == KVTREE_TYPE_BYTES) {
+      /* a blob is its length followed by its data */
+      const struct kvtree_bytes_struct* bytes = hash->val.bytes;
+      uint64_t len_network = kvtree_hton64(bytes->size);
+      memcpy(buf + size, &len_network, sizeof(uint64_t));
+      size += sizeof(uint64_t);
+      memcpy(buf + size, bytes->data, (size_t) bytes->size);
+      size += (size_t) bytes->size;
     } else {
-      size += 1;
+      uint64_t val_network = kvtree_hton64(hash->val.u);
+      memcpy(buf + size, &val_network, sizeof(uint64_t));
+      size += sizeof(uint64_t);
     }
-    size += kvtree_pack_size(elem->hash);
-  } else {
-    size += 1;
-    size += kvtree_pack_size(NULL);
+    return size;
   }
+
+  /* get the number of items in the hash */
+  uint32_t count = (uint32_t) hash->count;
+
+  /* pack the count value, the elements follow */
+  uint32_t count_network = kvtree_hton32(count);
+  memcpy(buf + size, &count_network, sizeof(uint32_t));
+  size += sizeof(uint32_t);
+
+  *leaf = 0;
   return size;
 }
 
-/** packs a hash element into specified buf and returns the number of
- * bytes written */
-static size_t kvtree_elem_pack(char* buf, const kvtree_elem* elem)
+/** packs the given hash into specified buf and returns the number of
+ * bytes written, returns 0 if the tree holds a sharded hash */
+size_t kvtree_pack(char* buf, const kvtree* hash)
 {
-  size_t size = 0;
-  if (elem != NULL) {
+  int leaf;
+  size_t size = kvtree_pack_head(buf, hash, &leaf);
+  if (leaf) {
+    return size;
+  }
+
+  /* pack each element, its key followed by its hash */
+  struct kvtree_walk walk;
+  kvtree_walk_init(&walk, hash, 0, KVTREE_WALK_PRE);
+  int event;
+  kvtree_elem* elem;
+  while ((elem = kvtree_walk_next(&walk, &event)) != NULL) {
     if (elem->key != NULL) {
-      strcpy(buf + size, elem->key);
-      size += strlen(elem->key) + 1;
+      memcpy(buf + size, elem->key, elem->keylen + 1);
+      size += elem->keylen + 1;
     } else {
       buf[size] = '\0';
       size += 1;
     }
-    size += kvtree_pack(buf + size, elem->hash);
-  } else {
-    buf[size] = '\0';
-    size += 1;
-    size += kvtree_pack(buf + size, NULL);
+    size_t head = kvtree_pack_head(buf + size, elem->hash, &leaf);
+    if (head == 0) {
+      size = 0;
+      break;
+    }
+    size += head;
+    if (leaf) {
+      kvtree_walk_prune(&walk);
+    }
   }
+  kvtree_walk_free(&walk);
   return size;
 }
 
-/** unpacks hash element from specified buffer and returns the number of
- * bytes read and a pointer to a newly allocated hash */
-static size_t kvtree_elem_unpack(const char* buf, kvtree_elem* elem)
+/** qsort compare function for elements by key */
+static int kvtree_freeze_cmp(const void* a, const void* b)
 {
-  /* check that we got an elem object to unpack data into */
-  if (elem == NULL) {
-    return 0;
+  const kvtree_elem* elem_a = *(const kvtree_elem* const*) a;
+  const kvtree_elem* elem_b = *(const kvtree_elem* const*) b;
+  return strcmp(
+    (elem_a->key != NULL) ? elem_a->key : "",
+    (elem_b->key != NULL) ? elem_b->key : ""
+  );
+}
+
+/** copies the children and value of hash into the empty arena hash
+ * frozen, with the children of each hash sorted by key, so that
+ * lookups use binary search with the order KVTREE_ORDER_STR */
+static void kvtree_freeze_into(kvtree* frozen, const kvtree* hash)
+{
+  int count = hash->count;
+  if (count > 1) {
+    kvtree_children_resize(frozen, count);
   }
 
-  /* read in the key and value strings */
-  size_t size = 0;
+  /* gather the children and sort them by key */
+  const kvtree_elem** list = NULL;
+  if (count > 0) {
+    list = (const kvtree_elem**) KVTREE_MALLOC(count * sizeof(kvtree_elem*));
+  }
+  int index = 0;
+  kvtree_elem* elem;
+  kvtree_elem** slot;
+  KVTREE_FOREACH(elem, slot, hash) {
+    list[index++] = elem;
+  }
+  if (count > 1) {
+    qsort(list, count, sizeof(kvtree_elem*), kvtree_freeze_cmp);
+  }
 
-  /* read in the KEY string */
-  const char* key = buf;
-  size += strlen(key) + 1;
+  /* an ordered hash is visited from its first slot, so append them in
+   * order, keys are copied behind their elements rather than pooled */
+  int i;
+  for (i = 0; i < count; i++) {
+    kvtree* child = NULL;
+    if (list[i]->hash != NULL) {
+      child = kvtree_new_child(frozen);
+      kvtree_freeze_into(child, list[i]->hash);
+    }
+    kvtree_elem* copy = kvtree_elem_new(frozen, list[i]->key, list[i]->keylen, 0, child);
+    kvtree_children_append(frozen, copy);
+    frozen->count++;
+  }
+  frozen->flags |= KVTREE_FLAG_ORDER_STR;
+  kvtree_free(&list);
 
-  /* read in the hash object */
-  kvtree* hash = kvtree_new();
-  size += kvtree_unpack(buf + size, hash);
+  /* copy the value of a typed leaf */
+  if (hash->flags & KVTREE_FLAG_TYPE_ALL) {
+    frozen->flags |= (hash->flags & KVTREE_FLAG_TYPE_ALL);
+    if (KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+      const struct kvtree_bytes_struct* bytes = hash->val.bytes;
+      frozen->val.bytes = kvtree_bytes_new(frozen->arena, bytes->data, (size_t) bytes->size);
+    } else {
+      frozen->val = hash->val;
+    }
+  }
+}
+
+/** returns a read-only copy of hash laid out in a single slab, along
+ * with its packed form, which kvtree_pack and the functions that send
+ * or write a hash use as it is, returns NULL if the tree holds a
+ * sharded hash */
+kvtree* kvtree_freeze(const kvtree* hash)
+{
+  /* size the slab to hold the copy followed by its packed form */
+  int typed = 0;
+  size_t image_size = kvtree_pack_size_typed(hash, &typed);
+  if (image_size == 0) {
+    return NULL;
+  }
+  struct kvtree_arena_struct* arena = kvtree_arena_new();
+  size_t size = kvtree_arena_rounded(sizeof(kvtree)) + kvtree_arena_rounded(image_size);
+  if (hash != NULL) {
+    size += kvtree_clone_size(hash, -1);
+  }
+  kvtree_arena_reserve(arena, size);
 
-  /* set our elem with the key and hash values we unpacked */
-  kvtree_elem_init(elem, key, hash);
+  kvtree* frozen = (kvtree*) kvtree_arena_alloc(arena, sizeof(kvtree));
+  kvtree_init(frozen, arena, KVTREE_FLAG_ARENA_NODE | KVTREE_FLAG_ARENA_OWNER);
+  if (hash != NULL) {
+    kvtree_freeze_into(frozen, hash);
+  }
 
-  return size;
+  /* pack the copy once, setting the image is what makes it frozen */
+  char* image = (char*) kvtree_arena_alloc(arena, image_size);
+  kvtree_pack(image, frozen);
+  arena->image_size  = image_size;
+  arena->image_typed = typed;
+  arena->image       = image;
+  return frozen;
 }
 
-/** computes the number of bytes needed to pack the given hash */
-size_t kvtree_pack_size(const kvtree* hash)
+/** moves the children of each shard of a sharded hash into the hash
+ * itself, and frees the shards */
+static void kvtree_flatten_node(kvtree* hash)
 {
-  size_t size = 0;
-  if (hash != NULL) {
-    kvtree_elem* elem;
+  struct kvtree_shards_struct* sharded = hash->val.shards;
+  hash->flags &= ~KVTREE_FLAG_SHARDED;
+  hash->val.u = 0;
 
-    /* add the size required to store the COUNT */
-    size += sizeof(uint32_t);
+  int count = 0;
+  int i;
+  for (i = 0; i < sharded->count; i++) {
+    count += sharded->shards[i].s.hash->count;
+  }
+  kvtree_reserve(hash, count);
+
+  /* append the shards last to first, each oldest child first, so that
+   * the children are visited in the same order as they were before */
+  for (i = sharded->count - 1; i >= 0; i--) {
+    kvtree* shard = sharded->shards[i].s.hash;
+    kvtree_elem** slots = kvtree_children_slots(shard);
+    int used = kvtree_children_used(shard);
+    int j;
+    for (j = 0; j < used; j++) {
+      if (slots[j] != NULL) {
+        kvtree_children_append(hash, slots[j]);
+        hash->count++;
+      }
+    }
+
+    /* the children have moved, so only the shard itself is left */
+    pthread_rwlock_destroy(&sharded->shards[i].s.lock);
+    kvtree_delete_node(shard);
+  }
+  kvtree_free(&sharded);
 
-    /* finally add the size of each element */
-    LIST_FOREACH(elem, hash, pointers) {
-      size += kvtree_elem_pack_size(elem);
+  /* index the children once they are all in */
+  if (hash->count >= KVTREE_INDEX_THRESHOLD) {
+    hash->index = kvtree_index_build(hash);
+  }
+}
+
+/** turns each sharded hash in the tree below hash into an ordinary
+ * hash, leaving alone hashes that are shared or frozen */
+int kvtree_flatten(kvtree* hash)
+{
+  if (hash == NULL || KVTREE_HASH_SHARES(hash) > 0 || KVTREE_HASH_FROZEN(hash)) {
+    return KVTREE_SUCCESS;
+  }
+  if (hash->flags & KVTREE_FLAG_SHARDED) {
+    kvtree_flatten_node(hash);
+  }
+
+  /* a hash is flattened before the walk goes down into its children */
+  struct kvtree_walk walk;
+  kvtree_walk_init(&walk, hash, 0, KVTREE_WALK_PRE);
+  int event;
+  kvtree_elem* elem;
+  while ((elem = kvtree_walk_next(&walk, &event)) != NULL) {
+    kvtree* child = elem->hash;
+    if (child == NULL) {
+      continue;
+    }
+    if (KVTREE_HASH_SHARES(child) > 0 || KVTREE_HASH_FROZEN(child)) {
+      kvtree_walk_prune(&walk);
+    } else if (child->flags & KVTREE_FLAG_SHARDED) {
+      kvtree_flatten_node(child);
     }
-  } else {
-    size += sizeof(uint32_t);
   }
-  return size;
+  kvtree_walk_free(&walk);
+  return KVTREE_SUCCESS;
 }
 
-/** packs the given hash into specified buf and returns the number of
- * bytes written */
-size_t kvtree_pack(char* buf, const kvtree* hash)
+/** unpacks a typed leaf given the marker read in place of its count,
+ * adding its subkey to hash, returns the number of bytes read after
+ * the marker */
+static size_t kvtree_unpack_typed(const char* buf, kvtree* hash, uint32_t marker)
 {
   size_t size = 0;
-  if (hash != NULL) {
-    kvtree_elem* elem;
+  int type = (int) (marker & 0xff);
+  int hex  = (marker & KVTREE_PACK_TYPED_HEX) ? 1 : 0;
+
+  /* a corrupt buffer, or one packed by a newer version, may hold a
+   * type we do not know how to read */
+  if (type < KVTREE_TYPE_INT64 || type > KVTREE_TYPE_BYTES) {
+    kvtree_err("Unknown type %d in packed hash @ %s:%d",
+      type, __FILE__, __LINE__
+    );
+    return 0;
+  }
 
-    /* count the items in the hash */
-    uint32_t count = 0;
-    LIST_FOREACH(elem, hash, pointers) {
-      count++;
+  /* a blob has no subkey to add, it replaces any current value if hash
+   * has no subkeys and is dropped otherwise */
+  if (type == KVTREE_TYPE_BYTES) {
+    uint64_t len_network;
+    memcpy(&len_network, buf, sizeof(uint64_t));
+    size_t len = (size_t) kvtree_ntoh64(len_network);
+    size += sizeof(uint64_t);
+    if (kvtree_is_empty(hash)) {
+      kvtree_clear_type(hash);
+      hash->flags |= (KVTREE_TYPE_BYTES << KVTREE_FLAG_TYPE_SHIFT);
+      hash->val.bytes = kvtree_bytes_new(hash->arena, buf + size, len);
     }
+    size += len;
+    return size;
+  }
 
-    /* pack the count value */
-    uint32_t count_network = kvtree_hton32(count);
-    memcpy(buf + size, &count_network, sizeof(uint32_t));
-    size += sizeof(uint32_t);
+  /* read the value, and get its string form */
+  union kvtree_value val;
+  val.u = 0;
+  char buf_str[KVTREE_MAX_LINE];
+  const char* str = buf_str;
+  size_t len;
+  if (type == KVTREE_TYPE_STRING) {
+    str = buf;
+    len = strlen(str);
+    size += len + 1;
+  } else {
+    uint64_t val_network;
+    memcpy(&val_network, buf, sizeof(uint64_t));
+    val.u = kvtree_ntoh64(val_network);
+    size += sizeof(uint64_t);
+    len = (size_t) kvtree_format_value(buf_str, sizeof(buf_str), type, hex, val);
+  }
 
-    /* pack each element */
-    LIST_FOREACH(elem, hash, pointers) {
-      size += kvtree_elem_pack(buf + size, elem);
+  /* the hash only becomes a typed leaf if it was empty */
+  int was_empty = kvtree_is_empty(hash);
+  kvtree_elem* elem = kvtree_elem_new(hash, str, len, 0, kvtree_new_child(hash));
+  kvtree_elem_link(hash, elem);
+  if (was_empty) {
+    hash->flags |= (type << KVTREE_FLAG_TYPE_SHIFT);
+    if (hex) {
+      hash->flags |= KVTREE_FLAG_TYPE_HEX;
     }
-  } else {
-    /* no hash -- just pack the count of 0 */
-    uint32_t count_network = kvtree_hton32((uint32_t) 0);
-    memcpy(buf + size, &count_network, sizeof(uint32_t));
-    size += sizeof(uint32_t);
+    hash->val = val;
   }
+
   return size;
 }
 
-/** unpacks hash from specified buffer into given hash object and
- * returns the number of bytes read */
-size_t kvtree_unpack(const char* buf, kvtree* hash)
-{
-  /* check that we got a hash object to unpack data into */
-  if (hash == NULL) {
-    return 0;
-  }
+/* define a frame of kvtree_unpack, one for each hash being filled */
+struct kvtree_unpack_frame {
+  kvtree* hash;   /* hash the elements are added to */
+  uint32_t count; /* number of elements packed for hash */
+  uint32_t left;  /* number of those still to be read */
+  int order;      /* order hash keeps once all elements are in */
+  int direction;  /* direction of that order */
+};
 
-  /* allocate a new hash object and initialize it */
+/** reads the count of hash from buf, or its value if it is a typed
+ * leaf, returns the number of bytes read, or 0 if the value has an
+ * unknown type, if elements follow, gets hash ready for them and
+ * pushes a frame to read them on stack */
+static size_t kvtree_unpack_head(const char* buf, kvtree* hash, struct kvtree_stack* stack)
+{
   size_t size = 0;
 
   /* read in the COUNT value */
@@ -1086,13 +4284,105 @@ size_t kvtree_unpack(const char* buf, kvtree* hash)
   uint32_t count = kvtree_ntoh32(count_network);
   size += sizeof(uint32_t);
 
-  /* for each element, read in its hash */
-  int i;
-  for (i = 0; i < count; i++) {
-    kvtree_elem* elem = kvtree_elem_new();
-    size += kvtree_elem_unpack(buf + size, elem);
-    LIST_INSERT_HEAD(hash, elem, pointers);
+  /* check whether this is a typed leaf */
+  if (count & KVTREE_PACK_TYPED) {
+    size_t typed_size = kvtree_unpack_typed(buf + size, hash, count);
+    if (typed_size == 0) {
+      return 0;
+    }
+    size += typed_size;
+    return size;
+  }
+  if (count == 0) {
+    return size;
+  }
+
+  /* we know how many elements are coming, so rather than growing the
+   * index one insert at a time, drop it and build it once at the end,
+   * likewise an ordered hash is sorted once at the end */
+  struct kvtree_unpack_frame* frame = (struct kvtree_unpack_frame*) kvtree_stack_push(stack);
+  frame->hash      = hash;
+  frame->count     = count;
+  frame->left      = count;
+  frame->order     = kvtree_get_order(hash);
+  frame->direction = (hash->flags & KVTREE_FLAG_ORDER_DESC) ? KVTREE_SORT_DESCENDING : KVTREE_SORT_ASCENDING;
+  if (frame->order != KVTREE_ORDER_NONE) {
+    kvtree_set_order(hash, KVTREE_ORDER_NONE, 0);
+  }
+  kvtree_index_delete(&hash->index);
+  kvtree_clear_type(hash);
+  kvtree_reserve(hash, hash->count + (int) count);
+  return size;
+}
+
+/** finishes the hash of frame once all of its elements are in */
+static void kvtree_unpack_tail(const struct kvtree_unpack_frame* frame)
+{
+  /* elements were packed newest first, so flip the slots they were
+   * appended to, which leaves them in the order they were packed */
+  kvtree* hash = frame->hash;
+  if (frame->count > 1) {
+    kvtree_children_reverse_range(hash, kvtree_children_used(hash) - (int) frame->count);
+  }
+  if (frame->order != KVTREE_ORDER_NONE) {
+    kvtree_set_order(hash, frame->order, frame->direction);
+  } else if (hash->count >= KVTREE_INDEX_THRESHOLD) {
+    hash->index = kvtree_index_build(hash);
+  }
+}
+
+/** unpacks hash from specified buffer into given hash object and
+ * returns the number of bytes read, or 0 if the buffer holds a value
+ * of an unknown type */
+size_t kvtree_unpack(const char* buf, kvtree* hash)
+{
+  /* check that we got a hash object to unpack data into */
+  if (hash == NULL || ! kvtree_writable(hash)) {
+    return 0;
+  }
+
+  /* read the hashes of the tree in the order they were packed, keeping
+   * a frame for each hash that still expects elements */
+  struct kvtree_stack stack;
+  kvtree_stack_init(&stack, sizeof(struct kvtree_unpack_frame));
+  size_t size = kvtree_unpack_head(buf, hash, &stack);
+  while (stack.depth > 0) {
+    struct kvtree_unpack_frame* frame = (struct kvtree_unpack_frame*) kvtree_stack_top(&stack);
+    if (frame->left == 0) {
+      kvtree_unpack_tail(frame);
+      kvtree_stack_pop(&stack);
+      continue;
+    }
+    frame->left--;
+    kvtree* parent = frame->hash;
+
+    /* read in the KEY string */
+    const char* key = buf + size;
+    size_t keylen = strlen(key);
+    size += keylen + 1;
+
+    /* allocate the element before its hash, so that in an arena it sits
+     * in front of its children, then read in the hash, which may push a
+     * frame for its own elements */
+    kvtree_elem* elem = kvtree_elem_new(parent, key, keylen, 0, NULL);
+    elem->hash = kvtree_new_child(parent);
+    kvtree_children_append(parent, elem);
+    parent->count++;
+    size_t head = kvtree_unpack_head(buf + size, elem->hash, &stack);
+    if (head == 0) {
+      /* stop reading, but leave each hash read so far complete */
+      size = 0;
+      while (stack.depth > 0) {
+        frame = (struct kvtree_unpack_frame*) kvtree_stack_top(&stack);
+        frame->count -= frame->left;
+        kvtree_unpack_tail(frame);
+        kvtree_stack_pop(&stack);
+      }
+      break;
+    }
+    size += head;
   }
+  kvtree_stack_free(&stack);
 
   /* return the size */
   return size;
@@ -1103,13 +4393,21 @@ size_t kvtree_unpack(const char* buf, kvtree* hash)
 /** @name Read and write hash to a file */
 ///@{
 
-/** computes the size needed to persist a hash
-includes room for header, data, and crc32 */
-size_t kvtree_persist_size(const kvtree* hash)
+/** computes the size needed to persist a hash and the file version
+needed to hold it, includes room for header, data, and crc32,
+returns 0 if the tree holds a sharded hash */
+static size_t kvtree_persist_size_version(const kvtree* hash, uint16_t* version)
 {
   /* compute the size of the file (includes header, data, and
-   * trailing crc32) */
-  size_t pack_size = kvtree_pack_size(hash);
+   * trailing crc32), we only need version 2 if there are typed
+   * leaves, so that files without them stay readable by older
+   * versions of the library */
+  int typed = 0;
+  size_t pack_size = kvtree_pack_size_typed(hash, &typed);
+  if (pack_size == 0) {
+    return 0;
+  }
+  *version = typed ? KVTREE_FILE_VERSION_HASH_2 : KVTREE_FILE_VERSION_HASH_1;
   size_t size = KVTREE_FILE_HASH_HEADER_SIZE + pack_size;
 
   /* add room for the crc32 value */
@@ -1118,6 +4416,14 @@ size_t kvtree_persist_size(const kvtree* hash)
   return size;
 }
 
+/** computes the size needed to persist a hash
+includes room for header, data, and crc32 */
+size_t kvtree_persist_size(const kvtree* hash)
+{
+  uint16_t version;
+  return kvtree_persist_size_version(hash, &version);
+}
+
 /** persist hash in newly allocated buffer,
  * return buffer address and size to be freed by caller */
 int kvtree_write_persist(void** ptr_buf, size_t* ptr_size, const kvtree* hash)
@@ -1128,7 +4434,11 @@ int kvtree_write_persist(void** ptr_buf, size_t* ptr_size, const kvtree* hash)
   }
 
   /* compute size of buffer to persist hash */
-  size_t bufsize = kvtree_persist_size(hash);
+  uint16_t version;
+  size_t bufsize = kvtree_persist_size_version(hash, &version);
+  if (bufsize == 0) {
+    return KVTREE_FAILURE;
+  }
 
   /* allocate a buffer to pack the hash in */
   char* buf = (char*) KVTREE_MALLOC(bufsize);
@@ -1140,7 +4450,7 @@ int kvtree_write_persist(void** ptr_buf, size_t* ptr_size, const kvtree* hash)
    * version number */
   kvtree_pack_uint32_t(buf, filesize, &size, (uint32_t) KVTREE_FILE_MAGIC);
   kvtree_pack_uint16_t(buf, filesize, &size, (uint16_t) KVTREE_FILE_TYPE_HASH);
-  kvtree_pack_uint16_t(buf, filesize, &size, (uint16_t) KVTREE_FILE_VERSION_HASH_1);
+  kvtree_pack_uint16_t(buf, filesize, &size, version);
 
   /* write the file size (includes header, data, and trailing crc) */
   kvtree_pack_uint64_t(buf, filesize, &size, (uint64_t) filesize);
@@ -1185,7 +4495,9 @@ ssize_t kvtree_write_fd(const char* file, int fd, const kvtree* hash)
   /* persist hash to buffer */
   void* buf;
   size_t size;
-  kvtree_write_persist(&buf, &size, hash);
+  if (kvtree_write_persist(&buf, &size, hash) != KVTREE_SUCCESS) {
+    return -1;
+  }
 
   /* write buffer to file */
   ssize_t nwrite = kvtree_write_attempt(file, fd, buf, size);
@@ -1260,7 +4572,8 @@ ssize_t kvtree_read_persist(const void* buf, size_t bufsize, kvtree* hash)
   /* check that the file version matches */
   if (magic   != KVTREE_FILE_MAGIC ||
       type    != KVTREE_FILE_TYPE_HASH ||
-      version != KVTREE_FILE_VERSION_HASH_1)
+      (version != KVTREE_FILE_VERSION_HASH_1 &&
+       version != KVTREE_FILE_VERSION_HASH_2))
   {
     kvtree_err("Header does not match expected values @ %s:%d",
       __FILE__, __LINE__
@@ -1313,10 +4626,17 @@ ssize_t kvtree_read_persist(const void* buf, size_t bufsize, kvtree* hash)
     }
   }
 
-  /* create a temporary hash to read data into, unpack, and merge */
-  kvtree* tmp_hash = kvtree_new();
-  kvtree_unpack(buf + size, tmp_hash);
-  kvtree_merge(hash, tmp_hash);
+  /* create a temporary hash to read data into, unpack, and move its
+   * contents into hash, it shares the arena of hash so that they can */
+  kvtree* tmp_hash = kvtree_new_child(hash);
+  if (kvtree_unpack(buf + size, tmp_hash) == 0) {
+    kvtree_err("Failed to unpack hash @ %s:%d",
+      __FILE__, __LINE__
+    );
+    kvtree_delete(&tmp_hash);
+    return -1;
+  }
+  kvtree_merge_move(hash, tmp_hash);
   kvtree_delete(&tmp_hash);
 
   /* return number of bytes processed */
@@ -1372,7 +4692,8 @@ ssize_t kvtree_read_fd(const char* file, int fd, kvtree* hash)
   /* check that the file version matches */
   if (magic   != KVTREE_FILE_MAGIC ||
       type    != KVTREE_FILE_TYPE_HASH ||
-      version != KVTREE_FILE_VERSION_HASH_1)
+      (version != KVTREE_FILE_VERSION_HASH_1 &&
+       version != KVTREE_FILE_VERSION_HASH_2))
   {
     kvtree_err("File header does not match expected values in %s @ %s:%d",
       file, __FILE__, __LINE__
@@ -1445,10 +4766,18 @@ ssize_t kvtree_read_fd(const char* file, int fd, kvtree* hash)
     }
   }
 
-  /* create a temporary hash to read data into, unpack, and merge */
-  kvtree* tmp_hash = kvtree_new();
-  kvtree_unpack(buf + size, tmp_hash);
-  kvtree_merge(hash, tmp_hash);
+  /* create a temporary hash to read data into, unpack, and move its
+   * contents into hash, it shares the arena of hash so that they can */
+  kvtree* tmp_hash = kvtree_new_child(hash);
+  if (kvtree_unpack(buf + size, tmp_hash) == 0) {
+    kvtree_err("Failed to unpack hash from %s @ %s:%d",
+      file, __FILE__, __LINE__
+    );
+    kvtree_delete(&tmp_hash);
+    kvtree_free(&buf);
+    return -1;
+  }
+  kvtree_merge_move(hash, tmp_hash);
   kvtree_delete(&tmp_hash);
 
   /* free the buffer holding the file contents */
@@ -1572,11 +4901,14 @@ int kvtree_write_with_lock(const char* file, kvtree* hash)
   int fd = kvtree_read_write_with_lock(file, hash, 1);
   if (fd >= 0) {
     /* write the file into the hash */
-    kvtree_write_fd(file, fd, hash);
+    ssize_t nwrite = kvtree_write_fd(file, fd, hash);
 
     /* close the file and release the lock */
     kvtree_close_with_unlock(file, fd);
 
+    if (nwrite < 0) {
+      return KVTREE_FAILURE;
+    }
     return KVTREE_SUCCESS;
   } else {
     kvtree_err("Failed to open file with lock %s @ %s:%d",
@@ -1693,6 +5025,10 @@ int kvtree_write_close_unlock(const char* file, int* fd, const kvtree* hash)
 
     /* mark the file descriptor as closed */
     *fd = -1;
+
+    if (nwrite < 0) {
+      return KVTREE_FAILURE;
+    }
   }
 
   return KVTREE_SUCCESS;
@@ -1720,7 +5056,8 @@ int kvtree_write_to_gather(const char* prefix, kvtree* data, int ranks)
 
   /* we hardcode this to be two levels deep */
 
-  /* sort so that elements are ordered by rank value */
+  /* sort so that elements are ordered by rank value, this returns at
+   * once if data already keeps KVTREE_ORDER_INT */
   kvtree_sort_int(data, KVTREE_SORT_ASCENDING);
 
   /* create hash for primary map and encode level */
@@ -1749,8 +5086,13 @@ int kvtree_write_to_gather(const char* prefix, kvtree* data, int ranks)
 
       /* copy hash of current rank under RANK/<rank> in entries */
       kvtree* elem_hash = kvtree_elem_hash(elem);
-      kvtree* rank_hash = kvtree_set_kv_int(entries, "RANK", rank);
-      kvtree_merge(rank_hash, elem_hash);
+      kvtree* rank_hash = kvtree_get_kv_int(entries, "RANK", rank);
+      if (rank_hash == NULL) {
+        kvtree_key keys[2] = { { "RANK", 0 }, { NULL, rank } };
+        kvtree_set_keys(entries, kvtree_clone(elem_hash), keys, 2);
+      } else {
+        kvtree_merge(rank_hash, elem_hash);
+      }
       count++;
 
       /* break early if we reach the end */
@@ -1897,9 +5239,11 @@ int kvtree_read_scatter_single(const char* prefix, kvtree* data)
           /* Break off and remove the "RANK" subtree from the rank2file tree */
           kvtree* subfile_rank_tree = kvtree_extract(subfile_tree, "RANK");
           if (subfile_rank_tree) {
-            if (kvtree_merge(final_tree, subfile_rank_tree) == KVTREE_SUCCESS) {
-              actual_ranks += kvtree_size(subfile_rank_tree);
+            int subfile_ranks = kvtree_size(subfile_rank_tree);
+            if (kvtree_merge_move(final_tree, subfile_rank_tree) == KVTREE_SUCCESS) {
+              actual_ranks += subfile_ranks;
             }
+            kvtree_delete(&subfile_rank_tree);
           }
         }
       }
@@ -1907,7 +5251,7 @@ int kvtree_read_scatter_single(const char* prefix, kvtree* data)
     }
   }
   closedir(d);
-  kvtree_merge(data, final_tree);
+  kvtree_merge_move(data, final_tree);
   rc = KVTREE_SUCCESS;
 
 end:
@@ -1926,86 +5270,67 @@ end:
 /** @name Print hash and elements to stdout for debugging */
 ///@{
 
-/** prints specified hash element to stdout for debugging */
-static int kvtree_elem_print(const kvtree_elem* elem, int indent, int mode)
+/** prints specified hash to stdout for debugging */
+int kvtree_print_mode(const kvtree* hash, int indent, int mode)
 {
-  char tmp[KVTREE_MAX_FILENAME];
-  int i;
-  for (i = 0; i < indent; i++) {
-    tmp[i] = ' ';
-  }
-  tmp[indent] = '\0';
-
-  if (mode == KVTREE_PRINT_TREE) {
-    if (elem != NULL) {
-      if (elem->key != NULL) {
-        printf("%s%s\n", tmp, elem->key);
-      } else {
-        printf("%sNULL KEY\n", tmp);
-      }
-      kvtree_print_mode(elem->hash, indent, mode);
-    } else {
-      printf("%sNULL ELEMENT\n", tmp);
-    }
-
+  if (hash == NULL) {
+    printf("%*sNULL LIST\n", indent, "");
     return KVTREE_SUCCESS;
   }
+  if (! kvtree_flat(hash)) {
+    return KVTREE_FAILURE;
+  }
 
-  if (mode == KVTREE_PRINT_KEYVAL) {
-    if (elem != NULL) {
-      if (elem->key != NULL) {
-        if (kvtree_size(elem->hash) == 1) {
-          /* hash for current element has one value, this may be a key/value pair */
-          kvtree_elem* elem2 = kvtree_elem_first(elem->hash);
-          if (elem2->hash == NULL || kvtree_size(elem2->hash) == 0) {
-            /* my hash has one value, and the hash for that one value
-             * is empty, so print this as a key/value pair */
-            printf("%s%s = %s\n", tmp, elem->key, elem2->key);
-          } else {
-            /* my hash has one value, but the hash for that one value is
-             * non-empty so we need to recurse into hash */
-            printf("%s%s\n", tmp, elem->key);
-            kvtree_print_mode(elem->hash, indent, mode);
-          }
-        } else {
-          /* hash for current element has 0 or more than one items,
-           * so we need to recurse into hash */
-          printf("%s%s\n", tmp, elem->key);
-          kvtree_print_mode(elem->hash, indent, mode);
-        }
-      } else {
-        printf("%sNULL KEY\n", tmp);
-        kvtree_print_mode(elem->hash, indent, mode);
+  /* each element is indented two more spaces than the hash holding it,
+   * its children and the size of a blob two more than that */
+  int elem_order = (mode & KVTREE_PRINT_SORTED) ? KVTREE_WALK_ORDER_STR : 1;
+  int rc = KVTREE_SUCCESS;
+  struct kvtree_walk walk;
+  kvtree_walk_init(&walk, hash, elem_order, KVTREE_WALK_PRE | KVTREE_WALK_POST);
+  int event;
+  kvtree_elem* elem;
+  while ((elem = kvtree_walk_next(&walk, &event)) != NULL) {
+    int elem_indent = indent + 2 * walk.stack.depth;
+    if (event == KVTREE_WALK_POST) {
+      if (elem->hash == NULL) {
+        printf("%*sNULL LIST\n", elem_indent, "");
+      } else if (KVTREE_HASH_TYPE(elem->hash) == KVTREE_TYPE_BYTES) {
+        printf("%*s  <%llu bytes>\n", elem_indent, "",
+          (unsigned long long) elem->hash->val.bytes->size
+        );
       }
-    } else {
-      printf("%sNULL ELEMENT\n", tmp);
+      continue;
     }
 
-    return KVTREE_SUCCESS;
-  }
+    if (elem->key == NULL) {
+      printf("%*sNULL KEY\n", elem_indent, "");
+      continue;
+    }
 
-  return KVTREE_SUCCESS;
-}
+    /* the children of a sharded hash can not be walked */
+    if (! kvtree_flat(elem->hash)) {
+      rc = KVTREE_FAILURE;
+      break;
+    }
 
-/** prints specified hash to stdout for debugging */
-int kvtree_print_mode(const kvtree* hash, int indent, int mode)
-{
-  char tmp[KVTREE_MAX_FILENAME];
-  int i;
-  for (i = 0; i < indent; i++) {
-    tmp[i] = ' ';
+    /* in key/value mode, a hash with one value whose own hash is
+     * empty is printed as a key/value pair */
+    if ((mode & KVTREE_PRINT_KEYVAL) && kvtree_has_one(elem->hash)) {
+      kvtree_elem* elem2 = kvtree_elem_first(elem->hash);
+      if (kvtree_is_empty(elem2->hash)) {
+        printf("%*s%s = %s\n", elem_indent, "", elem->key, elem2->key);
+        kvtree_walk_prune(&walk);
+        continue;
+      }
+    }
+    printf("%*s%s\n", elem_indent, "", elem->key);
   }
-  tmp[indent] = '\0';
+  kvtree_walk_free(&walk);
 
-  if (hash != NULL) {
-    kvtree_elem* elem;
-    LIST_FOREACH(elem, hash, pointers) {
-      kvtree_elem_print(elem, indent + 2, mode);
-    }
-  } else {
-    printf("%sNULL LIST\n", tmp);
+  if (rc == KVTREE_SUCCESS && KVTREE_HASH_TYPE(hash) == KVTREE_TYPE_BYTES) {
+    printf("%*s  <%llu bytes>\n", indent, "", (unsigned long long) hash->val.bytes->size);
   }
-  return KVTREE_SUCCESS;
+  return rc;
 }
 
 /** prints specified hash to stdout for debugging */
@@ -2015,24 +5340,24 @@ int kvtree_print(const kvtree* hash, int indent)
 }
 
 /** logs specified hash element to stdout for debugging */
-static int kvtree_elem_log(const kvtree_elem* elem, int log_level, int indent)
-{
-  char tmp[KVTREE_MAX_FILENAME];
-  int i;
-  for (i = 0; i < indent; i++) {
-    tmp[i] = ' ';
-  }
-  tmp[indent] = '\0';
+/* define the arguments kvtree_log passes to kvtree_elem_log */
+struct kvtree_log_arg {
+  int log_level;
+  int indent;
+};
 
-  if (elem != NULL) {
-    if (elem->key != NULL) {
-      kvtree_dbg(log_level, "%s%s\n", tmp, elem->key);
-    } else {
-      kvtree_dbg(log_level, "%sNULL KEY\n", tmp);
-    }
-    kvtree_log(elem->hash, log_level, indent);
+/** logs the key of an element visited by kvtree_log */
+static int kvtree_elem_log(kvtree_elem* elem, kvtree_visit* visit, void* arg)
+{
+  const struct kvtree_log_arg* log = (const struct kvtree_log_arg*) arg;
+  int indent = log->indent + 2 * (kvtree_visit_depth(visit) + 1);
+  if (elem->key != NULL) {
+    kvtree_dbg(log->log_level, "%*s%s\n", indent, "", elem->key);
   } else {
-    kvtree_dbg(log_level, "%sNULL ELEMENT\n", tmp);
+    kvtree_dbg(log->log_level, "%*sNULL KEY\n", indent, "");
+  }
+  if (elem->hash == NULL) {
+    kvtree_dbg(log->log_level, "%*sNULL LIST\n", indent, "");
   }
   return KVTREE_SUCCESS;
 }
@@ -2040,22 +5365,13 @@ static int kvtree_elem_log(const kvtree_elem* elem, int log_level, int indent)
 /** prints specified hash to stdout for debugging */
 int kvtree_log(const kvtree* hash, int log_level, int indent)
 {
-  char tmp[KVTREE_MAX_FILENAME];
-  int i;
-  for (i = 0; i < indent; i++) {
-    tmp[i] = ' ';
+  if (hash == NULL) {
+    kvtree_dbg(log_level, "%*sNULL LIST\n", indent, "");
+    return KVTREE_SUCCESS;
   }
-  tmp[indent] = '\0';
 
-  if (hash != NULL) {
-    kvtree_elem* elem;
-    LIST_FOREACH(elem, hash, pointers) {
-      kvtree_elem_log(elem, log_level, indent+2);
-    }
-  } else {
-    kvtree_dbg(log_level, "%sNULL LIST\n", tmp);
-  }
-  return KVTREE_SUCCESS;
+  struct kvtree_log_arg log = { log_level, indent };
+  return kvtree_walk(hash, kvtree_elem_log, NULL, &log);
 }
 ///@}
 
@@ -2089,17 +5405,14 @@ static int TV_ttf_display_type(const kvtree* hash)
 
     /* add a row to the TV debug window */
     if (h != NULL) {
-      /* compute the size of the hash for this key */
-      int size = kvtree_size(h);
-
-      if (size == 0) {
+      if (kvtree_is_empty(h)) {
         /* if the hash is empty, stop at the key */
         TV_ttf_add_row("value", TV_ttf_type_ascii_string, key);
-      } else if (size == 1) {
+      } else if (kvtree_has_one(h)) {
         /* my hash has one value, this may be a key/value pair */
         char* value = kvtree_elem_get_first_val(hash, key);
         kvtree* h2 = kvtree_get(h, value);
-        if (h2 == NULL || kvtree_size(h2) == 0) {
+        if (kvtree_is_empty(h2)) {
           /* my hash has one value, and the hash for that one value
            * is empty, so print this as a key/value pair */
           TV_ttf_add_row(key, TV_ttf_type_ascii_string, value);
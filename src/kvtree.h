@@ -1,39 +1,8 @@
-/* Several lines are reproduced from queue.h, under the following license */
-
-/*
- * Copyright (c) 1991, 1993
- *	The Regents of the University of California.  All rights reserved.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
- *
- *	@(#)queue.h	8.5 (Berkeley) 8/20/94
- */
 #ifndef KVTREE_H
 #define KVTREE_H
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 /* enable C++ codes to include this header directly */
@@ -68,6 +37,7 @@ extern "C" {
 
 #define KVTREE_PRINT_TREE   (1)
 #define KVTREE_PRINT_KEYVAL (2)
+#define KVTREE_PRINT_SORTED (4) /* or'd into a mode, prints keys in string order */
 
 /********************************************************/
 /** \name Sort directions for sorting keys in hash */
@@ -76,32 +46,93 @@ extern "C" {
 #define KVTREE_SORT_DESCENDING (1)
 ///@}
 
+/********************************************************/
+/** \name Orders a hash can keep its keys in, see kvtree_set_order */
+///@{
+#define KVTREE_ORDER_NONE (0) /* order keys were added, newest first */
+#define KVTREE_ORDER_STR  (1) /* keys compared as strings */
+#define KVTREE_ORDER_INT  (2) /* keys compared as ints, as kvtree_sort_int */
+///@}
+
 /********************************************************/
 /** \name Define hash and element structures */
 ///@{
 
 /** \struct define the structure for the head of a hash */
 struct kvtree_elem_struct;
+struct kvtree_index_struct;
+struct kvtree_children_struct;
+struct kvtree_arena_struct;
+struct kvtree_bytes_struct;
+struct kvtree_shards_struct;
+
+/** \union define storage for the value of a typed scalar leaf */
+union kvtree_value {
+  int64_t  i;
+  uint64_t u;
+  double   d;
+  struct kvtree_bytes_struct* bytes; /* length and data of a blob */
+  struct kvtree_shards_struct* shards; /* children of a sharded hash */
+};
 
-// the following 3 lines reproduced from queue.h
 struct kvtree_struct{
-  struct kvtree_elem_struct *lh_first;
+  union {
+    struct kvtree_elem_struct *one;         /* the only child, if any */
+    struct kvtree_children_struct *array;   /* children, once there were two */
+  } kids;                            /* see KVTREE_FLAG_CHILD_ARRAY */
+  int count;                         /* number of elements in hash */
+  int flags;                         /* internal bookkeeping flags */
+  int shares;                        /* owners beyond the first, see kvtree_share */
+  struct kvtree_index_struct *index; /* key index, built once hash grows large */
+  struct kvtree_arena_struct *arena; /* arena to allocate from, NULL for heap */
+  union kvtree_value val;            /* native value if hash is a typed leaf */
 };
 
-/** \struct define the structure for an element of a hash */
+/** \struct define the structure for an element of a hash,
+ * unless the key is shared, it is stored right after the structure */
 struct kvtree_elem_struct {
   char* key;
   struct kvtree_struct* hash;
-  // the following 4 lines reproduced from queue.h
-  struct{
-    struct kvtree_elem_struct *le_next; /* next element */
-    struct kvtree_elem_struct **le_prev; /* address of previos next element */
-  } pointers;
+  int flags;           /* internal bookkeeping flags */
+  unsigned int keylen; /* length of key, not counting terminating NUL */
+  int64_t ikey;        /* value of key if it is an integer, see flags */
+  struct kvtree_struct* parent; /* hash holding this element, NULL once removed */
+  int pos;             /* slot of this element among children of parent */
 };
 
 /** \typedef kvtree */
 typedef struct kvtree_struct      kvtree;
 typedef struct kvtree_elem_struct kvtree_elem;
+
+/** \typedef kvtree_path
+ * a format string for kvtree_getf/kvtree_setf compiled by
+ * kvtree_path_new, so it need not be parsed again on each call */
+typedef struct kvtree_path_struct kvtree_path;
+
+/** \struct describes one key of a path for kvtree_get_keys and
+ * friends, the key is the string str, or the integer ival if str is
+ * NULL, which is found without formatting it as a string */
+typedef struct kvtree_key_struct {
+  const char* str;
+  int64_t ival;
+} kvtree_key;
+
+/** \typedef kvtree_elem_fn
+ * called on each element visited by kvtree_range_int and
+ * kvtree_prefix with the arg given to them, return KVTREE_SUCCESS to
+ * go on, any other value stops the visit and is returned to the caller */
+typedef int (*kvtree_elem_fn)(kvtree_elem* elem, void* arg);
+
+/** \typedef kvtree_visit
+ * describes where kvtree_walk is in the tree, it is only valid
+ * during the callback it is passed to */
+typedef struct kvtree_visit_struct kvtree_visit;
+
+/** \typedef kvtree_visit_fn
+ * called on each element visited by kvtree_walk with the arg given
+ * to it, return KVTREE_SUCCESS to go on, any other value stops the
+ * walk and is returned to the caller */
+typedef int (*kvtree_visit_fn)(kvtree_elem* elem, kvtree_visit* visit, void* arg);
 ///@}
 
 /********************************************************/
@@ -111,8 +142,37 @@ typedef struct kvtree_elem_struct kvtree_elem;
 /** allocates a new hash */
 kvtree* kvtree_new(void);
 
+/** allocates a new hash whose elements, keys, and child hashes are
+ * allocated from slabs owned by the hash, deleting it releases all of
+ * that memory at once */
+kvtree* kvtree_new_arena(void);
+
+/** number of shards used if kvtree_new_sharded is given 0 */
+#define KVTREE_SHARDS (64)
+
+/** allocates a new hash whose keys are spread by their hash value
+ * over shards, rounded up to a power of two, each with its own lock,
+ * so that threads setting, getting, and unsetting different keys with
+ * kvtree_set, kvtree_get, kvtree_unset, and the functions built on
+ * them seldom wait for one another, kvtree_elem_first and
+ * kvtree_elem_next visit the keys of every shard without taking a
+ * lock, functions that work on the hash as a whole, such as
+ * kvtree_merge, kvtree_sort, and kvtree_pack, need kvtree_flatten first */
+kvtree* kvtree_new_sharded(int shards);
+
+/** turns each hash made by kvtree_new_sharded in the tree below hash,
+ * hash included, into an ordinary hash holding the same keys, no other
+ * thread may be using the tree */
+int kvtree_flatten(kvtree* hash);
+
 /** frees a hash */
 int kvtree_delete(kvtree** ptr_hash);
+
+/** enable (1) or disable (0) sharing of identical keys through a
+ * reference-counted pool for elements created from then on,
+ * returns the previous setting, the pool is guarded by a mutex but
+ * the setting itself should be changed before threads start */
+int kvtree_intern_keys(int enable);
 ///@}
 
 /********************************************************/
@@ -122,6 +182,16 @@ int kvtree_delete(kvtree** ptr_hash);
 /** return size of hash (number of keys) */
 int kvtree_size(const kvtree* hash);
 
+/** return 1 if hash has no keys (or is NULL), 0 otherwise */
+int kvtree_is_empty(const kvtree* hash);
+
+/** return 1 if hash has exactly one key, 0 otherwise */
+int kvtree_has_one(const kvtree* hash);
+
+/** makes room for hash to hold n keys without growing its child
+ * array again, for callers about to add many keys at once */
+int kvtree_reserve(kvtree* hash, int n);
+
 /** given a hash and a key, return the hash associated with key, returns NULL if not found */
 kvtree* kvtree_get(const kvtree* hash, const char* key);
 
@@ -140,6 +210,41 @@ int kvtree_unset_all(kvtree* hash);
 /** merges (copies) elements from hash2 into hash1 */
 int kvtree_merge(kvtree* hash1, const kvtree* hash2);
 
+/** merges elements from hash2 into hash1 like kvtree_merge, but moves
+ * rather than copies the elements and subtrees of hash2 whose keys are
+ * not in hash1, leaves hash2 empty */
+int kvtree_merge_move(kvtree* hash1, kvtree* hash2);
+
+/** returns a new hash holding a copy of hash, with keys in the same
+ * order, an empty hash if hash is NULL, caller must delete it */
+kvtree* kvtree_clone(const kvtree* hash);
+
+/** same as kvtree_clone, but the copy is allocated from an arena it
+ * owns, sized up front to hold the whole copy */
+kvtree* kvtree_clone_arena(const kvtree* hash);
+
+/** returns hash itself in O(1) with one more owner, each owner must
+ * delete it, a shared hash is read-only, a hash from an arena is
+ * copied with kvtree_clone instead */
+kvtree* kvtree_share(const kvtree* hash);
+
+/** returns a new hash holding the keys of hash whose children are
+ * shared with hash rather than copied, so it costs one element per
+ * key of hash, an empty hash if hash is NULL, caller must delete it */
+kvtree* kvtree_snapshot(const kvtree* hash);
+
+/** returns the hash for key in hash ready to be changed, replacing a
+ * shared hash with a snapshot of it first, returns NULL if key is not
+ * set or if hash itself is shared */
+kvtree* kvtree_unshare(kvtree* hash, const char* key);
+
+/** returns a read-only copy of hash, laid out in one block with the
+ * keys of each hash sorted for binary search and stored inline, which
+ * keeps its packed form so that it is sent or written without packing
+ * it again, an empty frozen hash if hash is NULL, caller must delete it,
+ * returns NULL if the tree holds a sharded hash */
+kvtree* kvtree_freeze(const kvtree* hash);
+
 /** traverse the given hash using a printf-like format string setting an arbitrary list of keys
  * to set (or reset) the hash associated with the last key */
 kvtree* kvtree_setf(kvtree* hash, kvtree* hash_value, const char* format, ...);
@@ -147,14 +252,109 @@ kvtree* kvtree_setf(kvtree* hash, kvtree* hash_value, const char* format, ...);
 /** same as above, but simply returns the hash associated with the list of keys */
 kvtree* kvtree_getf(const kvtree* hash, const char* format, ...);
 
+/** same as kvtree_setf, but with the keys given as a va_list */
+kvtree* kvtree_vsetf(kvtree* hash, kvtree* hash_value, const char* format, va_list args);
+
+/** same as kvtree_getf, but with the keys given as a va_list */
+kvtree* kvtree_vgetf(const kvtree* hash, const char* format, va_list args);
+
+/** compiles a format string as taken by kvtree_getf and kvtree_setf,
+ * tokens are separated by spaces and are either a conversion such as
+ * %s or %d or a literal key, returns NULL if format has an unsupported
+ * conversion */
+kvtree_path* kvtree_path_new(const char* format);
+
+/** frees a compiled path, sets caller's pointer to NULL */
+void kvtree_path_delete(kvtree_path** ptr_path);
+
+/** same as kvtree_setf, but with a path compiled by kvtree_path_new,
+ * this allocates nothing beyond the hashes it adds */
+kvtree* kvtree_setp(kvtree* hash, kvtree* hash_value, const kvtree_path* path, ...);
+
+/** same as kvtree_getf, but with a path compiled by kvtree_path_new,
+ * this allocates nothing and formats integer and string keys without
+ * snprintf */
+kvtree* kvtree_getp(const kvtree* hash, const kvtree_path* path, ...);
+
+/** returns the hash found by following the n keys in keys from hash,
+ * returns NULL if any of them is not set */
+kvtree* kvtree_get_path(const kvtree* hash, const char* const keys[], int n);
+
+/** follows the n keys in keys from hash, adding any that are missing,
+ * and sets (or resets) the last one to hash_value, returns the hash of
+ * the last key */
+kvtree* kvtree_set_path(kvtree* hash, kvtree* hash_value, const char* const keys[], int n);
+
+/** deletes the last of the n keys in keys found by following them
+ * from hash, succeeds if the path is not set */
+int kvtree_unset_path(kvtree* hash, const char* const keys[], int n);
+
+/** same as kvtree_get_path, but with a mix of string and integer keys */
+kvtree* kvtree_get_keys(const kvtree* hash, const kvtree_key keys[], int n);
+
+/** same as kvtree_set_path, but with a mix of string and integer keys */
+kvtree* kvtree_set_keys(kvtree* hash, kvtree* hash_value, const kvtree_key keys[], int n);
+
+/** same as kvtree_unset_path, but with a mix of string and integer keys */
+int kvtree_unset_keys(kvtree* hash, const kvtree_key keys[], int n);
+
 /** sort the hash assuming the keys are strings */
 int kvtree_sort(kvtree* hash, int direction);
 
 /** sort the hash assuming the keys are ints */
 int kvtree_sort_int(kvtree* hash, int direction);
 
+/** keeps the keys of hash sorted in the given order and direction
+ * from now on, new keys are inserted in place and lookups use binary
+ * search, kvtree_sort and kvtree_sort_int return at once for a hash
+ * that already keeps their order, pass KVTREE_ORDER_NONE to return to
+ * insertion order */
+int kvtree_set_order(kvtree* hash, int order, int direction);
+
+/** returns the order kept by hash, KVTREE_ORDER_NONE if none */
+int kvtree_get_order(const kvtree* hash);
+
 /** return list of keys in hash as integers, caller must free list */
 int kvtree_list_int(const kvtree* hash, int* num, int** list);
+
+/** returns the children of hash sorted as by kvtree_sort or
+ * kvtree_sort_int, for KVTREE_ORDER_STR or KVTREE_ORDER_INT, in the
+ * given direction, without changing the order of hash, and sets count
+ * to their number, the list belongs to hash, which keeps it for the
+ * next call until its children change, so it is only sorted again
+ * after keys are added or removed, the list is valid until then */
+kvtree_elem* const* kvtree_sorted_view(const kvtree* hash, int order, int direction, int* count);
+
+/** calls fn on each element of hash whose key is an integer from lo
+ * to hi inclusive, in increasing order, without sorting hash, fn must
+ * not add or remove elements of hash */
+int kvtree_range_int(const kvtree* hash, int lo, int hi, kvtree_elem_fn fn, void* arg);
+
+/** calls fn on each element of hash whose key starts with prefix, in
+ * string order, without sorting hash, fn must not add or remove
+ * elements of hash */
+int kvtree_prefix(const kvtree* hash, const char* prefix, kvtree_elem_fn fn, void* arg);
+
+/** visits every element in the tree below hash depth first, calling
+ * pre on an element before its children and post after them, either
+ * may be NULL, the children of each hash are visited in the order of
+ * kvtree_elem_next, the walk does not recurse, so the tree may be of
+ * any depth, pre and post must not add or remove elements of the tree,
+ * returns an error on reaching a sharded hash, see kvtree_flatten */
+int kvtree_walk(const kvtree* hash, kvtree_visit_fn pre, kvtree_visit_fn post, void* arg);
+
+/** returns the depth of the element being visited, 0 for a child of
+ * the hash given to kvtree_walk */
+int kvtree_visit_depth(const kvtree_visit* visit);
+
+/** returns the element at the given depth on the path from the hash
+ * given to kvtree_walk down to the element being visited, which is
+ * the element itself at its own depth, NULL if depth is out of range */
+kvtree_elem* kvtree_visit_elem(const kvtree_visit* visit, int depth);
+
+/** called from pre, skips the children of the element being visited,
+ * post is still called on it */
+void kvtree_visit_prune(kvtree_visit* visit);
 ///@}
 
 /********************************************************/
@@ -180,6 +380,65 @@ int kvtree_unset_kv(kvtree* hash, const char* key, const char* val);
 int kvtree_unset_kv_int(kvtree* hash, const char* key, int val);
 ///@}
 
+/********************************************************/
+/** \name Typed scalar values
+ * A typed value is stored like any other value, as a hash under key
+ * holding a single subkey with the value formatted as a string, so
+ * kvtree_get_val and friends keep working.  The hash also remembers the
+ * native value, so getting it back needs no parsing.  Adding or
+ * removing a subkey of that hash turns it back into a plain hash.
+ *
+ * A blob of bytes has no string form, its hash holds no subkeys and
+ * only the blob itself. */
+///@{
+#define KVTREE_TYPE_NONE   (0) /**< not a typed value */
+#define KVTREE_TYPE_INT64  (1) /**< signed integer, formatted in decimal */
+#define KVTREE_TYPE_UINT64 (2) /**< unsigned integer, formatted in decimal or hex */
+#define KVTREE_TYPE_DOUBLE (3) /**< floating point, formatted with %f */
+#define KVTREE_TYPE_STRING (4) /**< string, the subkey itself */
+#define KVTREE_TYPE_BYTES  (5) /**< blob of bytes, no subkey */
+
+/** set key to a typed signed integer value, returns hash for key */
+kvtree* kvtree_set_int64(kvtree* hash, const char* key, int64_t val);
+
+/** set key to a typed unsigned integer value, returns hash for key */
+kvtree* kvtree_set_uint64(kvtree* hash, const char* key, uint64_t val);
+
+/** same as kvtree_set_uint64, but formats the value in hex as "0x..." */
+kvtree* kvtree_set_uint64_hex(kvtree* hash, const char* key, uint64_t val);
+
+/** set key to a typed floating point value, returns hash for key */
+kvtree* kvtree_set_double(kvtree* hash, const char* key, double val);
+
+/** set key to a typed string value, returns hash for key */
+kvtree* kvtree_set_str(kvtree* hash, const char* key, const char* val);
+
+/** set key to a copy of size bytes starting at buf, returns hash for
+ * key */
+kvtree* kvtree_set_bytes(kvtree* hash, const char* key, const void* buf, size_t size);
+
+/** return the type of the value stored under key, KVTREE_TYPE_NONE if
+ * key is not set or does not hold a typed value */
+int kvtree_get_type(const kvtree* hash, const char* key);
+
+/** get value of key as a signed integer, if the value is not typed,
+ * parses it from its string form, returns KVTREE_SUCCESS if found */
+int kvtree_get_int64(const kvtree* hash, const char* key, int64_t* val);
+
+/** get value of key as an unsigned integer, if the value is not typed,
+ * parses it from its string form, returns KVTREE_SUCCESS if found */
+int kvtree_get_uint64(const kvtree* hash, const char* key, uint64_t* val);
+
+/** get value of key as floating point, if the value is not typed,
+ * parses it from its string form, returns KVTREE_SUCCESS if found */
+int kvtree_get_double(const kvtree* hash, const char* key, double* val);
+
+/** get blob stored under key, sets buf to point to the data held in
+ * the hash, which is valid until key is changed or the hash is deleted,
+ * returns KVTREE_SUCCESS if key holds a blob */
+int kvtree_get_bytes(const kvtree* hash, const char* key, const void** buf, size_t* size);
+///@}
+
 /********************************************************/
 /** \name Hash element functions */
 ///@{
@@ -221,13 +480,16 @@ char* kvtree_get_val(const kvtree* hash, const char* key);
 /** \name Pack and unpack hash and elements into a char buffer */
 ///@{
 
-/** computes the number of bytes needed to pack the given hash */
+/** computes the number of bytes needed to pack the given hash,
+ * returns 0 if the tree holds a sharded hash, see kvtree_flatten */
 size_t kvtree_pack_size(const kvtree* hash);
 
-/** packs the given hash into specified buf and returns the number of bytes written */
+/** packs the given hash into specified buf and returns the number of bytes written,
+ * returns 0 if the tree holds a sharded hash */
 size_t kvtree_pack(char* buf, const kvtree* hash);
 
-/** unpacks hash from specified buffer into given hash object and returns the number of bytes read */
+/** unpacks hash from specified buffer into given hash object and returns the number of bytes read,
+ * returns 0 if the buffer holds a value of an unknown type */
 size_t kvtree_unpack(const char* buf, kvtree* hash);
 ///@}
 
@@ -287,10 +549,14 @@ int kvtree_read_scatter_single(const char* prefix, kvtree* data);
 /** prints specified hash to stdout for debugging */
 int kvtree_print(const kvtree* hash, int indent);
 
-/** prints specified hash to stdout for debugging */
+/** prints specified hash to stdout for debugging, mode is
+ * KVTREE_PRINT_TREE or KVTREE_PRINT_KEYVAL, with KVTREE_PRINT_SORTED
+ * or'd in to print the keys of each hash in string order, returns an
+ * error on reaching a sharded hash */
 int kvtree_print_mode(const kvtree* hash, int indent, int mode);
 
-/** logs specified hash for debugging */
+/** logs specified hash for debugging, returns an error on reaching a
+ * sharded hash */
 int kvtree_log(const kvtree* hash, int log_level, int indent);
 ///@}
 
@@ -0,0 +1,146 @@
+/* Implements a simple bump allocator over a list of slabs.  Slabs
+ * start small and double in size up to a limit, so small trees do not
+ * pay for a large slab while large trees need few of them. */
+
+#include "kvtree_arena.h"
+#include "kvtree_helpers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** size of the first slab in an arena */
+#define KVTREE_ARENA_MIN_SLAB (16 * 1024)
+
+/** largest size we grow slabs to */
+#define KVTREE_ARENA_MAX_SLAB (1024 * 1024)
+
+/** all allocations are rounded up to a multiple of this */
+#define KVTREE_ARENA_ALIGN (16)
+
+/** define the header at the start of each slab */
+struct kvtree_arena_slab {
+  struct kvtree_arena_slab* next; /* next (older) slab */
+  size_t size; /* number of bytes in data */
+  size_t used; /* number of bytes handed out from data */
+};
+
+/** size of slab header, rounded up so data starts aligned */
+#define KVTREE_ARENA_HEADER \
+  ((sizeof(struct kvtree_arena_slab) + KVTREE_ARENA_ALIGN - 1) & ~((size_t) KVTREE_ARENA_ALIGN - 1))
+
+/** allocates a new, empty arena */
+struct kvtree_arena_struct* kvtree_arena_new(void)
+{
+  struct kvtree_arena_struct* arena = (struct kvtree_arena_struct*) KVTREE_MALLOC(sizeof(struct kvtree_arena_struct));
+  arena->slabs     = NULL;
+  arena->slab_size = KVTREE_ARENA_MIN_SLAB;
+  arena->foreign   = 0;
+  arena->image       = NULL;
+  arena->image_size  = 0;
+  arena->image_typed = 0;
+  return arena;
+}
+
+/** frees all memory held by the arena, sets caller's pointer to NULL */
+void kvtree_arena_delete(struct kvtree_arena_struct** ptr_arena)
+{
+  if (ptr_arena != NULL && *ptr_arena != NULL) {
+    struct kvtree_arena_slab* slab = (*ptr_arena)->slabs;
+    while (slab != NULL) {
+      struct kvtree_arena_slab* next = slab->next;
+      kvtree_free(&slab);
+      slab = next;
+    }
+    kvtree_free(ptr_arena);
+  }
+}
+
+/** returns the number of bytes of a slab taken by an allocation */
+size_t kvtree_arena_rounded(size_t size)
+{
+  /* round request up to keep everything aligned, a key string
+   * could use less, but keeping one rule is simpler */
+  return (size + KVTREE_ARENA_ALIGN - 1) & ~((size_t) KVTREE_ARENA_ALIGN - 1);
+}
+
+/** makes sure the next size bytes of allocations come from one slab */
+void kvtree_arena_reserve(struct kvtree_arena_struct* arena, size_t size)
+{
+  /* nothing to do if the current slab has room */
+  struct kvtree_arena_slab* slab = arena->slabs;
+  if (slab != NULL && slab->used + size <= slab->size) {
+    return;
+  }
+
+  /* otherwise start a slab of exactly that size, the current slab
+   * stays in the list and is freed with the arena */
+  slab = (struct kvtree_arena_slab*) KVTREE_MALLOC(KVTREE_ARENA_HEADER + size);
+  slab->size = size;
+  slab->used = 0;
+  slab->next = arena->slabs;
+  arena->slabs = slab;
+}
+
+/** allocates size bytes from the arena */
+void* kvtree_arena_alloc(struct kvtree_arena_struct* arena, size_t size)
+{
+  size = kvtree_arena_rounded(size);
+
+  /* allocate a new slab if the current one is full */
+  struct kvtree_arena_slab* slab = arena->slabs;
+  if (slab == NULL || slab->used + size > slab->size) {
+    /* requests that are large compared to a slab get a slab of their
+     * own, which we link in behind the current slab so that the space
+     * left in the current slab is not lost */
+    if (size > arena->slab_size / 4) {
+      struct kvtree_arena_slab* big = (struct kvtree_arena_slab*) KVTREE_MALLOC(KVTREE_ARENA_HEADER + size);
+      big->size = size;
+      big->used = size;
+      if (slab != NULL) {
+        big->next  = slab->next;
+        slab->next = big;
+      } else {
+        big->next     = NULL;
+        arena->slabs  = big;
+      }
+      return (char*) big + KVTREE_ARENA_HEADER;
+    }
+
+    slab = (struct kvtree_arena_slab*) KVTREE_MALLOC(KVTREE_ARENA_HEADER + arena->slab_size);
+    slab->size = arena->slab_size;
+    slab->used = 0;
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+
+    /* double the size of the next slab */
+    if (arena->slab_size < KVTREE_ARENA_MAX_SLAB) {
+      arena->slab_size *= 2;
+    }
+  }
+
+  void* ptr = (char*) slab + KVTREE_ARENA_HEADER + slab->used;
+  slab->used += size;
+  return ptr;
+}
+
+/** allocates size bytes from arena if arena is not NULL,
+ * otherwise from the heap with kvtree_malloc */
+void* kvtree_arena_malloc(struct kvtree_arena_struct* arena, size_t size)
+{
+  if (arena != NULL) {
+    return kvtree_arena_alloc(arena, size);
+  }
+  return KVTREE_MALLOC(size);
+}
+
+/** frees memory allocated with kvtree_arena_malloc, which is a no-op
+ * for arena memory, sets caller's pointer to NULL */
+void kvtree_arena_free(struct kvtree_arena_struct* arena, void* ptr)
+{
+  if (arena == NULL) {
+    kvtree_free(ptr);
+  } else if (ptr != NULL) {
+    /* memory is released when the arena is deleted */
+    *(void**)ptr = NULL;
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef KVTREE_ARENA_H
+#define KVTREE_ARENA_H
+
+#include <stddef.h>
+
+/** \file kvtree_arena.h
+ *  \ingroup kvtree
+ *  \brief Slab allocator backing kvtrees created with kvtree_new_arena.
+ *  Memory is handed out from large slabs and is only returned when the
+ *  whole arena is deleted.
+ */
+
+/** set in flags of a hash whose own memory comes from an arena */
+#define KVTREE_FLAG_ARENA_NODE  (0x1)
+
+/** set in flags of the hash that owns the arena, deleting it frees
+ * the arena */
+#define KVTREE_FLAG_ARENA_OWNER (0x2)
+
+struct kvtree_arena_slab;
+
+/** define the structure for an arena */
+struct kvtree_arena_struct {
+  struct kvtree_arena_slab* slabs; /* list of slabs, current slab first */
+  size_t slab_size; /* size of next slab to allocate */
+  int foreign;      /* number of times a hash not allocated from this
+                     * arena was attached to a hash in the arena */
+  const char* image; /* packed form of a tree made by kvtree_freeze,
+                      * NULL unless the tree is frozen */
+  size_t image_size; /* number of bytes in image */
+  int image_typed;   /* whether image uses the typed encoding */
+};
+
+/** allocates a new, empty arena */
+struct kvtree_arena_struct* kvtree_arena_new(void);
+
+/** frees all memory held by the arena, sets caller's pointer to NULL */
+void kvtree_arena_delete(struct kvtree_arena_struct** ptr_arena);
+
+/** allocates size bytes from the arena, calls kvtree_abort if
+ * allocation fails */
+void* kvtree_arena_alloc(struct kvtree_arena_struct* arena, size_t size);
+
+/** returns the number of bytes of a slab taken by an allocation of
+ * size bytes, which includes padding for alignment */
+size_t kvtree_arena_rounded(size_t size);
+
+/** makes sure that the next size bytes of allocations, counted with
+ * kvtree_arena_rounded, come from a single slab */
+void kvtree_arena_reserve(struct kvtree_arena_struct* arena, size_t size);
+
+/** allocates size bytes from arena if arena is not NULL,
+ * otherwise from the heap with kvtree_malloc */
+void* kvtree_arena_malloc(struct kvtree_arena_struct* arena, size_t size);
+
+/** frees memory allocated with kvtree_arena_malloc given the address
+ * of the pointer, which is a no-op for arena memory,
+ * sets caller's pointer to NULL */
+void kvtree_arena_free(struct kvtree_arena_struct* arena, void* ptr);
+
+#endif
@@ -0,0 +1,753 @@
+/* Implements a kvtree handle that several threads may use at once.
+ *
+ * Each top level key hashes to one of a power-of-two number of stripes,
+ * each holding a reader-writer lock.  The top level of the tree itself
+ * is only changed while every stripe is write locked, so holding any
+ * one stripe is enough to look up a top level key, and holding the
+ * stripe of a key is enough to read or change the hash under it.
+ * Stripes are locked in index order, so taking all of them can not
+ * deadlock with another thread doing the same. */
+
+#include "kvtree.h"
+#include "kvtree_util.h"
+#include "kvtree_concurrent.h"
+#include "kvtree_helpers.h"
+#include "kvtree_index.h"
+#include "kvtree_io.h"
+#include "kvtree_err.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+/** each lock is padded so that no two locks share a cache line,
+ * even when the array is not aligned to one */
+union kvtree_concurrent_stripe {
+  pthread_rwlock_t lock;
+  char pad[128];
+};
+
+/** define the structure for a concurrent handle */
+struct kvtree_concurrent_struct {
+  kvtree* hash;  /* tree held by the handle */
+  uint32_t mask; /* number of stripes minus one */
+  union kvtree_concurrent_stripe* stripes;
+};
+
+/** returns the stripe guarding the given top level key */
+static pthread_rwlock_t* kvtree_concurrent_lock(const kvtree_concurrent* tree, const char* key)
+{
+  return &tree->stripes[kvtree_key_hash(key) & tree->mask].lock;
+}
+
+/** takes every stripe in index order, for writing if write is set */
+static void kvtree_concurrent_lock_all(const kvtree_concurrent* tree, int write)
+{
+  uint32_t i;
+  for (i = 0; i <= tree->mask; i++) {
+    if (write) {
+      pthread_rwlock_wrlock(&tree->stripes[i].lock);
+    } else {
+      pthread_rwlock_rdlock(&tree->stripes[i].lock);
+    }
+  }
+}
+
+/** releases every stripe */
+static void kvtree_concurrent_unlock_all(const kvtree_concurrent* tree)
+{
+  uint32_t i;
+  for (i = 0; i <= tree->mask; i++) {
+    pthread_rwlock_unlock(&tree->stripes[i].lock);
+  }
+}
+
+kvtree_concurrent* kvtree_concurrent_new(kvtree* hash, int stripes)
+{
+  if (hash != NULL && hash->arena != NULL) {
+    kvtree_err("Can not share a hash allocated from an arena between threads @ %s:%d",
+      __FILE__, __LINE__
+    );
+    return NULL;
+  }
+
+  if (stripes <= 0) {
+    stripes = KVTREE_CONCURRENT_STRIPES;
+  }
+  uint32_t count = 1;
+  while (count < (uint32_t) stripes) {
+    count <<= 1;
+  }
+
+  kvtree_concurrent* tree = (kvtree_concurrent*) KVTREE_MALLOC(sizeof(kvtree_concurrent));
+  tree->hash    = (hash != NULL) ? hash : kvtree_new();
+  tree->mask    = count - 1;
+  tree->stripes = (union kvtree_concurrent_stripe*) KVTREE_MALLOC(count * sizeof(union kvtree_concurrent_stripe));
+
+  uint32_t i;
+  for (i = 0; i < count; i++) {
+    pthread_rwlock_init(&tree->stripes[i].lock, NULL);
+  }
+
+  return tree;
+}
+
+kvtree* kvtree_concurrent_release(kvtree_concurrent** ptr_tree)
+{
+  if (ptr_tree == NULL || *ptr_tree == NULL) {
+    return NULL;
+  }
+
+  kvtree_concurrent* tree = *ptr_tree;
+  kvtree* hash = tree->hash;
+
+  uint32_t i;
+  for (i = 0; i <= tree->mask; i++) {
+    pthread_rwlock_destroy(&tree->stripes[i].lock);
+  }
+  kvtree_free(&tree->stripes);
+  kvtree_free(ptr_tree);
+
+  return hash;
+}
+
+int kvtree_concurrent_delete(kvtree_concurrent** ptr_tree)
+{
+  kvtree* hash = kvtree_concurrent_release(ptr_tree);
+  return kvtree_delete(&hash);
+}
+
+int kvtree_concurrent_read(kvtree_concurrent* tree, const char* key, kvtree_concurrent_fn fn, void* arg)
+{
+  if (tree == NULL || fn == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  int rc;
+  if (key == NULL) {
+    kvtree_concurrent_lock_all(tree, 0);
+    rc = fn(tree->hash, arg);
+    kvtree_concurrent_unlock_all(tree);
+    return rc;
+  }
+
+  pthread_rwlock_t* lock = kvtree_concurrent_lock(tree, key);
+  pthread_rwlock_rdlock(lock);
+  rc = fn(kvtree_get(tree->hash, key), arg);
+  pthread_rwlock_unlock(lock);
+  return rc;
+}
+
+int kvtree_concurrent_write(kvtree_concurrent* tree, const char* key, kvtree_concurrent_fn fn, void* arg)
+{
+  if (tree == NULL || fn == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  int rc = KVTREE_FAILURE;
+  if (key == NULL) {
+    kvtree_concurrent_lock_all(tree, 1);
+    rc = fn(tree->hash, arg);
+    kvtree_concurrent_unlock_all(tree);
+    return rc;
+  }
+
+  /* the common case changes a key that is already set, which only
+   * needs the lock of its stripe */
+  pthread_rwlock_t* lock = kvtree_concurrent_lock(tree, key);
+  pthread_rwlock_wrlock(lock);
+  kvtree* hash = kvtree_get(tree->hash, key);
+  int called = (hash != NULL);
+  int done = 0;
+  if (called) {
+    rc = fn(hash, arg);
+    done = ! kvtree_is_empty(hash);
+  }
+  pthread_rwlock_unlock(lock);
+  if (done) {
+    return rc;
+  }
+
+  /* adding or removing the key changes the top level, which readers
+   * of every stripe look at, another thread may have added or filled
+   * the key while we held no lock, so look it up again */
+  kvtree_concurrent_lock_all(tree, 1);
+  hash = kvtree_get(tree->hash, key);
+  if (! called) {
+    if (hash == NULL) {
+      hash = kvtree_set(tree->hash, key, kvtree_new());
+    }
+    if (hash != NULL) {
+      rc = fn(hash, arg);
+    }
+  }
+  if (hash != NULL && kvtree_is_empty(hash)) {
+    kvtree_unset(tree->hash, key);
+  }
+  kvtree_concurrent_unlock_all(tree);
+
+  return rc;
+}
+
+/* define the arguments of the callbacks used to get and set hashes */
+struct kvtree_concurrent_arg {
+  const char* key;   /* key under the hash the callback is given */
+  kvtree* hash;      /* copy that was found, or value to set */
+  const char* val;   /* subkey to set or unset */
+};
+
+/** copies hash, or the hash of arg->key under it if that is set */
+static int kvtree_concurrent_clone_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_arg* a = (struct kvtree_concurrent_arg*) arg;
+  if (a->key != NULL) {
+    hash = kvtree_get(hash, a->key);
+  }
+  if (hash == NULL) {
+    return KVTREE_FAILURE;
+  }
+  a->hash = kvtree_clone(hash);
+  return KVTREE_SUCCESS;
+}
+
+kvtree* kvtree_concurrent_get(kvtree_concurrent* tree, const char* key)
+{
+  if (key == NULL) {
+    return NULL;
+  }
+
+  struct kvtree_concurrent_arg a = { NULL, NULL, NULL };
+  kvtree_concurrent_read(tree, key, kvtree_concurrent_clone_fn, &a);
+  return a.hash;
+}
+
+kvtree* kvtree_concurrent_get_kv(kvtree_concurrent* tree, const char* key, const char* val)
+{
+  if (key == NULL || val == NULL) {
+    return NULL;
+  }
+
+  struct kvtree_concurrent_arg a = { val, NULL, NULL };
+  kvtree_concurrent_read(tree, key, kvtree_concurrent_clone_fn, &a);
+  return a.hash;
+}
+
+kvtree* kvtree_concurrent_getf(kvtree_concurrent* tree, const char* format, ...)
+{
+  if (tree == NULL || format == NULL) {
+    return NULL;
+  }
+
+  /* the first key of the path picks the stripe, a path with no keys
+   * names the whole tree */
+  va_list args;
+  va_start(args, format);
+  char buf[KVTREE_MAX_LINE];
+  int last;
+  const char* first = kvtree_path_first_key(format, args, buf, sizeof(buf), &last);
+
+  kvtree* copy = NULL;
+  if (first == NULL) {
+    kvtree_concurrent_lock_all(tree, 0);
+    copy = kvtree_clone(tree->hash);
+    kvtree_concurrent_unlock_all(tree);
+  } else {
+    pthread_rwlock_t* lock = kvtree_concurrent_lock(tree, first);
+    pthread_rwlock_rdlock(lock);
+    kvtree* hash = kvtree_vgetf(tree->hash, format, args);
+    if (hash != NULL) {
+      copy = kvtree_clone(hash);
+    }
+    pthread_rwlock_unlock(lock);
+  }
+  va_end(args);
+
+  return copy;
+}
+
+int kvtree_concurrent_set(kvtree_concurrent* tree, const char* key, kvtree* hash_value)
+{
+  if (tree == NULL || key == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  /* setting a top level key replaces its element, which changes the
+   * top level */
+  kvtree_concurrent_lock_all(tree, 1);
+  kvtree* hash = kvtree_set(tree->hash, key, hash_value);
+  kvtree_concurrent_unlock_all(tree);
+
+  return (hash != NULL) ? KVTREE_SUCCESS : KVTREE_FAILURE;
+}
+
+/** sets a->val under hash */
+static int kvtree_concurrent_set_kv_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_arg* a = (struct kvtree_concurrent_arg*) arg;
+  kvtree* val = kvtree_set(hash, a->val, kvtree_new());
+  return (val != NULL) ? KVTREE_SUCCESS : KVTREE_FAILURE;
+}
+
+int kvtree_concurrent_set_kv(kvtree_concurrent* tree, const char* key, const char* val)
+{
+  if (key == NULL || val == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  struct kvtree_concurrent_arg a = { NULL, NULL, val };
+  return kvtree_concurrent_write(tree, key, kvtree_concurrent_set_kv_fn, &a);
+}
+
+int kvtree_concurrent_setf(kvtree_concurrent* tree, kvtree* hash_value, const char* format, ...)
+{
+  if (tree == NULL || format == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  va_list args;
+  va_start(args, format);
+  char buf[KVTREE_MAX_LINE];
+  int last;
+  const char* first = kvtree_path_first_key(format, args, buf, sizeof(buf), &last);
+  if (first == NULL) {
+    /* like kvtree_setf, a path with no keys sets nothing */
+    va_end(args);
+    return KVTREE_FAILURE;
+  }
+
+  /* a longer path under a key that is already set only changes the
+   * hash of that key */
+  kvtree* hash = NULL;
+  int done = 0;
+  if (! last) {
+    pthread_rwlock_t* lock = kvtree_concurrent_lock(tree, first);
+    pthread_rwlock_wrlock(lock);
+    if (kvtree_get(tree->hash, first) != NULL) {
+      hash = kvtree_vsetf(tree->hash, hash_value, format, args);
+      done = 1;
+    }
+    pthread_rwlock_unlock(lock);
+  }
+
+  /* otherwise the path adds or replaces a top level key */
+  if (! done) {
+    kvtree_concurrent_lock_all(tree, 1);
+    hash = kvtree_vsetf(tree->hash, hash_value, format, args);
+    kvtree_concurrent_unlock_all(tree);
+  }
+  va_end(args);
+
+  return (hash != NULL) ? KVTREE_SUCCESS : KVTREE_FAILURE;
+}
+
+int kvtree_concurrent_unset(kvtree_concurrent* tree, const char* key)
+{
+  if (tree == NULL || key == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  kvtree_concurrent_lock_all(tree, 1);
+  int rc = kvtree_unset(tree->hash, key);
+  kvtree_concurrent_unlock_all(tree);
+
+  return rc;
+}
+
+/** unsets a->val under hash */
+static int kvtree_concurrent_unset_kv_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_arg* a = (struct kvtree_concurrent_arg*) arg;
+  return kvtree_unset(hash, a->val);
+}
+
+int kvtree_concurrent_unset_kv(kvtree_concurrent* tree, const char* key, const char* val)
+{
+  if (key == NULL || val == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  /* kvtree_concurrent_write unsets key if this leaves it empty */
+  struct kvtree_concurrent_arg a = { NULL, NULL, val };
+  return kvtree_concurrent_write(tree, key, kvtree_concurrent_unset_kv_fn, &a);
+}
+
+/** runs fn on the hash of key, or on the whole tree if key is NULL,
+ * in which case name is a top level key and only its stripe is read
+ * locked, as fn only looks at name */
+static int kvtree_concurrent_util_read(kvtree_concurrent* tree, const char* key, const char* name,
+  kvtree_concurrent_fn fn, void* arg)
+{
+  if (tree == NULL || name == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  if (key != NULL) {
+    return kvtree_concurrent_read(tree, key, fn, arg);
+  }
+
+  pthread_rwlock_t* lock = kvtree_concurrent_lock(tree, name);
+  pthread_rwlock_rdlock(lock);
+  int rc = fn(tree->hash, arg);
+  pthread_rwlock_unlock(lock);
+  return rc;
+}
+
+/** runs fn on the hash of key, or on the whole tree if key is NULL */
+static int kvtree_concurrent_util_write(kvtree_concurrent* tree, const char* key, const char* name,
+  kvtree_concurrent_fn fn, void* arg)
+{
+  if (tree == NULL || name == NULL) {
+    return KVTREE_FAILURE;
+  }
+  return kvtree_concurrent_write(tree, key, fn, arg);
+}
+
+/* defines the getter and setter for a type of value that kvtree_util
+ * copies in and out by value */
+#define KVTREE_CONCURRENT_UTIL(NAME, TYPE) \
+struct kvtree_concurrent_util_##NAME { \
+  const char* name; \
+  TYPE value; \
+}; \
+\
+static int kvtree_concurrent_set_##NAME##_fn(kvtree* hash, void* arg) \
+{ \
+  struct kvtree_concurrent_util_##NAME* a = (struct kvtree_concurrent_util_##NAME*) arg; \
+  return kvtree_util_set_##NAME(hash, a->name, a->value); \
+} \
+\
+static int kvtree_concurrent_get_##NAME##_fn(kvtree* hash, void* arg) \
+{ \
+  struct kvtree_concurrent_util_##NAME* a = (struct kvtree_concurrent_util_##NAME*) arg; \
+  return kvtree_util_get_##NAME(hash, a->name, &a->value); \
+} \
+\
+int kvtree_concurrent_util_set_##NAME(kvtree_concurrent* tree, const char* key, const char* name, TYPE value) \
+{ \
+  struct kvtree_concurrent_util_##NAME a; \
+  a.name  = name; \
+  a.value = value; \
+  return kvtree_concurrent_util_write(tree, key, name, kvtree_concurrent_set_##NAME##_fn, &a); \
+} \
+\
+int kvtree_concurrent_util_get_##NAME(kvtree_concurrent* tree, const char* key, const char* name, TYPE* value) \
+{ \
+  struct kvtree_concurrent_util_##NAME a; \
+  a.name = name; \
+  int rc = kvtree_concurrent_util_read(tree, key, name, kvtree_concurrent_get_##NAME##_fn, &a); \
+  if (rc == KVTREE_SUCCESS) { \
+    *value = a.value; \
+  } \
+  return rc; \
+}
+
+KVTREE_CONCURRENT_UTIL(bytecount, unsigned long)
+KVTREE_CONCURRENT_UTIL(crc32, uLong)
+KVTREE_CONCURRENT_UTIL(int, int)
+KVTREE_CONCURRENT_UTIL(unsigned_long, unsigned long)
+KVTREE_CONCURRENT_UTIL(int64, int64_t)
+KVTREE_CONCURRENT_UTIL(double, double)
+KVTREE_CONCURRENT_UTIL(ptr, void*)
+
+/* define the arguments of the callbacks for strings and bytes, which
+ * are copied out while the lock is held */
+struct kvtree_concurrent_util_buf {
+  const char* name;
+  const void* buf;
+  size_t size;
+  void* copy;
+};
+
+/** returns a copy of size bytes starting at buf */
+static void* kvtree_concurrent_copy(const void* buf, size_t size)
+{
+  /* KVTREE_MALLOC returns NULL for 0 bytes, so allocate at least one */
+  void* copy = KVTREE_MALLOC(size > 0 ? size : 1);
+  if (size > 0) {
+    memcpy(copy, buf, size);
+  }
+  return copy;
+}
+
+static int kvtree_concurrent_set_str_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_util_buf* a = (struct kvtree_concurrent_util_buf*) arg;
+  return kvtree_util_set_str(hash, a->name, (const char*) a->buf);
+}
+
+static int kvtree_concurrent_get_str_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_util_buf* a = (struct kvtree_concurrent_util_buf*) arg;
+  char* str;
+  int rc = kvtree_util_get_str(hash, a->name, &str);
+  if (rc == KVTREE_SUCCESS) {
+    a->copy = kvtree_concurrent_copy(str, strlen(str) + 1);
+  }
+  return rc;
+}
+
+int kvtree_concurrent_util_set_str(kvtree_concurrent* tree, const char* key, const char* name, const char* value)
+{
+  struct kvtree_concurrent_util_buf a = { name, value, 0, NULL };
+  return kvtree_concurrent_util_write(tree, key, name, kvtree_concurrent_set_str_fn, &a);
+}
+
+int kvtree_concurrent_util_get_str(kvtree_concurrent* tree, const char* key, const char* name, char** value)
+{
+  struct kvtree_concurrent_util_buf a = { name, NULL, 0, NULL };
+  int rc = kvtree_concurrent_util_read(tree, key, name, kvtree_concurrent_get_str_fn, &a);
+  if (rc == KVTREE_SUCCESS) {
+    *value = (char*) a.copy;
+  }
+  return rc;
+}
+
+static int kvtree_concurrent_set_bytes_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_util_buf* a = (struct kvtree_concurrent_util_buf*) arg;
+  return kvtree_util_set_bytes(hash, a->name, a->buf, a->size);
+}
+
+static int kvtree_concurrent_get_bytes_fn(kvtree* hash, void* arg)
+{
+  struct kvtree_concurrent_util_buf* a = (struct kvtree_concurrent_util_buf*) arg;
+  const void* buf;
+  int rc = kvtree_util_get_bytes(hash, a->name, &buf, &a->size);
+  if (rc == KVTREE_SUCCESS) {
+    a->copy = kvtree_concurrent_copy(buf, a->size);
+  }
+  return rc;
+}
+
+int kvtree_concurrent_util_set_bytes(kvtree_concurrent* tree, const char* key, const char* name, const void* buf, size_t size)
+{
+  struct kvtree_concurrent_util_buf a = { name, buf, size, NULL };
+  return kvtree_concurrent_util_write(tree, key, name, kvtree_concurrent_set_bytes_fn, &a);
+}
+
+int kvtree_concurrent_util_get_bytes(kvtree_concurrent* tree, const char* key, const char* name, void** buf, size_t* size)
+{
+  struct kvtree_concurrent_util_buf a = { name, NULL, 0, NULL };
+  int rc = kvtree_concurrent_util_read(tree, key, name, kvtree_concurrent_get_bytes_fn, &a);
+  if (rc == KVTREE_SUCCESS) {
+    *buf  = a.copy;
+    *size = a.size;
+  }
+  return rc;
+}
+
+/* A publisher keeps the current version of a tree in a pointer that
+ * readers load without a lock.  Writers take a mutex, swap in a new
+ * version, and put the old one on a list of retired versions, tagged
+ * with the epoch in which it was retired.
+ *
+ * A reader adds itself to the counter of the parity of the current
+ * epoch before it loads the pointer.  The epoch only advances from e
+ * to e + 1 once no reader is counted under the parity of e - 1, so a
+ * version retired in epoch e may be deleted once the epoch reaches
+ * e + 2: both parities have been seen empty since it was retired, and
+ * any reader counted after that loaded a newer version.  Each parity
+ * has several counters, padded apart, and each thread always uses
+ * the same one, so readers on different cores rarely share a line. */
+
+/** number of counters for each parity, a power of two */
+#define KVTREE_PUBLISHER_STRIPES (16)
+
+/** counter of readers, padded to its own cache line */
+union kvtree_publisher_count {
+  long count;
+  char pad[128];
+};
+
+/* define a version waiting to be deleted */
+struct kvtree_publisher_retired {
+  kvtree* hash;        /* replaced version */
+  unsigned long epoch; /* epoch in which it was replaced */
+  struct kvtree_publisher_retired* next;
+};
+
+/** define the structure for a publisher */
+struct kvtree_publisher_struct {
+  kvtree* current;       /* version readers get, read without a lock */
+  unsigned long epoch;   /* only advanced by writers */
+  pthread_mutex_t lock;  /* held by writers from begin to commit */
+  struct kvtree_publisher_retired* head; /* oldest retired version */
+  struct kvtree_publisher_retired* tail; /* newest retired version */
+  int pending;           /* number of retired versions */
+  union kvtree_publisher_count readers[2 * KVTREE_PUBLISHER_STRIPES];
+};
+
+/** counter each thread uses, picked round robin on first use */
+static __thread int kvtree_publisher_slot = -1;
+static int kvtree_publisher_slots = 0;
+
+/** returns the counter stripe of the calling thread */
+static int kvtree_publisher_stripe(void)
+{
+  if (kvtree_publisher_slot < 0) {
+    int slot = __atomic_fetch_add(&kvtree_publisher_slots, 1, __ATOMIC_RELAXED);
+    kvtree_publisher_slot = slot & (KVTREE_PUBLISHER_STRIPES - 1);
+  }
+  return kvtree_publisher_slot;
+}
+
+kvtree_publisher* kvtree_publisher_new(kvtree* hash)
+{
+  kvtree_publisher* pub = (kvtree_publisher*) KVTREE_MALLOC(sizeof(kvtree_publisher));
+  memset(pub, 0, sizeof(kvtree_publisher));
+  pub->current = (hash != NULL) ? hash : kvtree_new();
+  pthread_mutex_init(&pub->lock, NULL);
+  return pub;
+}
+
+int kvtree_publisher_delete(kvtree_publisher** ptr_pub)
+{
+  if (ptr_pub == NULL || *ptr_pub == NULL) {
+    return KVTREE_SUCCESS;
+  }
+
+  kvtree_publisher* pub = *ptr_pub;
+  while (pub->head != NULL) {
+    struct kvtree_publisher_retired* retired = pub->head;
+    pub->head = retired->next;
+    kvtree_delete(&retired->hash);
+    kvtree_free(&retired);
+  }
+  kvtree_delete(&pub->current);
+  pthread_mutex_destroy(&pub->lock);
+  kvtree_free(ptr_pub);
+
+  return KVTREE_SUCCESS;
+}
+
+const kvtree* kvtree_acquire(kvtree_publisher* pub, int* token)
+{
+  if (pub == NULL || token == NULL) {
+    return NULL;
+  }
+
+  /* count ourselves under the current epoch before loading the
+   * version, see the comment above */
+  unsigned long epoch = __atomic_load_n(&pub->epoch, __ATOMIC_SEQ_CST);
+  int t = (int) (epoch & 1) * KVTREE_PUBLISHER_STRIPES + kvtree_publisher_stripe();
+  __atomic_fetch_add(&pub->readers[t].count, 1, __ATOMIC_SEQ_CST);
+  *token = t;
+
+  return __atomic_load_n(&pub->current, __ATOMIC_SEQ_CST);
+}
+
+void kvtree_release(kvtree_publisher* pub, int token)
+{
+  if (pub == NULL || token < 0 || token >= 2 * KVTREE_PUBLISHER_STRIPES) {
+    return;
+  }
+  __atomic_fetch_sub(&pub->readers[token].count, 1, __ATOMIC_RELEASE);
+}
+
+/** returns 1 if no reader is counted under the given parity */
+static int kvtree_publisher_idle(const kvtree_publisher* pub, unsigned long parity)
+{
+  int i;
+  const union kvtree_publisher_count* readers = &pub->readers[parity * KVTREE_PUBLISHER_STRIPES];
+  for (i = 0; i < KVTREE_PUBLISHER_STRIPES; i++) {
+    if (__atomic_load_n(&readers[i].count, __ATOMIC_SEQ_CST) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** advances the epoch as far as readers allow and deletes the retired
+ * versions no reader can hold, caller must hold the writer lock */
+static void kvtree_publisher_collect(kvtree_publisher* pub)
+{
+  /* a version needs the epoch to advance twice past its own */
+  int steps;
+  for (steps = 0; steps < 2 && pub->head != NULL; steps++) {
+    unsigned long epoch = pub->epoch;
+    if (! kvtree_publisher_idle(pub, (epoch + 1) & 1)) {
+      break;
+    }
+    __atomic_store_n(&pub->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+  }
+
+  while (pub->head != NULL && pub->head->epoch + 2 <= pub->epoch) {
+    struct kvtree_publisher_retired* retired = pub->head;
+    pub->head = retired->next;
+    if (pub->head == NULL) {
+      pub->tail = NULL;
+    }
+    pub->pending--;
+    kvtree_delete(&retired->hash);
+    kvtree_free(&retired);
+  }
+}
+
+kvtree* kvtree_publish_begin(kvtree_publisher* pub)
+{
+  if (pub == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&pub->lock);
+  return kvtree_snapshot(pub->current);
+}
+
+int kvtree_publish_commit(kvtree_publisher* pub, kvtree* hash)
+{
+  if (pub == NULL || hash == NULL) {
+    return KVTREE_FAILURE;
+  }
+
+  /* swap in the new version, then retire the old one */
+  kvtree* old = pub->current;
+  __atomic_store_n(&pub->current, hash, __ATOMIC_SEQ_CST);
+
+  struct kvtree_publisher_retired* retired = (struct kvtree_publisher_retired*) KVTREE_MALLOC(sizeof(struct kvtree_publisher_retired));
+  retired->hash  = old;
+  retired->epoch = pub->epoch;
+  retired->next  = NULL;
+  if (pub->tail != NULL) {
+    pub->tail->next = retired;
+  } else {
+    pub->head = retired;
+  }
+  pub->tail = retired;
+  pub->pending++;
+
+  kvtree_publisher_collect(pub);
+  pthread_mutex_unlock(&pub->lock);
+
+  return KVTREE_SUCCESS;
+}
+
+void kvtree_publish_abort(kvtree_publisher* pub, kvtree** ptr_hash)
+{
+  if (pub == NULL) {
+    return;
+  }
+  kvtree_delete(ptr_hash);
+  pthread_mutex_unlock(&pub->lock);
+}
+
+int kvtree_publish(kvtree_publisher* pub, kvtree* hash)
+{
+  if (pub == NULL || hash == NULL) {
+    return KVTREE_FAILURE;
+  }
+  pthread_mutex_lock(&pub->lock);
+  return kvtree_publish_commit(pub, hash);
+}
+
+int kvtree_publisher_reclaim(kvtree_publisher* pub)
+{
+  if (pub == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&pub->lock);
+  kvtree_publisher_collect(pub);
+  int pending = pub->pending;
+  pthread_mutex_unlock(&pub->lock);
+  return pending;
+}
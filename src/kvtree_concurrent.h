@@ -0,0 +1,197 @@
+#ifndef KVTREE_CONCURRENT_H
+#define KVTREE_CONCURRENT_H
+
+#include "kvtree.h"
+#include "kvtree_util.h"
+
+/* enable C++ codes to include this header directly */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \file kvtree_concurrent.h
+ *  \ingroup kvtree
+ *  \brief A kvtree that several threads may read and change at once.
+ *
+ * The handle owns a tree and stripes reader-writer locks over its top
+ * level keys, so threads that work under different top level keys do
+ * not wait for one another, and readers of the same key share its
+ * lock.  Changing what lies under a key that is already set takes only
+ * the lock of its stripe, while adding or removing a top level key
+ * takes every stripe.
+ *
+ * Values are copied out, since a pointer into the tree is only valid
+ * while its lock is held.  Use kvtree_concurrent_read and
+ * kvtree_concurrent_write to run other kvtree calls under a lock.
+ * Those must not call kvtree_sorted_view or print with
+ * KVTREE_PRINT_SORTED while reading, as those cache sorted lists in
+ * the tree, and the tree must not hold a hash shared with
+ * kvtree_share under more than one top level key.
+ *
+ * For trees that are read far more often than they change, a
+ * kvtree_publisher instead lets readers take the current version of a
+ * tree without any lock.  A writer builds a new version, which shares
+ * the hashes it does not change with the current one, and publishes
+ * it in place of the current version.  A replaced version is deleted
+ * once no reader can still hold it, which readers announce through
+ * per-epoch counters rather than locks. */
+
+/** \typedef kvtree_concurrent */
+typedef struct kvtree_concurrent_struct kvtree_concurrent;
+
+/** \typedef kvtree_concurrent_fn
+ * called by kvtree_concurrent_read and kvtree_concurrent_write with
+ * the hash of a key, which is NULL when reading a key that is not set,
+ * and the arg given to them, its return value is passed back */
+typedef int (*kvtree_concurrent_fn)(kvtree* hash, void* arg);
+
+/** number of lock stripes used if kvtree_concurrent_new is given 0 */
+#define KVTREE_CONCURRENT_STRIPES (64)
+
+/** returns a handle that takes ownership of hash, or of a new empty
+ * hash if hash is NULL, with stripes locks rounded up to a power of
+ * two, returns NULL if hash is allocated from an arena, as a frozen
+ * hash is, since threads would then allocate from the same arena */
+kvtree_concurrent* kvtree_concurrent_new(kvtree* hash, int stripes);
+
+/** frees the handle and returns the tree it held, which the caller
+ * must delete, no other thread may be using the handle, sets caller's
+ * pointer to NULL */
+kvtree* kvtree_concurrent_release(kvtree_concurrent** ptr_tree);
+
+/** frees the handle and its tree, sets caller's pointer to NULL */
+int kvtree_concurrent_delete(kvtree_concurrent** ptr_tree);
+
+/** calls fn with the hash of key while holding a read lock on it, or
+ * with the whole tree while holding every read lock if key is NULL,
+ * fn must not change the hash */
+int kvtree_concurrent_read(kvtree_concurrent* tree, const char* key, kvtree_concurrent_fn fn, void* arg);
+
+/** calls fn with the hash of key while holding the write lock on it,
+ * setting key to an empty hash first if it is not set, and unsetting
+ * key if fn leaves its hash empty, calls fn with the whole tree while
+ * holding every write lock if key is NULL */
+int kvtree_concurrent_write(kvtree_concurrent* tree, const char* key, kvtree_concurrent_fn fn, void* arg);
+
+/** \name getter functions
+ * return a copy of the hash found, which the caller must delete, or
+ * NULL if it is not set */
+///@{
+kvtree* kvtree_concurrent_get(kvtree_concurrent* tree, const char* key);
+
+kvtree* kvtree_concurrent_get_kv(kvtree_concurrent* tree, const char* key, const char* val);
+
+/** takes the format of kvtree_getf, its first key picks the lock */
+kvtree* kvtree_concurrent_getf(kvtree_concurrent* tree, const char* format, ...);
+///@}
+
+/** \name setter functions
+ * the set functions take ownership of hash_value and return
+ * KVTREE_SUCCESS or KVTREE_FAILURE */
+///@{
+int kvtree_concurrent_set(kvtree_concurrent* tree, const char* key, kvtree* hash_value);
+
+int kvtree_concurrent_set_kv(kvtree_concurrent* tree, const char* key, const char* val);
+
+/** takes the format of kvtree_setf, its first key picks the lock */
+int kvtree_concurrent_setf(kvtree_concurrent* tree, kvtree* hash_value, const char* format, ...);
+
+int kvtree_concurrent_unset(kvtree_concurrent* tree, const char* key);
+
+/** unsets val under key, and key as well if that empties it */
+int kvtree_concurrent_unset_kv(kvtree_concurrent* tree, const char* key, const char* val);
+///@}
+
+/** \name util functions
+ * same as the kvtree_util functions applied to the hash of key, or to
+ * the whole tree if key is NULL, in which case name is a top level
+ * key, strings and bytes are copied into memory the caller must free */
+///@{
+int kvtree_concurrent_util_set_bytecount(kvtree_concurrent* tree, const char* key, const char* name, unsigned long value);
+
+int kvtree_concurrent_util_set_crc32(kvtree_concurrent* tree, const char* key, const char* name, uLong value);
+
+int kvtree_concurrent_util_set_int(kvtree_concurrent* tree, const char* key, const char* name, int value);
+
+int kvtree_concurrent_util_set_unsigned_long(kvtree_concurrent* tree, const char* key, const char* name, unsigned long value);
+
+int kvtree_concurrent_util_set_str(kvtree_concurrent* tree, const char* key, const char* name, const char* value);
+
+int kvtree_concurrent_util_set_int64(kvtree_concurrent* tree, const char* key, const char* name, int64_t value);
+
+int kvtree_concurrent_util_set_double(kvtree_concurrent* tree, const char* key, const char* name, double value);
+
+int kvtree_concurrent_util_set_ptr(kvtree_concurrent* tree, const char* key, const char* name, void* value);
+
+int kvtree_concurrent_util_set_bytes(kvtree_concurrent* tree, const char* key, const char* name, const void* buf, size_t size);
+
+int kvtree_concurrent_util_get_bytecount(kvtree_concurrent* tree, const char* key, const char* name, unsigned long* value);
+
+int kvtree_concurrent_util_get_crc32(kvtree_concurrent* tree, const char* key, const char* name, uLong* value);
+
+int kvtree_concurrent_util_get_int(kvtree_concurrent* tree, const char* key, const char* name, int* value);
+
+int kvtree_concurrent_util_get_unsigned_long(kvtree_concurrent* tree, const char* key, const char* name, unsigned long* value);
+
+int kvtree_concurrent_util_get_str(kvtree_concurrent* tree, const char* key, const char* name, char** value);
+
+int kvtree_concurrent_util_get_int64(kvtree_concurrent* tree, const char* key, const char* name, int64_t* value);
+
+int kvtree_concurrent_util_get_double(kvtree_concurrent* tree, const char* key, const char* name, double* value);
+
+int kvtree_concurrent_util_get_ptr(kvtree_concurrent* tree, const char* key, const char* name, void** value);
+
+int kvtree_concurrent_util_get_bytes(kvtree_concurrent* tree, const char* key, const char* name, void** buf, size_t* size);
+///@}
+
+/** \typedef kvtree_publisher */
+typedef struct kvtree_publisher_struct kvtree_publisher;
+
+/** returns a publisher whose first version is hash, which it takes
+ * ownership of, or a new empty hash if hash is NULL */
+kvtree_publisher* kvtree_publisher_new(kvtree* hash);
+
+/** frees the publisher and every version it holds, no reader may
+ * still hold a version, sets caller's pointer to NULL */
+int kvtree_publisher_delete(kvtree_publisher** ptr_pub);
+
+/** returns the current version without taking a lock, which stays
+ * valid until it is passed to kvtree_release along with the token,
+ * the version must not be changed, nor passed to kvtree_sorted_view,
+ * or printed with KVTREE_PRINT_SORTED */
+const kvtree* kvtree_acquire(kvtree_publisher* pub, int* token);
+
+/** gives up a version returned by kvtree_acquire */
+void kvtree_release(kvtree_publisher* pub, int token);
+
+/** waits for other writers and returns a new version to change, which
+ * shares the children of the current version, get a child ready to
+ * change with kvtree_unshare or kvtree_setf, which copy a shared hash
+ * first, then pass the version to kvtree_publish_commit or
+ * kvtree_publish_abort */
+kvtree* kvtree_publish_begin(kvtree_publisher* pub);
+
+/** publishes hash, which the publisher takes ownership of, in place
+ * of the current version, and lets the next writer in */
+int kvtree_publish_commit(kvtree_publisher* pub, kvtree* hash);
+
+/** deletes a version returned by kvtree_publish_begin without
+ * publishing it, and lets the next writer in, sets caller's pointer to
+ * NULL */
+void kvtree_publish_abort(kvtree_publisher* pub, kvtree** ptr_hash);
+
+/** publishes hash in place of the current version, same as
+ * kvtree_publish_begin followed by kvtree_publish_commit with hash */
+int kvtree_publish(kvtree_publisher* pub, kvtree* hash);
+
+/** deletes replaced versions that no reader can still hold, which is
+ * also tried on each publish, returns the number of versions that
+ * readers may still hold */
+int kvtree_publisher_reclaim(kvtree_publisher* pub);
+
+/* enable C++ codes to include this header directly */
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
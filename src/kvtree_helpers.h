@@ -5,6 +5,9 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdarg.h>
+
+struct kvtree_struct;
 
 /** \file kvtree_helpers.h
  *  \ingroup kvtree
@@ -22,6 +25,10 @@ void* kvtree_malloc(size_t size, const char* file, int line);
 /** pass address of pointer to be freed, frees memory if not NULL and sets pointer to NULL */
 void kvtree_free(void* ptr);
 
+/** returns the packed form of hash if it is the top of a tree made by
+ * kvtree_freeze and sets size to its length, otherwise returns NULL */
+const char* kvtree_packed(const struct kvtree_struct* hash, size_t* size);
+
 /** pack an unsigned 16 bit value to specified buffer in network order */
 int kvtree_pack_uint16_t(void* buf, size_t buf_size, size_t* buf_pos, uint16_t val);
 
@@ -40,4 +47,10 @@ int kvtree_unpack_uint32_t(const void* buf, size_t buf_size, size_t* buf_pos, ui
 /** unpack an unsigned 64 bit value to specified buffer in network order */
 int kvtree_unpack_uint64_t(const void* buf, size_t buf_size, size_t* buf_pos, uint64_t* val);
 
+/** formats the first key named by a kvtree_getf format string and its
+ * arguments into buf of bufsize bytes, which must have room for an
+ * integer key, sets last to 1 if no keys follow it, returns buf or
+ * NULL if format has no keys */
+const char* kvtree_path_first_key(const char* format, va_list args, char* buf, size_t bufsize, int* last);
+
 #endif
@@ -0,0 +1,580 @@
+/* Implements the key index of a kvtree node, in one of two forms.
+ *
+ * Nodes of moderate size keep a fingerprint array: the hash value of
+ * the key of each indexed element in a contiguous array, next to a
+ * parallel array of element pointers, both in the order elements were
+ * inserted.  A lookup compares the hash of the wanted key against a
+ * block of fingerprints at a time, with SSE2 or AVX2 when the compiler
+ * targets them, and only compares keys at matching positions.
+ *
+ * Larger nodes switch to an open-addressing hash table.  The table
+ * uses linear probing and backward shift deletion, so it never
+ * accumulates tombstones.  It stores the hash value of each key next
+ * to the element pointer so that probing and rehashing rarely need to
+ * touch the key strings. */
+
+#include "kvtree.h"
+#include "kvtree_index.h"
+#include "kvtree_helpers.h"
+#include "kvtree_arena.h"
+#include "kvtree_intern.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/** smallest table we allocate, must be a power of two */
+#define KVTREE_INDEX_MIN_SLOTS (64)
+
+/** number of fingerprints compared at once, arrays are allocated in
+ * multiples of this */
+#define KVTREE_FPRINT_BLOCK (8)
+
+/** define a slot in the index table */
+struct kvtree_index_slot {
+  uint32_t hash;     /* hash value of key of elem */
+  kvtree_elem* elem; /* element, NULL if slot is empty */
+};
+
+/** define the structure for the index of a hash, which is a
+ * fingerprint array while slots is NULL and a table otherwise */
+struct kvtree_index_struct {
+  struct kvtree_index_slot* slots; /* table of slots */
+  size_t mask;  /* number of slots minus one */
+  size_t count; /* number of occupied slots or array entries */
+  size_t dups;  /* number of times an insert shadowed an existing key */
+  struct kvtree_arena_struct* arena; /* arena of the hash, NULL for heap */
+  uint32_t* fprints;    /* hash value of key of each element in elems */
+  kvtree_elem** elems;  /* indexed elements, oldest first */
+  size_t cap;           /* number of entries allocated in each array */
+};
+
+/** computes the hash value of a string (FNV-1a) */
+static uint32_t kvtree_str_hash(const char* key)
+{
+  uint32_t h = 2166136261u;
+  const unsigned char* p = (const unsigned char*) key;
+  while (*p != '\0') {
+    h ^= (uint32_t) *p;
+    h *= 16777619u;
+    p++;
+  }
+  return h;
+}
+
+/** computes the hash value of an integer key (murmur3 finalizer) */
+uint32_t kvtree_int_hash(int64_t key)
+{
+  uint64_t x = (uint64_t) key;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (uint32_t) x;
+}
+
+/** returns 1 and sets val if key is the canonical decimal form of a
+ * 64-bit integer, returns 0 otherwise */
+int kvtree_key_parse_int(const char* key, int64_t* val)
+{
+  const char* p = key;
+  int negative = 0;
+  if (*p == '-') {
+    negative = 1;
+    p++;
+  }
+
+  /* need at least one digit, and only "0" itself may start with 0 */
+  if (*p < '0' || *p > '9') {
+    return 0;
+  }
+  if (*p == '0') {
+    if (p[1] != '\0' || negative) {
+      return 0;
+    }
+    *val = 0;
+    return 1;
+  }
+
+  /* accumulate digits, 19 digits always fit in 64 bits unsigned */
+  uint64_t v = 0;
+  int digits = 0;
+  while (*p >= '0' && *p <= '9') {
+    if (digits == 19) {
+      return 0;
+    }
+    v = v * 10 + (uint64_t) (*p - '0');
+    digits++;
+    p++;
+  }
+  if (*p != '\0') {
+    return 0;
+  }
+
+  /* check that the value fits in a signed 64-bit integer */
+  if (negative) {
+    if (v > (uint64_t) INT64_MAX + 1) {
+      return 0;
+    }
+    *val = (int64_t) (0 - v);
+  } else {
+    if (v > (uint64_t) INT64_MAX) {
+      return 0;
+    }
+    *val = (int64_t) v;
+  }
+  return 1;
+}
+
+/** writes the canonical decimal form of val to buf, returns length of
+ * the string */
+size_t kvtree_key_format_int(char* buf, int64_t val)
+{
+  /* generate digits in reverse order */
+  char digits[KVTREE_INT_KEY_MAX];
+  uint64_t v = (val < 0) ? (uint64_t) 0 - (uint64_t) val : (uint64_t) val;
+  size_t n = 0;
+  do {
+    digits[n++] = (char) ('0' + (int) (v % 10));
+    v /= 10;
+  } while (v > 0);
+
+  size_t len = 0;
+  if (val < 0) {
+    buf[len++] = '-';
+  }
+  while (n > 0) {
+    buf[len++] = digits[--n];
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/** computes the hash value of a key string */
+uint32_t kvtree_key_hash(const char* key)
+{
+  int64_t val;
+  if (((*key >= '0' && *key <= '9') || *key == '-') && kvtree_key_parse_int(key, &val)) {
+    return kvtree_int_hash(val);
+  }
+  return kvtree_str_hash(key);
+}
+
+/** returns the hash value of the key of an element, pooled keys
+ * carry their hash value so we need not compute it again */
+uint32_t kvtree_elem_key_hash(const kvtree_elem* elem)
+{
+  if (elem->flags & KVTREE_ELEM_FLAG_INTKEY) {
+    return kvtree_int_hash(elem->ikey);
+  }
+  if (elem->flags & KVTREE_ELEM_FLAG_INTERNED) {
+    return kvtree_intern_hash(elem->key);
+  }
+  /* we know the key is not an integer */
+  return kvtree_str_hash(elem->key);
+}
+
+/** returns a bit mask with bit i set if fprints[i] == hash, for the
+ * KVTREE_FPRINT_BLOCK fingerprints starting at fprints */
+static unsigned int kvtree_fprint_match(const uint32_t* fprints, uint32_t hash)
+{
+#if defined(__AVX2__)
+  __m256i want = _mm256_set1_epi32((int) hash);
+  __m256i have = _mm256_loadu_si256((const __m256i*) fprints);
+  __m256i eq   = _mm256_cmpeq_epi32(want, have);
+  return (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+#elif defined(__SSE2__)
+  __m128i want = _mm_set1_epi32((int) hash);
+  __m128i lo = _mm_cmpeq_epi32(want, _mm_loadu_si128((const __m128i*) fprints));
+  __m128i hi = _mm_cmpeq_epi32(want, _mm_loadu_si128((const __m128i*) (fprints + 4)));
+  return (unsigned int) _mm_movemask_ps(_mm_castsi128_ps(lo)) |
+         ((unsigned int) _mm_movemask_ps(_mm_castsi128_ps(hi)) << 4);
+#else
+  unsigned int mask = 0;
+  int i;
+  for (i = 0; i < KVTREE_FPRINT_BLOCK; i++) {
+    if (fprints[i] == hash) {
+      mask |= (1u << i);
+    }
+  }
+  return mask;
+#endif
+}
+
+/** returns position of the newest element in the fingerprint array
+ * before position end whose fingerprint equals hash, or -1 if none,
+ * callers continue the search from the returned position if the key
+ * of that element does not match */
+static long kvtree_fprint_prev(const struct kvtree_index_struct* index, uint32_t hash, long end)
+{
+  /* walk blocks from the newest end of the array, the array is padded
+   * to a whole block, and bits past end are masked off */
+  long block = (end - 1) & ~((long) KVTREE_FPRINT_BLOCK - 1);
+  while (block >= 0) {
+    unsigned int mask = kvtree_fprint_match(index->fprints + block, hash);
+    long valid = end - block;
+    if (valid < KVTREE_FPRINT_BLOCK) {
+      mask &= (1u << valid) - 1;
+    }
+    if (mask != 0) {
+      int bit = KVTREE_FPRINT_BLOCK - 1;
+      while (! (mask & (1u << bit))) {
+        bit--;
+      }
+      return block + bit;
+    }
+    end = block;
+    block -= KVTREE_FPRINT_BLOCK;
+  }
+  return -1;
+}
+
+/** allocate fingerprint arrays with room for at least cap elements,
+ * copying over any current entries */
+static void kvtree_fprint_alloc(struct kvtree_index_struct* index, size_t cap)
+{
+  cap = (cap + KVTREE_FPRINT_BLOCK - 1) & ~((size_t) KVTREE_FPRINT_BLOCK - 1);
+  uint32_t* fprints = (uint32_t*) kvtree_arena_malloc(index->arena, cap * sizeof(uint32_t));
+  kvtree_elem** elems = (kvtree_elem**) kvtree_arena_malloc(index->arena, cap * sizeof(kvtree_elem*));
+  if (index->count > 0) {
+    memcpy(fprints, index->fprints, index->count * sizeof(uint32_t));
+    memcpy(elems, index->elems, index->count * sizeof(kvtree_elem*));
+  }
+
+  /* padding is compared along with the last block, give it a defined
+   * value even though its bits are masked off */
+  memset(fprints + index->count, 0, (cap - index->count) * sizeof(uint32_t));
+  kvtree_arena_free(index->arena, &index->fprints);
+  kvtree_arena_free(index->arena, &index->elems);
+  index->fprints = fprints;
+  index->elems   = elems;
+  index->cap     = cap;
+}
+
+/** allocate an empty table with the given number of slots */
+static void kvtree_index_alloc(struct kvtree_index_struct* index, size_t slots)
+{
+  index->slots = (struct kvtree_index_slot*) kvtree_arena_malloc(index->arena, slots * sizeof(struct kvtree_index_slot));
+  memset(index->slots, 0, slots * sizeof(struct kvtree_index_slot));
+  index->mask  = slots - 1;
+  index->count = 0;
+}
+
+/** place element with given hash in the table, if an element with
+ * the same key exists, replace it if replace is set */
+static void kvtree_index_place(struct kvtree_index_struct* index, uint32_t hash, kvtree_elem* elem, int replace)
+{
+  size_t i = (size_t) hash & index->mask;
+  while (index->slots[i].elem != NULL) {
+    kvtree_elem* cur = index->slots[i].elem;
+    if (index->slots[i].hash == hash &&
+        KVTREE_KEY_EQUAL(cur->key, cur->flags & KVTREE_ELEM_FLAG_INTERNED,
+                         elem->key, elem->flags & KVTREE_ELEM_FLAG_INTERNED))
+    {
+      /* one of the two elements now shadows the other */
+      if (replace) {
+        index->slots[i].elem = elem;
+      }
+      index->dups++;
+      return;
+    }
+    i = (i + 1) & index->mask;
+  }
+  index->slots[i].hash = hash;
+  index->slots[i].elem = elem;
+  index->count++;
+}
+
+/** double the size of the table and reinsert all elements */
+static void kvtree_index_grow(struct kvtree_index_struct* index)
+{
+  struct kvtree_index_slot* old = index->slots;
+  size_t old_slots = index->mask + 1;
+
+  kvtree_index_alloc(index, old_slots * 2);
+
+  size_t i;
+  for (i = 0; i < old_slots; i++) {
+    if (old[i].elem != NULL) {
+      /* keys in the old table are unique, so we can skip the compare */
+      size_t j = (size_t) old[i].hash & index->mask;
+      while (index->slots[j].elem != NULL) {
+        j = (j + 1) & index->mask;
+      }
+      index->slots[j] = old[i];
+      index->count++;
+    }
+  }
+
+  kvtree_arena_free(index->arena, &old);
+}
+
+/** switch an index from a fingerprint array to a table */
+static void kvtree_index_to_table(struct kvtree_index_struct* index)
+{
+  uint32_t* fprints = index->fprints;
+  kvtree_elem** elems = index->elems;
+  size_t count = index->count;
+
+  /* size the table so that it is at most half full */
+  size_t slots = KVTREE_INDEX_MIN_SLOTS;
+  while (slots < count * 2) {
+    slots *= 2;
+  }
+  kvtree_index_alloc(index, slots);
+
+  /* newer elements take precedence over older elements with the same
+   * key, so place them first */
+  size_t i;
+  for (i = count; i > 0; i--) {
+    kvtree_index_place(index, fprints[i - 1], elems[i - 1], 0);
+  }
+
+  kvtree_arena_free(index->arena, &fprints);
+  kvtree_arena_free(index->arena, &elems);
+  index->fprints = NULL;
+  index->elems   = NULL;
+  index->cap     = 0;
+}
+
+/** allocates a new index and inserts each element currently in hash */
+struct kvtree_index_struct* kvtree_index_build(const kvtree* hash)
+{
+  struct kvtree_index_struct* index = (struct kvtree_index_struct*) kvtree_arena_malloc(hash->arena, sizeof(struct kvtree_index_struct));
+  index->slots   = NULL;
+  index->mask    = 0;
+  index->count   = 0;
+  index->dups    = 0;
+  index->arena   = hash->arena;
+  index->fprints = NULL;
+  index->elems   = NULL;
+  index->cap     = 0;
+
+  /* moderate nodes get a fingerprint array, rounded up to a whole
+   * block, which leaves some room to grow */
+  size_t count = (size_t) hash->count;
+  if (count < KVTREE_INDEX_TABLE_THRESHOLD) {
+    kvtree_fprint_alloc(index, count + 1);
+
+    /* we visit elements newest first, while the array is oldest first */
+    kvtree_elem* elem;
+    for (elem = kvtree_elem_first(hash); elem != NULL; elem = kvtree_elem_next_sibling(elem)) {
+      if (elem->key != NULL) {
+        index->count++;
+      }
+    }
+    size_t i = index->count;
+    for (elem = kvtree_elem_first(hash); elem != NULL; elem = kvtree_elem_next_sibling(elem)) {
+      if (elem->key != NULL) {
+        i--;
+        index->fprints[i] = kvtree_elem_key_hash(elem);
+        index->elems[i]   = elem;
+      }
+    }
+    return index;
+  }
+
+  /* size the table so that it is at most half full */
+  size_t slots = KVTREE_INDEX_MIN_SLOTS;
+  while (slots < count * 2) {
+    slots *= 2;
+  }
+  kvtree_index_alloc(index, slots);
+
+  /* newer elements shadow older elements with the same key, and we
+   * visit the newest first, so keep the first one we see */
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(hash); elem != NULL; elem = kvtree_elem_next_sibling(elem)) {
+    if (elem->key != NULL) {
+      kvtree_index_place(index, kvtree_elem_key_hash(elem), elem, 0);
+    }
+  }
+
+  return index;
+}
+
+/** frees an index, sets caller's pointer to NULL */
+void kvtree_index_delete(struct kvtree_index_struct** ptr_index)
+{
+  if (ptr_index != NULL && *ptr_index != NULL) {
+    struct kvtree_arena_struct* arena = (*ptr_index)->arena;
+    kvtree_arena_free(arena, &(*ptr_index)->slots);
+    kvtree_arena_free(arena, &(*ptr_index)->fprints);
+    kvtree_arena_free(arena, &(*ptr_index)->elems);
+    kvtree_arena_free(arena, ptr_index);
+  }
+}
+
+/** adds an element to the index, a newly added element shadows any
+ * older element having the same key */
+void kvtree_index_insert(struct kvtree_index_struct* index, kvtree_elem* elem)
+{
+  if (index == NULL || elem->key == NULL) {
+    return;
+  }
+
+  if (index->slots == NULL) {
+    if (index->count + 1 < KVTREE_INDEX_TABLE_THRESHOLD) {
+      /* append to the fingerprint array */
+      if (index->count == index->cap) {
+        kvtree_fprint_alloc(index, index->cap * 2);
+      }
+      index->fprints[index->count] = kvtree_elem_key_hash(elem);
+      index->elems[index->count]   = elem;
+      index->count++;
+      return;
+    }
+
+    /* node grew too large to scan */
+    kvtree_index_to_table(index);
+  }
+
+  /* keep the table at most half full */
+  if ((index->count + 1) * 2 > index->mask + 1) {
+    kvtree_index_grow(index);
+  }
+
+  kvtree_index_place(index, kvtree_elem_key_hash(elem), elem, 1);
+}
+
+/** removes an element from the index */
+void kvtree_index_remove(struct kvtree_index_struct* index, const kvtree* hash, kvtree_elem* elem)
+{
+  if (index == NULL || elem->key == NULL) {
+    return;
+  }
+
+  uint32_t h = kvtree_elem_key_hash(elem);
+
+  if (index->slots == NULL) {
+    /* the array holds every element, so removing one never uncovers
+     * another, just close the gap to keep the array in order */
+    long pos = kvtree_fprint_prev(index, h, (long) index->count);
+    while (pos >= 0 && index->elems[pos] != elem) {
+      pos = kvtree_fprint_prev(index, h, pos);
+    }
+    if (pos >= 0) {
+      size_t after = index->count - (size_t) pos - 1;
+      memmove(index->fprints + pos, index->fprints + pos + 1, after * sizeof(uint32_t));
+      memmove(index->elems + pos, index->elems + pos + 1, after * sizeof(kvtree_elem*));
+      index->count--;
+    }
+    return;
+  }
+
+  /* find the slot holding this element */
+  size_t i = (size_t) h & index->mask;
+  while (index->slots[i].elem != NULL && index->slots[i].elem != elem) {
+    i = (i + 1) & index->mask;
+  }
+  if (index->slots[i].elem == NULL) {
+    /* element is shadowed by a newer element with the same key */
+    if (index->dups > 0) {
+      index->dups--;
+    }
+    return;
+  }
+
+  /* backward shift deletion: pull later entries of the probe
+   * sequence into the hole so lookups never stop early */
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & index->mask;
+    if (index->slots[j].elem == NULL) {
+      break;
+    }
+    size_t k = (size_t) index->slots[j].hash & index->mask;
+    int stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (! stays) {
+      index->slots[i] = index->slots[j];
+      i = j;
+    }
+  }
+  index->slots[i].elem = NULL;
+  index->count--;
+
+  /* if we ever shadowed a key, an older element with the same key may
+   * still be in the hash, and it becomes visible again */
+  if (index->dups > 0) {
+    kvtree_elem* e;
+    for (e = kvtree_elem_first(hash); e != NULL; e = kvtree_elem_next_sibling(e)) {
+      if (e != elem && e->key != NULL &&
+          KVTREE_KEY_EQUAL(e->key, e->flags & KVTREE_ELEM_FLAG_INTERNED,
+                           elem->key, elem->flags & KVTREE_ELEM_FLAG_INTERNED))
+      {
+        kvtree_index_insert(index, e);
+        index->dups--;
+        break;
+      }
+    }
+  }
+}
+
+/** returns the element matching key, or NULL if not found */
+kvtree_elem* kvtree_index_lookup(const struct kvtree_index_struct* index, const char* key)
+{
+  return kvtree_index_lookup_hash(index, key, kvtree_key_hash(key), 0);
+}
+
+/** returns the element whose key is the canonical form of the given
+ * integer, or NULL if not found */
+kvtree_elem* kvtree_index_lookup_int(const struct kvtree_index_struct* index, int64_t key)
+{
+  uint32_t h = kvtree_int_hash(key);
+
+  if (index->slots == NULL) {
+    long pos = kvtree_fprint_prev(index, h, (long) index->count);
+    while (pos >= 0) {
+      const kvtree_elem* cur = index->elems[pos];
+      if ((cur->flags & KVTREE_ELEM_FLAG_INTKEY) && cur->ikey == key) {
+        return index->elems[pos];
+      }
+      pos = kvtree_fprint_prev(index, h, pos);
+    }
+    return NULL;
+  }
+
+  size_t i = (size_t) h & index->mask;
+  while (index->slots[i].elem != NULL) {
+    const kvtree_elem* cur = index->slots[i].elem;
+    if (index->slots[i].hash == h && (cur->flags & KVTREE_ELEM_FLAG_INTKEY) && cur->ikey == key) {
+      return index->slots[i].elem;
+    }
+    i = (i + 1) & index->mask;
+  }
+  return NULL;
+}
+
+/** returns the element matching key given its hash value and whether
+ * key came from the intern pool, or NULL if not found */
+kvtree_elem* kvtree_index_lookup_hash(const struct kvtree_index_struct* index, const char* key, uint32_t hash, int interned)
+{
+  if (index->slots == NULL) {
+    long pos = kvtree_fprint_prev(index, hash, (long) index->count);
+    while (pos >= 0) {
+      const kvtree_elem* cur = index->elems[pos];
+      if (KVTREE_KEY_EQUAL(cur->key, cur->flags & KVTREE_ELEM_FLAG_INTERNED, key, interned)) {
+        return index->elems[pos];
+      }
+      pos = kvtree_fprint_prev(index, hash, pos);
+    }
+    return NULL;
+  }
+
+  size_t i = (size_t) hash & index->mask;
+  while (index->slots[i].elem != NULL) {
+    const kvtree_elem* cur = index->slots[i].elem;
+    if (index->slots[i].hash == hash &&
+        KVTREE_KEY_EQUAL(cur->key, cur->flags & KVTREE_ELEM_FLAG_INTERNED, key, interned))
+    {
+      return index->slots[i].elem;
+    }
+    i = (i + 1) & index->mask;
+  }
+  return NULL;
+}
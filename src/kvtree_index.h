@@ -0,0 +1,85 @@
+#ifndef KVTREE_INDEX_H
+#define KVTREE_INDEX_H
+
+#include <stdint.h>
+
+#include "kvtree.h"
+
+/** \file kvtree_index.h
+ *  \ingroup kvtree
+ *  \brief Index over the elements of a single kvtree node, used to speed
+ *  up key lookups on nodes with many children, either an array of key
+ *  fingerprints scanned a block at a time or an open-addressing table
+ */
+
+/** number of elements a node must hold before we build an index for it */
+#ifndef KVTREE_INDEX_THRESHOLD
+#define KVTREE_INDEX_THRESHOLD (8)
+#endif
+
+/** number of elements at which the index switches from scanning an
+ * array of key fingerprints to a hash table */
+#ifndef KVTREE_INDEX_TABLE_THRESHOLD
+#define KVTREE_INDEX_TABLE_THRESHOLD (32)
+#endif
+
+/** set in flags of an element whose key is the canonical decimal form
+ * of an integer, whose value is then stored in ikey */
+#define KVTREE_ELEM_FLAG_INTKEY (0x2)
+
+/** computes the hash value of a key string, keys that are the
+ * canonical decimal form of an integer hash the same as that integer
+ * does with kvtree_int_hash */
+uint32_t kvtree_key_hash(const char* key);
+
+/** computes the hash value of an integer key */
+uint32_t kvtree_int_hash(int64_t key);
+
+/** returns 1 and sets val if key is the canonical decimal form of a
+ * 64-bit integer (no sign unless negative, no leading zeros, no
+ * "-0"), returns 0 otherwise */
+int kvtree_key_parse_int(const char* key, int64_t* val);
+
+/** number of bytes needed to hold the canonical decimal form of any
+ * 64-bit integer, including the terminating NUL */
+#define KVTREE_INT_KEY_MAX (21)
+
+/** writes the canonical decimal form of val to buf, which must have
+ * room for KVTREE_INT_KEY_MAX bytes, returns length of the string */
+size_t kvtree_key_format_int(char* buf, int64_t val);
+
+/** allocates a new index and inserts each element currently in hash */
+struct kvtree_index_struct* kvtree_index_build(const kvtree* hash);
+
+/** frees an index, sets caller's pointer to NULL */
+void kvtree_index_delete(struct kvtree_index_struct** ptr_index);
+
+/** adds an element to the index, a newly added element shadows any
+ * older element having the same key */
+void kvtree_index_insert(struct kvtree_index_struct* index, kvtree_elem* elem);
+
+/** removes an element from the index, hash is the node the index
+ * belongs to, which is used to find any shadowed duplicate key */
+void kvtree_index_remove(struct kvtree_index_struct* index, const kvtree* hash, kvtree_elem* elem);
+
+/** returns the child of the same hash after elem, or NULL after the
+ * last one, unlike kvtree_elem_next it does not go on from the last
+ * child of one shard of a sharded hash to the next shard, defined in
+ * kvtree.c */
+kvtree_elem* kvtree_elem_next_sibling(const kvtree_elem* elem);
+
+/** returns the hash value of the key of an element */
+uint32_t kvtree_elem_key_hash(const kvtree_elem* elem);
+
+/** returns the element matching key, or NULL if not found */
+kvtree_elem* kvtree_index_lookup(const struct kvtree_index_struct* index, const char* key);
+
+/** returns the element whose key is the canonical form of the given
+ * integer, or NULL if not found */
+kvtree_elem* kvtree_index_lookup_int(const struct kvtree_index_struct* index, int64_t key);
+
+/** returns the element matching key given its hash value and whether
+ * key came from the intern pool, or NULL if not found */
+kvtree_elem* kvtree_index_lookup_hash(const struct kvtree_index_struct* index, const char* key, uint32_t hash, int interned);
+
+#endif
@@ -0,0 +1,193 @@
+/* Implements the key intern pool.  Each pooled key is stored behind a
+ * small header holding its reference count and hash value, and the
+ * pool itself is an open-addressing table of pointers to those
+ * headers, using linear probing and backward shift deletion like the
+ * per-node key index.
+ *
+ * The pool is shared by every kvtree in the process, so a mutex
+ * guards the table and reference counts, which lets threads that
+ * modify different kvtrees (or different subtrees through a
+ * kvtree_concurrent handle) intern keys at the same time. */
+
+#include "kvtree.h"
+#include "kvtree_intern.h"
+#include "kvtree_index.h"
+#include "kvtree_helpers.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/** smallest table we allocate, must be a power of two */
+#define KVTREE_INTERN_MIN_SLOTS (256)
+
+/** define the header stored in front of each pooled key */
+struct kvtree_intern_entry {
+  uint32_t refs; /* number of elements referencing this key */
+  uint32_t hash; /* hash value of key */
+  char key[];    /* key string */
+};
+
+/** whether new heap elements intern their keys */
+static int kvtree_intern_on = 0;
+
+/** table of pooled keys, NULL slots are empty */
+static struct kvtree_intern_entry** kvtree_intern_slots = NULL;
+static size_t kvtree_intern_mask  = 0;
+static size_t kvtree_intern_count = 0;
+
+/** guards the table and the reference counts of pooled keys */
+static pthread_mutex_t kvtree_intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** given a pooled key, return its header */
+static struct kvtree_intern_entry* kvtree_intern_entry_of(const char* key)
+{
+  return (struct kvtree_intern_entry*) (key - offsetof(struct kvtree_intern_entry, key));
+}
+
+/** enable (1) or disable (0) interning of keys of new elements,
+ * returns the previous setting */
+int kvtree_intern_keys(int enable)
+{
+  int prev = kvtree_intern_on;
+  kvtree_intern_on = (enable != 0);
+  return prev;
+}
+
+/** returns 1 if new heap elements should intern their keys */
+int kvtree_intern_enabled(void)
+{
+  return kvtree_intern_on;
+}
+
+/** resize table to given number of slots and reinsert all keys */
+static void kvtree_intern_resize(size_t slots)
+{
+  struct kvtree_intern_entry** old = kvtree_intern_slots;
+  size_t old_slots = (old != NULL) ? kvtree_intern_mask + 1 : 0;
+
+  kvtree_intern_slots = (struct kvtree_intern_entry**) KVTREE_MALLOC(slots * sizeof(struct kvtree_intern_entry*));
+  memset(kvtree_intern_slots, 0, slots * sizeof(struct kvtree_intern_entry*));
+  kvtree_intern_mask = slots - 1;
+
+  size_t i;
+  for (i = 0; i < old_slots; i++) {
+    if (old[i] != NULL) {
+      size_t j = (size_t) old[i]->hash & kvtree_intern_mask;
+      while (kvtree_intern_slots[j] != NULL) {
+        j = (j + 1) & kvtree_intern_mask;
+      }
+      kvtree_intern_slots[j] = old[i];
+    }
+  }
+
+  kvtree_free(&old);
+}
+
+/** returns pooled copy of key, adding it to the pool if needed,
+ * and takes a reference on it */
+char* kvtree_intern_get(const char* key)
+{
+  /* hash the key before taking the lock */
+  uint32_t h = kvtree_key_hash(key);
+
+  pthread_mutex_lock(&kvtree_intern_lock);
+
+  /* keep the table at most half full */
+  if (kvtree_intern_slots == NULL) {
+    kvtree_intern_resize(KVTREE_INTERN_MIN_SLOTS);
+  } else if ((kvtree_intern_count + 1) * 2 > kvtree_intern_mask + 1) {
+    kvtree_intern_resize((kvtree_intern_mask + 1) * 2);
+  }
+
+  /* look for the key in the pool */
+  size_t i = (size_t) h & kvtree_intern_mask;
+  while (kvtree_intern_slots[i] != NULL) {
+    struct kvtree_intern_entry* entry = kvtree_intern_slots[i];
+    if (entry->hash == h && strcmp(entry->key, key) == 0) {
+      entry->refs++;
+      pthread_mutex_unlock(&kvtree_intern_lock);
+      return entry->key;
+    }
+    i = (i + 1) & kvtree_intern_mask;
+  }
+
+  /* not found, add a new entry in the empty slot we stopped at */
+  size_t len = strlen(key) + 1;
+  struct kvtree_intern_entry* entry = (struct kvtree_intern_entry*) KVTREE_MALLOC(sizeof(struct kvtree_intern_entry) + len);
+  entry->refs = 1;
+  entry->hash = h;
+  memcpy(entry->key, key, len);
+  kvtree_intern_slots[i] = entry;
+  kvtree_intern_count++;
+  pthread_mutex_unlock(&kvtree_intern_lock);
+  return entry->key;
+}
+
+/** takes another reference on a key returned by kvtree_intern_get */
+char* kvtree_intern_ref(char* key)
+{
+  pthread_mutex_lock(&kvtree_intern_lock);
+  kvtree_intern_entry_of(key)->refs++;
+  pthread_mutex_unlock(&kvtree_intern_lock);
+  return key;
+}
+
+/** drops a reference on a key returned by kvtree_intern_get, frees
+ * the key once its last reference is dropped */
+void kvtree_intern_put(char** ptr_key)
+{
+  if (ptr_key == NULL || *ptr_key == NULL) {
+    return;
+  }
+
+  struct kvtree_intern_entry* entry = kvtree_intern_entry_of(*ptr_key);
+  *ptr_key = NULL;
+
+  pthread_mutex_lock(&kvtree_intern_lock);
+  entry->refs--;
+  if (entry->refs > 0) {
+    pthread_mutex_unlock(&kvtree_intern_lock);
+    return;
+  }
+
+  /* find the slot holding this entry */
+  size_t i = (size_t) entry->hash & kvtree_intern_mask;
+  while (kvtree_intern_slots[i] != entry) {
+    i = (i + 1) & kvtree_intern_mask;
+  }
+
+  /* backward shift deletion, see kvtree_index_remove */
+  size_t j = i;
+  while (1) {
+    j = (j + 1) & kvtree_intern_mask;
+    if (kvtree_intern_slots[j] == NULL) {
+      break;
+    }
+    size_t k = (size_t) kvtree_intern_slots[j]->hash & kvtree_intern_mask;
+    int stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (! stays) {
+      kvtree_intern_slots[i] = kvtree_intern_slots[j];
+      i = j;
+    }
+  }
+  kvtree_intern_slots[i] = NULL;
+  kvtree_intern_count--;
+
+  /* release the table once the pool is empty */
+  if (kvtree_intern_count == 0) {
+    kvtree_free(&kvtree_intern_slots);
+    kvtree_intern_mask = 0;
+  }
+  pthread_mutex_unlock(&kvtree_intern_lock);
+
+  kvtree_free(&entry);
+}
+
+/** returns the hash value of a key returned by kvtree_intern_get */
+uint32_t kvtree_intern_hash(const char* key)
+{
+  return kvtree_intern_entry_of(key)->hash;
+}
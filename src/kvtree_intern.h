@@ -0,0 +1,39 @@
+#ifndef KVTREE_INTERN_H
+#define KVTREE_INTERN_H
+
+#include <stdint.h>
+
+/** \file kvtree_intern.h
+ *  \ingroup kvtree
+ *  \brief Reference-counted pool of key strings shared by all kvtrees,
+ *  so that elements with identical keys can share one allocation
+ */
+
+/** set in flags of an element whose key came from the pool */
+#define KVTREE_ELEM_FLAG_INTERNED (0x1)
+
+/** compares two keys, given whether each was interned, two interned
+ * keys are equal only if they are the same pointer */
+#define KVTREE_KEY_EQUAL(a, a_interned, b, b_interned) \
+  ((a) == (b) || (! ((a_interned) && (b_interned)) && strcmp((a), (b)) == 0))
+
+/** returns 1 if new heap elements should intern their keys */
+int kvtree_intern_enabled(void);
+
+/** returns pooled copy of key, adding it to the pool if needed,
+ * and takes a reference on it */
+char* kvtree_intern_get(const char* key);
+
+/** takes another reference on a key returned by kvtree_intern_get */
+char* kvtree_intern_ref(char* key);
+
+/** drops a reference on a key returned by kvtree_intern_get, frees
+ * the key once its last reference is dropped, sets caller's pointer to
+ * NULL */
+void kvtree_intern_put(char** ptr_key);
+
+/** returns the hash value of a key returned by kvtree_intern_get,
+ * which is computed once when the key enters the pool */
+uint32_t kvtree_intern_hash(const char* key);
+
+#endif
@@ -28,6 +28,8 @@ Hash MPI transfer functions
 /* packs and send the given hash to the specified rank */
 int kvtree_send(const kvtree* hash, int rank, MPI_Comm comm)
 {
+  int rc = KVTREE_SUCCESS;
+
   /* get size of hash and check that it doesn't exceed INT_MAX */
   size_t pack_size = kvtree_pack_size(hash);
   size_t max_int = (size_t) INT_MAX;
@@ -37,12 +39,20 @@ int kvtree_send(const kvtree* hash, int rank, MPI_Comm comm)
     );
   }
 
-  /* tell destination how big the pack size is */
+  /* tell destination how big the pack size is, a size of 0 tells it
+   * that we failed to pack the hash */
   int size = (int) pack_size;
   MPI_Send(&size, 1, MPI_INT, rank, 0, comm);
+  if (size == 0) {
+    rc = KVTREE_FAILURE;
+  }
 
-  /* pack the hash and send it */
-  if (size > 0) {
+  /* pack the hash and send it, a frozen hash is already packed */
+  size_t image_size;
+  const char* image = kvtree_packed(hash, &image_size);
+  if (size > 0 && image != NULL) {
+    MPI_Send((void*) image, size, MPI_BYTE, rank, 0, comm);
+  } else if (size > 0) {
     /* allocate a buffer big enough to pack the hash */
     /* pack the hash, send it, and free our buffer */
     char* buf = (char*) KVTREE_MALLOC((size_t)size);
@@ -51,7 +61,7 @@ int kvtree_send(const kvtree* hash, int rank, MPI_Comm comm)
     kvtree_free(&buf);
   }
 
-  return KVTREE_SUCCESS;
+  return rc;
 }
 
 /* receives a hash from the specified rank and unpacks it into specified hash */
@@ -76,8 +86,14 @@ int kvtree_recv(kvtree* hash, int rank, MPI_Comm comm)
     /* receive the hash, unpack it, and free our buffer */
     char* buf = (char*) KVTREE_MALLOC((size_t)size);
     MPI_Recv(buf, size, MPI_BYTE, rank, 0, comm, &status);
-    kvtree_unpack(buf, hash);
+    size_t unpacked = kvtree_unpack(buf, hash);
     kvtree_free(&buf);
+    if (unpacked == 0) {
+      return KVTREE_FAILURE;
+    }
+  } else {
+    /* the sender failed to pack its hash */
+    return KVTREE_FAILURE;
   }
 
   return KVTREE_SUCCESS;
@@ -132,6 +148,11 @@ int kvtree_sendrecv(const kvtree* hash_send, int rank_send,
     MPI_Waitall(num_req, request, status);
   }
 
+  /* a size of 0 means that the sender failed to pack its hash */
+  if ((have_outgoing && size_send == 0) || (have_incoming && size_recv == 0)) {
+    rc = KVTREE_FAILURE;
+  }
+
   /* allocate space to pack our hash and space to receive the incoming hash */
   num_req = 0;
   char* buf_send = NULL;
@@ -143,10 +164,16 @@ int kvtree_sendrecv(const kvtree* hash_send, int rank_send,
     num_req++;
   }
   if (size_send > 0) {
-    /* allocate space, pack our hash, and send it */
-    buf_send = (char*) KVTREE_MALLOC((size_t)size_send);
-    kvtree_pack(buf_send, hash_send);
-    MPI_Isend(buf_send, size_send, MPI_BYTE, rank_send, 0, comm, &request[num_req]);
+    /* allocate space, pack our hash, and send it, a frozen hash is
+     * sent as it is */
+    size_t image_size;
+    const char* image = kvtree_packed(hash_send, &image_size);
+    if (image == NULL) {
+      buf_send = (char*) KVTREE_MALLOC((size_t)size_send);
+      kvtree_pack(buf_send, hash_send);
+      image = buf_send;
+    }
+    MPI_Isend((void*) image, size_send, MPI_BYTE, rank_send, 0, comm, &request[num_req]);
     num_req++;
   }
   if (num_req > 0) {
@@ -154,8 +181,8 @@ int kvtree_sendrecv(const kvtree* hash_send, int rank_send,
   }
 
   /* unpack the hash into the hash_recv provided by the caller */
-  if (size_recv > 0) {
-    kvtree_unpack(buf_recv, hash_recv);
+  if (size_recv > 0 && kvtree_unpack(buf_recv, hash_recv) == 0) {
+    rc = KVTREE_FAILURE;
   }
 
   /* free the pack buffers */
@@ -168,6 +195,8 @@ int kvtree_sendrecv(const kvtree* hash_send, int rank_send,
 /* broadcasts a hash from a root and unpacks it into specified hash on all other tasks */
 int kvtree_bcast(kvtree* hash, int root, MPI_Comm comm)
 {
+  int rc = KVTREE_SUCCESS;
+
   /* get our rank in the communicator */
   int rank;
   MPI_Comm_rank(comm, &rank);
@@ -183,12 +212,20 @@ int kvtree_bcast(kvtree* hash, int root, MPI_Comm comm)
       );
     }
 
-    /* broadcast the size */
+    /* broadcast the size, a size of 0 tells the others that we failed
+     * to pack the hash */
     int size = (int) pack_size;
     MPI_Bcast(&size, 1, MPI_INT, root, comm);
+    if (size == 0) {
+      rc = KVTREE_FAILURE;
+    }
 
-    /* pack the hash and send it */
-    if (size > 0) {
+    /* pack the hash and send it, a frozen hash is already packed */
+    size_t image_size;
+    const char* image = kvtree_packed(hash, &image_size);
+    if (size > 0 && image != NULL) {
+      MPI_Bcast((void*) image, size, MPI_BYTE, root, comm);
+    } else if (size > 0) {
       /* allocate a buffer big enough to pack the hash */
       /* pack the hash, broadcast it, and free our buffer */
       char* buf = (char*) KVTREE_MALLOC((size_t)size);
@@ -210,12 +247,17 @@ int kvtree_bcast(kvtree* hash, int root, MPI_Comm comm)
       /* receive the hash, unpack it, and free our buffer */
       char* buf = (char*) KVTREE_MALLOC((size_t)size);
       MPI_Bcast(buf, size, MPI_BYTE, root, comm);
-      kvtree_unpack(buf, hash);
+      if (kvtree_unpack(buf, hash) == 0) {
+        rc = KVTREE_FAILURE;
+      }
       kvtree_free(&buf);
+    } else {
+      /* the root failed to pack its hash */
+      rc = KVTREE_FAILURE;
     }
   }
 
-  return KVTREE_SUCCESS;
+  return rc;
 }
 
 /* insert message destined for rank into send kvtree */
@@ -223,15 +265,18 @@ int kvtree_exchange_sendq(kvtree* send_hash, int rank, const kvtree* msg)
 {
   /* see whether we've already got data for this rank,
    * if so, merge it in, otherwise create a copy and add it */
-  kvtree* hash = kvtree_getf(send_hash, "%d", rank);
+  kvtree_key key = { NULL, rank };
+  kvtree* hash = kvtree_get_keys(send_hash, &key, 1);
   if (hash == NULL) {
     /* no hash going to this rank yet, make a copy of the message and attach it */
-    kvtree* copy = kvtree_new();
-    kvtree_merge(copy, msg);
-    kvtree_setf(send_hash, copy, "%d", rank);
+    kvtree* copy = kvtree_clone(msg);
+    if (copy == NULL) {
+      return KVTREE_FAILURE;
+    }
+    kvtree_set_keys(send_hash, copy, &key, 1);
   } else {
     /* got something already, just merge this message with outgoing data */
-    kvtree_merge(hash, msg);
+    return kvtree_merge(hash, msg);
   }
   return KVTREE_SUCCESS;
 }
@@ -338,15 +383,15 @@ static int kvtree_exchange_direction_hops(
         /* we are the destination for this item, discard SRC key
          * and copy hash to output hash */
         kvtree* dest_hash = kvtree_get(elem_hash, "S");
-        kvtree_merge(hash_out, dest_hash);
+        kvtree_merge_move(hash_out, dest_hash);
       } else if (dist & bit) {
         /* we send the hash if the bit is set */
         kvtree* dest_send = kvtree_set_kv_int(send, "D", dest_rank);
-        kvtree_merge(dest_send, elem_hash);
+        kvtree_merge_move(dest_send, elem_hash);
       } else {
-        /* otherwise, copy hash to keep */
+        /* otherwise, move hash to keep */
         kvtree* dest_keep = kvtree_set_kv_int(keep, "D", dest_rank);
-        kvtree_merge(dest_keep, elem_hash);
+        kvtree_merge_move(dest_keep, elem_hash);
       }
     }
 
@@ -354,7 +399,7 @@ static int kvtree_exchange_direction_hops(
     kvtree_sendrecv(send, dst, recv, src, comm);
 
     /* merge received hash into keep */
-    kvtree_merge(keep, recv);
+    kvtree_merge_move(keep, recv);
 
     /* delete current hash and point it to keep instead */
     kvtree_delete(&current);
@@ -370,10 +415,10 @@ static int kvtree_exchange_direction_hops(
 
   /* TODO: check that all items are really destined for this rank */
 
-  /* copy current into output hash */
+  /* move current into output hash */
   kvtree* dest_hash = kvtree_get_kv_int(current, "D", rank);
   kvtree* elem_hash = kvtree_get(dest_hash, "S");
-  kvtree_merge(hash_out, elem_hash);
+  kvtree_merge_move(hash_out, elem_hash);
 
   /* free the current hash */
   kvtree_delete(&current);
@@ -466,17 +511,17 @@ int kvtree_exchange(const kvtree* send, kvtree* recv, MPI_Comm comm)
     }
 
     /* assign to hash having the fewest hops */
-    kvtree* tmp = kvtree_new();
-    kvtree_merge(tmp, elem_hash);
+    kvtree* tmp = kvtree_clone(elem_hash);
+    kvtree_key key = { NULL, dest };
     if (hops_left < hops_right) {
       /* assign to left-going exchange */
-      kvtree_setf(left, tmp, "%d", dest);
+      kvtree_set_keys(left, tmp, &key, 1);
       if (steps_left > max_steps[STEPS_LEFT]) {
         max_steps[STEPS_LEFT] = steps_left;
       }
     } else {
       /* assign to right-going exchange */
-      kvtree_setf(right, tmp, "%d", dest);
+      kvtree_set_keys(right, tmp, &key, 1);
       if (steps_right > max_steps[STEPS_RIGHT]) {
         max_steps[STEPS_RIGHT] = steps_right;
       }
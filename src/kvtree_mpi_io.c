@@ -233,7 +233,9 @@ static unsigned long kvtree_write_gather_map(
       /* persist hash */
       void* buf = NULL;
       size_t bufsize = 0;
-      kvtree_write_persist(&buf, &bufsize, save);
+      if (kvtree_write_persist(&buf, &bufsize, save) != KVTREE_SUCCESS) {
+        rc = KVTREE_FAILURE;
+      }
 
       /* write data to file */
       kvtree_lseek(mappath, fd, offset, SEEK_SET);
@@ -290,8 +292,10 @@ int kvtree_write_gather(
   kvtree* send = kvtree_new();
   kvtree* recv = kvtree_new();
 
-  /* copy data into send hash */
-  kvtree_exchange_sendq(send, writer, data);
+  /* copy data into send hash, this fails if data holds a sharded hash */
+  if (kvtree_exchange_sendq(send, writer, data) != KVTREE_SUCCESS) {
+    rc = KVTREE_FAILURE;
+  }
 
   /* gather hashes to writers */
   kvtree_exchange_direction(send, recv, comm, KVTREE_EXCHANGE_LEFT);
@@ -341,9 +345,11 @@ int kvtree_write_gather(
       kvtree_util_set_int(save, "RANKS", ranks_world);
 
       /* persist and compress hash */
-      void* buf;
-      size_t bufsize;
-      kvtree_write_persist(&buf, &bufsize, save);
+      void* buf = NULL;
+      size_t bufsize = 0;
+      if (kvtree_write_persist(&buf, &bufsize, save) != KVTREE_SUCCESS) {
+        rc = KVTREE_FAILURE;
+      }
 
       /* write data to file */
       kvtree_lseek(mappath, fd, offset, SEEK_SET);
@@ -425,13 +431,15 @@ static int kvtree_read_scatter_map(
   }
 
   /* create hashes to exchange data */
-  kvtree* send = kvtree_new();
+  kvtree* send = NULL;
   kvtree* recv = kvtree_new();
 
   /* copy rank data into send hash */
   if (valid) {
     kvtree* rank_hash = kvtree_get(hash, "RANK");
-    kvtree_merge(send, rank_hash);
+    send = kvtree_clone(rank_hash);
+  } else {
+    send = kvtree_new();
   }
 
   /* exchange hashes */
@@ -611,7 +619,7 @@ int kvtree_read_scatter(
     /* the key is the source rank, which we don't care about,
      * the info we need is in the element hash */
     kvtree* elem_hash = kvtree_elem_hash(elem);
-    kvtree_merge(data, elem_hash);
+    kvtree_merge_move(data, elem_hash);
   }
 
   /* check that everyone read the data ok */
@@ -21,6 +21,7 @@ static void print_usage(void)
   printf("\n");
   printf("  Options:\n");
   printf("    -m, --mode <mode>  Specify print format: \"tree\" or \"keyval\" (default tree)\n");
+  printf("    -s, --sorted       Print keys in sorted order\n");
   printf("    -h, --help         Print usage\n");
   printf("\n");
 }
@@ -29,15 +30,17 @@ int main(int argc, char* argv[])
 {
   int rc = 0;
 
-  static const char *opt_string = "m:h";
+  static const char *opt_string = "m:sh";
   static struct option long_options[] = {
     {"mode",    required_argument, NULL, 'm'},
+    {"sorted",  no_argument,       NULL, 's'},
     {"help",    no_argument,       NULL, 'h'},
     {NULL,      no_argument,       NULL,   0}
   };
 
   int usage = 0;
   char* mode = NULL;
+  int sorted = 0;
 
   int long_index = 0;
   while (1) {
@@ -50,6 +53,9 @@ int main(int argc, char* argv[])
       case 'm':
         mode = strdup(optarg);
         break;
+      case 's':
+        sorted = 1;
+        break;
       case 'h':
         usage = 1;
         break;
@@ -84,6 +90,10 @@ int main(int argc, char* argv[])
     free(mode);
   }
 
+  if (sorted) {
+    print_mode |= KVTREE_PRINT_SORTED;
+  }
+
   if (usage) {
     print_usage();
     return rc;
@@ -11,82 +11,61 @@
 #include <sys/stat.h>
 #include <stdint.h>
 
-/* need at least version 8.5 of queue.h from Berkeley */
-#include "queue.h"
-
 int kvtree_util_set_bytecount(kvtree* hash, const char* key, unsigned long count)
 {
-  /* first, unset any current setting */
-  kvtree_unset(hash, key);
-
-  /* then set the new value */
-  kvtree_setf(hash, NULL, "%s %lu", key, count);
+  /* setting a typed value replaces any current setting */
+  kvtree_set_uint64(hash, key, (uint64_t) count);
 
   return KVTREE_SUCCESS;
 }
 
 int kvtree_util_set_crc32(kvtree* hash, const char* key, uLong crc)
 {
-  /* first, unset any current setting */
-  kvtree_unset(hash, key);
-
-  /* then set the new value */
-  kvtree_setf(hash, NULL, "%s %#x", key, (uint32_t) crc);
+  /* setting a typed value replaces any current setting */
+  kvtree_set_uint64_hex(hash, key, (uint64_t) (uint32_t) crc);
 
   return KVTREE_SUCCESS;
 }
 
 int kvtree_util_set_int(kvtree* hash, const char* key, int value)
 {
-  /* first, unset any current setting */
-  kvtree_unset(hash, key);
-
-  /* then set the new value */
-  kvtree_set_kv_int(hash, key, value);
+  /* setting a typed value replaces any current setting */
+  kvtree_set_int64(hash, key, (int64_t) value);
 
   return KVTREE_SUCCESS;
 }
 
 int kvtree_util_set_unsigned_long(kvtree* hash, const char* key, unsigned long value)
 {
-  /* first, unset any current setting */
-  kvtree_unset(hash, key);
-
-  /* then set the new value */
-  kvtree_setf(hash, NULL, "%s %lu", key, value);
+  /* setting a typed value replaces any current setting */
+  kvtree_set_uint64(hash, key, (uint64_t) value);
 
   return KVTREE_SUCCESS;
 }
 
 int kvtree_util_set_str(kvtree* hash, const char* key, const char* value)
 {
-  /* first, unset any current setting */
+  /* first, unset any current setting, in case value is NULL */
   kvtree_unset(hash, key);
 
   /* then set the new value */
-  kvtree_set_kv(hash, key, value);
+  kvtree_set_str(hash, key, value);
 
   return KVTREE_SUCCESS;
 }
 
 int kvtree_util_set_int64(kvtree* hash, const char* key, int64_t value)
 {
-  /* first, unset any current setting */
-  kvtree_unset(hash, key);
-
-  /* then set the new value */
-  kvtree_setf(hash, NULL, "%s %lld", key, value);
+  /* setting a typed value replaces any current setting */
+  kvtree_set_int64(hash, key, value);
 
   return KVTREE_SUCCESS;
 }
 
 int kvtree_util_set_double(kvtree* hash, const char* key, double value)
 {
-  /* first, unset any current setting */
-  kvtree_unset(hash, key);
-
-  /* then set the new value */
-  kvtree_setf(hash, NULL, "%s %f", key, value);
+  /* setting a typed value replaces any current setting */
+  kvtree_set_double(hash, key, value);
 
   return KVTREE_SUCCESS;
 }
@@ -97,21 +76,31 @@ int kvtree_util_set_ptr(kvtree* hash, const char* key, void* value)
   kvtree_unset(hash, key);
 
   /* then set the new value */
-  kvtree_setf(hash, NULL, "%s %p", key, value);
+  char value_str[32];
+  snprintf(value_str, sizeof(value_str), "%p", value);
+  const char* keys[2] = { key, value_str };
+  kvtree_set_path(hash, NULL, keys, 2);
 
   return KVTREE_SUCCESS;
 }
 
-int kvtree_util_get_bytecount(const kvtree* hash, const char* key, unsigned long* val)
+int kvtree_util_set_bytes(kvtree* hash, const char* key, const void* buf, size_t size)
 {
-  int rc = KVTREE_FAILURE;
+  /* setting a blob replaces any current setting */
+  if (kvtree_set_bytes(hash, key, buf, size) == NULL) {
+    return KVTREE_FAILURE;
+  }
 
-  /* check whether this key is even set */
-  char* val_str = kvtree_get_val(hash, key);
-  if (val_str != NULL) {
-    /* convert the key string */
-    *val = strtoul(val_str, NULL, 0);
-    rc = KVTREE_SUCCESS;
+  return KVTREE_SUCCESS;
+}
+
+int kvtree_util_get_bytecount(const kvtree* hash, const char* key, unsigned long* val)
+{
+  /* use the native value if it has one, otherwise parse the string */
+  uint64_t val_tmp;
+  int rc = kvtree_get_uint64(hash, key, &val_tmp);
+  if (rc == KVTREE_SUCCESS) {
+    *val = (unsigned long) val_tmp;
   }
 
   return rc;
@@ -119,14 +108,11 @@ int kvtree_util_get_bytecount(const kvtree* hash, const char* key, unsigned long
 
 int kvtree_util_get_crc32(const kvtree* hash, const char* key, uLong* val)
 {
-  int rc = KVTREE_FAILURE;
-
-  /* check whether this key is even set */
-  char* val_str = kvtree_get_val(hash, key);
-  if (val_str != NULL) {
-    /* convert the key string */
-    *val = (uLong) strtoul(val_str, NULL, 0);
-    rc = KVTREE_SUCCESS;
+  /* use the native value if it has one, otherwise parse the string */
+  uint64_t val_tmp;
+  int rc = kvtree_get_uint64(hash, key, &val_tmp);
+  if (rc == KVTREE_SUCCESS) {
+    *val = (uLong) val_tmp;
   }
 
   return rc;
@@ -136,6 +122,16 @@ int kvtree_util_get_int(const kvtree* hash, const char* key, int* value)
 {
   int rc = KVTREE_FAILURE;
 
+  /* use the native value if it has one */
+  if (kvtree_get_type(hash, key) != KVTREE_TYPE_NONE) {
+    int64_t val_tmp;
+    rc = kvtree_get_int64(hash, key, &val_tmp);
+    if (rc == KVTREE_SUCCESS) {
+      *value = (int) val_tmp;
+    }
+    return rc;
+  }
+
   char* val_str = kvtree_elem_get_first_val(hash, key);
   if (val_str != NULL) {
     *value = atoi(val_str);
@@ -147,14 +143,11 @@ int kvtree_util_get_int(const kvtree* hash, const char* key, int* value)
 
 int kvtree_util_get_unsigned_long(const kvtree* hash, const char* key, unsigned long* val)
 {
-  int rc = KVTREE_FAILURE;
-
-  /* check whether this key is even set */
-  char* val_str = kvtree_get_val(hash, key);
-  if (val_str != NULL) {
-    /* convert the key string */
-    *val = strtoul(val_str, NULL, 0);
-    rc = KVTREE_SUCCESS;
+  /* use the native value if it has one, otherwise parse the string */
+  uint64_t val_tmp;
+  int rc = kvtree_get_uint64(hash, key, &val_tmp);
+  if (rc == KVTREE_SUCCESS) {
+    *val = (unsigned long) val_tmp;
   }
 
   return rc;
@@ -177,32 +170,17 @@ int kvtree_util_get_str(const kvtree* hash, const char* key, char** val)
 
 int kvtree_util_get_int64(const kvtree* hash, const char* key, int64_t* val)
 {
-  int rc = KVTREE_FAILURE;
-
-  /* check whether this key is even set */
-  char* val_str = kvtree_get_val(hash, key);
-  if (val_str != NULL) {
-    /* convert the key string */
-    *val = (int64_t) strtoll(val_str, NULL, 0);
-    rc = KVTREE_SUCCESS;
-  }
-
-  return rc;
+  /* use the native value if it has one, otherwise parse the string */
+  return kvtree_get_int64(hash, key, val);
 }
 
 int kvtree_util_get_double(const kvtree* hash, const char* key, double* val)
 {
-  int rc = KVTREE_FAILURE;
-
-  /* check whether this key is even set */
-  char* val_str = kvtree_get_val(hash, key);
-  if (val_str != NULL) {
-    /* convert the key string */
-    double val_tmp;
-    if (kvtree_atod(val_str, &val_tmp) == KVTREE_SUCCESS) {
-      *val = val_tmp;
-      rc = KVTREE_SUCCESS;
-    }
+  /* use the native value if it has one, otherwise parse the string */
+  double val_tmp;
+  int rc = kvtree_get_double(hash, key, &val_tmp);
+  if (rc == KVTREE_SUCCESS) {
+    *val = val_tmp;
   }
 
   return rc;
@@ -226,3 +204,9 @@ int kvtree_util_get_ptr(const kvtree* hash, const char* key, void** val)
 
   return rc;
 }
+
+int kvtree_util_get_bytes(const kvtree* hash, const char* key, const void** buf, size_t* size)
+{
+  /* hands back a pointer to the data held in the hash */
+  return kvtree_get_bytes(hash, key, buf, size);
+}
@@ -34,6 +34,10 @@ int kvtree_util_set_int64(kvtree* hash, const char* key, int64_t value);
 int kvtree_util_set_double(kvtree* hash, const char* key, double value);
 
 int kvtree_util_set_ptr(kvtree* hash, const char* key, void* ptr);
+
+/** stores a copy of size bytes starting at buf, unlike the other
+ * values these have no string form */
+int kvtree_util_set_bytes(kvtree* hash, const char* key, const void* buf, size_t size);
 ///@}
 
 /** \name getter functions
@@ -59,6 +63,10 @@ int kvtree_util_get_int64(const kvtree* hash, const char* key, int64_t* value);
 int kvtree_util_get_double(const kvtree* hash, const char* key, double* value);
 
 int kvtree_util_get_ptr(const kvtree* hash, const char* key, void** value);
+
+/** sets buf to point to the bytes held in the hash, without copying
+ * them, the pointer is valid until key is changed or hash is deleted */
+int kvtree_util_get_bytes(const kvtree* hash, const char* key, const void** buf, size_t* size);
 ///@}
 
 /* enable C++ codes to include this header directly */
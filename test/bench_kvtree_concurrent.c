@@ -0,0 +1,130 @@
+/*
+ * This benchmark measures how well threads that read and update per-rank
+ * metadata scale with a kvtree_concurrent handle, compared to a single
+ * global mutex around a plain kvtree.  Each thread does 90% util_get_int
+ * and 10% util_set_int calls on randomly picked top level keys.  It is
+ * built along with the tests, but not run by ctest, as its numbers only
+ * mean something on an otherwise idle multi-core node.
+ *
+ * usage: bench_kvtree_concurrent [total_ops] [max_threads]
+ */
+
+#include "kvtree.h"
+#include "kvtree_util.h"
+#include "kvtree_concurrent.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define KEYS 256
+#define OPS (4 * 1024 * 1024)
+#define MAX_THREADS 64
+
+static char keys[KEYS][16];
+
+static kvtree* plain;
+static pthread_mutex_t plain_lock = PTHREAD_MUTEX_INITIALIZER;
+static kvtree_concurrent* striped;
+
+/* define the work of one benchmark thread */
+struct bench_arg {
+  int ops;
+  unsigned int seed;
+  int use_striped;
+};
+
+/* returns a pseudo-random number, each thread keeps its own state */
+static unsigned int bench_rand(unsigned int* seed)
+{
+  *seed = *seed * 1103515245u + 12345u;
+  return *seed >> 8;
+}
+
+static void* bench_thread(void* arg)
+{
+  struct bench_arg* a = (struct bench_arg*) arg;
+  int i, value;
+  for (i = 0; i < a->ops; i++) {
+    unsigned int r = bench_rand(&a->seed);
+    const char* key = keys[r % KEYS];
+    int write = ((r >> 16) % 10 == 0);
+    if (a->use_striped) {
+      if (write) {
+        kvtree_concurrent_util_set_int(striped, key, "SIZE", i);
+      } else {
+        kvtree_concurrent_util_get_int(striped, key, "SIZE", &value);
+      }
+    } else {
+      pthread_mutex_lock(&plain_lock);
+      if (write) {
+        kvtree_util_set_int(kvtree_get(plain, key), "SIZE", i);
+      } else {
+        kvtree_util_get_int(kvtree_get(plain, key), "SIZE", &value);
+      }
+      pthread_mutex_unlock(&plain_lock);
+    }
+  }
+  return NULL;
+}
+
+/* runs total_ops operations split across nthreads, returns Mops/s */
+static double bench_run(int nthreads, int total_ops, int use_striped)
+{
+  pthread_t threads[MAX_THREADS];
+  struct bench_arg args[MAX_THREADS];
+  struct timespec start, end;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < nthreads; i++) {
+    args[i].ops         = total_ops / nthreads;
+    args[i].seed        = (unsigned int) i + 1;
+    args[i].use_striped = use_striped;
+    pthread_create(&threads[i], NULL, bench_thread, &args[i]);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (double) (end.tv_sec - start.tv_sec) +
+                (double) (end.tv_nsec - start.tv_nsec) * 1e-9;
+  double ops = (double) (total_ops / nthreads) * nthreads;
+  return ops / secs * 1e-6;
+}
+
+int main(int argc, char** argv)
+{
+  int total_ops = (argc > 1) ? atoi(argv[1]) : OPS;
+  int max_threads = (argc > 2) ? atoi(argv[2]) : MAX_THREADS;
+  if (total_ops < 1 || max_threads < 1 || max_threads > MAX_THREADS) {
+    printf("usage: %s [total_ops] [max_threads <= %d]\n", argv[0], MAX_THREADS);
+    return 1;
+  }
+
+  /* both trees start out with every key set */
+  int i;
+  plain = kvtree_new();
+  kvtree* hash = kvtree_new();
+  for (i = 0; i < KEYS; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "RANK%d", i);
+    kvtree_util_set_int(kvtree_set(plain, keys[i], kvtree_new()), "SIZE", 0);
+    kvtree_util_set_int(kvtree_set(hash, keys[i], kvtree_new()), "SIZE", 0);
+  }
+  striped = kvtree_concurrent_new(hash, 0);
+
+  printf("%d ops, 90%% get and 10%% set over %d keys\n", total_ops, KEYS);
+  printf("threads   global mutex   kvtree_concurrent\n");
+  int nthreads;
+  for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+    double mutex_rate   = bench_run(nthreads, total_ops, 0);
+    double striped_rate = bench_run(nthreads, total_ops, 1);
+    printf("%7d   %7.2f Mops/s   %7.2f Mops/s\n", nthreads, mutex_rate, striped_rate);
+    fflush(stdout);
+  }
+
+  kvtree_concurrent_delete(&striped);
+  kvtree_delete(&plain);
+  return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * This benchmark times the functions that walk a whole tree, pack,
+ * unpack, merge, and delete, on a deep and narrow tree, a chain of
+ * nested hashes, and on a shallow and wide tree, a single hash with
+ * many children.  It reports the best of several runs of each.  It is
+ * built along with the tests, but not run by ctest.
+ *
+ * usage: bench_kvtree_walk [depth] [fanout]
+ */
+
+#include "kvtree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEPTH 10000
+#define FANOUT (1024 * 1024)
+#define DEEP_RUNS 40
+#define WIDE_RUNS 8
+
+/* returns the current time in seconds */
+static double bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/* returns a chain of depth nested hashes, each under the key "K" */
+static kvtree* bench_deep(int depth)
+{
+  kvtree* top = kvtree_new();
+  kvtree* hash = top;
+  int i;
+  for (i = 0; i < depth; i++) {
+    hash = kvtree_set(hash, "K", kvtree_new());
+  }
+  return top;
+}
+
+/* returns a hash with fanout children, each keyed by its index */
+static kvtree* bench_wide(int fanout)
+{
+  kvtree* top = kvtree_new();
+  int i;
+  for (i = 0; i < fanout; i++) {
+    kvtree_set_kv_int(top, "RANK", i);
+  }
+  return top;
+}
+
+/* times each walk over the tree built by make, keeping the best of
+ * runs, and prints the times in milliseconds */
+static void bench_tree(const char* name, kvtree* (*make)(int), int size, int runs)
+{
+  double best[4] = { 1e30, 1e30, 1e30, 1e30 };
+  int r;
+  for (r = 0; r < runs; r++) {
+    kvtree* hash = make(size);
+
+    double start = bench_now();
+    size_t pack_size = kvtree_pack_size(hash);
+    char* buf = (char*) malloc(pack_size);
+    kvtree_pack(buf, hash);
+    double t = bench_now() - start;
+    if (t < best[0]) best[0] = t;
+
+    kvtree* copy = kvtree_new();
+    start = bench_now();
+    kvtree_unpack(buf, copy);
+    t = bench_now() - start;
+    if (t < best[1]) best[1] = t;
+    free(buf);
+
+    kvtree* merged = kvtree_new();
+    start = bench_now();
+    kvtree_merge(merged, copy);
+    t = bench_now() - start;
+    if (t < best[2]) best[2] = t;
+
+    start = bench_now();
+    kvtree_delete(&merged);
+    t = bench_now() - start;
+    if (t < best[3]) best[3] = t;
+
+    kvtree_delete(&copy);
+    kvtree_delete(&hash);
+  }
+
+  printf("%-14s pack %9.2fms  unpack %9.2fms  merge %9.2fms  delete %9.2fms\n",
+    name, best[0] * 1e3, best[1] * 1e3, best[2] * 1e3, best[3] * 1e3
+  );
+  fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+  int depth  = (argc > 1) ? atoi(argv[1]) : DEPTH;
+  int fanout = (argc > 2) ? atoi(argv[2]) : FANOUT;
+  if (depth < 1 || fanout < 1) {
+    printf("usage: %s [depth] [fanout]\n", argv[0]);
+    return 1;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "depth %d", depth);
+  bench_tree(name, bench_deep, depth, DEEP_RUNS);
+  snprintf(name, sizeof(name), "fanout %d", fanout);
+  bench_tree(name, bench_wide, fanout, WIDE_RUNS);
+  return 0;
+}
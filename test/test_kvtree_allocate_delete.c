@@ -1,6 +1,8 @@
 #include "test_kvtree.h"
 #include "test_kvtree_allocate_delete.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define TEST_PASS (0)
@@ -18,6 +20,76 @@ int test_kvtree_allocate_delete(){
   return rc;
 }
 
+int test_kvtree_allocate_delete_arena(){
+  int rc = TEST_PASS;
+
+  /* build a heap tree to compare against */
+  kvtree* heap = kvtree_new();
+  int i;
+  for (i = 0; i < 100; i++) {
+    kvtree* rank = kvtree_set_kv_int(heap, "RANK", i);
+    kvtree_set_kv(rank, "FILE", "file.txt");
+    kvtree_set_kv_int(rank, "SIZE", i * 10);
+  }
+
+  /* unpacking into an arena tree should give us the same tree
+   * as unpacking into a heap tree */
+  size_t size = kvtree_pack_size(heap);
+  char* buf = malloc(size);
+  kvtree_pack(buf, heap);
+  kvtree_unset_all(heap);
+  kvtree_unpack(buf, heap);
+
+  kvtree* arena = kvtree_new_arena();
+  if (arena == NULL) return TEST_FAIL;
+  if (kvtree_unpack(buf, arena) != size) rc = TEST_FAIL;
+
+  char* buf2 = malloc(size);
+  if (kvtree_pack_size(arena) != size) rc = TEST_FAIL;
+  kvtree_pack(buf, heap);
+  kvtree_pack(buf2, arena);
+  if (memcmp(buf, buf2, size) != 0) rc = TEST_FAIL;
+
+  /* set, reset, and unset values in the arena tree */
+  kvtree_setf(arena, kvtree_new(), "%s %d %s", "RANK", 5, "DONE");
+  if (kvtree_getf(arena, "%s %d %s", "RANK", 5, "DONE") == NULL) rc = TEST_FAIL;
+  kvtree_set_kv(arena, "NAME", "first");
+  kvtree_unset(arena, "NAME");
+  kvtree_set_kv(arena, "NAME", "second");
+  if (kvtree_get_kv(arena, "NAME", "second") == NULL) rc = TEST_FAIL;
+  kvtree_unset_kv_int(arena, "RANK", 7);
+  if (kvtree_get_kv_int(arena, "RANK", 7) != NULL) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(arena, "RANK")) != 99) rc = TEST_FAIL;
+
+  /* merge a heap tree into the arena tree */
+  kvtree* other = kvtree_new();
+  kvtree_set_kv_int(other, "RANK", 200);
+  kvtree_merge(arena, other);
+  if (kvtree_get_kv_int(arena, "RANK", 200) == NULL) rc = TEST_FAIL;
+
+  /* attach heap trees directly, these must be freed with the arena */
+  kvtree_set(arena, "OTHER", other);
+  kvtree* extra = kvtree_set(arena, "EXTRA", kvtree_new());
+  kvtree_set_kv(extra, "KEY", "value");
+  kvtree_set(extra, "REPLACED", kvtree_new());
+  kvtree_set(extra, "REPLACED", kvtree_new());
+
+  /* and an arena tree into a heap tree */
+  kvtree* outer = kvtree_new();
+  kvtree_set(outer, "ARENA", arena);
+  if (kvtree_getf(outer, "%s %s %s", "ARENA", "EXTRA", "KEY") == NULL) rc = TEST_FAIL;
+
+  kvtree_delete(&outer);
+  if (outer != NULL) rc = TEST_FAIL;
+
+  free(buf2);
+  free(buf);
+  kvtree_delete(&heap);
+
+  return rc;
+}
+
 void test_kvtree_allocate_delete_init(){
   register_test(test_kvtree_allocate_delete, "test_kvtree_allocate_delete");
+  register_test(test_kvtree_allocate_delete_arena, "test_kvtree_allocate_delete_arena");
 }
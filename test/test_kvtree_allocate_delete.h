@@ -4,6 +4,7 @@
 #include "test_kvtree.h"
 
 int test_kvtree_allocate_delete();
+int test_kvtree_allocate_delete_arena();
 void test_kvtree_allocate_delete_init();
 
 #endif //TEST_KVTREE_ALLOCATE_DELETE_H
@@ -1,8 +1,13 @@
 #include "test_kvtree.h"
 #include "test_kvtree_kv.h"
+#include "kvtree_concurrent.h"
+#include "config.h"
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define TEST_PASS (0)
 #define TEST_FAIL (1)
@@ -22,6 +27,7 @@ int test_kvtree_kv(){
 
   int size = kvtree_size(kvt);
   if (size != 1) rc = TEST_FAIL;
+  if (! kvtree_has_one(kvt) || kvtree_is_empty(kvt)) rc = TEST_FAIL;
 
   kvtree* get = kvtree_get_kv(kvt, key, value);
   if (get != val) rc = TEST_FAIL;
@@ -29,6 +35,7 @@ int test_kvtree_kv(){
   if(kvtree_unset_kv(kvt, key, value) != KVTREE_SUCCESS) rc = TEST_FAIL;
   size = kvtree_size(kvt);
   if(size != 0) rc = TEST_FAIL;
+  if (kvtree_has_one(kvt) || ! kvtree_is_empty(kvt)) rc = TEST_FAIL;
 
   kvtree_delete(&kvt);
   return rc;
@@ -142,9 +149,1649 @@ int test_kvtree_kv_int(){
   return rc;
 }
 
+int test_kvtree_kv_int_keys(){
+  int rc = TEST_PASS;
+  int i;
+
+  /* keys that only look like integers are not matched by int lookups */
+  kvtree* kvt = kvtree_new();
+  kvtree_set_kv(kvt, "K", "007");
+  kvtree_set_kv(kvt, "K", "-0");
+  kvtree_set_kv(kvt, "K", "+5");
+  kvtree_set_kv(kvt, "K", "9223372036854775808");
+  if (kvtree_get_kv_int(kvt, "K", 7) != NULL) rc = TEST_FAIL;
+  if (kvtree_get_kv_int(kvt, "K", 0) != NULL) rc = TEST_FAIL;
+  if (kvtree_get_kv_int(kvt, "K", 5) != NULL) rc = TEST_FAIL;
+  kvtree_elem* elem = kvtree_elem_get(kvtree_get(kvt, "K"), "007");
+  if (kvtree_elem_key_int(elem) != 7) rc = TEST_FAIL;
+
+  /* int and string lookups find the same elements, with and without
+   * an index on the node */
+  int counts[2] = {10, 1000};
+  int c;
+  for (c = 0; c < 2; c++) {
+    kvtree_unset_all(kvt);
+    for (i = -counts[c]; i < counts[c]; i++) {
+      kvtree_set_kv_int(kvt, "RANK", i);
+    }
+    kvtree* ranks = kvtree_get(kvt, "RANK");
+    if (kvtree_size(ranks) != 2 * counts[c]) rc = TEST_FAIL;
+    for (i = -counts[c]; i < counts[c]; i++) {
+      char str[16];
+      snprintf(str, sizeof(str), "%d", i);
+      kvtree* get = kvtree_get_kv_int(kvt, "RANK", i);
+      if (get == NULL || get != kvtree_get(ranks, str)) rc = TEST_FAIL;
+    }
+
+    /* setting an existing int key returns the same hash */
+    if (kvtree_set_kv_int(kvt, "RANK", 3) != kvtree_get_kv_int(kvt, "RANK", 3)) rc = TEST_FAIL;
+    if (kvtree_size(ranks) != 2 * counts[c]) rc = TEST_FAIL;
+
+    /* a key set as a string is found by int */
+    kvtree_unset_kv_int(kvt, "RANK", 2);
+    kvtree_set_kv(kvt, "RANK", "2");
+    if (kvtree_get_kv_int(kvt, "RANK", 2) == NULL) rc = TEST_FAIL;
+
+    kvtree_elem* e = kvtree_elem_extract_int(ranks, -1);
+    if (e == NULL || kvtree_elem_key_int(e) != -1) rc = TEST_FAIL;
+    kvtree_delete(&e->hash);
+    free(e);
+    if (kvtree_get_kv_int(kvt, "RANK", -1) != NULL) rc = TEST_FAIL;
+  }
+
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+int test_kvtree_kv_large(){
+  int rc = TEST_PASS;
+  int count = 1000;
+  char key[32];
+  int i;
+
+  kvtree* kvt = kvtree_new();
+  if (kvt == NULL) rc = TEST_FAIL;
+
+  /* enough keys that lookups go through the index */
+  for (i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "key.%d", i);
+    if (kvtree_set_kv_int(kvt, key, i) == NULL) rc = TEST_FAIL;
+  }
+  if (kvtree_size(kvt) != count) rc = TEST_FAIL;
+
+  /* most recently set key still comes first */
+  char* first = kvtree_elem_key(kvtree_elem_first(kvt));
+  snprintf(key, sizeof(key), "key.%d", count - 1);
+  if (first == NULL || strcmp(first, key)) rc = TEST_FAIL;
+
+  /* remove the even keys */
+  for (i = 0; i < count; i += 2) {
+    snprintf(key, sizeof(key), "key.%d", i);
+    if (kvtree_unset(kvt, key) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  }
+  if (kvtree_size(kvt) != count / 2) rc = TEST_FAIL;
+
+  /* check that we find exactly the odd keys */
+  for (i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "key.%d", i);
+    kvtree* get = kvtree_get_kv_int(kvt, key, i);
+    if ((i % 2 == 0) != (get == NULL)) rc = TEST_FAIL;
+  }
+
+  /* resetting a key replaces its value */
+  snprintf(key, sizeof(key), "key.%d", 1);
+  kvtree_set(kvt, key, kvtree_new());
+  if (kvtree_size(kvt) != count / 2) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(kvt, key)) != 0) rc = TEST_FAIL;
+
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+int test_kvtree_kv_sizes(){
+  int rc = TEST_PASS;
+  char key[32];
+  int i;
+
+  /* node sizes around the points where the index changes form */
+  int counts[] = {5, 8, 9, 31, 32, 33, 70};
+  int c;
+  for (c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); c++) {
+    int count = counts[c];
+    kvtree* kvt = kvtree_new();
+    for (i = 0; i < count; i++) {
+      snprintf(key, sizeof(key), "key.%d", i);
+      kvtree_set_kv_int(kvt, key, i);
+      kvtree_set_kv_int(kvt, "INT", i);
+    }
+
+    /* remove every third key, then put one back */
+    for (i = 0; i < count; i += 3) {
+      snprintf(key, sizeof(key), "key.%d", i);
+      kvtree_unset(kvt, key);
+      kvtree_unset_kv_int(kvt, "INT", i);
+    }
+    kvtree_set_kv_int(kvt, "key.0", 0);
+    kvtree_set_kv_int(kvt, "INT", 0);
+
+    /* check lookups before and after a pack and unpack */
+    size_t size = kvtree_pack_size(kvt);
+    char* buf = malloc(size);
+    kvtree_pack(buf, kvt);
+    kvtree* copy = kvtree_new();
+    kvtree_unpack(buf, copy);
+    free(buf);
+
+    kvtree* trees[2] = {kvt, copy};
+    int t;
+    for (t = 0; t < 2; t++) {
+      for (i = 0; i < count; i++) {
+        int expect = (i == 0 || i % 3 != 0);
+        snprintf(key, sizeof(key), "key.%d", i);
+        if ((kvtree_get_kv_int(trees[t], key, i) != NULL) != expect) rc = TEST_FAIL;
+        if ((kvtree_get_kv_int(trees[t], "INT", i) != NULL) != expect) rc = TEST_FAIL;
+      }
+      snprintf(key, sizeof(key), "key.%d", count);
+      if (kvtree_get(trees[t], key) != NULL) rc = TEST_FAIL;
+    }
+
+    kvtree_delete(&copy);
+    kvtree_delete(&kvt);
+  }
+
+  return rc;
+}
+
+int test_kvtree_kv_order(){
+  int rc = TEST_PASS;
+  char key[32];
+  int i;
+
+  /* reserve space up front, then add keys, which iterate newest first */
+  int count = 100;
+  kvtree* kvt = kvtree_new();
+  if (kvtree_reserve(kvt, count) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  for (i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "%d", i);
+    kvtree_set(kvt, key, kvtree_new());
+  }
+  kvtree_elem* elem;
+  i = count;
+  for (elem = kvtree_elem_first(kvt); elem != NULL; elem = kvtree_elem_next(elem)) {
+    i--;
+    if (kvtree_elem_key_int(elem) != i) rc = TEST_FAIL;
+  }
+  if (i != 0) rc = TEST_FAIL;
+
+  /* remove odd keys while iterating, holding on to the next element */
+  elem = kvtree_elem_first(kvt);
+  while (elem != NULL) {
+    kvtree_elem* next = kvtree_elem_next(elem);
+    if (kvtree_elem_key_int(elem) % 2 == 1) {
+      kvtree_unset(kvt, kvtree_elem_key(elem));
+    }
+    elem = next;
+  }
+  if (kvtree_size(kvt) != count / 2) rc = TEST_FAIL;
+
+  /* new keys reuse the freed slots, and still come first */
+  for (i = count; i < count + count / 2; i++) {
+    snprintf(key, sizeof(key), "%d", i);
+    kvtree_set(kvt, key, kvtree_new());
+  }
+  elem = kvtree_elem_first(kvt);
+  if (kvtree_elem_key_int(elem) != count + count / 2 - 1) rc = TEST_FAIL;
+  int prev = count + count / 2;
+  int seen = 0;
+  for (; elem != NULL; elem = kvtree_elem_next(elem)) {
+    int k = kvtree_elem_key_int(elem);
+    if (k >= prev || (k < count && k % 2 == 1)) rc = TEST_FAIL;
+    prev = k;
+    seen++;
+  }
+  if (seen != count) rc = TEST_FAIL;
+
+  /* sorting rewrites the order */
+  kvtree_sort_int(kvt, KVTREE_SORT_ASCENDING);
+  prev = -1;
+  seen = 0;
+  for (elem = kvtree_elem_first(kvt); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (kvtree_elem_key_int(elem) <= prev) rc = TEST_FAIL;
+    prev = kvtree_elem_key_int(elem);
+    seen++;
+  }
+  if (seen != count) rc = TEST_FAIL;
+
+  /* an emptied hash can be filled again */
+  kvtree_unset_all(kvt);
+  if (kvtree_elem_first(kvt) != NULL) rc = TEST_FAIL;
+  kvtree_set_kv(kvt, "KEY", "VALUE");
+  if (kvtree_get_kv(kvt, "KEY", "VALUE") == NULL) rc = TEST_FAIL;
+  if (kvtree_size(kvt) != 1) rc = TEST_FAIL;
+
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+int test_kvtree_kv_ordered(){
+  int rc = TEST_PASS;
+  char key[32];
+  int i;
+
+  /* add rank ids out of order to a hash kept in integer order */
+  int count = 100;
+  kvtree* kvt = kvtree_new();
+  if (kvtree_set_order(kvt, KVTREE_ORDER_INT, KVTREE_SORT_ASCENDING) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_get_order(kvt) != KVTREE_ORDER_INT) rc = TEST_FAIL;
+  for (i = 0; i < count; i++) {
+    kvtree_set_kv_int(kvt, "RANK", (i * 37) % count);
+  }
+  kvtree* ranks = kvtree_get(kvt, "RANK");
+  if (kvtree_get_order(ranks) != KVTREE_ORDER_NONE) rc = TEST_FAIL;
+  kvtree_set_order(ranks, KVTREE_ORDER_INT, KVTREE_SORT_ASCENDING);
+  for (i = 0; i < count; i++) {
+    snprintf(key, sizeof(key), "%d", (i * 53 + 7) % (2 * count));
+    kvtree_set(ranks, key, kvtree_new());
+  }
+
+  /* keys come out sorted and are found by string or by integer */
+  kvtree_elem* elem;
+  int prev = -1;
+  int seen = 0;
+  for (elem = kvtree_elem_first(ranks); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (kvtree_elem_key_int(elem) <= prev) rc = TEST_FAIL;
+    prev = kvtree_elem_key_int(elem);
+    seen++;
+  }
+  if (seen != kvtree_size(ranks)) rc = TEST_FAIL;
+  int added[200] = {0};
+  for (i = 0; i < count; i++) {
+    added[i] = 1;
+    added[(i * 53 + 7) % (2 * count)] = 1;
+  }
+  for (i = 0; i < 2 * count; i++) {
+    snprintf(key, sizeof(key), "%d", i);
+    kvtree_elem* found = kvtree_elem_get(ranks, key);
+    kvtree* found_int = kvtree_get_kv_int(kvt, "RANK", i);
+    if ((found != NULL) != added[i]) rc = TEST_FAIL;
+    if (found_int != kvtree_elem_hash(found)) rc = TEST_FAIL;
+  }
+
+  /* resetting a key keeps its place, removing keys keeps the order */
+  int size = kvtree_size(ranks);
+  kvtree_set_kv(ranks, "5", "VALUE");
+  if (kvtree_size(ranks) != size) rc = TEST_FAIL;
+  if (kvtree_get_kv(ranks, "5", "VALUE") == NULL) rc = TEST_FAIL;
+  for (i = 0; i < count; i += 2) {
+    kvtree_unset_kv_int(kvt, "RANK", i);
+  }
+  prev = -1;
+  for (elem = kvtree_elem_first(ranks); elem != NULL; elem = kvtree_elem_next(elem)) {
+    int k = kvtree_elem_key_int(elem);
+    if (k <= prev || (k < count && k % 2 == 0)) rc = TEST_FAIL;
+    prev = k;
+  }
+  if (kvtree_get_kv_int(kvt, "RANK", 3) == NULL) rc = TEST_FAIL;
+  if (kvtree_get_kv_int(kvt, "RANK", 4) != NULL) rc = TEST_FAIL;
+
+  /* sorting in the order already kept changes nothing */
+  kvtree_sort_int(ranks, KVTREE_SORT_ASCENDING);
+  if (kvtree_get_order(ranks) != KVTREE_ORDER_INT) rc = TEST_FAIL;
+
+  /* a copy made by merge keeps the order, as does an ordered hash
+   * filled by unpack */
+  kvtree* copy = kvtree_new();
+  kvtree_merge(copy, ranks);
+  if (kvtree_get_order(copy) != KVTREE_ORDER_INT) rc = TEST_FAIL;
+  size_t bufsize = kvtree_pack_size(ranks);
+  char* buf = malloc(bufsize);
+  kvtree_pack(buf, ranks);
+  kvtree* unpacked = kvtree_new();
+  kvtree_set_order(unpacked, KVTREE_ORDER_STR, KVTREE_SORT_DESCENDING);
+  kvtree_unpack(buf, unpacked);
+  free(buf);
+  if (kvtree_size(unpacked) != kvtree_size(ranks)) rc = TEST_FAIL;
+  const char* last = NULL;
+  for (elem = kvtree_elem_first(unpacked); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (last != NULL && strcmp(last, kvtree_elem_key(elem)) <= 0) rc = TEST_FAIL;
+    last = kvtree_elem_key(elem);
+    if (kvtree_get(copy, last) == NULL) rc = TEST_FAIL;
+  }
+  if (kvtree_get_kv_int(unpacked, "5", 0) != NULL) rc = TEST_FAIL;
+  if (kvtree_get(unpacked, "99") == NULL) rc = TEST_FAIL;
+
+  /* sorting in another order drops the order kept, and going back to
+   * insertion order keeps the current order of iteration */
+  kvtree_sort(copy, KVTREE_SORT_ASCENDING);
+  if (kvtree_get_order(copy) != KVTREE_ORDER_NONE) rc = TEST_FAIL;
+  kvtree_set_order(unpacked, KVTREE_ORDER_NONE, 0);
+  last = NULL;
+  for (elem = kvtree_elem_first(unpacked); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (last != NULL && strcmp(last, kvtree_elem_key(elem)) <= 0) rc = TEST_FAIL;
+    last = kvtree_elem_key(elem);
+  }
+  kvtree_set(unpacked, "NEW", kvtree_new());
+  if (strcmp(kvtree_elem_key(kvtree_elem_first(unpacked)), "NEW") != 0) rc = TEST_FAIL;
+  for (elem = kvtree_elem_first(ranks); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (kvtree_get(copy, kvtree_elem_key(elem)) == NULL) rc = TEST_FAIL;
+    if (kvtree_get(unpacked, kvtree_elem_key(elem)) == NULL) rc = TEST_FAIL;
+  }
+
+  if (kvtree_set_order(kvt, 42, KVTREE_SORT_ASCENDING) == KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  kvtree_delete(&unpacked);
+  kvtree_delete(&copy);
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+/* records the keys visited by kvtree_range_int and kvtree_prefix */
+struct visited {
+  int count;
+  int stop;       /* stop after this many keys, if not zero */
+  char keys[200][32];
+};
+
+static int visit_key(kvtree_elem* elem, void* arg){
+  struct visited* v = (struct visited*) arg;
+  strcpy(v->keys[v->count], kvtree_elem_key(elem));
+  v->count++;
+  return (v->count == v->stop) ? 42 : KVTREE_SUCCESS;
+}
+
+/* checks that a range visit saw exactly the integers lo to hi */
+static int check_range(const struct visited* v, int lo, int hi){
+  int rc = TEST_PASS;
+  int i;
+  if (v->count != hi - lo + 1) rc = TEST_FAIL;
+  for (i = 0; i < v->count; i++) {
+    if (atoi(v->keys[i]) != lo + i) rc = TEST_FAIL;
+  }
+  return rc;
+}
+
+int test_kvtree_kv_range(){
+  int rc = TEST_PASS;
+  char key[32];
+  int i;
+  struct visited v;
+
+  /* add rank ids newest first, plus keys that only look like ints */
+  int count = 100;
+  kvtree* kvt = kvtree_new();
+  for (i = count - 1; i >= 0; i--) {
+    snprintf(key, sizeof(key), "%d", i);
+    kvtree_set(kvt, key, kvtree_new());
+  }
+  kvtree_set(kvt, "0042", kvtree_new());
+  kvtree_set(kvt, "x", kvtree_new());
+
+  /* a narrow window, a wide one, and one past the end */
+  memset(&v, 0, sizeof(v));
+  if (kvtree_range_int(kvt, 40, 45, visit_key, &v) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (check_range(&v, 40, 45) != TEST_PASS) rc = TEST_FAIL;
+  memset(&v, 0, sizeof(v));
+  kvtree_range_int(kvt, -1000, 1000, visit_key, &v);
+  if (check_range(&v, 0, count - 1) != TEST_PASS) rc = TEST_FAIL;
+  memset(&v, 0, sizeof(v));
+  kvtree_range_int(kvt, count, 2 * count, visit_key, &v);
+  if (v.count != 0) rc = TEST_FAIL;
+
+  /* the same in integer order, ascending and descending */
+  int dir;
+  for (dir = 0; dir < 2; dir++) {
+    int direction = dir ? KVTREE_SORT_DESCENDING : KVTREE_SORT_ASCENDING;
+    kvtree_set_order(kvt, KVTREE_ORDER_INT, direction);
+    memset(&v, 0, sizeof(v));
+    kvtree_range_int(kvt, 40, 45, visit_key, &v);
+    if (check_range(&v, 40, 45) != TEST_PASS) rc = TEST_FAIL;
+    memset(&v, 0, sizeof(v));
+    kvtree_range_int(kvt, -1000, 1000, visit_key, &v);
+    if (check_range(&v, 0, count - 1) != TEST_PASS) rc = TEST_FAIL;
+    memset(&v, 0, sizeof(v));
+    kvtree_range_int(kvt, 50, 49, visit_key, &v);
+    if (v.count != 0) rc = TEST_FAIL;
+  }
+  if (kvtree_get_order(kvt) != KVTREE_ORDER_INT) rc = TEST_FAIL;
+
+  /* a callback can stop the visit */
+  memset(&v, 0, sizeof(v));
+  v.stop = 3;
+  if (kvtree_range_int(kvt, 0, 10, visit_key, &v) != 42) rc = TEST_FAIL;
+  if (check_range(&v, 0, 2) != TEST_PASS) rc = TEST_FAIL;
+  kvtree_delete(&kvt);
+
+  /* file names with a common prefix, in each order */
+  const char* names[] = {"ckpt.1/a", "ckpt.12/c", "ckpt.12/a", "ckpt.123/b", "ckpt.12/b", "ckpt.2/a"};
+  int order;
+  for (order = 0; order < 3; order++) {
+    kvt = kvtree_new();
+    for (i = 0; i < 6; i++) {
+      kvtree_set(kvt, names[i], kvtree_new());
+    }
+    if (order > 0) {
+      int direction = (order == 2) ? KVTREE_SORT_DESCENDING : KVTREE_SORT_ASCENDING;
+      kvtree_set_order(kvt, KVTREE_ORDER_STR, direction);
+    }
+    memset(&v, 0, sizeof(v));
+    if (kvtree_prefix(kvt, "ckpt.12/", visit_key, &v) != KVTREE_SUCCESS) rc = TEST_FAIL;
+    if (v.count != 3) rc = TEST_FAIL;
+    if (strcmp(v.keys[0], "ckpt.12/a") != 0) rc = TEST_FAIL;
+    if (strcmp(v.keys[1], "ckpt.12/b") != 0) rc = TEST_FAIL;
+    if (strcmp(v.keys[2], "ckpt.12/c") != 0) rc = TEST_FAIL;
+    memset(&v, 0, sizeof(v));
+    kvtree_prefix(kvt, "ckpt.12", visit_key, &v);
+    if (v.count != 4 || strcmp(v.keys[3], "ckpt.123/b") != 0) rc = TEST_FAIL;
+    memset(&v, 0, sizeof(v));
+    kvtree_prefix(kvt, "", visit_key, &v);
+    if (v.count != 6 || strcmp(v.keys[0], "ckpt.1/a") != 0) rc = TEST_FAIL;
+    memset(&v, 0, sizeof(v));
+    kvtree_prefix(kvt, "zz", visit_key, &v);
+    if (v.count != 0) rc = TEST_FAIL;
+    kvtree_delete(&kvt);
+  }
+
+  if (kvtree_prefix(NULL, "a", visit_key, &v) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_range_int(NULL, 0, 1, NULL, &v) == KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  return rc;
+}
+
+int test_kvtree_kv_merge_move(){
+  int rc = TEST_PASS;
+  int i;
+
+  /* build a source tree of ranks with a few files each */
+  kvtree* src = kvtree_new();
+  for (i = 0; i < 20; i++) {
+    kvtree* rank = kvtree_set_kv_int(src, "RANK", i);
+    kvtree_set_kv(rank, "FILE", "a");
+    kvtree_set_int64(kvtree_set_kv(rank, "FILE", "b"), "SIZE", i);
+  }
+  kvtree_set_order(kvtree_get(src, "RANK"), KVTREE_ORDER_INT, KVTREE_SORT_ASCENDING);
+  size_t size = kvtree_pack_size(src);
+  char* buf = malloc(size);
+  char* buf2 = malloc(size);
+  kvtree_pack(buf, src);
+
+  /* moving into an empty tree takes the tree as it is */
+  kvtree* dst = kvtree_new();
+  if (kvtree_merge_move(dst, src) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (! kvtree_is_empty(src)) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(dst, "RANK")) != 20) rc = TEST_FAIL;
+  if (kvtree_get_order(kvtree_get(dst, "RANK")) != KVTREE_ORDER_INT) rc = TEST_FAIL;
+  kvtree_pack(buf2, dst);
+  if (memcmp(buf, buf2, size) != 0) rc = TEST_FAIL;
+
+  /* the emptied source can be filled and moved again, colliding with
+   * keys already in the destination */
+  kvtree_unpack(buf, src);
+  kvtree_set_kv(kvtree_get_kv_int(src, "RANK", 3), "FILE", "c");
+  kvtree_set_kv_int(src, "RANK", 100);
+  kvtree_set_kv_int(dst, "RANK", 200);
+  kvtree_unset(kvtree_get_kv_int(dst, "RANK", 5), "FILE");
+  kvtree* expect = kvtree_new();
+  kvtree_merge(expect, dst);
+  kvtree_merge(expect, src);
+  kvtree_merge_move(dst, src);
+  if (! kvtree_is_empty(src)) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(dst, "RANK")) != 22) rc = TEST_FAIL;
+  if (kvtree_get_kv(kvtree_get_kv_int(dst, "RANK", 3), "FILE", "c") == NULL) rc = TEST_FAIL;
+  int64_t val = 0;
+  kvtree* file = kvtree_get_kv(kvtree_get_kv_int(dst, "RANK", 5), "FILE", "b");
+  if (kvtree_get_int64(file, "SIZE", &val) != KVTREE_SUCCESS || val != 5) rc = TEST_FAIL;
+  size = kvtree_pack_size(dst);
+  if (kvtree_pack_size(expect) != size) rc = TEST_FAIL;
+
+  /* an arena tree and a heap tree copy instead of moving */
+  kvtree* arena = kvtree_new_arena();
+  kvtree_unpack(buf, src);
+  kvtree_merge_move(arena, src);
+  if (! kvtree_is_empty(src)) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(arena, "RANK")) != 20) rc = TEST_FAIL;
+  kvtree_merge_move(src, arena);
+  if (! kvtree_is_empty(arena)) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(src, "RANK")) != 20) rc = TEST_FAIL;
+
+  /* within one arena, subtrees move */
+  kvtree_set_kv_int(arena, "RANK", 1);
+  kvtree* part = kvtree_set_kv_int(arena, "PART", 0);
+  kvtree_set_kv_int(part, "RANK", 2);
+  kvtree_merge_move(arena, part);
+  if (kvtree_size(kvtree_get(arena, "RANK")) != 2) rc = TEST_FAIL;
+  if (! kvtree_is_empty(part)) rc = TEST_FAIL;
+
+  if (kvtree_merge_move(NULL, src) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_merge_move(dst, NULL) != KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  /* a typed leaf moves its value along with its children */
+  kvtree* typed = kvtree_new();
+  kvtree_set_int64(typed, "N", 42);
+  kvtree_set_bytes(typed, "CRC", "crc", 4);
+  kvtree* moved = kvtree_new();
+  kvtree_merge_move(kvtree_set(moved, "N", kvtree_new()), kvtree_get(typed, "N"));
+  kvtree_merge_move(kvtree_set(moved, "CRC", kvtree_new()), kvtree_get(typed, "CRC"));
+  if (kvtree_get_type(typed, "N") != KVTREE_TYPE_NONE || kvtree_get_int64(typed, "N", &val) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_get_type(typed, "CRC") != KVTREE_TYPE_NONE) rc = TEST_FAIL;
+  if (kvtree_get_int64(moved, "N", &val) != KVTREE_SUCCESS || val != 42) rc = TEST_FAIL;
+  const void* bytes = NULL;
+  size_t bytes_size = 0;
+  if (kvtree_get_bytes(moved, "CRC", &bytes, &bytes_size) != KVTREE_SUCCESS ||
+      bytes_size != 4 || memcmp(bytes, "crc", 4) != 0)
+  {
+    rc = TEST_FAIL;
+  }
+  kvtree_delete(&moved);
+  kvtree_delete(&typed);
+
+  free(buf2);
+  free(buf);
+  kvtree_delete(&arena);
+  kvtree_delete(&expect);
+  kvtree_delete(&dst);
+  kvtree_delete(&src);
+  return rc;
+}
+
+int test_kvtree_kv_clone(){
+  int rc = TEST_PASS;
+  int i;
+
+  /* a tree with ranks in order, typed leaves, blobs, and gaps left by
+   * removed keys */
+  kvtree* kvt = kvtree_new();
+  kvtree* ranks = kvtree_set(kvt, "RANK", kvtree_new());
+  kvtree_set_order(ranks, KVTREE_ORDER_INT, KVTREE_SORT_DESCENDING);
+  for (i = 0; i < 50; i++) {
+    kvtree* rank = kvtree_set_kv_int(kvt, "RANK", i);
+    kvtree_set_int64(rank, "SIZE", i);
+    kvtree_set_bytes(rank, "CRC", &i, sizeof(i));
+  }
+  for (i = 0; i < 50; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "file.%d", i);
+    kvtree_set_kv(kvt, "FILE", key);
+  }
+  for (i = 0; i < 50; i += 3) {
+    char key[32];
+    snprintf(key, sizeof(key), "file.%d", i);
+    kvtree_unset(kvtree_get(kvt, "FILE"), key);
+  }
+  size_t size = kvtree_pack_size(kvt);
+  char* buf = malloc(size);
+  char* buf2 = malloc(size);
+  kvtree_pack(buf, kvt);
+
+  /* both copies pack to the same bytes, so keys are in the same order */
+  kvtree* copy = kvtree_clone(kvt);
+  kvtree* arena = kvtree_clone_arena(kvt);
+  kvtree* copies[2] = { copy, arena };
+  int c;
+  for (c = 0; c < 2; c++) {
+    if (kvtree_pack_size(copies[c]) != size) rc = TEST_FAIL;
+    kvtree_pack(buf2, copies[c]);
+    if (memcmp(buf, buf2, size) != 0) rc = TEST_FAIL;
+    kvtree* rank = kvtree_get_kv_int(copies[c], "RANK", 7);
+    int64_t val = 0;
+    const void* crc = NULL;
+    size_t crc_size = 0;
+    if (kvtree_get_int64(rank, "SIZE", &val) != KVTREE_SUCCESS || val != 7) rc = TEST_FAIL;
+    if (kvtree_get_bytes(rank, "CRC", &crc, &crc_size) != KVTREE_SUCCESS) rc = TEST_FAIL;
+    if (crc_size != sizeof(int) || *(const int*) crc != 7) rc = TEST_FAIL;
+    if (kvtree_get_order(kvtree_get(copies[c], "RANK")) != KVTREE_ORDER_INT) rc = TEST_FAIL;
+    if (kvtree_get_kv(copies[c], "FILE", "file.4") == NULL) rc = TEST_FAIL;
+    if (kvtree_get_kv(copies[c], "FILE", "file.3") != NULL) rc = TEST_FAIL;
+  }
+
+  /* the copies are independent of the original */
+  kvtree_unset(kvt, "RANK");
+  if (kvtree_get_kv_int(copy, "RANK", 7) == NULL) rc = TEST_FAIL;
+  kvtree_set_kv_int(arena, "RANK", 100);
+  if (kvtree_size(kvtree_get(arena, "RANK")) != 51) rc = TEST_FAIL;
+
+  /* a NULL hash clones to an empty one */
+  kvtree* empty = kvtree_clone(NULL);
+  if (empty == NULL || ! kvtree_is_empty(empty)) rc = TEST_FAIL;
+
+  free(buf2);
+  free(buf);
+  kvtree_delete(&empty);
+  kvtree_delete(&arena);
+  kvtree_delete(&copy);
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+int test_kvtree_kv_share(){
+  int rc = TEST_PASS;
+  int i;
+
+  kvtree* kvt = kvtree_new();
+  for (i = 0; i < 20; i++) {
+    kvtree* rank = kvtree_set_kv_int(kvt, "RANK", i);
+    kvtree_set_int64(rank, "SIZE", i);
+  }
+  kvtree_set_kv(kvt, "STATE", "RUNNING");
+  size_t size = kvtree_pack_size(kvt);
+  char* buf = malloc(size);
+  char* buf2 = malloc(size);
+  kvtree_pack(buf, kvt);
+
+  /* a shared hash is the same hash, and it is read-only */
+  kvtree* reader = kvtree_share(kvt);
+  if (reader != kvt) rc = TEST_FAIL;
+  if (kvtree_set_kv(reader, "STATE", "DONE") != NULL) rc = TEST_FAIL;
+  if (kvtree_unset(reader, "STATE") == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_set_int64(reader, "SIZE", 1) != NULL) rc = TEST_FAIL;
+  if (kvtree_unshare(reader, "RANK") != NULL) rc = TEST_FAIL;
+  if (kvtree_sort(reader, KVTREE_SORT_DESCENDING) == KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  /* a snapshot can be changed along any path without touching the
+   * original, including through subtrees that are still shared */
+  kvtree* snap = kvtree_snapshot(kvt);
+  if (kvtree_get(snap, "RANK") != kvtree_get(kvt, "RANK")) rc = TEST_FAIL;
+  if (kvtree_sort_int(kvtree_get(snap, "RANK"), KVTREE_SORT_DESCENDING) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  kvtree* rank = kvtree_set_kv_int(snap, "RANK", 5);
+  kvtree_set_int64(rank, "SIZE", 500);
+  kvtree_unset_kv(snap, "STATE", "RUNNING");
+  kvtree_set_kv(snap, "STATE", "DONE");
+  kvtree_unset_kv_int(snap, "RANK", 6);
+  if (kvtree_get(snap, "RANK") == kvtree_get(kvt, "RANK")) rc = TEST_FAIL;
+  if (kvtree_get_kv_int(snap, "RANK", 4) != kvtree_get_kv_int(kvt, "RANK", 4)) rc = TEST_FAIL;
+  if (kvtree_get_kv_int(snap, "RANK", 6) != NULL) rc = TEST_FAIL;
+  int64_t val = 0;
+  kvtree_get_int64(kvtree_get_kv_int(snap, "RANK", 5), "SIZE", &val);
+  if (val != 500) rc = TEST_FAIL;
+  if (kvtree_get_kv(snap, "STATE", "DONE") == NULL) rc = TEST_FAIL;
+
+  /* the original is unchanged */
+  kvtree_pack(buf2, kvt);
+  if (kvtree_pack_size(kvt) != size || memcmp(buf, buf2, size) != 0) rc = TEST_FAIL;
+
+  /* kvtree_unshare hands back a subtree that can be changed directly */
+  kvtree* sub = kvtree_unshare(snap, "STATE");
+  if (sub == NULL || kvtree_unset(sub, "DONE") != KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  /* merging a snapshot shares its subtrees, and so does an arena copy
+   * of a snapshot, which only copies the top */
+  kvtree* snap2 = kvtree_snapshot(kvt);
+  kvtree* merged = kvtree_new();
+  kvtree_merge(merged, snap2);
+  if (kvtree_get(merged, "RANK") != kvtree_get(kvt, "RANK")) rc = TEST_FAIL;
+  kvtree* arena = kvtree_clone_arena(snap2);
+  kvtree_pack(buf2, arena);
+  if (kvtree_pack_size(arena) != size || memcmp(buf, buf2, size) != 0) rc = TEST_FAIL;
+  if (kvtree_get(arena, "RANK") != kvtree_get(kvt, "RANK")) rc = TEST_FAIL;
+
+  /* subtrees outlive the hashes they were shared from */
+  kvtree_delete(&reader);
+  kvtree_delete(&kvt);
+  kvtree_delete(&snap2);
+  if (kvtree_set_kv(merged, "STATE", "DONE") == NULL) rc = TEST_FAIL;
+  kvtree_get_int64(kvtree_get_kv_int(arena, "RANK", 5), "SIZE", &val);
+  if (val != 5) rc = TEST_FAIL;
+
+  /* an arena hash is copied rather than shared */
+  kvtree* owned = kvtree_new_arena();
+  kvtree_set_kv(owned, "STATE", "RUNNING");
+  kvtree* copy = kvtree_share(owned);
+  if (copy == owned || kvtree_get_kv(copy, "STATE", "RUNNING") == NULL) rc = TEST_FAIL;
+
+  free(buf2);
+  free(buf);
+  kvtree_delete(&copy);
+  kvtree_delete(&owned);
+  kvtree_delete(&arena);
+  kvtree_delete(&merged);
+  kvtree_delete(&snap);
+  return rc;
+}
+
+int test_kvtree_kv_freeze(){
+  int rc = TEST_PASS;
+  int i;
+
+  kvtree* kvt = kvtree_new();
+  for (i = 0; i < 40; i++) {
+    kvtree* rank = kvtree_set_kv_int(kvt, "RANK", i);
+    kvtree_util_set_int(rank, "SIZE", i * 10);
+    kvtree_set_bytes(rank, "CRC", &i, sizeof(i));
+  }
+  kvtree_set_kv(kvt, "STATE", "RUNNING");
+  size_t size = kvtree_pack_size(kvt);
+
+  kvtree* frozen = kvtree_freeze(kvt);
+  if (kvtree_size(frozen) != 2) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(frozen, "RANK")) != 40) rc = TEST_FAIL;
+  if (kvtree_pack_size(frozen) != size) rc = TEST_FAIL;
+
+  /* lookups work as on any other hash */
+  int val = 0;
+  kvtree* rank = kvtree_getf(frozen, "RANK %d", 17);
+  if (kvtree_util_get_int(rank, "SIZE", &val) != KVTREE_SUCCESS || val != 170) rc = TEST_FAIL;
+  const void* crc = NULL;
+  size_t crc_size = 0;
+  if (kvtree_get_bytes(rank, "CRC", &crc, &crc_size) != KVTREE_SUCCESS || *(const int*) crc != 17) rc = TEST_FAIL;
+  if (kvtree_get_kv(frozen, "STATE", "RUNNING") == NULL) rc = TEST_FAIL;
+  if (kvtree_get_kv_int(frozen, "RANK", 40) != NULL) rc = TEST_FAIL;
+
+  /* keys are visited in ascending order as strings */
+  const char* prev = "";
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(kvtree_get(frozen, "RANK"));
+       elem != NULL;
+       elem = kvtree_elem_next(elem))
+  {
+    if (strcmp(prev, kvtree_elem_key(elem)) >= 0) rc = TEST_FAIL;
+    prev = kvtree_elem_key(elem);
+  }
+
+  /* its packed form unpacks to a tree that packs the same way */
+  char* buf = malloc(size);
+  char* buf2 = malloc(size);
+  kvtree_pack(buf, frozen);
+  kvtree* copy = kvtree_new();
+  kvtree_unpack(buf, copy);
+  kvtree_pack(buf2, copy);
+  if (memcmp(buf, buf2, size) != 0) rc = TEST_FAIL;
+  if (kvtree_util_get_int(kvtree_get_kv_int(copy, "RANK", 39), "SIZE", &val) != KVTREE_SUCCESS || val != 390) rc = TEST_FAIL;
+
+  void* persist = NULL;
+  size_t persist_size = 0;
+  kvtree_write_persist(&persist, &persist_size, frozen);
+  if (persist == NULL || persist_size <= size) rc = TEST_FAIL;
+
+  /* no part of it can be changed */
+  if (kvtree_set_kv(frozen, "STATE", "DONE") != NULL) rc = TEST_FAIL;
+  if (kvtree_unset(rank, "SIZE") == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_sort_int(kvtree_get(frozen, "RANK"), KVTREE_SORT_ASCENDING) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_util_get_int(rank, "SIZE", &val) != KVTREE_SUCCESS || val != 170) rc = TEST_FAIL;
+
+  /* it can be shared as it is, and it outlives the tree it came from */
+  kvtree* shared = kvtree_share(frozen);
+  if (shared != frozen) rc = TEST_FAIL;
+  kvtree_delete(&kvt);
+  kvtree_delete(&frozen);
+  if (kvtree_get_kv_int(shared, "RANK", 3) == NULL) rc = TEST_FAIL;
+
+  kvtree* empty = kvtree_freeze(NULL);
+  if (empty == NULL || ! kvtree_is_empty(empty)) rc = TEST_FAIL;
+
+  free(persist);
+  free(buf2);
+  free(buf);
+  kvtree_delete(&empty);
+  kvtree_delete(&copy);
+  kvtree_delete(&shared);
+  return rc;
+}
+
+int test_kvtree_kv_deep(){
+  int rc = TEST_PASS;
+  int i;
+
+  /* a chain deep enough to overflow the stack if we recursed */
+  int depth = 200000;
+  kvtree* kvt = kvtree_new();
+  kvtree* h = kvt;
+  for (i = 0; i < depth; i++) {
+    kvtree_set_kv(h, "SIBLING", "x");
+    h = kvtree_set(h, "CHILD", kvtree_new());
+  }
+  kvtree_util_set_int(h, "DEPTH", depth);
+
+  size_t size = kvtree_pack_size(kvt);
+  char* buf = malloc(size);
+  if (kvtree_pack(buf, kvt) != size) rc = TEST_FAIL;
+  kvtree* copy = kvtree_new();
+  if (kvtree_unpack(buf, copy) != size) rc = TEST_FAIL;
+  kvtree* merged = kvtree_new_arena();
+  if (kvtree_merge(merged, copy) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_merge(merged, kvt) != KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  /* the leaf made it through pack, unpack, and both merges */
+  kvtree* trees[2] = { copy, merged };
+  int t;
+  for (t = 0; t < 2; t++) {
+    h = trees[t];
+    for (i = 0; i < depth && h != NULL; i++) {
+      if (kvtree_size(h) != 2) rc = TEST_FAIL;
+      h = kvtree_get(h, "CHILD");
+    }
+    int val = 0;
+    if (kvtree_util_get_int(h, "DEPTH", &val) != KVTREE_SUCCESS || val != depth) rc = TEST_FAIL;
+  }
+
+  free(buf);
+  kvtree_delete(&merged);
+  kvtree_delete(&copy);
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+/* records the paths visited by kvtree_walk, "+" before the children
+ * of an element and "-" after them */
+struct walked {
+  int count;
+  const char* prune; /* key whose children are skipped */
+  const char* stop;  /* key at which the walk stops */
+  char paths[32][64];
+};
+
+static int walk_record(kvtree_elem* elem, kvtree_visit* visit, char mark, struct walked* w){
+  char* path = w->paths[w->count++];
+  int depth = kvtree_visit_depth(visit);
+  int i;
+  path[0] = mark;
+  path[1] = '\0';
+  for (i = 0; i <= depth; i++) {
+    if (i > 0) strcat(path, "/");
+    strcat(path, kvtree_elem_key(kvtree_visit_elem(visit, i)));
+  }
+  if (kvtree_visit_elem(visit, depth) != elem || kvtree_visit_elem(visit, depth + 1) != NULL) {
+    return 1;
+  }
+  return KVTREE_SUCCESS;
+}
+
+static int walk_pre(kvtree_elem* elem, kvtree_visit* visit, void* arg){
+  struct walked* w = (struct walked*) arg;
+  int rc = walk_record(elem, visit, '+', w);
+  if (w->prune != NULL && strcmp(kvtree_elem_key(elem), w->prune) == 0) {
+    kvtree_visit_prune(visit);
+  }
+  if (w->stop != NULL && strcmp(kvtree_elem_key(elem), w->stop) == 0) {
+    rc = 42;
+  }
+  return rc;
+}
+
+static int walk_post(kvtree_elem* elem, kvtree_visit* visit, void* arg){
+  return walk_record(elem, visit, '-', (struct walked*) arg);
+}
+
+/* checks that a walk saw exactly the given paths */
+static int check_walk(const struct walked* w, const char* const* paths){
+  int i;
+  for (i = 0; paths[i] != NULL; i++) {
+    if (i >= w->count || strcmp(w->paths[i], paths[i]) != 0) return TEST_FAIL;
+  }
+  return (i == w->count) ? TEST_PASS : TEST_FAIL;
+}
+
+/* adds an empty hash under key that keeps its keys in string order */
+static kvtree* walk_child(kvtree* hash, const char* key){
+  kvtree* child = kvtree_set(hash, key, kvtree_new());
+  kvtree_set_order(child, KVTREE_ORDER_STR, KVTREE_SORT_ASCENDING);
+  return child;
+}
+
+int test_kvtree_kv_walk(){
+  int rc = TEST_PASS;
+  struct walked w;
+
+  /* a/b/c, a/d, and e/x */
+  kvtree* kvt = kvtree_new();
+  kvtree_set_order(kvt, KVTREE_ORDER_STR, KVTREE_SORT_ASCENDING);
+  kvtree* a = walk_child(kvt, "a");
+  walk_child(walk_child(a, "b"), "c");
+  walk_child(a, "d");
+  walk_child(walk_child(kvt, "e"), "x");
+
+  const char* all[] = {
+    "+a", "+a/b", "+a/b/c", "-a/b/c", "-a/b", "+a/d", "-a/d", "-a",
+    "+e", "+e/x", "-e/x", "-e", NULL
+  };
+  memset(&w, 0, sizeof(w));
+  if (kvtree_walk(kvt, walk_pre, walk_post, &w) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (check_walk(&w, all) != TEST_PASS) rc = TEST_FAIL;
+
+  /* only before the children */
+  const char* pre[] = { "+a", "+a/b", "+a/b/c", "+a/d", "+e", "+e/x", NULL };
+  memset(&w, 0, sizeof(w));
+  if (kvtree_walk(kvt, walk_pre, NULL, &w) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (check_walk(&w, pre) != TEST_PASS) rc = TEST_FAIL;
+
+  /* skip what is below b, it still sees its post */
+  const char* pruned[] = {
+    "+a", "+a/b", "-a/b", "+a/d", "-a/d", "-a", "+e", "+e/x", "-e/x", "-e", NULL
+  };
+  memset(&w, 0, sizeof(w));
+  w.prune = "b";
+  if (kvtree_walk(kvt, walk_pre, walk_post, &w) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (check_walk(&w, pruned) != TEST_PASS) rc = TEST_FAIL;
+
+  /* stop at d */
+  const char* stopped[] = { "+a", "+a/b", "+a/b/c", "-a/b/c", "-a/b", "+a/d", NULL };
+  memset(&w, 0, sizeof(w));
+  w.stop = "d";
+  if (kvtree_walk(kvt, walk_pre, walk_post, &w) != 42) rc = TEST_FAIL;
+  if (check_walk(&w, stopped) != TEST_PASS) rc = TEST_FAIL;
+
+  /* nothing to visit */
+  const char* none[] = { NULL };
+  memset(&w, 0, sizeof(w));
+  if (kvtree_walk(NULL, walk_pre, walk_post, &w) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_walk(kvtree_get_kv(kvt, "e", "x"), walk_pre, walk_post, &w) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (check_walk(&w, none) != TEST_PASS) rc = TEST_FAIL;
+
+  kvtree_delete(&kvt);
+  return rc;
+}
+
+/* checks that kvtree_sort_int put the keys of kvt in order, with
+ * equal keys in the order they were visited in before, which is
+ * recorded in their "I" subkey */
+static int check_sort_int(kvtree* kvt, int direction, int count){
+  int rc = TEST_PASS;
+  int seen = 0;
+  int prev_key = 0;
+  int prev_index = 0;
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(kvt); elem != NULL; elem = kvtree_elem_next(elem)) {
+    int key = kvtree_elem_key_int(elem);
+    int index = 0;
+    kvtree_util_get_int(kvtree_elem_hash(elem), "I", &index);
+    if (seen > 0) {
+      int cmp = (direction == KVTREE_SORT_ASCENDING) ? key - prev_key : prev_key - key;
+      if (cmp < 0 || (cmp == 0 && index < prev_index)) rc = TEST_FAIL;
+    }
+    prev_key = key;
+    prev_index = index;
+    seen++;
+  }
+  if (seen != count) rc = TEST_FAIL;
+  return rc;
+}
+
+int test_kvtree_kv_sort(){
+  int rc = TEST_PASS;
+  char key[32];
+  int i;
+
+  /* a short list takes the comparison sort, a long one the radix
+   * sort, each has pairs of keys like "-5" and " -5" that are equal
+   * as ints */
+  int counts[2] = { 100, 5000 };
+  int c, dir;
+  for (c = 0; c < 2; c++) {
+    int count = counts[c];
+    for (dir = 0; dir < 2; dir++) {
+      int direction = dir ? KVTREE_SORT_DESCENDING : KVTREE_SORT_ASCENDING;
+      kvtree* kvt = kvtree_new();
+      int half = count / 2;
+      for (i = 0; i < count; i++) {
+        int val = (i * 7919) % half - half / 2;
+        snprintf(key, sizeof(key), (i < half) ? "%d" : " %d", val);
+        kvtree_set(kvt, key, kvtree_new());
+      }
+      int index = 0;
+      kvtree_elem* elem;
+      for (elem = kvtree_elem_first(kvt); elem != NULL; elem = kvtree_elem_next(elem)) {
+        kvtree_util_set_int(kvtree_elem_hash(elem), "I", index++);
+      }
+      if (kvtree_sort_int(kvt, direction) != KVTREE_SUCCESS) rc = TEST_FAIL;
+      if (check_sort_int(kvt, direction, count) != TEST_PASS) rc = TEST_FAIL;
+      kvtree_delete(&kvt);
+    }
+  }
+
+  /* a list of strings long enough to be sorted with several threads
+   * comes out the same as one sorted with a single thread */
+  int count = 70000;
+  kvtree* kvt[2];
+  for (c = 0; c < 2; c++) {
+    kvt[c] = kvtree_new();
+    for (i = 0; i < count; i++) {
+      snprintf(key, sizeof(key), "%d", (i * 7919) % count);
+      kvtree_set(kvt[c], key, kvtree_new());
+    }
+  }
+  setenv("KVTREE_SORT_THREADS", "4", 1);
+  kvtree_sort(kvt[0], KVTREE_SORT_DESCENDING);
+  setenv("KVTREE_SORT_THREADS", "1", 1);
+  kvtree_sort(kvt[1], KVTREE_SORT_DESCENDING);
+  unsetenv("KVTREE_SORT_THREADS");
+  kvtree_elem* elem0 = kvtree_elem_first(kvt[0]);
+  kvtree_elem* elem1 = kvtree_elem_first(kvt[1]);
+  const char* last = NULL;
+  int seen = 0;
+  while (elem0 != NULL && elem1 != NULL) {
+    if (strcmp(kvtree_elem_key(elem0), kvtree_elem_key(elem1)) != 0) rc = TEST_FAIL;
+    if (last != NULL && strcmp(last, kvtree_elem_key(elem0)) <= 0) rc = TEST_FAIL;
+    last = kvtree_elem_key(elem0);
+    elem0 = kvtree_elem_next(elem0);
+    elem1 = kvtree_elem_next(elem1);
+    seen++;
+  }
+  if (seen != count || elem0 != NULL || elem1 != NULL) rc = TEST_FAIL;
+  if (kvtree_get(kvt[0], "12345") == NULL) rc = TEST_FAIL;
+  kvtree_delete(&kvt[0]);
+  kvtree_delete(&kvt[1]);
+
+  return rc;
+}
+
+/* checks that view lists the children of sorted in the same order */
+static int check_view(kvtree_elem* const* view, int count, const kvtree* sorted){
+  int rc = TEST_PASS;
+  int i = 0;
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(sorted); elem != NULL; elem = kvtree_elem_next(elem)) {
+    if (i >= count || strcmp(kvtree_elem_key(view[i]), kvtree_elem_key(elem)) != 0) rc = TEST_FAIL;
+    i++;
+  }
+  if (i != count) rc = TEST_FAIL;
+  return rc;
+}
+
+int test_kvtree_kv_view(){
+  int rc = TEST_PASS;
+  char key[32];
+  int i, count;
+  kvtree_elem* const* view;
+
+  /* rank ids out of order, with a few that are equal as ints */
+  int n = 300;
+  kvtree* kvt[2] = { kvtree_new(), kvtree_new_arena() };
+  int a;
+  for (a = 0; a < 2; a++) {
+    for (i = 0; i < n; i++) {
+      snprintf(key, sizeof(key), (i % 50 == 0) ? " %d" : "%d", (i * 37) % n);
+      kvtree_set(kvt[a], key, kvtree_new());
+    }
+    const char* first = kvtree_elem_key(kvtree_elem_first(kvt[a]));
+
+    /* each view matches a sorted copy, and leaves kvt as it is */
+    int order, dir;
+    for (order = KVTREE_ORDER_STR; order <= KVTREE_ORDER_INT; order++) {
+      for (dir = 0; dir < 2; dir++) {
+        int direction = dir ? KVTREE_SORT_DESCENDING : KVTREE_SORT_ASCENDING;
+        kvtree* copy = kvtree_new();
+        kvtree_merge(copy, kvt[a]);
+        if (order == KVTREE_ORDER_STR) {
+          kvtree_sort(copy, direction);
+        } else {
+          kvtree_sort_int(copy, direction);
+        }
+        view = kvtree_sorted_view(kvt[a], order, direction, &count);
+        if (check_view(view, count, copy) != TEST_PASS) rc = TEST_FAIL;
+        if (kvtree_sorted_view(kvt[a], order, direction, &count) != view) rc = TEST_FAIL;
+        if (kvtree_get_order(kvt[a]) != KVTREE_ORDER_NONE) rc = TEST_FAIL;
+        if (strcmp(kvtree_elem_key(kvtree_elem_first(kvt[a])), first) != 0) rc = TEST_FAIL;
+        kvtree_delete(&copy);
+      }
+    }
+
+    /* the view follows added and removed keys */
+    kvtree_set(kvt[a], "-1", kvtree_new());
+    kvtree_unset(kvt[a], "5");
+    view = kvtree_sorted_view(kvt[a], KVTREE_ORDER_INT, KVTREE_SORT_ASCENDING, &count);
+    if (count != n || kvtree_elem_key_int(view[0]) != -1) rc = TEST_FAIL;
+    for (i = 1; i < count; i++) {
+      if (kvtree_elem_key_int(view[i]) < kvtree_elem_key_int(view[i - 1])) rc = TEST_FAIL;
+      if (strcmp(kvtree_elem_key(view[i]), "5") == 0) rc = TEST_FAIL;
+    }
+    int num;
+    int* list;
+    kvtree_list_int(kvt[a], &num, &list);
+    if (num != count) rc = TEST_FAIL;
+    for (i = 0; i < num && i < count; i++) {
+      if (list[i] != kvtree_elem_key_int(view[i])) rc = TEST_FAIL;
+    }
+    free(list);
+  }
+
+  /* a hash that keeps the order is its own view, and a frozen tree
+   * has views too */
+  kvtree_set_order(kvt[0], KVTREE_ORDER_STR, KVTREE_SORT_DESCENDING);
+  view = kvtree_sorted_view(kvt[0], KVTREE_ORDER_STR, KVTREE_SORT_DESCENDING, &count);
+  if (count != n || view[0] != kvtree_elem_first(kvt[0])) rc = TEST_FAIL;
+  kvtree* frozen = kvtree_freeze(kvt[1]);
+  view = kvtree_sorted_view(frozen, KVTREE_ORDER_INT, KVTREE_SORT_DESCENDING, &count);
+  if (count != n || kvtree_elem_key_int(view[0]) != n - 1) rc = TEST_FAIL;
+  kvtree_delete(&frozen);
+
+  /* one child, none, and no order */
+  kvtree* one = kvtree_new();
+  kvtree_set(one, "x", kvtree_new());
+  view = kvtree_sorted_view(one, KVTREE_ORDER_STR, KVTREE_SORT_ASCENDING, &count);
+  if (count != 1 || view[0] != kvtree_elem_first(one)) rc = TEST_FAIL;
+  kvtree_unset(one, "x");
+  if (kvtree_sorted_view(one, KVTREE_ORDER_STR, KVTREE_SORT_ASCENDING, &count) != NULL || count != 0) rc = TEST_FAIL;
+  kvtree_set(one, "x", kvtree_new());
+  if (kvtree_sorted_view(one, KVTREE_ORDER_NONE, KVTREE_SORT_ASCENDING, &count) != NULL || count != 0) rc = TEST_FAIL;
+  kvtree_delete(&one);
+
+  kvtree_delete(&kvt[0]);
+  kvtree_delete(&kvt[1]);
+  return rc;
+}
+
+/* define the work of one thread of test_kvtree_kv_concurrent */
+struct concurrent_arg {
+  kvtree_concurrent* tree;
+  int id;
+  int rc;
+};
+
+#define CONCURRENT_THREADS (8)
+#define CONCURRENT_ITERS   (500)
+
+static void* concurrent_thread(void* arg){
+  struct concurrent_arg* a = (struct concurrent_arg*) arg;
+  char key[32], val[32];
+  int i;
+  snprintf(key, sizeof(key), "%d", a->id);
+  for (i = 0; i < CONCURRENT_ITERS; i++) {
+    /* count under a key of our own */
+    int count = 0;
+    kvtree_concurrent_util_get_int(a->tree, key, "COUNT", &count);
+    if (count != i) a->rc = TEST_FAIL;
+    kvtree_concurrent_util_set_int(a->tree, key, "COUNT", i + 1);
+
+    /* add to a key every thread shares */
+    snprintf(val, sizeof(val), "%d_%d", a->id, i);
+    kvtree_concurrent_set_kv(a->tree, "SHARED", val);
+
+    /* add and remove a top level key, while reading another thread's */
+    snprintf(val, sizeof(val), "TMP%d", a->id);
+    kvtree_concurrent_set_kv(a->tree, val, "x");
+    kvtree* copy = kvtree_concurrent_getf(a->tree, "%d", (a->id + 1) % CONCURRENT_THREADS);
+    kvtree_delete(&copy);
+    kvtree_concurrent_unset_kv(a->tree, val, "x");
+  }
+  return NULL;
+}
+
+int test_kvtree_kv_concurrent(){
+  int rc = TEST_PASS;
+  int i;
+
+  /* a tree from an arena is refused */
+  kvtree* arena = kvtree_new_arena();
+  if (kvtree_concurrent_new(arena, 0) != NULL) rc = TEST_FAIL;
+  kvtree_delete(&arena);
+
+  kvtree_concurrent* tree = kvtree_concurrent_new(NULL, 3);
+
+  /* values are copied out */
+  char* str = NULL;
+  kvtree_concurrent_util_set_str(tree, "RANK", "HOST", "node1");
+  if (kvtree_concurrent_util_get_str(tree, "RANK", "HOST", &str) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (str == NULL || strcmp(str, "node1") != 0) rc = TEST_FAIL;
+  free(str);
+  double d = 0.0;
+  kvtree_concurrent_util_set_double(tree, NULL, "TIME", 2.5);
+  if (kvtree_concurrent_util_get_double(tree, NULL, "TIME", &d) != KVTREE_SUCCESS || d != 2.5) rc = TEST_FAIL;
+  int n;
+  if (kvtree_concurrent_util_get_int(tree, "NONE", "X", &n) == KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  kvtree_concurrent_setf(tree, kvtree_new(), "RANK %d FILE %s", 7, "a.dat");
+  kvtree* copy = kvtree_concurrent_getf(tree, "RANK %d", 7);
+  if (copy == NULL || kvtree_get(copy, "FILE") == NULL) rc = TEST_FAIL;
+  kvtree_delete(&copy);
+
+  /* unsetting the last subkey unsets the key */
+  kvtree_concurrent_set_kv(tree, "FLAGS", "A");
+  kvtree_concurrent_unset_kv(tree, "FLAGS", "A");
+  copy = kvtree_concurrent_get(tree, "FLAGS");
+  if (copy != NULL) rc = TEST_FAIL;
+
+  /* threads work under their own keys and a shared one at once,
+   * with interned keys so that the pool is shared as well */
+  int prev = kvtree_intern_keys(1);
+  pthread_t threads[CONCURRENT_THREADS];
+  struct concurrent_arg args[CONCURRENT_THREADS];
+  for (i = 0; i < CONCURRENT_THREADS; i++) {
+    args[i].tree = tree;
+    args[i].id   = i;
+    args[i].rc   = TEST_PASS;
+    pthread_create(&threads[i], NULL, concurrent_thread, &args[i]);
+  }
+  for (i = 0; i < CONCURRENT_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (args[i].rc != TEST_PASS) rc = TEST_FAIL;
+  }
+
+  kvtree* hash = kvtree_concurrent_release(&tree);
+  if (tree != NULL) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(hash, "SHARED")) != CONCURRENT_THREADS * CONCURRENT_ITERS) rc = TEST_FAIL;
+  if (kvtree_size(hash) != CONCURRENT_THREADS + 3) rc = TEST_FAIL;
+  for (i = 0; i < CONCURRENT_THREADS; i++) {
+    if (kvtree_util_get_int(kvtree_getf(hash, "%d", i), "COUNT", &n) != KVTREE_SUCCESS ||
+        n != CONCURRENT_ITERS)
+    {
+      rc = TEST_FAIL;
+    }
+  }
+  kvtree_delete(&hash);
+  kvtree_intern_keys(prev);
+
+  return rc;
+}
+
+/* define the work of one reader of test_kvtree_kv_publish */
+struct publish_arg {
+  kvtree_publisher* pub;
+  int done;
+  int rc;
+};
+
+static void* publish_reader(void* arg){
+  struct publish_arg* a = (struct publish_arg*) arg;
+  int last = 0;
+  while (! __atomic_load_n(&a->done, __ATOMIC_ACQUIRE)) {
+    /* both values of a version match, and never go backwards */
+    int token;
+    const kvtree* v = kvtree_acquire(a->pub, &token);
+    int x = -1, y = -2;
+    kvtree_util_get_int(kvtree_get(v, "STATE"), "X", &x);
+    kvtree_util_get_int(kvtree_get(v, "STATE"), "Y", &y);
+    if (x != y || x < last) a->rc = TEST_FAIL;
+    last = x;
+
+    /* listing keys only reads the version */
+    int num;
+    int* list;
+    kvtree_list_int(kvtree_get(kvtree_get(v, "CONFIG"), "FILE"), &num, &list);
+    if (num != 100 || list[0] != 0 || list[99] != 99) a->rc = TEST_FAIL;
+    free(list);
+
+    /* copies share the hashes of a version */
+    kvtree* copy = kvtree_clone(v);
+    kvtree_release(a->pub, token);
+    kvtree_delete(&copy);
+  }
+  return NULL;
+}
+
+int test_kvtree_kv_publish(){
+  int rc = TEST_PASS;
+  int i, x;
+
+  kvtree* kvt = kvtree_new();
+  kvtree_util_set_int(kvtree_set(kvt, "STATE", kvtree_new()), "X", 0);
+  kvtree_util_set_int(kvtree_get(kvt, "STATE"), "Y", 0);
+  kvtree* config = kvtree_set(kvt, "CONFIG", kvtree_new());
+  for (i = 0; i < 100; i++) {
+    kvtree_setf(config, kvtree_new(), "FILE %d", i);
+  }
+  kvtree_publisher* pub = kvtree_publisher_new(kvt);
+
+  /* a version stays as it was while it is held, and the new one
+   * shares what did not change */
+  int t1, t2;
+  const kvtree* v1 = kvtree_acquire(pub, &t1);
+  kvtree* v = kvtree_publish_begin(pub);
+  kvtree_util_set_int(kvtree_unshare(v, "STATE"), "X", 1);
+  kvtree_publish_commit(pub, v);
+  const kvtree* v2 = kvtree_acquire(pub, &t2);
+  if (v1 == v2 || kvtree_get(v1, "CONFIG") != kvtree_get(v2, "CONFIG")) rc = TEST_FAIL;
+  if (kvtree_util_get_int(kvtree_get(v1, "STATE"), "X", &x) != KVTREE_SUCCESS || x != 0) rc = TEST_FAIL;
+  if (kvtree_util_get_int(kvtree_get(v2, "STATE"), "X", &x) != KVTREE_SUCCESS || x != 1) rc = TEST_FAIL;
+  if (kvtree_publisher_reclaim(pub) != 1) rc = TEST_FAIL;
+  kvtree_release(pub, t1);
+  kvtree_release(pub, t2);
+  if (kvtree_publisher_reclaim(pub) != 0) rc = TEST_FAIL;
+
+  /* an aborted version is not published */
+  v = kvtree_publish_begin(pub);
+  kvtree_util_set_int(kvtree_unshare(v, "STATE"), "X", 5);
+  kvtree_publish_abort(pub, &v);
+  v1 = kvtree_acquire(pub, &t1);
+  if (v != NULL || v1 != v2) rc = TEST_FAIL;
+  kvtree_release(pub, t1);
+  v = kvtree_publish_begin(pub);
+  kvtree_util_set_int(kvtree_unshare(v, "STATE"), "X", 0);
+  kvtree_publish_commit(pub, v);
+
+  /* readers never see a version half done */
+  struct publish_arg args[4];
+  pthread_t threads[4];
+  for (i = 0; i < 4; i++) {
+    args[i].pub  = pub;
+    args[i].done = 0;
+    args[i].rc   = TEST_PASS;
+    pthread_create(&threads[i], NULL, publish_reader, &args[i]);
+  }
+  for (i = 1; i <= 300; i++) {
+    v = kvtree_publish_begin(pub);
+    kvtree* state = kvtree_unshare(v, "STATE");
+    kvtree_util_set_int(state, "X", i);
+    kvtree_util_set_int(state, "Y", i);
+    kvtree_publish_commit(pub, v);
+  }
+  for (i = 0; i < 4; i++) {
+    __atomic_store_n(&args[i].done, 1, __ATOMIC_RELEASE);
+    pthread_join(threads[i], NULL);
+    if (args[i].rc != TEST_PASS) rc = TEST_FAIL;
+  }
+  if (kvtree_publisher_reclaim(pub) != 0) rc = TEST_FAIL;
+
+  kvtree_publisher_delete(&pub);
+  if (pub != NULL) rc = TEST_FAIL;
+  return rc;
+}
+
+/* define the work of one thread of test_kvtree_kv_shard */
+struct shard_arg {
+  kvtree* tree;
+  int id;
+  int rc;
+};
+
+#define SHARD_THREADS (8)
+#define SHARD_RANKS   (250)
+
+static void* shard_thread(void* arg){
+  struct shard_arg* a = (struct shard_arg*) arg;
+  kvtree* ranks = kvtree_get(a->tree, "RANK");
+  char key[32];
+  int i;
+  for (i = a->id; i < SHARD_THREADS * SHARD_RANKS; i += SHARD_THREADS) {
+    /* each thread adds ranks of its own under the same parent */
+    kvtree* rank = kvtree_set_kv_int(a->tree, "RANK", i);
+    kvtree_util_set_int(rank, "ID", a->id);
+    if (kvtree_get_kv_int(a->tree, "RANK", i) != rank) a->rc = TEST_FAIL;
+
+    /* while a scratch key comes and goes */
+    snprintf(key, sizeof(key), "TMP%d", i);
+    kvtree_set(ranks, key, kvtree_new());
+    kvtree_unset(ranks, key);
+  }
+  return NULL;
+}
+
+int test_kvtree_kv_shard(){
+  int rc = TEST_PASS;
+  int i, n;
+
+  /* a sharded hash is freed along with its shards */
+  kvtree* kvt = kvtree_new_sharded(3);
+  kvtree_set_kv(kvt, "FILE", "a.dat");
+  kvtree_util_set_int(kvt, "SIZE", 5);
+  if (kvtree_size(kvt) != 2 || kvtree_get_kv(kvt, "FILE", "a.dat") == NULL) rc = TEST_FAIL;
+  kvtree_unset(kvt, "FILE");
+  if (! kvtree_has_one(kvt)) rc = TEST_FAIL;
+  kvtree_delete(&kvt);
+
+  /* an integer key is removed from the shard that holds it */
+  kvtree* root = kvtree_new();
+  kvtree_set(root, "K", kvtree_new_sharded(4));
+  for (i = 0; i < 20; i++) {
+    kvtree_set_kv_int(root, "K", i);
+  }
+  kvtree_unset_kv_int(root, "K", 5);
+  if (kvtree_get_kv_int(root, "K", 5) != NULL || kvtree_get_kv_int(root, "K", 6) == NULL) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(root, "K")) != 19) rc = TEST_FAIL;
+  kvtree_key key = { NULL, 3 };
+  kvtree_unset_keys(kvtree_get(root, "K"), &key, 1);
+  if (kvtree_get_kv_int(root, "K", 3) != NULL || kvtree_size(kvtree_get(root, "K")) != 18) rc = TEST_FAIL;
+  kvtree_delete(&root);
+
+  kvtree* tree = kvtree_new();
+  kvtree_set(tree, "RANK", kvtree_new_sharded(0));
+  pthread_t threads[SHARD_THREADS];
+  struct shard_arg args[SHARD_THREADS];
+  for (i = 0; i < SHARD_THREADS; i++) {
+    args[i].tree = tree;
+    args[i].id   = i;
+    args[i].rc   = TEST_PASS;
+    pthread_create(&threads[i], NULL, shard_thread, &args[i]);
+  }
+  for (i = 0; i < SHARD_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    if (args[i].rc != TEST_PASS) rc = TEST_FAIL;
+  }
+
+  /* one iteration visits the ranks of every shard */
+  kvtree* ranks = kvtree_get(tree, "RANK");
+  int total = SHARD_THREADS * SHARD_RANKS;
+  if (kvtree_size(ranks) != total) rc = TEST_FAIL;
+  int* order = (int*) malloc(total * sizeof(int));
+  int count = 0;
+  kvtree_elem* elem;
+  for (elem = kvtree_elem_first(ranks); elem != NULL; elem = kvtree_elem_next(elem)) {
+    int id = kvtree_elem_key_int(elem);
+    if (kvtree_util_get_int(kvtree_elem_hash(elem), "ID", &n) != KVTREE_SUCCESS ||
+        n != id % SHARD_THREADS || count == total)
+    {
+      rc = TEST_FAIL;
+      break;
+    }
+    order[count++] = id;
+  }
+  if (count != total) rc = TEST_FAIL;
+
+  /* the hash must be flattened before it is used as a whole, or before
+   * the tree holding it is walked, packed, or written */
+  if (kvtree_sort_int(ranks, KVTREE_SORT_ASCENDING) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_walk(tree, NULL, NULL, NULL) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_print(tree, 0) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_pack_size(tree) != 0 || kvtree_freeze(tree) != NULL) rc = TEST_FAIL;
+  char file[256];
+  snprintf(file, sizeof(file), "%s/%s", KVTREE_TEST_BASE, "test_kvtree_kv_shard");
+  if (kvtree_write_file(file, tree) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  unlink(file);
+
+  /* flattening keeps the keys and the order they are visited in */
+  kvtree_flatten(tree);
+  if (kvtree_size(ranks) != total) rc = TEST_FAIL;
+  count = 0;
+  for (elem = kvtree_elem_first(ranks); elem != NULL && count < total; elem = kvtree_elem_next(elem)) {
+    if (kvtree_elem_key_int(elem) != order[count++]) rc = TEST_FAIL;
+  }
+  if (count != total || kvtree_get_kv_int(tree, "RANK", total - 1) == NULL) rc = TEST_FAIL;
+  free(order);
+
+  /* and then the tree packs as any other */
+  size_t size = kvtree_pack_size(tree);
+  char* buf = malloc(size);
+  if (kvtree_pack(buf, tree) != size) rc = TEST_FAIL;
+  kvtree* copy = kvtree_new();
+  if (kvtree_unpack(buf, copy) != size) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(copy, "RANK")) != total) rc = TEST_FAIL;
+  if (kvtree_util_get_int(kvtree_get_kv_int(copy, "RANK", 9), "ID", &n) != KVTREE_SUCCESS || n != 1) rc = TEST_FAIL;
+  free(buf);
+  kvtree_delete(&copy);
+
+  kvtree_delete(&tree);
+  return rc;
+}
+
+int test_kvtree_kv_intern(){
+  int rc = TEST_PASS;
+  int i;
+
+  int prev = kvtree_intern_keys(1);
+
+  /* the same key under different parents shares one string */
+  kvtree* kvt = kvtree_new();
+  for (i = 0; i < 100; i++) {
+    kvtree* rank = kvtree_set_kv_int(kvt, "RANK", i);
+    kvtree_set_kv(rank, "FILE", "ckpt");
+  }
+  kvtree_elem* a = kvtree_elem_get(kvtree_get_kv_int(kvt, "RANK", 1), "FILE");
+  kvtree_elem* b = kvtree_elem_get(kvtree_get_kv_int(kvt, "RANK", 2), "FILE");
+  if (a == NULL || b == NULL) return TEST_FAIL;
+  if (kvtree_elem_key(a) != kvtree_elem_key(b)) rc = TEST_FAIL;
+
+  /* merge into a tree created while interning is off */
+  kvtree_intern_keys(0);
+  kvtree* copy = kvtree_new();
+  kvtree_set_kv_int(copy, "RANK", 1000);
+  kvtree_merge(copy, kvt);
+  if (kvtree_size(kvtree_get(copy, "RANK")) != 101) rc = TEST_FAIL;
+  for (i = 0; i < 100; i++) {
+    if (kvtree_get(kvtree_get_kv_int(copy, "RANK", i), "FILE") == NULL) rc = TEST_FAIL;
+  }
+
+  /* keys outlive the tree they were interned by */
+  kvtree_delete(&kvt);
+  if (kvtree_get_kv(kvtree_get_kv_int(copy, "RANK", 5), "FILE", "ckpt") == NULL) rc = TEST_FAIL;
+  kvtree_unset_kv_int(copy, "RANK", 5);
+  if (kvtree_get_kv_int(copy, "RANK", 5) != NULL) rc = TEST_FAIL;
+  kvtree_delete(&copy);
+
+  kvtree_intern_keys(prev);
+
+  return rc;
+}
+
+int test_kvtree_kv_keys(){
+  int rc = TEST_PASS;
+
+  /* keys of very different lengths, including an empty key */
+  char long_key[2000];
+  memset(long_key, 'k', sizeof(long_key) - 1);
+  long_key[sizeof(long_key) - 1] = '\0';
+
+  kvtree* kvt = kvtree_new();
+  kvtree_set_kv(kvt, "", "empty");
+  kvtree_set_kv(kvt, long_key, "long");
+  kvtree_set_kv(kvt, "k", "short");
+
+  /* pack and unpack into a new tree */
+  size_t size = kvtree_pack_size(kvt);
+  char* buf = malloc(size);
+  if (kvtree_pack(buf, kvt) != size) rc = TEST_FAIL;
+  kvtree* copy = kvtree_new();
+  if (kvtree_unpack(buf, copy) != size) rc = TEST_FAIL;
+
+  if (kvtree_get_kv(copy, "", "empty") == NULL) rc = TEST_FAIL;
+  if (kvtree_get_kv(copy, long_key, "long") == NULL) rc = TEST_FAIL;
+  if (kvtree_get_kv(copy, "k", "short") == NULL) rc = TEST_FAIL;
+  kvtree_elem* elem = kvtree_elem_get(copy, long_key);
+  if (elem == NULL || strcmp(kvtree_elem_key(elem), long_key)) rc = TEST_FAIL;
+
+  free(buf);
+  kvtree_delete(&copy);
+  kvtree_delete(&kvt);
+
+  return rc;
+}
+
+int test_kvtree_kv_path(){
+  int rc = TEST_PASS;
+  int i;
+
+  /* compiled paths set the same tree as format strings */
+  kvtree* kvt1 = kvtree_new();
+  kvtree* kvt2 = kvtree_new();
+  kvtree_path* path = kvtree_path_new("%s %d FILE %lu");
+  if (path == NULL) return TEST_FAIL;
+  for (i = -20; i < 20; i++) {
+    kvtree_setf(kvt1, kvtree_new(), "%s %d FILE %lu", "RANK", i, 18446744073709551615UL);
+    kvtree_setp(kvt2, kvtree_new(), path, "RANK", i, 18446744073709551615UL);
+  }
+  size_t size1 = kvtree_pack_size(kvt1);
+  size_t size2 = kvtree_pack_size(kvt2);
+  char* buf1 = malloc(size1);
+  char* buf2 = malloc(size2);
+  kvtree_pack(buf1, kvt1);
+  kvtree_pack(buf2, kvt2);
+  if (size1 != size2 || memcmp(buf1, buf2, size1) != 0) rc = TEST_FAIL;
+  free(buf1);
+  free(buf2);
+
+  /* and find the same hashes */
+  for (i = -20; i < 20; i++) {
+    kvtree* get1 = kvtree_getf(kvt1, "%s %d FILE %lu", "RANK", i, 18446744073709551615UL);
+    kvtree* get2 = kvtree_getp(kvt1, path, "RANK", i, 18446744073709551615UL);
+    if (get1 == NULL || get1 != get2) rc = TEST_FAIL;
+  }
+  if (kvtree_getp(kvt1, path, "RANK", 20, 1UL) != NULL) rc = TEST_FAIL;
+  if (kvtree_get(kvtree_getf(kvt1, "RANK 0 FILE"), "18446744073709551615") == NULL) rc = TEST_FAIL;
+  kvtree_path_delete(&path);
+  if (path != NULL) rc = TEST_FAIL;
+
+  /* setting the last key replaces its hash */
+  path = kvtree_path_new(" %s  %#x ");
+  kvtree_setp(kvt1, kvtree_new(), path, "CRC", 0xbeef);
+  kvtree_setp(kvt1, kvtree_new(), path, "CRC", 0xbeef);
+  if (kvtree_size(kvtree_get(kvt1, "CRC")) != 1) rc = TEST_FAIL;
+  if (kvtree_get_kv(kvt1, "CRC", "0xbeef") == NULL) rc = TEST_FAIL;
+  kvtree_path_delete(&path);
+
+  /* unsupported conversions are rejected */
+  if (kvtree_path_new("%s %x") != NULL) rc = TEST_FAIL;
+
+  kvtree_delete(&kvt1);
+  kvtree_delete(&kvt2);
+  return rc;
+}
+
+int test_kvtree_kv_path_keys(){
+  int rc = TEST_PASS;
+
+  /* keys longer than the format functions can handle */
+  char long_key[2000];
+  memset(long_key, 'k', sizeof(long_key) - 1);
+  long_key[sizeof(long_key) - 1] = '\0';
+
+  kvtree* kvt = kvtree_new();
+  const char* keys[3] = { "DIR", long_key, "FILE" };
+  kvtree* file = kvtree_set_path(kvt, kvtree_new(), keys, 3);
+  if (file == NULL || kvtree_get_path(kvt, keys, 3) != file) rc = TEST_FAIL;
+  if (kvtree_get(kvtree_get(kvtree_get(kvt, "DIR"), long_key), "FILE") != file) rc = TEST_FAIL;
+  if (kvtree_get_path(kvt, keys, 0) != kvt) rc = TEST_FAIL;
+  if (kvtree_set_path(kvt, NULL, keys, 0) != NULL) rc = TEST_FAIL;
+
+  /* mixed string and integer keys find what the format functions set */
+  int i;
+  for (i = -5; i < 40; i++) {
+    kvtree_setf(kvt, kvtree_new(), "RANK %d CKPT %s", i, "10");
+  }
+  for (i = -5; i < 40; i++) {
+    kvtree_key ckpt[4] = { {"RANK", 0}, {NULL, i}, {"CKPT", 0}, {"10", 0} };
+    kvtree* get = kvtree_get_keys(kvt, ckpt, 4);
+    if (get == NULL || get != kvtree_getf(kvt, "RANK %d CKPT 10", i)) rc = TEST_FAIL;
+  }
+
+  /* setting keys adds only what is missing */
+  kvtree_key rank[3] = { {"RANK", 0}, {NULL, 7}, {NULL, 3} };
+  kvtree_set_keys(kvt, kvtree_new(), rank, 3);
+  if (kvtree_size(kvtree_get(kvt, "RANK")) != 45) rc = TEST_FAIL;
+  if (kvtree_getf(kvt, "RANK 7 CKPT 10") == NULL) rc = TEST_FAIL;
+  if (kvtree_getf(kvt, "RANK 7 3") == NULL) rc = TEST_FAIL;
+
+  /* unset removes only the last key */
+  if (kvtree_unset_keys(kvt, rank, 2) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_getf(kvt, "RANK 7") != NULL) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(kvt, "RANK")) != 44) rc = TEST_FAIL;
+  if (kvtree_unset_keys(kvt, rank, 3) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_unset_path(kvt, keys, 3) != KVTREE_SUCCESS) rc = TEST_FAIL;
+  if (kvtree_get_path(kvt, keys, 2) == NULL || kvtree_get_path(kvt, keys, 3) != NULL) rc = TEST_FAIL;
+
+  kvtree_delete(&kvt);
+  return rc;
+}
+
 void test_kvtree_kv_init(){
   register_test(test_kvtree_kv, "test_kvtree_kv");
   register_test(test_kvtree_kv_nested, "test_kvtree_kv_nested");
   register_test(test_kvtree_kv_multiple, "test_kvtree_kv_multiple");
   register_test(test_kvtree_kv_int, "test_kvtree_kv_int");
+  register_test(test_kvtree_kv_int_keys, "test_kvtree_kv_int_keys");
+  register_test(test_kvtree_kv_large, "test_kvtree_kv_large");
+  register_test(test_kvtree_kv_sizes, "test_kvtree_kv_sizes");
+  register_test(test_kvtree_kv_order, "test_kvtree_kv_order");
+  register_test(test_kvtree_kv_ordered, "test_kvtree_kv_ordered");
+  register_test(test_kvtree_kv_range, "test_kvtree_kv_range");
+  register_test(test_kvtree_kv_merge_move, "test_kvtree_kv_merge_move");
+  register_test(test_kvtree_kv_clone, "test_kvtree_kv_clone");
+  register_test(test_kvtree_kv_share, "test_kvtree_kv_share");
+  register_test(test_kvtree_kv_freeze, "test_kvtree_kv_freeze");
+  register_test(test_kvtree_kv_deep, "test_kvtree_kv_deep");
+  register_test(test_kvtree_kv_walk, "test_kvtree_kv_walk");
+  register_test(test_kvtree_kv_sort, "test_kvtree_kv_sort");
+  register_test(test_kvtree_kv_view, "test_kvtree_kv_view");
+  register_test(test_kvtree_kv_concurrent, "test_kvtree_kv_concurrent");
+  register_test(test_kvtree_kv_publish, "test_kvtree_kv_publish");
+  register_test(test_kvtree_kv_shard, "test_kvtree_kv_shard");
+  register_test(test_kvtree_kv_intern, "test_kvtree_kv_intern");
+  register_test(test_kvtree_kv_keys, "test_kvtree_kv_keys");
+  register_test(test_kvtree_kv_path, "test_kvtree_kv_path");
+  register_test(test_kvtree_kv_path_keys, "test_kvtree_kv_path_keys");
 }
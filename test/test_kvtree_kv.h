@@ -5,6 +5,27 @@
 
 int test_kvtree_kv();
 int test_kvtree_kv_int();
+int test_kvtree_kv_int_keys();
+int test_kvtree_kv_large();
+int test_kvtree_kv_sizes();
+int test_kvtree_kv_order();
+int test_kvtree_kv_ordered();
+int test_kvtree_kv_range();
+int test_kvtree_kv_merge_move();
+int test_kvtree_kv_clone();
+int test_kvtree_kv_share();
+int test_kvtree_kv_freeze();
+int test_kvtree_kv_deep();
+int test_kvtree_kv_walk();
+int test_kvtree_kv_sort();
+int test_kvtree_kv_view();
+int test_kvtree_kv_concurrent();
+int test_kvtree_kv_publish();
+int test_kvtree_kv_shard();
+int test_kvtree_kv_intern();
+int test_kvtree_kv_keys();
+int test_kvtree_kv_path();
+int test_kvtree_kv_path_keys();
 void test_kvtree_kv_init();
 
 #endif //TEST_KVTREE_KV_H
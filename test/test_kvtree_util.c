@@ -2,6 +2,8 @@
 #include "test_kvtree_util.h"
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 
 int test_kvtree_util_set_get_bytecount(){
   int rc = TEST_PASS;
@@ -122,6 +124,165 @@ int test_kvtree_util_set_get_ptr(){
   return rc;
 }
 
+/* returns file version stored in the header of a persisted hash */
+static int persist_version(const kvtree* kvtree){
+  void* buf;
+  size_t size;
+  kvtree_write_persist(&buf, &size, kvtree);
+  const unsigned char* p = (const unsigned char*) buf;
+  int version = (p[6] << 8) | p[7];
+  free(buf);
+  return version;
+}
+
+int test_kvtree_util_typed(){
+  int rc = TEST_PASS;
+
+  kvtree* hash = kvtree_new();
+  kvtree_util_set_bytecount(hash, "SIZE", 1048576);
+  kvtree_util_set_crc32(hash, "CRC", 0xdeadbeef);
+  kvtree_util_set_int(hash, "RANK", -3);
+  kvtree_util_set_double(hash, "TIME", 0.5);
+  kvtree_util_set_str(hash, "NAME", "ckpt.1");
+
+  /* values still look like strings to old code */
+  char* str;
+  str = kvtree_get_val(hash, "SIZE");
+  if (str == NULL || strcmp(str, "1048576")) rc = TEST_FAIL;
+  str = kvtree_get_val(hash, "CRC");
+  if (str == NULL || strcmp(str, "0xdeadbeef")) rc = TEST_FAIL;
+  str = kvtree_get_val(hash, "RANK");
+  if (str == NULL || strcmp(str, "-3")) rc = TEST_FAIL;
+  str = kvtree_get_val(hash, "TIME");
+  if (str == NULL || strcmp(str, "0.500000")) rc = TEST_FAIL;
+  if (kvtree_get_type(hash, "CRC") != KVTREE_TYPE_UINT64) rc = TEST_FAIL;
+
+  /* pack and unpack keeps types and strings */
+  size_t size = kvtree_pack_size(hash);
+  char* buf = malloc(size);
+  if (kvtree_pack(buf, hash) != size) rc = TEST_FAIL;
+  kvtree_delete(&hash);
+  hash = kvtree_new();
+  if (kvtree_unpack(buf, hash) != size) rc = TEST_FAIL;
+  free(buf);
+
+  if (kvtree_get_type(hash, "SIZE") != KVTREE_TYPE_UINT64) rc = TEST_FAIL;
+  if (kvtree_get_type(hash, "RANK") != KVTREE_TYPE_INT64) rc = TEST_FAIL;
+  if (kvtree_get_type(hash, "TIME") != KVTREE_TYPE_DOUBLE) rc = TEST_FAIL;
+  if (kvtree_get_type(hash, "NAME") != KVTREE_TYPE_STRING) rc = TEST_FAIL;
+  str = kvtree_get_val(hash, "CRC");
+  if (str == NULL || strcmp(str, "0xdeadbeef")) rc = TEST_FAIL;
+  if (kvtree_get_kv(hash, "NAME", "ckpt.1") == NULL) rc = TEST_FAIL;
+  uLong crc;
+  if (kvtree_util_get_crc32(hash, "CRC", &crc) != KVTREE_SUCCESS || crc != 0xdeadbeef) rc = TEST_FAIL;
+  int rank;
+  if (kvtree_util_get_int(hash, "RANK", &rank) != KVTREE_SUCCESS || rank != -3) rc = TEST_FAIL;
+  double t;
+  if (kvtree_util_get_double(hash, "TIME", &t) != KVTREE_SUCCESS || t != 0.5) rc = TEST_FAIL;
+
+  /* typed values need version 2 files */
+  if (persist_version(hash) != 2) rc = TEST_FAIL;
+
+  /* anything hung below a value is kept, adding a subkey drops the type */
+  kvtree_set(kvtree_get_kv(hash, "NAME", "ckpt.1"), "EXTRA", kvtree_new());
+  kvtree_set(kvtree_get(hash, "SIZE"), "7", kvtree_new());
+  if (kvtree_get_type(hash, "SIZE") != KVTREE_TYPE_NONE) rc = TEST_FAIL;
+  size = kvtree_pack_size(hash);
+  buf = malloc(size);
+  kvtree_pack(buf, hash);
+  kvtree* copy = kvtree_new();
+  kvtree_unpack(buf, copy);
+  free(buf);
+  if (kvtree_get(kvtree_get_kv(copy, "NAME", "ckpt.1"), "EXTRA") == NULL) rc = TEST_FAIL;
+  if (kvtree_size(kvtree_get(copy, "SIZE")) != 2) rc = TEST_FAIL;
+  kvtree_delete(&copy);
+
+  /* plain string values still parse through the typed getters */
+  kvtree_unset_all(hash);
+  kvtree_set_kv(hash, "SIZE", "0x10");
+  uint64_t u;
+  if (kvtree_get_uint64(hash, "SIZE", &u) != KVTREE_SUCCESS || u != 16) rc = TEST_FAIL;
+  if (persist_version(hash) != 1) rc = TEST_FAIL;
+
+  /* a value of an unknown type fails to unpack, the marker of RANK
+   * follows the count and the key, with its type in the last byte */
+  kvtree_unset_all(hash);
+  kvtree_set_int64(hash, "RANK", 3);
+  size = kvtree_pack_size(hash);
+  buf = malloc(size);
+  kvtree_pack(buf, hash);
+  buf[sizeof(uint32_t) + strlen("RANK") + 1 + sizeof(uint32_t) - 1] = 9;
+  copy = kvtree_new();
+  if (kvtree_unpack(buf, copy) != 0) rc = TEST_FAIL;
+  if (kvtree_get_type(copy, "RANK") != KVTREE_TYPE_NONE) rc = TEST_FAIL;
+  free(buf);
+  kvtree_delete(&copy);
+
+  kvtree_delete(&hash);
+  return rc;
+}
+
+int test_kvtree_util_bytes(){
+  int rc = TEST_PASS;
+
+  /* bytes that could never be a key */
+  unsigned char data[300];
+  int i;
+  for (i = 0; i < (int) sizeof(data); i++) {
+    data[i] = (unsigned char) (i * 7);
+  }
+
+  kvtree* hash = kvtree_new();
+  kvtree_util_set_bytes(hash, "BITMAP", data, sizeof(data));
+  kvtree_util_set_bytes(hash, "EMPTY", NULL, 0);
+  kvtree_util_set_int(hash, "RANK", 4);
+  if (kvtree_get_type(hash, "BITMAP") != KVTREE_TYPE_BYTES) rc = TEST_FAIL;
+
+  const void* buf;
+  size_t size;
+  if (kvtree_util_get_bytes(hash, "BITMAP", &buf, &size) != KVTREE_SUCCESS ||
+      size != sizeof(data) || memcmp(buf, data, size) != 0)
+  {
+    rc = TEST_FAIL;
+  }
+  if (kvtree_util_get_bytes(hash, "RANK", &buf, &size) == KVTREE_SUCCESS) rc = TEST_FAIL;
+  int64_t i64;
+  if (kvtree_util_get_int64(hash, "BITMAP", &i64) == KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  /* pack into an arena tree and back */
+  size_t pack_size = kvtree_pack_size(hash);
+  char* packed = malloc(pack_size);
+  kvtree_pack(packed, hash);
+  kvtree* copy = kvtree_new_arena();
+  if (kvtree_unpack(packed, copy) != pack_size) rc = TEST_FAIL;
+  free(packed);
+  if (kvtree_util_get_bytes(copy, "BITMAP", &buf, &size) != KVTREE_SUCCESS ||
+      size != sizeof(data) || memcmp(buf, data, size) != 0)
+  {
+    rc = TEST_FAIL;
+  }
+  if (kvtree_util_get_bytes(copy, "EMPTY", &buf, &size) != KVTREE_SUCCESS || size != 0) rc = TEST_FAIL;
+  if (persist_version(copy) != 2) rc = TEST_FAIL;
+
+  /* a merge copies the bytes */
+  kvtree* merged = kvtree_new();
+  kvtree_merge(merged, copy);
+  kvtree_delete(&copy);
+  if (kvtree_util_get_bytes(merged, "BITMAP", &buf, &size) != KVTREE_SUCCESS ||
+      size != sizeof(data) || memcmp(buf, data, size) != 0)
+  {
+    rc = TEST_FAIL;
+  }
+  kvtree_delete(&merged);
+
+  /* adding a subkey drops the bytes */
+  kvtree_set(kvtree_get(hash, "BITMAP"), "KEY", kvtree_new());
+  if (kvtree_util_get_bytes(hash, "BITMAP", &buf, &size) == KVTREE_SUCCESS) rc = TEST_FAIL;
+
+  kvtree_delete(&hash);
+  return rc;
+}
+
 void test_kvtree_util_init(){
   register_test(test_kvtree_util_set_get_bytecount, "test_kvtree_util_set_get_bytecount");
   register_test(test_kvtree_util_set_get_int, "test_kvtree_util_set_get_int");
@@ -130,4 +291,6 @@ void test_kvtree_util_init(){
   register_test(test_kvtree_util_set_get_int64, "test_kvtree_util_set_get_int64");
   register_test(test_kvtree_util_set_get_double, "test_kvtree_util_set_get_double");
   register_test(test_kvtree_util_set_get_ptr, "test_kvtree_util_set_get_ptr");
+  register_test(test_kvtree_util_typed, "test_kvtree_util_typed");
+  register_test(test_kvtree_util_bytes, "test_kvtree_util_bytes");
 }